@@ -33,6 +33,7 @@
 #include "rom.h"
 #include "osapi.h"
 #include "mem.h"
+#include "scratch.h"
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
@@ -104,7 +105,7 @@ int ICACHE_FLASH_ATTR crypto_hash (const digest_mech_info_t *mi,
   if (!mi)
     return EINVAL;
 
-  void *ctx = (void *)os_malloc (mi->ctx_size);
+  void *ctx = scratch_alloc (mi->ctx_size);
   if (!ctx)
     return ENOMEM;
 
@@ -112,7 +113,7 @@ int ICACHE_FLASH_ATTR crypto_hash (const digest_mech_info_t *mi,
   mi->update (ctx, data, data_len);
   mi->finalize (digest, ctx);
 
-  os_free (ctx);
+  scratch_free (ctx);
   return 0;
 }
 
@@ -125,15 +126,18 @@ int ICACHE_FLASH_ATTR crypto_fhash (const digest_mech_info_t *mi,
     return EINVAL;
 
   // Initialise
-  void *ctx = (void *)os_malloc (mi->ctx_size);
+  void *ctx = scratch_alloc (mi->ctx_size);
   if (!ctx)
     return ENOMEM;
   mi->create (ctx);
 
   // Hash bytes from file in blocks
-  uint8_t* buffer = (uint8_t*)os_malloc (mi->block_size);
+  uint8_t* buffer = (uint8_t*)scratch_alloc (mi->block_size);
   if (!buffer)
+  {
+    scratch_free (ctx);
     return ENOMEM;
+  }
 
   int read_len = 0;
   do {
@@ -146,8 +150,8 @@ int ICACHE_FLASH_ATTR crypto_fhash (const digest_mech_info_t *mi,
   // Finish up
   mi->finalize (digest, ctx);
 
-  os_free (buffer);
-  os_free (ctx);
+  scratch_free (buffer);
+  scratch_free (ctx);
   return 0;
 }
 
@@ -205,7 +209,7 @@ int crypto_hmac (const digest_mech_info_t *mi,
   struct {
     uint8_t ctx[mi->ctx_size];
     uint8_t k_opad[mi->block_size];
-  } *tmp = os_malloc (sizeof (*tmp));
+  } *tmp = scratch_alloc (sizeof (*tmp));
   if (!tmp)
     return ENOMEM;
 
@@ -214,6 +218,6 @@ int crypto_hmac (const digest_mech_info_t *mi,
   mi->update (tmp->ctx, data, data_len);
   crypto_hmac_finalize (tmp->ctx, mi, tmp->k_opad, digest);
 
-  os_free (tmp);
+  scratch_free (tmp);
   return 0;
 }
@@ -46,6 +46,18 @@ static const char log_prefix[] = "HTTP client: ";
  */
 #define HTTP_REQUEST_TIMEOUT_MS    (60000)
 
+/*
+ * Number of connections kept open for reuse, see http_keepalive().
+ */
+#ifndef HTTP_KEEPALIVE_MAX
+#define HTTP_KEEPALIVE_MAX         (2)
+#endif
+
+/*
+ * Most requests sent on a connection ahead of their responses.
+ */
+#define HTTP_PIPELINE_MAX          (4)
+
 /*
  * "full_response" is a string containing all response headers and the response body.
  * "response_body and "http_status" are extracted from "full_response" for convenience.
@@ -53,52 +65,74 @@ static const char log_prefix[] = "HTTP client: ";
  * A successful request corresponds to an HTTP status code of 200 (OK).
  * More info at http://en.wikipedia.org/wiki/List_of_HTTP_status_codes
  */
-typedef void (* http_callback_t)(char * response_body, int http_status, char ** full_response_p, int body_size);
+typedef void (* http_callback_t)(char * response_body, int http_status, char ** full_response_p, int body_size, void * arg);
+
+/*
+ * Counts of connections made and requests sent, for tuning keep-alive.
+ * "reused" requests were sent on a connection which had carried another, and
+ * "pipelined" ones were sent while a response was still due on it.
+ */
+typedef struct {
+	uint32_t	connects;
+	uint32_t	requests;
+	uint32_t	reused;
+	uint32_t	pipelined;
+} http_stats_t;
+
+extern http_stats_t http_stats;
+
+/*
+ * Keep connections open for idle_ms after their last response, 0 to close
+ * them as soon as the response has been received.  Requests for the same
+ * scheme, host and port then reuse the connection, and up to pipeline of them
+ * are sent without waiting for the earlier responses.
+ */
+void ICACHE_FLASH_ATTR http_keepalive(uint32_t idle_ms, unsigned pipeline);
 
 /*
  * Call this function to skip URL parsing if the arguments are already in separate variables.
  */
-void ICACHE_FLASH_ATTR http_raw_request(const char * hostname, int port, bool secure, const char * method, const char * path, const char * headers, const char * post_data, http_callback_t callback_handle, int redirect_follow_count);
+void ICACHE_FLASH_ATTR http_raw_request(const char * hostname, int port, bool secure, const char * method, const char * path, const char * headers, const char * post_data, http_callback_t callback_handle, void * callback_arg, int redirect_follow_count);
 
 /*
  * Request data from URL use custom method.
  * The data should be encoded as any format.
  * Try:
- * http_request("http://httpbin.org/post", "OPTIONS", "Content-type: text/plain", "Hello world", http_callback_example, 0);
+ * http_request("http://httpbin.org/post", "OPTIONS", "Content-type: text/plain", "Hello world", http_callback_example, NULL, 0);
  */
-void ICACHE_FLASH_ATTR http_request(const char * url, const char * method, const char * headers, const char * post_data, http_callback_t callback_handle, int redirect_follow_count);
+void ICACHE_FLASH_ATTR http_request(const char * url, const char * method, const char * headers, const char * post_data, http_callback_t callback_handle, void * callback_arg, int redirect_follow_count);
 
 /*
  * Post data to a web form.
  * The data should be encoded as any format.
  * Try:
- * http_post("http://httpbin.org/post", "Content-type: application/json", "{\"hello\": \"world\"}", http_callback_example);
+ * http_post("http://httpbin.org/post", "Content-type: application/json", "{\"hello\": \"world\"}", http_callback_example, NULL);
  */
-void ICACHE_FLASH_ATTR http_post(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle);
+void ICACHE_FLASH_ATTR http_post(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle, void * callback_arg);
 
 /*
  * Download a web page from its URL.
  * Try:
- * http_get("http://wtfismyip.com/text", NULL, http_callback_example);
+ * http_get("http://wtfismyip.com/text", NULL, http_callback_example, NULL);
  */
-void ICACHE_FLASH_ATTR http_get(const char * url, const char * headers, http_callback_t callback_handle);
+void ICACHE_FLASH_ATTR http_get(const char * url, const char * headers, http_callback_t callback_handle, void * callback_arg);
 /*
  * Delete a web page from its URL.
  * Try:
- * http_delete("http://wtfismyip.com/text", NULL, http_callback_example);
+ * http_delete("http://wtfismyip.com/text", NULL, http_callback_example, NULL);
  */
-void ICACHE_FLASH_ATTR http_delete(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle);
+void ICACHE_FLASH_ATTR http_delete(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle, void * callback_arg);
 /*
  * Update data to a web form.
  * The data should be encoded as any format.
  * Try:
- * http_put("http://httpbin.org/post", "Content-type: application/json", "{\"hello\": \"world\"}", http_callback_example);
+ * http_put("http://httpbin.org/post", "Content-type: application/json", "{\"hello\": \"world\"}", http_callback_example, NULL);
  */
-void ICACHE_FLASH_ATTR http_put(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle);
+void ICACHE_FLASH_ATTR http_put(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle, void * callback_arg);
 
 /*
  * Output on the UART.
  */
-void http_callback_example(char * response, int http_status, char * full_response);
+void http_callback_example(char * response, int http_status, char ** full_response_p, int body_size, void * arg);
 
 #endif // __HTTPCLIENT_H__
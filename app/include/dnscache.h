@@ -0,0 +1,38 @@
+#ifndef _DNSCACHE_H
+#define _DNSCACHE_H
+
+/*
+ * Resolver front-end shared by the modules which look up host names.  It is
+ * called as dns_gethostbyname() is, and returns ERR_OK with the address for a
+ * name in its cache, or ERR_INPROGRESS and calls found later.  Answers are
+ * kept for their TTL, and requests for a name which is already being looked up
+ * wait for that query rather than sending another.
+ *
+ * DNS_CACHE_SIZE in user_config.h sets the number of names kept, and
+ * DNS_CACHE_RTC_BASE keeps the cache in RTC memory across deep sleep.
+ */
+
+#include <stdint.h>
+#include "user_config.h"
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/dns.h"
+
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE 8
+#endif
+
+typedef struct {
+  uint32_t hits;                /* answered from the cache */
+  uint32_t misses;              /* sent a query */
+  uint32_t shared;              /* waited for another requester's query */
+} dnscache_stats_t;
+
+extern dnscache_stats_t dnscache_stats;
+
+err_t dnscache_gethostbyname(const char *hostname, ip_addr_t *addr,
+                             dns_found_callback found, void *callback_arg);
+unsigned dnscache_count(void);
+void dnscache_flush(void);
+
+#endif
@@ -38,6 +38,13 @@
 #ifndef __LWIPOPTS_H__
 #define __LWIPOPTS_H__
 
+#include "user_config.h"
+
+/* An alternative profile overrides the defaults below, see user_config.h */
+#ifdef LWIP_PROFILE_THROUGHPUT
+#include "lwipopts_throughput.h"
+#endif
+
 
 /*
    -----------------------------------------------
@@ -965,6 +972,13 @@
 #define TCP_WND                         (*(volatile uint32*)0x600011F0)
 #endif
 
+/**
+ * TCP_WND_DEFAULT: The value which lwip_init() sets TCP_WND to.
+ */
+#ifndef TCP_WND_DEFAULT
+#define TCP_WND_DEFAULT                 (4 * TCP_MSS)
+#endif
+
 /**
  * TCP_CALCULATE_EFF_SEND_MSS: "The maximum size of a segment that TCP really
  * sends, the 'effective send MSS,' MUST be the smaller of the send MSS (which
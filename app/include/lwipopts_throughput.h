@@ -0,0 +1,17 @@
+/*
+ * lwIP options for bulk transfers, selected by LWIP_PROFILE_THROUGHPUT in
+ * user_config.h and applied ahead of the defaults in lwipopts.h.
+ *
+ * The default TCP_SND_BUF of two segments, against a TCP_WND of four, keeps
+ * a sender stalled for an ack in every round trip.  Doubling it doubles bulk
+ * throughput in tools/lwip_bench for some 3KB more heap per sending
+ * connection; going further gains little and costs as much again.  See
+ * tools/lwip_bench/README.md for the figures.
+ */
+#ifndef __LWIPOPTS_THROUGHPUT_H__
+#define __LWIPOPTS_THROUGHPUT_H__
+
+#define TCP_SND_BUF                     (4 * TCP_MSS)
+#define TCP_WND_DEFAULT                 (4 * TCP_MSS)
+
+#endif /* __LWIPOPTS_THROUGHPUT_H__ */
@@ -596,6 +596,12 @@
 #error "MBEDTLS_SSL_DTLS_CLIENT_PORT_REUSE  defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH) &&                        \
+    ( !defined(MBEDTLS_SSL_TLS_C) || defined(MBEDTLS_SSL_PROTO_DTLS) ||     \
+      defined(MBEDTLS_SSL_RENEGOTIATION) || defined(MBEDTLS_ZLIB_SUPPORT) )
+#error "MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_SSL_DTLS_ANTI_REPLAY) &&                              \
     ( !defined(MBEDTLS_SSL_TLS_C) || !defined(MBEDTLS_SSL_PROTO_DTLS) )
 #error "MBEDTLS_SSL_DTLS_ANTI_REPLAY  defined, but not all prerequisites"
@@ -1463,6 +1463,24 @@
  */
 #define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
 
+/**
+ * \def MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+ *
+ * Size the record buffers to the records in use rather than keeping both at
+ * MBEDTLS_SSL_IN_BUFFER_LEN and MBEDTLS_SSL_OUT_BUFFER_LEN for the life of
+ * the connection.  They are that size during a handshake.  Once it is over
+ * they are freed whenever no record is being read or written, and allocated
+ * again for each record at its size, up to the maximum fragment length
+ * negotiated.  Reading or writing then fails with
+ * MBEDTLS_ERR_SSL_ALLOC_FAILED if the memory cannot be had.
+ *
+ * Requires: TLS, without MBEDTLS_SSL_PROTO_DTLS, MBEDTLS_SSL_RENEGOTIATION
+ *           or MBEDTLS_ZLIB_SUPPORT
+ *
+ * Uncomment this to save memory with idle or slow connections.
+ */
+//#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+
 /**
  * \def MBEDTLS_SSL_PROTO_SSL3
  *
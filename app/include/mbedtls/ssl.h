@@ -1108,6 +1108,14 @@ struct mbedtls_ssl_context
     int keep_current_message;   /*!< drop or reuse current message
                                      on next call to record layer? */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    size_t in_buf_len;          /*!< length of in_buf, 0 while released */
+    size_t in_content_max;      /*!< largest incoming record content
+                                     once the handshake is over       */
+    unsigned char in_ctr_idle[8]; /*!< incoming message counter
+                                     while in_buf is released         */
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     uint8_t disable_datagram_packing;  /*!< Disable packing multiple records
                                         *   within a single datagram.  */
@@ -1129,6 +1137,10 @@ struct mbedtls_ssl_context
 
     unsigned char cur_out_ctr[8]; /*!<  Outgoing record sequence  number. */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    size_t out_buf_len;         /*!< length of out_buf, 0 while released */
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     uint16_t mtu;               /*!< path mtu, used to fragment outgoing messages */
 #endif /* MBEDTLS_SSL_PROTO_DTLS */
@@ -215,6 +215,26 @@ extern void espconn_ssl_sent(void *arg, uint8 *psent, uint16 length);
 
 extern void espconn_ssl_disconnect(espconn_msg *pdis);
 
+/******************************************************************************
+ * Client session cache, see espconn_session.c.  Sessions are kept by server
+ * address and port, and offered for resumption on the next connection.
+*******************************************************************************/
+
+typedef struct {
+	uint32 full;		/* handshakes with a key exchange */
+	uint32 resumed;		/* abbreviated handshakes */
+} espconn_ssl_session_stats_t;
+
+extern espconn_ssl_session_stats_t espconn_ssl_session_stats;
+
+extern void espconn_ssl_session_offer(const struct espconn *pespconn, mbedtls_ssl_context *ssl);
+extern void espconn_ssl_session_store(const struct espconn *pespconn, const mbedtls_ssl_context *ssl);
+extern void espconn_ssl_session_drop(const struct espconn *pespconn);
+extern void espconn_ssl_session_flush(void);
+extern uint32 espconn_ssl_session_count(void);
+extern uint32 espconn_ssl_session_save(uint8 *buf, uint32 len, uint32 *count);
+extern uint32 espconn_ssl_session_restore(const uint8 *buf, uint32 len);
+
 #endif
 
 
@@ -81,6 +81,14 @@
 
 //#define LUA_FLASH_STORE                   0x10000
 
+// Lua 5.1 builds can also use a second, smaller flash region as an LFS overlay.
+// This takes an image in the same format as LFS (built by luac.cross -f), but
+// is loaded separately using node.LFS.overlay(), so per-device code can be
+// executed in place from flash rather than loaded into RAM from .lc files.
+// LUA_FLASH_OVERLAY defines the default partition size.
+
+//#define LUA_FLASH_OVERLAY                 0x4000
+
 // By default Lua executes the file init.lua at start up.  The following
 // define allows you to replace this with an alternative startup.  Warning:
 // you must protect this execution otherwise you will enter a panic loop;
@@ -131,6 +139,24 @@
 #define SSL_BUFFER_SIZE 4096
 #define SSL_MAX_FRAGMENT_LENGTH_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_4096
 
+// SSL_BUFFER_SIZE is the largest TLS record a connection can take, and its
+// record buffers are that size for the handshake.  With SSL_BUFFER_DYNAMIC
+// they are then freed while the connection is idle, and allocated again for
+// each record at the record's size, so that two or three connections fit in
+// the heap.  A connection is closed if a buffer can't be had when a record
+// arrives.  A smaller SSL_MAX_FRAGMENT_LENGTH_CODE, if the server agrees to
+// it, keeps its records smaller too, but the server's certificates must then
+// fit in one record of that size.
+#define SSL_BUFFER_DYNAMIC
+
+// Client TLS sessions, by session ID or ticket, are kept for the last
+// SSL_SESSION_CACHE_SIZE servers connected to, and are offered when
+// connecting to them again.  A resumed handshake skips the key exchange and
+// certificate checks, saving seconds of CPU time.  Each session takes about
+// 110 bytes plus its ticket.  Set it to 0 for a full handshake every time.
+#define SSL_SESSION_CACHE_SIZE 2
+#define SSL_SESSION_TICKET_MAX 512
+
 
 // GPIO_INTERRUPT_ENABLE needs to be defined if your application uses the
 // gpio.trig() or related GPIO interrupt service routine code.  Likewise the
@@ -149,6 +175,32 @@
 //#define TIMER_SUSPEND_ENABLE
 //#define PMSLEEP_ENABLE
 
+// Applications with many tmr timers can run them all off a single SDK timer
+// using a hierarchical timer wheel, which makes starting and stopping a timer
+// O(1) and fires timers due at the same time in one wake-up.  The optional
+// TIMER_WHEEL_SLACK lets each expiry be deferred by up to this many ms so that
+// nearby expiries are aligned to a common time and so coalesced.
+
+//#define TIMER_WHEEL_ENABLE
+//#define TIMER_WHEEL_SLACK 0
+
+// lwIP is tuned by default for many small connections on little heap.  The
+// throughput profile in lwipopts_throughput.h trades some heap per connection
+// for faster bulk transfers; tools/lwip_bench measures the profiles on a
+// simulated link.
+//#define LWIP_PROFILE_THROUGHPUT
+
+// Host names looked up by the net, mqtt, tls, websocket, http and sntp
+// modules share one cache, which keeps answers for their TTL and makes a
+// single query for requests of a name already being looked up.
+// DNS_CACHE_SIZE is the number of names kept.  If DNS_CACHE_RTC_BASE is
+// defined, the cache is mirrored in RTC memory from that slot, in one slot
+// plus three per name up to slot 127, and so survives deep sleep.  This needs
+// the rtctime module with its clock set, and the slots must not be used by
+// rtcfifo or by Lua.
+#define DNS_CACHE_SIZE 8
+//#define DNS_CACHE_RTC_BASE 103
+
 // The net module optionally offers net info functionnality. Uncomment the following
 // to enable the functionnality.
 #define NET_PING_ENABLE
@@ -254,6 +306,10 @@
 #  define LUA_FLASH_STORE                 0x0
 #endif
 
+#ifndef LUA_FLASH_OVERLAY
+#  define LUA_FLASH_OVERLAY               0x0
+#endif
+
 #ifndef SPIFFS_FIXED_LOCATION
   #define SPIFFS_FIXED_LOCATION           0x0
   // You'll rarely need to customize this, because nowadays
@@ -266,9 +322,38 @@
 
 // The following define enables recording of the number of CPU cycles at certain
 // points in the startup process. It can be used to see where the time is being
-// consumed. It enables a nice node.startupcounts() function to get the results.
+// consumed. It enables a nice node.startupcounts() function to get the results,
+// and node.startupprofile() which returns the boot phases, including each
+// module's initialisation, as spans or as a Chrome trace.
 //#define PLATFORM_STARTUP_COUNT
 
+// Event tracing records task dispatches, GPIO interrupts, net callbacks and
+// Lua GC steps, plus events from the trace module, as fixed-size binary
+// records in a RAM ring.  Each event costs a few dozen CPU cycles once
+// tracing is started with trace.start(), and nothing when this is undefined.
+//#define TRACE_ENABLE
+
+// The metrics registry holds the firmware's own counters (net, mqtt, file,
+// tmr and GPIO interrupts) and those registered by the metrics module, in a
+// flat preallocated array.  METRICS_MAX is the total number of metrics.
+//#define METRICS_ENABLE
+//#define METRICS_MAX 48
+
+// Tasks posted by interrupt handlers, drivers and Lua node.task.post() are
+// queued in a ring per priority ahead of the SDK task queue, so that bursts
+// are not dropped. These set the ring depths; node.task.stats() reports the
+// high water marks and any drops, which can be used to tune them.
+#define PLATFORM_TASK_QUEUE_LOW     16
+#define PLATFORM_TASK_QUEUE_MEDIUM  16
+#define PLATFORM_TASK_QUEUE_HIGH    32
+
+// C modules take short-lived buffers, such as those for hash contexts,
+// encodings and websocket frames, from a fixed scratch arena which is reset
+// after every task, rather than from the heap.  This is its size in bytes;
+// requests which don't fit fall back to malloc().  node.scratchinfo() reports
+// the high water mark, which can be used to tune it, and 0 disables the arena.
+#define PLATFORM_SCRATCH_SIZE       1024
+
 #define LUA_TASK_PRIO             USER_TASK_PRIO_0
 #define LUA_PROCESS_LINE_SIG      2
 // LUAI_OPTIMIZE_DEBUG 0 = Keep all debug; 1 = keep line number info; 2 = remove all debug
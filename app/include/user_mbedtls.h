@@ -148,6 +148,9 @@
 #undef MBEDTLS_SSL_SRV_RESPECT_CLIENT_PREFERENCE
 
 #define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+#ifdef SSL_BUFFER_DYNAMIC
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#endif
 
 #undef MBEDTLS_SSL_PROTO_SSL3
 #undef MBEDTLS_SSL_PROTO_TLS1
@@ -303,10 +306,9 @@ extern void mbedtls_free_wrap(void *p);
 //#define MBEDTLS_SSL_CACHE_DEFAULT_TIMEOUT       86400 /**< 1 day  */
 //#define MBEDTLS_SSL_CACHE_DEFAULT_MAX_ENTRIES      50 /**< Maximum entries in cache */
 
-// the current mbedtls integration doesn't allow to set the buffer size dynamically:
-//   MBEDTLS_SSL_MAX_FRAGMENT_LENGTH feature and dynamic sizing are mutually exclusive
-//   due to non-constant initializer element in app/mbedtls/library/ssl_tls.c:150
-// the buffer size is hardcoded here and value is taken from SSL_BUFFER_SIZE (user_config.h)
+// the maximum content length must be a constant, as it is used in constant expressions
+//   throughout app/mbedtls/library, so it is taken from SSL_BUFFER_SIZE (user_config.h);
+// the buffers are only this large while they must be, see MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
 #define MBEDTLS_SSL_MAX_CONTENT_LEN             SSL_BUFFER_SIZE /**< Maxium fragment length in bytes, determines the size of each of the two internal I/O buffers */
 
 //#define MBEDTLS_SSL_DEFAULT_TICKET_LIFETIME     86400 /**< Lifetime of session tickets (if enabled) */
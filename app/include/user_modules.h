@@ -33,11 +33,13 @@
 //#define LUA_USE_MODULES_HDC1080
 //#define LUA_USE_MODULES_HMC5883L
 //#define LUA_USE_MODULES_HTTP
+//#define LUA_USE_MODULES_HTTPD
 //#define LUA_USE_MODULES_HX711
 #define LUA_USE_MODULES_I2C
 //#define LUA_USE_MODULES_L3G4200D
 //#define LUA_USE_MODULES_MCP4725
 //#define LUA_USE_MODULES_MDNS
+//#define LUA_USE_MODULES_METRICS
 #define LUA_USE_MODULES_MQTT
 #define LUA_USE_MODULES_NET
 #define LUA_USE_MODULES_NODE
@@ -60,12 +62,14 @@
 //#define LUA_USE_MODULES_SOFTUART
 //#define LUA_USE_MODULES_SOMFY
 #define LUA_USE_MODULES_SPI
+//#define LUA_USE_MODULES_STRBUF
 //#define LUA_USE_MODULES_STRUCT
 //#define LUA_USE_MODULES_SWITEC
 //#define LUA_USE_MODULES_TCS34725
 //#define LUA_USE_MODULES_TM1829
 //#define LUA_USE_MODULES_TLS
 #define LUA_USE_MODULES_TMR
+//#define LUA_USE_MODULES_TRACE
 //#define LUA_USE_MODULES_TSL2561
 #define LUA_USE_MODULES_UART
 //#define LUA_USE_MODULES_U8G2
@@ -15,6 +15,10 @@
 #ifndef LUA_CROSS_COMPILER
 #include "vfs.h"
 #include "user_interface.h"
+#include "platform.h"
+#define heap_failure(n)  platform_heap_failure(n)
+#else
+#define heap_failure(n)
 #endif
 #include <stdlib.h>
 #include <string.h>
@@ -899,9 +903,12 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
       return NULL;
   }
   nptr = (void *)this_realloc(ptr, osize, nsize);
-  if (nptr == NULL && L != NULL && (mode & EGC_ON_ALLOC_FAILURE)) {
-    luaC_fullgc(L); /* emergency full collection. */
-    nptr = (void *)this_realloc(ptr, osize, nsize); /* try allocation again */
+  if (nptr == NULL) {
+    heap_failure(nsize);  /* report the heap state before any collection */
+    if (L != NULL && (mode & EGC_ON_ALLOC_FAILURE)) {
+      luaC_fullgc(L); /* emergency full collection. */
+      nptr = (void *)this_realloc(ptr, osize, nsize); /* try allocation again */
+    }
   }
   return nptr;
 }
@@ -171,10 +171,16 @@ LUALIB_API void (luaL_pushresult) (luaL_Buffer *B);
 LUALIB_API int  (luaL_pushlfsmodules) (lua_State *L);
 LUALIB_API int  (luaL_pushlfsmodule) (lua_State *L);
 LUALIB_API int  (luaL_pushlfsdts) (lua_State *L);
+LUALIB_API int  (luaL_pushoverlaymodules) (lua_State *L);
 
 LUALIB_API void (luaL_lfsreload) (lua_State *L);
+LUALIB_API void (luaL_overlayreload) (lua_State *L);
 LUALIB_API int  (luaL_pcallx) (lua_State *L, int narg, int nres);
 LUALIB_API int  (luaL_posttask) ( lua_State* L, int prio );
+LUALIB_API int  (luaL_awaitref) (lua_State *L);
+LUALIB_API int  (luaL_awaitresume) (lua_State *L, int ref, int narg);
+LUALIB_API void (luaL_setbudget) (lua_State *L, int idx, int budget, int prio);
+LUALIB_API int  (luaL_pushbudget) (lua_State *L, int idx);
 #define  LUA_TASK_LOW    0
 #define  LUA_TASK_MEDIUM 1
 #define  LUA_TASK_HIGH   2
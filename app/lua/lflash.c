@@ -29,11 +29,30 @@
  * process.
  */
 
-static char    *flashAddr;
-static uint32_t flashSize;
-static uint32_t flashAddrPhys;
-static uint32_t flashSector;
-static uint32_t curOffset;
+/*
+ * The firmware supports two flash regions with the same image format: the main
+ * LFS and a (typically much smaller) overlay region.  The overlay is used for
+ * code that is not part of the main LFS image, e.g. per-device plugins, which
+ * would otherwise have to be loaded into RAM from .lc files.  Both regions are
+ * executed in place and share the load and relocation logic below; fr points to
+ * the region currently being initialised or written.
+ */
+typedef struct {
+  char     *addr;                        /* mapped address of region */
+  uint32_t  size;                        /* size of region in bytes */
+  uint32_t  addrPhys;                    /* flash offset of region */
+  uint32_t  sector;                      /* first flash sector of region */
+} flashRegion;
+
+static flashRegion  LFSregion, OVregion;
+static flashRegion *fr = &LFSregion;
+static uint32_t     curOffset;
+
+#define flashAddr     (fr->addr)
+#define flashSize     (fr->size)
+#define flashAddrPhys (fr->addrPhys)
+#define flashSector   (fr->sector)
+#define isOverlay     (fr == &OVregion)
 
 #define ALIGN(s)      (((s)+sizeof(size_t)-1) & ((size_t) (- (signed) sizeof(size_t))))
 #define ALIGN_BITS(s) (((uint32_t)s) & (sizeof(size_t)-1))
@@ -76,6 +95,10 @@ struct OUTPUT {
   int       flagsNdx;
   uint32_t *flags;
   const char *error;
+  uint32_t  wordNdx;        /* overlay only: image offset of current word */
+  uint32_t  strNdx;         /* overlay only: offset of next TString in image */
+  uint32_t  strLeft;        /* overlay only: TStrings still to be scanned */
+  uint32_t *strFlags;       /* overlay only: bitmap of TString offsets */
 } *out;
 
 #ifdef NODE_DEBUG
@@ -144,19 +167,17 @@ static void flashErase(uint32_t start, uint32_t end){
  */
 
 /*
- * Hook in lstate.c:f_luaopen() to set up ROstrt and ROpvmain if needed
+ * Map a flash region and validate any image that it contains.  Returns the
+ * image's FlashHeader or NULL if the region is absent or has no valid image.
  */
-LUAI_FUNC void luaN_init (lua_State *L) {
-
-  flashSize = platform_flash_get_partition (NODEMCU_LFS0_PARTITION, &flashAddrPhys);
-  if (flashSize == 0) {
-    return;   // Nothing to do if the size is zero
+static FlashHeader *mapRegion (flashRegion *r, int partition, const char *name) {
+  r->size = platform_flash_get_partition (partition, &r->addrPhys);
+  if (r->size == 0) {
+    return NULL;   // Nothing to do if the size is zero
   }
-  G(L)->LFSsize   = flashSize;
-  flashAddr       = cast(char *, platform_flash_phys2mapped(flashAddrPhys));
-  flashSector     = platform_flash_get_sector_of_address(flashAddrPhys);
-  FlashHeader *fh = cast(FlashHeader *, flashAddr);
-  curOffset       = 0;
+  r->addr         = cast(char *, platform_flash_phys2mapped(r->addrPhys));
+  r->sector       = platform_flash_get_sector_of_address(r->addrPhys);
+  FlashHeader *fh = cast(FlashHeader *, r->addr);
 
   /*
    * For the LFS to be valid, its signature has to be correct for this build
@@ -166,27 +187,52 @@ LUAI_FUNC void luaN_init (lua_State *L) {
    */
 
   if (fh->flash_sig == 0 || fh->flash_sig == ~0 ) {
-    NODE_ERR("No LFS image loaded\n");
-    return;
+    NODE_ERR("No %s image loaded\n", name);
+    return NULL;
   }
 
   if ((fh->flash_sig & (~FLASH_SIG_ABSOLUTE)) != FLASH_SIG ) {
     NODE_ERR("Flash sig not correct: 0x%08x vs 0x%08x\n",
        fh->flash_sig & (~FLASH_SIG_ABSOLUTE), FLASH_SIG);
-    return;
+    return NULL;
   }
 
   if (fh->pROhash == ALL_SET ||
       ((fh->mainProto - cast(FlashAddr, fh)) >= fh->flash_size)) {
     NODE_ERR("Flash size check failed: 0x%08x vs 0xFFFFFFFF; 0x%08x >= 0x%08x\n",
        fh->pROhash, fh->mainProto - cast(FlashAddr, fh), fh->flash_size);
-    return;
+    return NULL;
   }
+  return fh;
+}
 
-  G(L)->ROstrt.hash = cast(GCObject **, fh->pROhash);
-  G(L)->ROstrt.nuse = fh->nROuse ;
-  G(L)->ROstrt.size = fh->nROsize;
-  G(L)->ROpvmain    = cast(Proto *,fh->mainProto);
+/*
+ * Hook in lstate.c:f_luaopen() to set up ROstrt and ROpvmain if needed, and
+ * likewise OVstrt and OVpvmain for the overlay region.
+ */
+LUAI_FUNC void luaN_init (lua_State *L) {
+  FlashHeader *fh;
+
+  STARTUP_BEGIN("luaN_init");
+  curOffset = 0;
+  fh = mapRegion(&LFSregion, NODEMCU_LFS0_PARTITION, "LFS");
+  G(L)->LFSsize = LFSregion.size;
+  if (fh) {
+    G(L)->ROstrt.hash = cast(GCObject **, fh->pROhash);
+    G(L)->ROstrt.nuse = fh->nROuse ;
+    G(L)->ROstrt.size = fh->nROsize;
+    G(L)->ROpvmain    = cast(Proto *,fh->mainProto);
+  }
+
+  fh = mapRegion(&OVregion, NODEMCU_LFS1_PARTITION, "overlay");
+  G(L)->OVsize = OVregion.size;
+  if (fh) {
+    G(L)->OVstrt.hash = cast(GCObject **, fh->pROhash);
+    G(L)->OVstrt.nuse = fh->nROuse ;
+    G(L)->OVstrt.size = fh->nROsize;
+    G(L)->OVpvmain    = cast(Proto *,fh->mainProto);
+  }
+  STARTUP_END("luaN_init");
 }
 
 //extern void software_reset(void);
@@ -194,19 +240,19 @@ static int loadLFS (lua_State *L);
 static int loadLFSgc (lua_State *L);
 static void procFirstPass (void);
 
-/* luaL_lfsreload() is exported via lauxlib.h */
-
 /*
- * Library function called by node.flashreload(filename).
+ * Common reload processing for the LFS and overlay regions.
  */
-LUALIB_API void luaL_lfsreload (lua_State *L) {
+static void reloadRegion (lua_State *L, flashRegion *r) {
   const char *fn = lua_tostring(L, 1), *msg = "";
   int status;
 
-  if (G(L)->LFSsize == 0) {
-    lua_pushstring(L, "No LFS partition allocated");
+  if (r->size == 0) {
+    lua_pushstring(L, r == &OVregion ? "No overlay partition allocated" :
+                                       "No LFS partition allocated");
     return;
   }
+  fr = r;
 
  /*
   * Do a protected call of loadLFS.
@@ -242,6 +288,14 @@ LUALIB_API void luaL_lfsreload (lua_State *L) {
   if (status == 0) {
     /* Successful LFS rewrite */
     msg = "LFS region updated.  Restarting.";
+    if (!isOverlay && OVregion.size) {
+     /*
+      * Any overlay image binds its shared strings to the old LFS, so it is
+      * invalidated by erasing its header page.
+      */
+      fr = &OVregion;
+      flashErase(0,0);
+    }
   } else {
     /* We have errored during the second pass so clear the LFS and reboot */
     if (status == LUA_ERRMEM)
@@ -258,19 +312,47 @@ LUALIB_API void luaL_lfsreload (lua_State *L) {
   while (1) {}  // Force WDT as the ROM software_reset() doesn't seem to work
 }
 
+/* luaL_lfsreload() and luaL_overlayreload() are exported via lauxlib.h */
+
+/*
+ * Library function called by node.LFS.reload(filename).
+ */
+LUALIB_API void luaL_lfsreload (lua_State *L) {
+  reloadRegion(L, &LFSregion);
+}
+
+/*
+ * Library function called by node.LFS.overlay(filename).
+ */
+LUALIB_API void luaL_overlayreload (lua_State *L) {
+  reloadRegion(L, &OVregion);
+}
+
 
 LUA_API void lua_getlfsconfig (lua_State *L, int *config) {
   if (!config)
     return;
-  config[0] = (int) flashAddr;                   /* LFS region mapped address */
-  config[1] = flashAddrPhys;                 /* LFS region base flash address */
+  config[0] = (int) LFSregion.addr;              /* LFS region mapped address */
+  config[1] = LFSregion.addrPhys;            /* LFS region base flash address */
   config[2] = G(L)->LFSsize;                        /* LFS region actual size */
-  config[3] = (G(L)->ROstrt.hash) ? cast(FlashHeader *, flashAddr)->flash_size : 0;
+  config[3] = (G(L)->ROstrt.hash) ? cast(FlashHeader *, LFSregion.addr)->flash_size : 0;
                                                            /* LFS region used */
   config[4] = 0;                                       /* Not used in Lua 5.1 */
 }
 
 
+LUA_API void lua_getoverlayconfig (lua_State *L, int *config) {
+  if (!config)
+    return;
+  config[0] = (int) OVregion.addr;           /* overlay region mapped address */
+  config[1] = OVregion.addrPhys;         /* overlay region base flash address */
+  config[2] = G(L)->OVsize;                     /* overlay region actual size */
+  config[3] = (G(L)->OVstrt.hash) ? cast(FlashHeader *, OVregion.addr)->flash_size : 0;
+                                                       /* overlay region used */
+  config[4] = 0;                                                  /* Not used */
+}
+
+
 /* =====================================================================================
  * The following routines use my uzlib which was based on pfalcon's inflate and
  * deflate routines.  The standard NodeMCU make also makes two host tools uz_zip
@@ -402,6 +484,88 @@ void procFirstPass (void) {
 }
 
 
+/*
+ * Overlay images are built independently of the LFS, and Lua string equality is
+ * by address, so any string in an overlay that also exists in the LFS ROstrt must
+ * be rebound to the LFS copy.  This can't be done by luac.cross, so the second
+ * pass scans the TString records at the front of the overlay image, then fixes
+ * up any later reference to such a duplicate as it is relocated.  (The overlay's
+ * own ROstrt chains are left intact so any remaining strings are still found.)
+ *
+ * The string records have been written to flash by the time they are referenced
+ * unless they are in the current block, and the icache can be stale after a
+ * flash write, so any flash content is read back through the SPI interface.
+ */
+#define STR_CHUNK 32
+#define TS_WORDS  (sizeof(TString)/WORDSIZE)
+
+static void readImage (uint32_t offset, uint32_t *dst, uint32_t n) {
+  uint32_t inFlash = (offset < curOffset) ? curOffset - offset : 0;
+  if (inFlash > n)
+    inFlash = n;
+  if (inFlash)
+    platform_s_flash_read(dst, flashAddrPhys + offset, inFlash);
+  if (n > inFlash)
+    memcpy(cast(char *, dst) + inFlash,
+           out->buffer.byte + (offset + inFlash - curOffset), n - inFlash);
+}
+
+static uint32_t lfsString (uint32_t offset) {
+  global_State *g = G(out->L);
+  uint32_t hdr[TS_WORDS], chunk[STR_CHUNK/WORDSIZE];
+  GCObject *o;
+
+  if (!g->ROstrt.hash)
+    return 0;
+  readImage(offset, hdr, sizeof(hdr));
+  unsigned int h = hdr[2], l = hdr[3];       /* FlashTS hash and len fields */
+
+  for (o = g->ROstrt.hash[lmod(h, g->ROstrt.size)]; o; o = o->gch.next) {
+    TString *ts = rawgco2ts(o);
+    uint32_t i, n, padded = ALIGN(l + 1);
+    if (ts->tsv.hash != h || ts->tsv.len != l)
+      continue;
+    for (i = 0; i < padded; i += n) {
+      n = (padded - i < STR_CHUNK) ? padded - i : STR_CHUNK;
+      readImage(offset + sizeof(hdr) + i, chunk, n);
+      if (memcmp(chunk, getstr(ts) + i, (l - i < n) ? l - i : n))
+        break;
+    }
+    if (i >= padded)
+      return cast(uint32_t, ts);
+  }
+  return 0;
+}
+
+/*
+ * The TString records follow the header and ROstrt hash vector, and each is
+ * tracked using its len field to locate the next.
+ */
+static void overlayScan (uint32_t *buf, int i) {
+  uint32_t w = out->wordNdx;
+  if (out->strLeft == 0)
+    return;
+  if (w == out->strNdx)
+    out->strFlags[w/BITS_PER_WORD] |= 1u << (w%BITS_PER_WORD);
+  else if (w == out->strNdx + 3) {
+    out->strNdx += TS_WORDS + ALIGN(buf[i] + 1)/WORDSIZE;
+    out->strLeft--;
+  }
+}
+
+/*
+ * The next fields chain the overlay's own ROstrt, so only references after the
+ * last TString record are candidates for rebinding.
+ */
+static uint32_t overlayAddr (uint32_t target) {
+  uint32_t ts;
+  if (out->strLeft == 0 &&
+      (out->strFlags[target/BITS_PER_WORD] & (1u << (target%BITS_PER_WORD))) &&
+      (ts = lfsString(target*WORDSIZE)) != 0)
+    return ts;
+  return WORDSIZE*target + cast(uint32_t, flashAddr);
+}
+
 void procSecondPass (void) {
  /*
   * The length rules are different for the second pass since this only processes
@@ -419,11 +583,23 @@ void procSecondPass (void) {
   * first copy the block to a working buffer and do the relocation in this.
   */
   memcpy(out->buffer.byte, out->block[0]->byte, WRITE_BLOCKSIZE);
+  if (isOverlay && out->ndx <= WRITE_BLOCKSIZE) {
+    FlashHeader *fh = cast(FlashHeader *, buf);  /* still in word offset form */
+    out->strNdx  = fh->pROhash + fh->nROsize;
+    out->strLeft = fh->nROuse;
+  }
   for (i=0; i<len; i++,flags>>=1 ) {
     if ((i&31)==0)
       flags = out->flags[out->flagsNdx++];
-    if (flags&1)
-      buf[i] = WORDSIZE*buf[i] + cast(uint32_t, flashAddr);
+    if (!isOverlay) {
+      if (flags&1)
+        buf[i] = WORDSIZE*buf[i] + cast(uint32_t, flashAddr);
+    } else {
+      overlayScan(buf, i);
+      if (flags&1)
+        buf[i] = overlayAddr(buf[i]);
+      out->wordNdx++;
+    }
   }
  /*
   * On first block, set the flash_sig has the in progress bit set and this
@@ -443,7 +619,7 @@ void procSecondPass (void) {
 }
 
 /*
- * loadLFS)() is protected called from luaL_lfsreload() so that it can recover
+ * loadLFS)() is protected called from reloadRegion() so that it can recover
  * from out of memory and other thrown errors.  loadLFSgc() GCs any resources.
  */
 static int loadLFS (lua_State *L) {
@@ -484,6 +660,10 @@ static int loadLFS (lua_State *L) {
   if (crc != ~out->crc)
     flash_error("checksum error on LFS image file");
 
+  if (isOverlay) {
+    out->strFlags = luaM_newvector(L, out->flagsLen, uint32_t);
+    memset(out->strFlags, 0, out->flagsLen*WORDSIZE);
+  }
   out->fullBlkCB = procSecondPass;
   out->flagsNdx  = 0;
   out->ndx       = 0;
@@ -518,6 +698,8 @@ static int loadLFSgc (lua_State *L) {
         luaM_free(L, out->block[i]);
     if (out->flags)
       luaM_freearray(L, out->flags, out->flagsLen, uint32_t);
+    if (out->strFlags)
+      luaM_freearray(L, out->strFlags, out->flagsLen, uint32_t);
     luaM_free(L, out);
   }
   if (in) {
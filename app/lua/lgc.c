@@ -20,6 +20,12 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#ifdef LUA_USE_ESP
+#include "trace.h"
+#else
+#define TRACE_BEGIN(id, a, b)
+#define TRACE_END(id, a, b)
+#endif
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
@@ -634,6 +640,7 @@ void luaC_step (lua_State *L) {
   global_State *g = G(L);
   if(is_block_gc(L)) return;
   set_block_gc(L);
+  TRACE_BEGIN(TRACE_GC_STEP, g->totalbytes, 0);
   l_mem lim = (GCSTEPSIZE/100) * g->gcstepmul;
   if (lim == 0)
     lim = (MAX_LUMEM-1)/2;  /* no limit */
@@ -657,6 +664,7 @@ void luaC_step (lua_State *L) {
     lua_assert(g->totalbytes >= g->estimate);
     setthreshold(g);
   }
+  TRACE_END(TRACE_GC_STEP, g->totalbytes, 0);
   unset_block_gc(L);
 }
 
@@ -37,6 +37,12 @@
 #include "lauxlib.h"
 #include "lstate.h"
 #include "lnodemcu.h"
+#ifdef LUA_CROSS_COMPILER
+#define STARTUP_BEGIN(name)
+#define STARTUP_END(name)
+#else
+#include "platform.h"
+#endif
 
 extern LROT_TABLE(strlib);
 extern LROT_TABLE(tab_funcs);
@@ -73,6 +79,8 @@ LUAC_MODULE(bit)
 LUAC_MODULE(color_utils)
 LUAC_MODULE_INIT(sjson, luaopen_sjson)
 LUAC_MODULE(pipe)
+LUAC_MODULE_INIT(strbuf, luaopen_strbuf)
+LUAC_MODULE(perf)
 #ifndef _MSC_VER 
 LUAC_MODULE_INIT(pixbuf, luaopen_pixbuf)
 #endif
@@ -96,6 +104,8 @@ LROT_BEGIN(rotables, LROT_TABLEREF(rotables_meta), 0)
   LROT_TABENTRY(color_utils, color_utils)
   LROT_TABENTRY(sjson, sjson)
   LROT_TABENTRY(pipe, pipe)
+  LROT_TABENTRY(strbuf, strbuf)
+  LROT_TABENTRY(perf, perf)
 #ifndef _MSC_VER 
   LROT_TABENTRY(pixbuf, pixbuf)
 #endif
@@ -112,6 +122,8 @@ LROT_BEGIN(lua_libs, NULL, 0)
   LROT_FUNCENTRY(color_utils, NULL)
   LROT_FUNCENTRY(sjson, luaopen_sjson)
   LROT_FUNCENTRY(pipe, NULL)
+  LROT_FUNCENTRY(strbuf, luaopen_strbuf)
+  LROT_FUNCENTRY(perf, NULL)
 #ifndef _MSC_VER 
   LROT_FUNCENTRY(pixbuf, luaopen_pixbuf)
 #endif
@@ -146,7 +158,9 @@ void luaL_openlibs (lua_State *L) {
     if (ttislightfunction(&p->value) && fvalue(&p->value)) {
       lua_pushcfunction(L, fvalue(&p->value));
       lua_pushstring(L, p->key);
+      STARTUP_BEGIN(p->key);
       lua_call(L, 1, 0);  // call luaopen_XXX(libname)
+      STARTUP_END(p->key);
     }
     p++;
   }
@@ -23,6 +23,7 @@
 //== NodeMCU lauxlib.h API extensions ========================================//
 #ifdef LUA_USE_ESP
 #include "platform.h"
+#include "user_interface.h"
 /*
 ** Error Reporting Task.  We can't pass a string parameter to the error reporter
 ** directly through the task interface the call is wrapped in a C closure with
@@ -80,6 +81,7 @@ LUALIB_API int luaL_pcallx (lua_State *L, int narg, int nres) { // [-narg, +0, v
 }
 
 static platform_task_handle_t task_handle = 0;
+static lua_State *task_co;     /* being resumed by luaL_awaitresume() */
 
 /*
 ** Task callback handler. Uses luaN_call to do a protected call with full traceback
@@ -89,9 +91,24 @@ static void do_task (platform_task_param_t task_fn_ref, uint8_t prio) {
   if (prio < 0|| prio > 2)
     luaL_error(L, "invalid posk task");
 
+/*
+** A posted coroutine is resumed with the priority as the result of its yield,
+** except that one preempted by its instruction budget is just continued.
+*/
+  lua_rawgeti(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
+  if (lua_isthread(L, -1)) {
+    lua_State *co = lua_tothread(L, -1);
+    int narg = 0;
+    lua_pop(L, 1);
+    if (!(co->status == LUA_YIELD && isLua(co->ci))) {
+      lua_pushinteger(L, prio);
+      narg = 1;
+    }
+    luaL_awaitresume(L, (int) task_fn_ref, narg);
+    return;
+  }
 /* Pop the CB func from the Reg */
 //dbg_printf("calling Reg[%u]\n", task_fn_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
   luaL_checkfunction(L, -1);
   luaL_unref(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
   lua_pushinteger(L, prio);
@@ -99,13 +116,15 @@ static void do_task (platform_task_param_t task_fn_ref, uint8_t prio) {
 }
 
 /*
-** Schedule a Lua function for task execution
+** Schedule a Lua function for task execution, or a suspended coroutine to be
+** resumed by the task.
 */
 LUALIB_API int luaL_posttask( lua_State* L, int prio ) {          // [-1, +0, -]
   if (!task_handle)
     task_handle = platform_task_get_id(do_task);
 
-  if (!lua_isfunction(L, -1) || prio < LUA_TASK_LOW|| prio > LUA_TASK_HIGH)
+  if (!(lua_isfunction(L, -1) || lua_isthread(L, -1)) ||
+      prio < LUA_TASK_LOW|| prio > LUA_TASK_HIGH)
     luaL_error(L, "invalid posk task");
 //void *cl = clvalue(L->top-1);
   int task_fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -116,27 +135,253 @@ LUALIB_API int luaL_posttask( lua_State* L, int prio ) {          // [-1, +0, -]
   }
   return task_fn_ref;
 }
+
+/*
+** Coroutine await.  A C library function called from a coroutine suspends it
+** with
+**
+**     int ref = luaL_awaitref(L);  ... save ref ...;  return lua_yield(L, 0);
+**
+** and the C callback for the awaited event later pushes the event's values
+** and calls luaL_awaitresume(L, ref, narg) to resume the coroutine directly,
+** with those values returned as the results of the library call.  Unlike a
+** Lua callback, this needs no closure or upvalues per operation: the only
+** state held is a registry reference to the coroutine itself.
+*/
+LUALIB_API int luaL_awaitref (lua_State *L) {                    // [-0, +0, v]
+  if (L == G(L)->mainthread || L->nCcalls > L->baseCcalls)
+    luaL_error(L, "attempt to await outside a coroutine");
+  lua_pushthread(L);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/*
+** Resume a coroutine suspended by luaL_awaitref() with the narg values at ToS
+** and release the reference.  An error thrown by the coroutine is reported
+** through the onerror reporter in the same way as a luaL_pcallx() callback.
+** A coroutine which hasn't been started is also accepted, so that a new one
+** can be posted by luaL_posttask() and the values are its arguments.
+*/
+LUALIB_API int luaL_awaitresume (lua_State *L, int ref, int narg) { // [-narg, +0, -]
+  lua_State *co, *prev;
+  lua_Debug ar;
+  int status;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  co = lua_tothread(L, -1);
+  if (!co || !(lua_status(co) == LUA_YIELD ||         /* suspended or new */
+               (lua_status(co) == 0 && lua_getstack(co, 0, &ar) == 0 &&
+                lua_gettop(co) > 0))) {
+    lua_pop(L, narg + 1);        /* coroutine has already been resumed or died */
+    return LUA_ERRRUN;
+  }
+  lua_insert(L, -1 - narg);           /* anchor the thread below the args */
+  lua_xmove(L, co, narg);
+  prev = task_co;
+  task_co = co;
+  status = lua_resume(co, narg);
+  task_co = prev;
+  if (status != 0 && status != LUA_YIELD) {
+    lua_getglobal(L, "debug");
+    lua_getfield(L, -1, "traceback");
+    lua_remove(L, -2);
+    lua_pushvalue(L, -2);                                     /* the thread */
+    lua_xmove(co, L, 1);                                     /* the error */
+    if (lua_isfunction(L, -3)) {
+      lua_call(L, 2, 1);
+    } else {
+      lua_replace(L, -3);
+      lua_pop(L, 1);
+    }
+    lua_pushcclosure(L, errhandler_aux, 1);
+    luaL_posttask(L, LUA_TASK_HIGH);
+  }
+  lua_settop(co, 0);           /* discard any yielded values or results */
+  lua_pop(L, 1);                                     /* dump the thread */
+  return status == LUA_YIELD ? 0 : status;
+}
 #else
 LUALIB_API int luaL_posttask( lua_State* L, int prio ) { 
   return 0;
 } /* Dummy stub on host */
 #endif
 
+/*
+** Instruction budgets.  A coroutine given a budget runs with a count hook
+** which fires every budget VM instructions.  If the coroutine can yield at
+** that point, the hook posts it as a task and yields, so that a long
+** computation is continued from a later task instead of starving the SDK and
+** tripping the watchdog.  It can't yield inside a C call such as a table.sort()
+** comparator or a metamethod, so there it just feeds the watchdog and runs on.
+**
+** The budgets are userdata in a weak keyed registry table indexed by thread,
+** so they go when the coroutine is collected.  A coroutine created by a
+** budgeted one inherits the hook but not the budget, so its hook is removed
+** on first firing.  Only a coroutine being run by luaL_awaitresume(), from a
+** task or an event's callback, is preempted: one resumed by hand with
+** coroutine.resume() would see the preemption as a yield and then be resumed
+** twice, so it too is just fed.  On the host there is no task queue and a
+** preempted coroutine just yields to its resumer.
+*/
+#define BUDGETS "_budgets"
+
+typedef struct {
+  int budget;                   /* instructions between preemption points */
+  int prio;                     /* task priority when continued */
+  unsigned preempts;            /* yields to the task queue */
+  unsigned feeds;               /* preemption points where it couldn't yield */
+} Budget;
+
+/* Look up the budget of the thread at ToS, which is popped */
+static Budget *getbudget (lua_State *L) {
+  Budget *b = NULL;
+  lua_getfield(L, LUA_REGISTRYINDEX, BUDGETS);
+  if (lua_istable(L, -1)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    b = (Budget *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  return b;
+}
+
+#ifdef LUA_USE_ESP
+#define budget_resumable(L) ((L) == task_co)
+#else
+#define budget_resumable(L) 1
+#endif
+
+static int budget_post (lua_State *L, int prio) {
+#ifdef LUA_USE_ESP
+  int ref;
+  if (!task_handle)
+    task_handle = platform_task_get_id(do_task);
+  lua_pushthread(L);
+  ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (platform_post(prio, task_handle, (platform_task_param_t)ref))
+    return 1;
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);       /* queue full so run on */
+  return 0;
+#else
+  UNUSED(L); UNUSED(prio);
+  return 1;
+#endif
+}
+
+static void budget_hook (lua_State *L, lua_Debug *ar) {
+  Budget *b;
+  UNUSED(ar);
+  lua_pushthread(L);
+  b = getbudget(L);
+  if (b == NULL) {
+    lua_sethook(L, NULL, 0, 0);
+  } else if (budget_resumable(L) && L->nCcalls <= L->baseCcalls &&
+             budget_post(L, b->prio)) {
+    b->preempts++;
+    lua_yield(L, 0);
+  } else {
+    b->feeds++;
 #ifdef LUA_USE_ESP
+    system_soft_wdt_feed();
+#endif
+  }
+}
+
 /*
- * Return an LFS function
+** Set the instruction budget and continuation priority of the coroutine at
+** idx, or remove its budget if budget <= 0.  Setting a budget resets the
+** coroutine's statistics and replaces any other hook set on it.
+*/
+LUALIB_API void luaL_setbudget (lua_State *L, int idx, int budget, int prio) { // [-0, +0, m]
+  lua_State *co = lua_tothread(L, idx);
+  Budget *b;
+  luaL_argcheck(L, co && co != G(L)->mainthread, idx, "coroutine expected");
+  if (idx < 0 && idx > LUA_REGISTRYINDEX)
+    idx = lua_gettop(L) + idx + 1;
+  lua_getfield(L, LUA_REGISTRYINDEX, BUDGETS);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, BUDGETS);
+  }
+  lua_pushvalue(L, idx);
+  if (budget > 0) {
+    b = (Budget *) lua_newuserdata(L, sizeof(Budget));
+    b->budget = budget;
+    b->prio = prio;
+    b->preempts = b->feeds = 0;
+    lua_sethook(co, budget_hook, LUA_MASKCOUNT, budget);
+  } else {
+    lua_pushnil(L);
+    if (lua_gethook(co) == budget_hook)
+      lua_sethook(co, NULL, 0, 0);
+  }
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/*
+** Push a table of the budget and statistics of the coroutine at idx, or nil
+** if it doesn't have a budget.
+*/
+LUALIB_API int luaL_pushbudget (lua_State *L, int idx) {        // [-0, +1, m]
+  Budget *b;
+  lua_pushvalue(L, idx);
+  b = getbudget(L);
+  if (b == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, b->budget);
+  lua_setfield(L, -2, "budget");
+  lua_pushinteger(L, b->prio);
+  lua_setfield(L, -2, "priority");
+  lua_pushinteger(L, b->preempts);
+  lua_setfield(L, -2, "preempts");
+  lua_pushinteger(L, b->feeds);
+  lua_setfield(L, -2, "feeds");
+  return 1;
+}
+
+#ifdef LUA_USE_ESP
+/*
+ * Look up the name at ToS using the given index function, replacing it by the
+ * corresponding function or nil.
  */
-LUALIB_API int luaL_pushlfsmodule (lua_State *L) {
-  if (lua_pushlfsindex(L) == LUA_TNIL) {
+static int pushindexedmodule (lua_State *L, int (*indexfn)(lua_State *L)) {
+  if (indexfn(L) == LUA_TNIL) {
     lua_remove(L,-2);  /* dump the name to balance the stack */
-    return 0;          /* return nil if LFS not loaded */
+    return 0;          /* return nil if not loaded */
   }
-  lua_insert(L, -2);
+  lua_pushvalue(L, -2);
   lua_call(L, 1, 1);
   if (!lua_isfunction(L, -1)) {
     lua_pop(L, 1);
     lua_pushnil(L);  /* replace DTS by nil */
   }
+  lua_remove(L, -2);   /* dump the name */
+  return 1;
+}
+
+/*
+ * Return an LFS function, falling back to the overlay region if the name
+ * isn't in the LFS
+ */
+LUALIB_API int luaL_pushlfsmodule (lua_State *L) {
+  lua_pushvalue(L, -1);                     /* keep a copy of the name */
+  pushindexedmodule(L, lua_pushlfsindex);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return pushindexedmodule(L, lua_pushoverlayindex);
+  }
+  lua_remove(L, -2);                        /* dump the name copy */
   return 1;
 }
 
@@ -152,6 +397,17 @@ LUALIB_API int luaL_pushlfsmodules (lua_State *L) {
 
 }
 
+/*
+ * Return an array of functions in the overlay region
+ */
+LUALIB_API int luaL_pushoverlaymodules (lua_State *L) {
+  if (lua_pushoverlayindex(L) == LUA_TNIL)
+    return 0;              /* return nil if overlay not loaded */
+  lua_call(L, 0, 2);
+  lua_remove(L, -2);     /* remove DTS leaving array */
+  return 1;
+}
+
 /*
  * Return the Unix timestamp of the LFS image creation
  */
@@ -238,10 +494,9 @@ LUA_API void lua_createrotable (lua_State *L, ROTable *t, const ROTable_entry *e
 #ifdef LUA_USE_ESP
 #include "lfunc.h"
 
-/* Push the LClosure of the LFS index function */
-LUA_API int lua_pushlfsindex (lua_State *L) {
+/* Push the LClosure of an LFS or overlay index function */
+static int pushindex (lua_State *L, Proto *p) {
   lua_lock(L);
-  Proto *p = G(L)->ROpvmain;
   if (p) {
     Closure *cl = luaF_newLclosure(L, 0, hvalue(gt(L)));
     cl->l.p = p;
@@ -253,4 +508,12 @@ LUA_API int lua_pushlfsindex (lua_State *L) {
   lua_unlock(L);
   return p ? LUA_TFUNCTION : LUA_TNIL;
 }
+
+LUA_API int lua_pushlfsindex (lua_State *L) {
+  return pushindex(L, G(L)->ROpvmain);
+}
+
+LUA_API int lua_pushoverlayindex (lua_State *L) {
+  return pushindex(L, G(L)->OVpvmain);
+}
 #endif
@@ -202,6 +202,11 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->ROstrt.hash    = NULL;
   g->ROpvmain       = NULL;
   g->LFSsize        = 0;
+  g->OVstrt.size    = 0;
+  g->OVstrt.nuse    = 0;
+  g->OVstrt.hash    = NULL;
+  g->OVpvmain       = NULL;
+  g->OVsize         = 0;
   g->error_reporter = 0;
 #endif
   for (i=0; i<LUA_NUMTAGS; i++) g->mt[i] = NULL;
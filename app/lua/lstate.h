@@ -99,6 +99,9 @@ typedef struct global_State {
   stringtable ROstrt;  /* Flash-based hash table for RO strings */
   Proto *ROpvmain;   /* Flash-based Proto main */
   int LFSsize;  /* Size of Lua Flash Store */
+  stringtable OVstrt;  /* Flash-based hash table for overlay RO strings */
+  Proto *OVpvmain;   /* Flash-based overlay Proto main */
+  int OVsize;  /* Size of overlay region */
   int error_reporter; /* Registry Index of error reporter task */
 #endif
 } global_State;
@@ -98,7 +98,9 @@ LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
 #ifndef LUA_CROSS_COMPILER
   /*
    * The RAM strt is searched first since RAM access is faster tham Flash access.
-   * If a miss, then search the RO string table.
+   * If a miss, then search the RO string table and then that of the overlay.
+   * Any overlay string that is also in the LFS is bound to the LFS copy when
+   * the overlay is loaded, so the LFS table must be searched first.
    */
   if (G(L)->ROstrt.hash) {
     for (o = G(L)->ROstrt.hash[lmod(h, G(L)->ROstrt.size)];
@@ -110,6 +112,16 @@ LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
       }
     }
   }
+  if (G(L)->OVstrt.hash) {
+    for (o = G(L)->OVstrt.hash[lmod(h, G(L)->OVstrt.size)];
+         o != NULL;
+         o = o->gch.next) {
+      TString *ts = rawgco2ts(o);
+      if (ts->tsv.len == l && (memcmp(str, getstr(ts), l) == 0)) {
+        return ts;
+      }
+    }
+  }
 #endif
   return newlstr(L, str, l, h);  /* not found */
 }
@@ -401,6 +401,8 @@ LUA_API int  (lua_freeheap) (void);
 
 LUA_API void (lua_getlfsconfig) (lua_State *L, int *);
 LUA_API int  (lua_pushlfsindex) (lua_State *L);
+LUA_API void (lua_getoverlayconfig) (lua_State *L, int *);
+LUA_API int  (lua_pushoverlayindex) (lua_State *L);
 
 #define EGC_NOT_ACTIVE        0   // EGC disabled
 #define EGC_ON_ALLOC_FAILURE  1   // run EGC on allocation failure
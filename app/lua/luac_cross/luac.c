@@ -13,7 +13,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#if !defined(_WIN32) && !defined(LUAC_NO_THREADS)
+#define LUAC_THREADS
+#include <pthread.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -40,6 +51,9 @@ static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* execute;       /* executed a Lua file */
 static const char* progname=PROGNAME;	/* actual program name */
+static const char* cachedir=NULL;	/* compiled chunk cache directory */
+static int jobs=1;			/* number of compile threads */
+static int timing=0;			/* report compile and link times? */
 static DumpTargetInfo target;
 
 void luac_fatal(const char* message)
@@ -71,10 +85,13 @@ static void usage(const char* message)
  "  -e name  execute a lua source file\n"
  "  -f       output a flash image file\n"
  "  -a addr  generate an absolute, rather than position independent flash image file\n"
+ "  -C dir   cache compiled files in directory " LUA_QL("dir") "\n"
+ "  -j n     compile using n threads\n"
  "  -i       generate lookup combination master (default with option -f)\n"
  "  -m size  maximum LFS image in bytes\n"
  "  -p       parse only\n"
  "  -s       strip debug information\n"
+ "  -t       report compile and link times\n"
  "  -v       show version information\n"
  "  --       stop handling options\n",
  progname,Output);
@@ -120,6 +137,17 @@ static int doargs(int argc, char* argv[])
    if (offset > IROM0_SEGMAX)
      usage(LUA_QL("-e") " absolute address must be valid flash address");
   }
+  else if (IS("-C"))			/* compile cache directory */
+  {
+   cachedir=argv[++i];
+   if (cachedir==NULL || *cachedir==0 || *cachedir=='-')
+     usage(LUA_QL("-C") " needs argument");
+  }
+  else if (IS("-j"))			/* number of compile threads */
+  {
+   if (argv[++i]==NULL || (jobs=strtol(argv[i],NULL,0)) < 1)
+     usage(LUA_QL("-j") " needs a positive thread count");
+  }
   else if (IS("-i"))			/* lookup */
    lookup = 1;
   else if (IS("-l"))			/* list */
@@ -142,6 +170,8 @@ static int doargs(int argc, char* argv[])
    dumping=0;
   else if (IS("-s"))			/* strip debug information */
    stripping=1;
+  else if (IS("-t"))			/* report timings */
+   timing=1;
   else if (IS("-v"))			/* show version */
    ++version;
   else					/* unknown option */
@@ -267,6 +297,254 @@ static int writer(lua_State* L, const void* p, size_t size, void* u)
  return (fwrite(p,size,1,(FILE*)u)!=1) && (size!=0);
 }
 
+/*
+** Compile cache and parallel compilation.  Each input file is read into RAM
+** and hashed together with its chunkname and the target build parameters.
+** If the -C directory holds a chunk with this hash then this is used instead
+** of recompiling the source.  The remaining files are compiled to unstripped
+** binary chunks by -j worker threads, each with its own lua_State, and these
+** chunks are written back to the cache.  The main state then only needs to
+** undump the chunks in file order before combining and dumping the image.
+*/
+typedef struct {
+ const char *filename;
+ char chunkname[FILENAME_MAX+2];
+ char *buf;				/* file contents */
+ const char *src;			/* source within buf */
+ size_t srclen;
+ char *bc;				/* binary chunk */
+ size_t bclen, bcsize;
+ int cached;
+ char key[17];
+} Unit;
+
+static Unit *units;
+static int nunits, nextunit;
+#ifdef LUAC_THREADS
+static pthread_mutex_t unitlock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static double wallclock(void)
+{
+#ifdef LUAC_THREADS
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return ts.tv_sec + ts.tv_nsec*1e-9;
+#else
+ return ((double) clock())/CLOCKS_PER_SEC;
+#endif
+}
+
+static char *readfile(const char *name, size_t *len)
+{
+ FILE *f=fopen(name,"rb");
+ char *buf=NULL;
+ long l;
+ if (f==NULL) return NULL;
+ if (fseek(f,0,SEEK_END)==0 && (l=ftell(f))>=0 && fseek(f,0,SEEK_SET)==0 &&
+     (buf=malloc(l+1))!=NULL && fread(buf,1,l,f)!=(size_t)l)
+ {
+  free(buf);
+  buf=NULL;
+ }
+ fclose(f);
+ if (buf) *len=l;
+ return buf;
+}
+
+static unsigned long long fnv1a(unsigned long long h, const void *p, size_t l)
+{
+ const unsigned char *s=p;
+ while (l--) h=(h^*s++)*0x100000001b3ull;
+ return h;
+}
+
+static void cachepath(char *path, const Unit *u)
+{
+ sprintf(path,"%.*s/%s.luc",FILENAME_MAX-22,cachedir,u->key);
+}
+
+static void cacheread(Unit *u)
+{
+ char path[FILENAME_MAX];
+ cachepath(path,u);
+ u->bc=readfile(path,&u->bclen);
+ if (u->bc && (u->bclen<sizeof(LUA_SIGNATURE) ||
+     memcmp(u->bc,LUA_SIGNATURE,sizeof(LUA_SIGNATURE)-1)!=0))
+ {
+  free(u->bc);
+  u->bc=NULL;
+ }
+ u->cached=(u->bc!=NULL);
+}
+
+/* Write to a private temporary then rename, as parallel builds can share a cache */
+static void cachewrite(const Unit *u)
+{
+ char path[FILENAME_MAX], tmp[FILENAME_MAX+24];
+ FILE *f;
+ int ok;
+ cachepath(path,u);
+ sprintf(tmp,"%s.%lu.%d",path,(unsigned long)getpid(),(int)(u-units));
+ if ((f=fopen(tmp,"wb"))==NULL) return;
+ ok=fwrite(u->bc,1,u->bclen,f)==u->bclen;
+ if (fclose(f)!=0) ok=0;
+ if (ok && rename(tmp,path)!=0)
+ {					/* Windows won't rename over a file */
+  remove(path);
+  rename(tmp,path);
+ }
+ remove(tmp);
+}
+
+static void openunit(Unit *u, const char *filename)
+{
+ unsigned long long h=0xcbf29ce484222325ull;
+ char tag[64];
+ const char *s;
+ u->filename=filename;
+ if (filename==NULL) return;		/* stdin is always compiled inline */
+ sprintf(u->chunkname,"@%.*s",FILENAME_MAX,filename);
+ if ((u->buf=readfile(filename,&u->srclen))==NULL)
+ {
+  fprintf(stderr,"%s: cannot open %s\n",progname,filename);
+  exit(EXIT_FAILURE);
+ }
+ u->src=u->buf;
+ if (*u->src=='#')			/* skip `#!...' but keep the line count */
+ {
+  s=memchr(u->src,'\n',u->srclen);
+  s=s ? s : u->src+u->srclen;
+  u->srclen-=s-u->src;
+  u->src=s;
+ }
+ sprintf(tag,"%s %d %d %d %d %d",LUA_RELEASE,LUAC_FORMAT,target.sizeof_int,
+         target.sizeof_strsize_t,target.sizeof_lua_Number,
+         target.lua_Number_integral);
+ h=fnv1a(h,tag,strlen(tag)+1);
+ h=fnv1a(h,u->chunkname,strlen(u->chunkname)+1);
+ h=fnv1a(h,u->src,u->srclen);
+ sprintf(u->key,"%08lx%08lx",(unsigned long)(h>>32),(unsigned long)(h&0xffffffff));
+ if (cachedir) cacheread(u);
+}
+
+static int bufwriter(lua_State* L, const void* p, size_t size, void* ud)
+{
+ Unit *u=(Unit *)ud;
+ UNUSED(L);
+ if (u->bclen+size>u->bcsize)
+ {
+  char *bc=realloc(u->bc,u->bcsize=2*(u->bclen+size));
+  if (bc==NULL) return 1;
+  u->bc=bc;
+ }
+ memcpy(u->bc+u->bclen,p,size);
+ u->bclen+=size;
+ return 0;
+}
+
+static Unit *nextjob(void)
+{
+ Unit *u=NULL;
+#ifdef LUAC_THREADS
+ pthread_mutex_lock(&unitlock);
+#endif
+ while (nextunit<nunits && (units[nextunit].bc || !units[nextunit].filename))
+  nextunit++;
+ if (nextunit<nunits) u=units+nextunit++;
+#ifdef LUAC_THREADS
+ pthread_mutex_unlock(&unitlock);
+#endif
+ return u;
+}
+
+/*
+** A compile worker.  Any compile error is left for the main state to report
+** when it recompiles the file, so that errors are raised in file order.
+*/
+static void *compiler(void *ud)
+{
+ lua_State *L=luaL_newstate();
+ Unit *u;
+ UNUSED(ud);
+ if (L==NULL) return NULL;
+ while ((u=nextjob())!=NULL)
+ {
+  if (luaL_loadbuffer(L,u->src,u->srclen,u->chunkname)==0 &&
+      lua_dump(L,bufwriter,u,0)==0)
+  {
+   if (cachedir) cachewrite(u);
+  }
+  else
+  {
+   free(u->bc);
+   u->bc=NULL;
+  }
+  lua_settop(L,0);
+ }
+ lua_close(L);
+ return NULL;
+}
+
+static void compileunits(void)
+{
+#ifdef LUAC_THREADS
+ pthread_t *t=calloc(jobs,sizeof(pthread_t));
+ int i, n=0;
+ for (i=0; t && i<jobs-1; i++, n++)
+  if (pthread_create(t+i,NULL,compiler,NULL)!=0) break;
+ compiler(NULL);
+ for (i=0; i<n; i++) pthread_join(t[i],NULL);
+ free(t);
+#else
+ compiler(NULL);
+#endif
+}
+
+static void loadunits(lua_State* L, int argc, char* argv[])
+{
+ int i, hits=0;
+ double t0=wallclock();
+ if (cachedir)
+#ifdef _WIN32
+  _mkdir(cachedir);
+#else
+  mkdir(cachedir,0777);
+#endif
+ units=calloc(argc,sizeof(Unit));
+ if (units==NULL) fatal("not enough memory for file list");
+ nunits=argc;
+ for (i=0; i<argc; i++)
+ {
+  openunit(units+i,IS("-") ? NULL : argv[i]);
+  hits+=units[i].cached;
+ }
+ compileunits();
+ for (i=0; i<argc; i++)
+ {
+  Unit *u=units+i;
+  int status;
+  if (u->filename==NULL)
+   status=luaL_loadfile(L,NULL);
+  else
+  {
+   status=u->bc ? luaL_loadbuffer(L,u->bc,u->bclen,u->chunkname) : 1;
+   if (status!=0)
+   {					/* fall back to compiling the source */
+    if (u->bc) lua_pop(L,1);
+    status=luaL_loadbuffer(L,u->src,u->srclen,u->chunkname);
+   }
+  }
+  if (status!=0) fatal(lua_tostring(L,-1));
+  free(u->buf);
+  free(u->bc);
+ }
+ free(units);
+ if (timing)
+  fprintf(stderr,"%s: compiled %d files (%d cached) using %d thread%s in %.3fs\n",
+          progname,argc,hits,jobs,jobs>1 ? "s" : "",wallclock()-t0);
+}
+
 struct Smain {
  int argc;
  char** argv;
@@ -299,7 +577,9 @@ static int pmain(lua_State* L)
    execute = NULL;
   }
  }
- for (i=0; i<argc; i++)
+ if (cachedir || jobs>1 || timing)
+  loadunits(L,argc,argv);
+ else for (i=0; i<argc; i++)
  {
   const char* filename=IS("-") ? NULL : argv[i];
   if (luaL_loadfile(L,filename)!=0) fatal(lua_tostring(L,-1));
@@ -309,6 +589,7 @@ static int pmain(lua_State* L)
  if (dumping)
  {
   int result;
+  double t0=wallclock();
   FILE* D= (output==NULL) ? stdout : fopen(output,"wb");
   if (D==NULL) cannot("open");
   lua_lock(L);
@@ -324,6 +605,9 @@ static int pmain(lua_State* L)
   if (result==LUA_ERR_CC_NOTINTEGER) fatal("target lua_Number is integral but fractional value found");
   if (ferror(D)) cannot("write");
   if (fclose(D)) cannot("close");
+  if (timing)
+   fprintf(stderr,"%s: %s written in %.3fs\n",progname,
+           flash ? "flash image" : "output",wallclock()-t0);
  }
  return 0;
 }
@@ -171,6 +171,7 @@ if not _G._soft then
 end
 dofile('nextvar.lua')
 dofile('pm.lua')
+dofile('cpattern.lua')
 dofile('utf8.lua')
 dofile('api.lua')
 assert(dofile('events.lua') == 12)
@@ -0,0 +1,94 @@
+-- NodeMCU: tests and benchmarks for string.compile().  This file only uses
+-- Lua 5.1 compatible syntax, so it can also be run on the Lua 5.1 host
+-- build with "luac.cross -e cpattern.lua".
+
+print('testing compiled patterns')
+
+local pats = {
+  "a", "^a", "abc", "a*", "a+b", "a-b", "a?b", "%d+", "^%s*(.-)%s*$",
+  "(%w+)=(%w+)", "[%a_][%w_]*", "[^%s]+", "%bxy", "%b()", "%f[%w]%w+",
+  "%f[%a]", "(a*(.)%w(%s*))", "()a()", "(.)%1", "x$", "$x", "^$", "",
+  ".-b", "[a-c]+", "[]]", "[^]]", "%.", "[%%a]", "(%d+)%.(%d+)",
+  "^([^:]+):%s*(.*)$", "GET /", "ab*c", "%S+", "a.", "([a-z]+)(%d*)",
+}
+
+local subjects = {
+  "", "a", "aaab", "abc abc", "  hello world  ", "key=value x=y",
+  "_foo bar2 baz_3", "x(a(b)c)y", "THE (quick) fox", "xayb xyyz",
+  "12.5 and 3.25", "aa bb cc", "a]b]", "Host: example.com",
+  "GET /index.html HTTP/1.1", "abbbc ac abc", "%a%", "ab1cd22",
+}
+
+local function pack (...) return {n = select("#", ...), ...} end
+
+local function same (a, b)
+  if a.n ~= b.n then return false end
+  for i = 1, a.n do
+    if a[i] ~= b[i] then return false end
+  end
+  return true
+end
+
+local function gmatchall (f, ...)
+  local r = {}
+  for a, b in f(...) do r[#r + 1] = tostring(a) .. "|" .. tostring(b) end
+  return table.concat(r, ",")
+end
+
+local repls = {"<%0>", "%1", function (x) return x:upper() end, {a = "A"}}
+
+-- every compiled method must give the same results as the string function
+for _, p in ipairs(pats) do
+  local cp = string.compile(p)
+  for _, s in ipairs(subjects) do
+    for init = -3, #s + 2 do
+      assert(same(pack(s:find(p, init)), pack(cp:find(s, init))))
+      assert(same(pack(s:match(p, init)), pack(cp:match(s, init))))
+    end
+    if p:sub(1, 1) ~= "^" then  -- see anchored gmatch below
+      assert(gmatchall(string.gmatch, s, p) == gmatchall(cp.gmatch, cp, s))
+    end
+    for _, r in ipairs(repls) do
+      for _, n in ipairs{1, 1000} do
+        assert(same(pack(pcall(string.gsub, s, p, r, n)),
+                    pack(pcall(cp.gsub, cp, s, r, n))))
+      end
+    end
+  end
+end
+
+-- an anchored pattern only matches at the start of the subject in gmatch
+assert(gmatchall(string.compile("^a").gmatch, string.compile("^a"), "aaa") == "a|nil")
+assert(gmatchall(string.compile("^b").gmatch, string.compile("^b"), "aba") == "")
+
+-- compiled patterns can be used through the string metatable
+assert(("k=v"):compile():match("xk=vx") == "k=v")
+
+-- malformed patterns are rejected when compiled
+for _, p in ipairs{"%", "[a", "%f", "%fx", "%b", "%bx"} do
+  assert(not pcall(string.compile, p))
+end
+
+if not _soft then
+  local line = "GET /api/v1/status?id=42 HTTP/1.1"
+  local hdr = ("Content-Type: text/html\r\nHost: example.com\r\n" ..
+               "Content-Length: 1234\r\n"):rep(4)
+  local N = 20000
+  for _, c in ipairs{
+    {"^(%u+) (%S+) HTTP/(%d)%.(%d)$", line},
+    {"Content%-Length: (%d+)", hdr},
+    {"(%w+)=(%w+)", line},
+  } do
+    local p, s = c[1], c[2]
+    local cp = string.compile(p)
+    local t0 = os.clock()
+    for _ = 1, N do s:match(p) end
+    local t1 = os.clock()
+    for _ = 1, N do cp:match(s) end
+    local t2 = os.clock()
+    print(string.format("  %-32s string %.3fs compiled %.3fs",
+                        p, t1 - t0, t2 - t1))
+  end
+end
+
+print('OK')
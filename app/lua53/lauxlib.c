@@ -37,6 +37,9 @@
 #include "vfs.h"
 #include <fcntl.h>
 #endif
+#define heap_failure(n)  platform_heap_failure(n)
+#else
+#define heap_failure(n)
 #endif
 
 
@@ -1104,8 +1107,9 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     void *newptr = realloc(ptr, nsize);
     if (newptr == NULL && ptr != NULL && nsize <= osize)
       return ptr;  /* keep the original block */
-    else  /* no fail or not shrinking */
-     return newptr;  /* use the new block */
+    if (newptr == NULL)   /* report the heap state before the emergency GC */
+      heap_failure(nsize);
+    return newptr;
   }
 }
 
@@ -1190,4 +1194,61 @@ LUALIB_API int luaL_pcallx (lua_State *L, int narg, int nres) {
     }
   return status;
 }
+
+/*
+** Coroutine await.  A C library function called from a coroutine suspends it
+** with
+**
+**     int ref = luaL_awaitref(L);  ... save ref ...;  return lua_yield(L, 0);
+**
+** and the C callback for the awaited event later pushes the event's values
+** and calls luaL_awaitresume(L, ref, narg) to resume the coroutine directly,
+** with those values returned as the results of the library call.  Unlike a
+** Lua callback, this needs no closure or upvalues per operation: the only
+** state held is a registry reference to the coroutine itself.
+*/
+LUALIB_API int luaL_awaitref (lua_State *L) {
+  if (!lua_isyieldable(L))
+    luaL_error(L, "attempt to await outside a coroutine");
+  lua_pushthread(L);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/*
+** Resume a coroutine suspended by luaL_awaitref() with the narg values at ToS
+** and release the reference.  An error thrown by the coroutine is reported
+** through the onerror reporter in the same way as a luaL_pcallx() callback.
+** A coroutine which hasn't been started is also accepted, so that a new one
+** can be posted by luaL_posttask() and the values are its arguments.
+*/
+extern lua_State *luaN_taskco;     /* see budget_hook() in lnodemcu.c */
+
+LUALIB_API int luaL_awaitresume (lua_State *L, int ref, int narg) {
+  lua_State *co, *prev;
+  lua_Debug ar;
+  int status;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  co = lua_tothread(L, -1);
+  if (!co || !(lua_status(co) == LUA_YIELD ||         /* suspended or new */
+               (lua_status(co) == 0 && lua_getstack(co, 0, &ar) == 0 &&
+                lua_gettop(co) > 0))) {
+    lua_pop(L, narg + 1);        /* coroutine has already been resumed or died */
+    return LUA_ERRRUN;
+  }
+  lua_insert(L, -1 - narg);              /* anchor the thread below the args */
+  lua_xmove(L, co, narg);
+  prev = luaN_taskco;
+  luaN_taskco = co;
+  status = lua_resume(co, L, narg);
+  luaN_taskco = prev;
+  if (status != LUA_OK && status != LUA_YIELD) {
+    luaL_traceback(L, co, lua_tostring(co, -1), 0);
+    lua_pushcclosure(L, errhandler_aux, 1);       /* report with str as upval */
+    luaL_posttask(L, LUA_TASK_HIGH);
+  }
+  lua_settop(co, 0);              /* discard any yielded values or results */
+  lua_pop(L, 1);                                         /* dump the thread */
+  return status == LUA_YIELD ? LUA_OK : status;
+}
 #endif
@@ -290,6 +290,10 @@ LUALIB_API int  (luaL_pushlfsdts) (lua_State *L);
 LUALIB_API void (luaL_lfsreload) (lua_State *L);
 LUALIB_API int  (luaL_posttask) (lua_State* L, int prio);
 LUALIB_API int  (luaL_pcallx) (lua_State *L, int narg, int nres);
+LUALIB_API int  (luaL_awaitref) (lua_State *L);
+LUALIB_API int  (luaL_awaitresume) (lua_State *L, int ref, int narg);
+LUALIB_API void (luaL_setbudget) (lua_State *L, int idx, int budget, int prio);
+LUALIB_API int  (luaL_pushbudget) (lua_State *L, int idx);
 
 #define luaL_pushlfsmodule(l) lua_pushlfsfunc(L)
 
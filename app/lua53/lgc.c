@@ -24,6 +24,12 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#ifdef LUA_USE_ESP
+#include "trace.h"
+#else
+#define TRACE_BEGIN(id, a, b)
+#define TRACE_END(id, a, b)
+#endif
 
 
 /*
@@ -1147,6 +1153,7 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  TRACE_BEGIN(TRACE_GC_STEP, gettotalbytes(g), 0);
   do {  /* repeat until pause or enough "credit" (negative debt) */
 /*DEBUG  int32_t start = CCOUNT_REG; */
     lu_mem work = singlestep(L);  /* perform one single step */
@@ -1162,6 +1169,7 @@ void luaC_step (lua_State *L) {
     runafewfinalizers(L);
 /*DEBUG  dbg_printf("new debt - %d, %d, %u \n", debt, lua_freeheap(), CCOUNT_REG-start); */
   }
+  TRACE_END(TRACE_GC_STEP, gettotalbytes(g), 0);
 }
 
 
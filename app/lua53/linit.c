@@ -40,6 +40,12 @@
 #include "lauxlib.h"
 #include "lstate.h"
 #include "lnodemcu.h"
+#ifdef LUA_CROSS_COMPILER
+#define STARTUP_BEGIN(name)
+#define STARTUP_END(name)
+#else
+#include "platform.h"
+#endif
 
 extern LROT_TABLE(strlib);
 extern LROT_TABLE(tab_funcs);
@@ -84,6 +90,8 @@ LUAC_MODULE(bit)
 LUAC_MODULE(color_utils)
 LUAC_MODULE_INIT(sjson, luaopen_sjson)
 LUAC_MODULE(pipe)
+LUAC_MODULE_INIT(strbuf, luaopen_strbuf)
+LUAC_MODULE(perf)
 LUAC_MODULE_INIT(pixbuf, luaopen_pixbuf)
 
 LUAC_MODULE(rotables_meta);
@@ -101,6 +109,8 @@ LROT_BEGIN(rotables, LROT_TABLEREF(rotables_meta), 0)
   LROT_TABENTRY(color_utils, color_utils)
   LROT_TABENTRY(sjson, sjson)
   LROT_TABENTRY(pipe, pipe)
+  LROT_TABENTRY(strbuf, strbuf)
+  LROT_TABENTRY(perf, perf)
   LROT_TABENTRY(pixbuf, pixbuf)
 LROT_END(rotables, LROT_TABLEREF(rotables_meta), 0)
 
@@ -114,6 +124,8 @@ LROT_BEGIN(lua_libs, NULL, 0)
   LROT_FUNCENTRY(color_utils, NULL)
   LROT_FUNCENTRY(sjson, luaopen_sjson)
   LROT_FUNCENTRY(pipe, NULL)
+  LROT_FUNCENTRY(strbuf, luaopen_strbuf)
+  LROT_FUNCENTRY(perf, NULL)
   LROT_FUNCENTRY(pixbuf, luaopen_pixbuf)
 LROT_END(lua_libs, NULL, 0)
 
@@ -144,7 +156,10 @@ void luaL_openlibs (lua_State *L) {
 #endif
   /* Now do lua opens */
   for ( ; p->key; p++) {
-    if (ttislcf(&p->value) && fvalue(&p->value))
+    if (ttislcf(&p->value) && fvalue(&p->value)) {
+      STARTUP_BEGIN(p->key);
       luaL_requiref(L, p->key, fvalue(&p->value), 1);
+      STARTUP_END(p->key);
+    }
   }
 }
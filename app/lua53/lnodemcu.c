@@ -168,6 +168,8 @@ static void platform_s_flash_write(const void *from, lu_int32 to, lu_int32 len)
 }
 
 #define flush_icache(F)   /* not needed */
+#define STARTUP_BEGIN(name)
+#define STARTUP_END(name)
 
 #endif
 
@@ -507,6 +509,7 @@ LUAI_FUNC int luaN_init (lua_State *L) {
   */
   if (F == NULL) {
     size_t Fsize = sizeof(LFSflashState) + OSIZE*WORDSIZE + ISIZE;
+    STARTUP_BEGIN("luaN_init");
     /* outlining the buffers just makes debugging easier.  Sorry */
     F = calloc(Fsize, 1);
     F->oBuff = wordptr(F + 1);
@@ -534,6 +537,7 @@ LUAI_FUNC int luaN_init (lua_State *L) {
         }
       }
     }
+    STARTUP_END("luaN_init");
     return 0;
   } else {  /* hook 2 called from protected pmain, so can throw errors. */
     int status = 0;
@@ -624,6 +628,9 @@ LUALIB_API void luaL_lfsreload (lua_State *L) {
 
 #ifdef LUA_USE_ESP
 extern void lua_main(void);
+static platform_task_handle_t task_handle = 0;
+lua_State *luaN_taskco;        /* being resumed by luaL_awaitresume() */
+
 /*
 ** Task callback handler. Uses luaN_call to do a protected call with full traceback
 */
@@ -635,8 +642,23 @@ static void do_task (platform_task_param_t task_fn_ref, uint8_t prio) {
   }
   if (prio < LUA_TASK_LOW|| prio > LUA_TASK_HIGH)
     luaL_error(L, "invalid posk task");
-/* Pop the CB func from the Reg */
+/*
+** A posted coroutine is resumed with the priority as the result of its yield,
+** except that one preempted by its instruction budget is just continued.
+*/
   lua_rawgeti(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
+  if (lua_isthread(L, -1)) {
+    lua_State *co = lua_tothread(L, -1);
+    int narg = 0;
+    lua_pop(L, 1);
+    if (!(lua_status(co) == LUA_YIELD && isLua(co->ci))) {
+      lua_pushinteger(L, prio);
+      narg = 1;
+    }
+    luaL_awaitresume(L, (int) task_fn_ref, narg);
+    return;
+  }
+/* Pop the CB func from the Reg */
   luaL_checktype(L, -1, LUA_TFUNCTION);
   luaL_unref(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
   lua_pushinteger(L, prio);
@@ -644,17 +666,18 @@ static void do_task (platform_task_param_t task_fn_ref, uint8_t prio) {
 }
 
 /*
-** Schedule a Lua function for task execution
+** Schedule a Lua function for task execution, or a suspended coroutine to be
+** resumed by the task.
 */
 LUALIB_API int luaL_posttask ( lua_State* L, int prio ) {         // [-1, +0, -]
-  static platform_task_handle_t task_handle = 0;
   if (!task_handle)
     task_handle = platform_task_get_id(do_task);
   if (L == NULL && prio == LUA_TASK_HIGH+1) { /* Undocumented hook for lua_main */
     platform_post(LUA_TASK_HIGH, task_handle, (platform_task_param_t)~0);
     return -1;
   }
-  if (lua_isfunction(L, -1) && prio >= LUA_TASK_LOW && prio <= LUA_TASK_HIGH) {
+  if ((lua_isfunction(L, -1) || lua_isthread(L, -1)) &&
+      prio >= LUA_TASK_LOW && prio <= LUA_TASK_HIGH) {
     int task_fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     if(!platform_post(prio, task_handle, (platform_task_param_t)task_fn_ref)) {
       luaL_unref(L, LUA_REGISTRYINDEX, task_fn_ref);
@@ -673,3 +696,140 @@ LUALIB_API int luaL_posttask( lua_State* L, int prio ) {            // [-1, +0,
   return -1;
 }
 #endif
+
+/*
+** Instruction budgets.  A coroutine given a budget runs with a count hook
+** which fires every budget VM instructions.  If the coroutine is yieldable at
+** that point, the hook posts it as a task and yields, so that a long
+** computation is continued from a later task instead of starving the SDK and
+** tripping the watchdog.  It can't yield inside a C call such as a table.sort()
+** comparator or a metamethod, so there it just feeds the watchdog and runs on.
+**
+** The budgets are userdata in a weak keyed registry table indexed by thread,
+** so they go when the coroutine is collected.  A coroutine created by a
+** budgeted one inherits the hook but not the budget, so its hook is removed
+** on first firing.  Only a coroutine being run by luaL_awaitresume(), from a
+** task or an event's callback, is preempted: one resumed by hand with
+** coroutine.resume() would see the preemption as a yield and then be resumed
+** twice, so it too is just fed.  On the host there is no task queue and a
+** preempted coroutine just yields to its resumer.
+*/
+#define BUDGETS "_budgets"
+
+typedef struct {
+  int budget;                   /* instructions between preemption points */
+  int prio;                     /* task priority when continued */
+  unsigned preempts;            /* yields to the task queue */
+  unsigned feeds;               /* preemption points where it couldn't yield */
+} Budget;
+
+/* Look up the budget of the thread at ToS, which is popped */
+static Budget *getbudget (lua_State *L) {
+  Budget *b = NULL;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, BUDGETS) == LUA_TTABLE) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    b = (Budget *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  return b;
+}
+
+#ifdef LUA_USE_ESP
+#define budget_resumable(L) ((L) == luaN_taskco)
+#else
+#define budget_resumable(L) 1
+#endif
+
+static int budget_post (lua_State *L, int prio) {
+#ifdef LUA_USE_ESP
+  int ref;
+  if (!task_handle)
+    task_handle = platform_task_get_id(do_task);
+  lua_pushthread(L);
+  ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (platform_post(prio, task_handle, (platform_task_param_t)ref))
+    return 1;
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);       /* queue full so run on */
+  return 0;
+#else
+  UNUSED(L); UNUSED(prio);
+  return 1;
+#endif
+}
+
+static void budget_hook (lua_State *L, lua_Debug *ar) {
+  Budget *b;
+  UNUSED(ar);
+  lua_pushthread(L);
+  b = getbudget(L);
+  if (b == NULL) {
+    lua_sethook(L, NULL, 0, 0);
+  } else if (budget_resumable(L) && lua_isyieldable(L) &&
+             budget_post(L, b->prio)) {
+    b->preempts++;
+    lua_yield(L, 0);
+  } else {
+    b->feeds++;
+#ifdef LUA_USE_ESP
+    system_soft_wdt_feed();
+#endif
+  }
+}
+
+/*
+** Set the instruction budget and continuation priority of the coroutine at
+** idx, or remove its budget if budget <= 0.  Setting a budget resets the
+** coroutine's statistics and replaces any other hook set on it.
+*/
+LUALIB_API void luaL_setbudget (lua_State *L, int idx, int budget, int prio) {
+  lua_State *co = lua_tothread(L, idx);
+  Budget *b;
+  luaL_argcheck(L, co && co != G(L)->mainthread, idx, "coroutine expected");
+  idx = lua_absindex(L, idx);
+  if (luaL_getsubtable(L, LUA_REGISTRYINDEX, BUDGETS) == 0) {
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+  }
+  lua_pushvalue(L, idx);
+  if (budget > 0) {
+    b = (Budget *) lua_newuserdata(L, sizeof(Budget));
+    b->budget = budget;
+    b->prio = prio;
+    b->preempts = b->feeds = 0;
+    lua_sethook(co, budget_hook, LUA_MASKCOUNT, budget);
+  } else {
+    lua_pushnil(L);
+    if (lua_gethook(co) == budget_hook)
+      lua_sethook(co, NULL, 0, 0);
+  }
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/*
+** Push a table of the budget and statistics of the coroutine at idx, or nil
+** if it doesn't have a budget.
+*/
+LUALIB_API int luaL_pushbudget (lua_State *L, int idx) {
+  Budget *b;
+  lua_pushvalue(L, idx);
+  b = getbudget(L);
+  if (b == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, b->budget);
+  lua_setfield(L, -2, "budget");
+  lua_pushinteger(L, b->prio);
+  lua_setfield(L, -2, "priority");
+  lua_pushinteger(L, b->preempts);
+  lua_setfield(L, -2, "preempts");
+  lua_pushinteger(L, b->feeds);
+  lua_setfield(L, -2, "feeds");
+  return 1;
+}
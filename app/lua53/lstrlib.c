@@ -807,6 +807,484 @@ static int str_gsub (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
+
+/*
+** string.compile(p) decodes a pattern once into a vector of items, so that
+** the pattern string isn't re-parsed at every step of every match.  Single
+** character classes (%a, [a-z_], etc.) are expanded into 256-bit sets, and
+** any leading literal characters are kept as a prefix which is located with
+** lmemfind() before attempting a full match at that position.
+*/
+
+#define PATTERN_MT	"string.pattern"
+
+enum { PAT_END, PAT_EOS, PAT_OPEN, PAT_POSOPEN, PAT_CLOSE, PAT_BALANCE,
+       PAT_FRONTIER, PAT_BACKREF, PAT_ANY, PAT_CHAR, PAT_SET };
+
+typedef struct PatItem {
+  unsigned char op;   /* PAT_xxx */
+  unsigned char rep;  /* repetition suffix: '\0', '?', '*', '+' or '-' */
+  unsigned char a;    /* char, set index, %b open or back reference digit */
+  unsigned char b;    /* %b close */
+} PatItem;
+
+typedef struct Pattern {
+  int nitems;        /* excluding the terminating PAT_END */
+  int nsets;
+  size_t prefixlen;  /* number of leading literal chars */
+  int anchor;
+} Pattern;
+
+#define pat_items(cp)  ((PatItem *)((cp)+1))
+#define pat_sets(cp)   ((unsigned char (*)[32])(pat_items(cp)+(cp)->nitems+1))
+#define pat_prefix(cp) ((char *)(pat_sets(cp)+(cp)->nsets))
+#define inset(set,c)   ((set)[(c)>>3] & (1<<((c)&7)))
+
+
+/*
+** Decode pattern p into cp.  This is called twice: first with it == NULL
+** just to size the Pattern, then to fill in the items and sets.
+*/
+static void pat_decode (lua_State *L, const char *p, size_t lp, Pattern *cp,
+                        PatItem *it, unsigned char (*sets)[32]) {
+  MatchState ms;
+  int literal = 1;
+  ms.L = L;
+  ms.p_end = p + lp;
+  cp->nitems = cp->nsets = 0;
+  cp->prefixlen = 0;
+  if ((cp->anchor = (*p == '^')) != 0) p++;
+  while (p < ms.p_end) {
+    PatItem i = {PAT_CHAR, 0, 0, 0};
+    const char *ep = NULL;  /* end of item including any suffix */
+    const char *ce = NULL;  /* end of class */
+    int c;
+    switch (*p) {
+      case '(':
+        i.op = (*(p+1) == ')') ? PAT_POSOPEN : PAT_OPEN;
+        p += (i.op == PAT_POSOPEN) ? 2 : 1;
+        break;
+      case ')':
+        i.op = PAT_CLOSE; p++;
+        break;
+      case '$':
+        if (p+1 == ms.p_end) {
+          i.op = PAT_EOS; p++;
+          break;
+        }
+        goto dflt;
+      case L_ESC:
+        if (*(p+1) == 'b') {
+          if (p+2 >= ms.p_end - 1)
+            luaL_error(L, "malformed pattern (missing arguments to '%%b')");
+          i.op = PAT_BALANCE; i.a = uchar(*(p+2)); i.b = uchar(*(p+3));
+          p += 4;
+          break;
+        }
+        if (*(p+1) == 'f') {
+          p += 2;
+          if (*p != '[')
+            luaL_error(L, "missing '[' after '%%f' in pattern");
+          i.op = PAT_FRONTIER;
+          ep = ce = classend(&ms, p);
+          break;
+        }
+        if (isdigit(uchar(*(p+1)))) {
+          i.op = PAT_BACKREF; i.a = uchar(*(p+1));
+          p += 2;
+          break;
+        }
+        /* FALLTHROUGH */
+      default: dflt:
+        ep = ce = classend(&ms, p);
+        if (*p == '.')
+          i.op = PAT_ANY;
+        else if (*p == L_ESC && !isalnum(uchar(*(p+1))))
+          i.a = uchar(*(p+1));
+        else if (*p == L_ESC || *p == '[')
+          i.op = PAT_SET;
+        else
+          i.a = uchar(*p);
+        if (ep < ms.p_end && *ep && strchr("?*+-", *ep))
+          i.rep = *ep++;
+    }
+    if (ep) {
+      if (i.op == PAT_SET || i.op == PAT_FRONTIER) {
+        if (cp->nsets > 255)
+          luaL_error(L, "pattern too complex");
+        if (sets) {
+          unsigned char *set = sets[cp->nsets];
+          memset(set, 0, 32);
+          for (c = 0; c < 256; c++)
+            if (*p == L_ESC ? match_class(c, uchar(*(p+1))) :
+                              matchbracketclass(c, p, ce-1))
+              set[c>>3] |= 1<<(c&7);
+        }
+        i.a = cp->nsets++;
+      }
+      p = ep;
+    }
+    if (literal && i.op == PAT_CHAR && i.rep == 0)
+      cp->prefixlen++;
+    else
+      literal = 0;
+    if (it) it[cp->nitems] = i;
+    cp->nitems++;
+  }
+  if (it) it[cp->nitems].op = PAT_END;
+}
+
+
+static int pat_single (const Pattern *cp, const PatItem *it, int c) {
+  switch (it->op) {
+    case PAT_ANY:  return 1;
+    case PAT_CHAR: return it->a == c;
+    default:       return inset(pat_sets(cp)[it->a], c);
+  }
+}
+
+
+static const char *pat_match (MatchState *ms, const Pattern *cp,
+                              const char *s, const PatItem *it);
+
+
+static const char *pat_max_expand (MatchState *ms, const Pattern *cp,
+                                   const char *s, const PatItem *it) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  while ((s+i)<ms->src_end && pat_single(cp, it, uchar(*(s+i))))
+    i++;
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    const char *res = pat_match(ms, cp, (s+i), it+1);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *pat_min_expand (MatchState *ms, const Pattern *cp,
+                                   const char *s, const PatItem *it) {
+  for (;;) {
+    const char *res = pat_match(ms, cp, s, it+1);
+    if (res != NULL)
+      return res;
+    else if (s<ms->src_end && pat_single(cp, it, uchar(*s)))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *pat_start_capture (MatchState *ms, const Pattern *cp,
+                                      const char *s, const PatItem *it,
+                                      int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=pat_match(ms, cp, s, it)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *pat_end_capture (MatchState *ms, const Pattern *cp,
+                                    const char *s, const PatItem *it) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = pat_match(ms, cp, s, it)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+static const char *pat_match (MatchState *ms, const Pattern *cp,
+                              const char *s, const PatItem *it) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto's to optimize tail recursion */
+  switch (it->op) {
+    case PAT_END:  /* end of pattern */
+      break;
+    case PAT_EOS:
+      s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+      break;
+    case PAT_OPEN:
+      s = pat_start_capture(ms, cp, s, it + 1, CAP_UNFINISHED);
+      break;
+    case PAT_POSOPEN:
+      s = pat_start_capture(ms, cp, s, it + 1, CAP_POSITION);
+      break;
+    case PAT_CLOSE:
+      s = pat_end_capture(ms, cp, s, it + 1);
+      break;
+    case PAT_BALANCE: {
+      int cont = 1;
+      if (s >= ms->src_end || uchar(*s) != it->a) {
+        s = NULL;
+        break;
+      }
+      while (++s < ms->src_end) {
+        if (uchar(*s) == it->b) {
+          if (--cont == 0) break;
+        }
+        else if (uchar(*s) == it->a) cont++;
+      }
+      if (s < ms->src_end) {
+        s++; it++; goto init;  /* return pat_match(ms, cp, s + 1, it + 1); */
+      }
+      s = NULL;  /* string ends out of balance */
+      break;
+    }
+    case PAT_FRONTIER: {
+      const unsigned char *set = pat_sets(cp)[it->a];
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+      int current = (s < ms->src_end) ? uchar(*s) : '\0';
+      if (!inset(set, previous) && inset(set, current)) {
+        it++; goto init;  /* return pat_match(ms, cp, s, it + 1); */
+      }
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PAT_BACKREF:
+      s = match_capture(ms, s, it->a);
+      if (s != NULL) {
+        it++; goto init;  /* return pat_match(ms, cp, s, it + 1) */
+      }
+      break;
+    default: {  /* single char class plus optional suffix */
+      /* does not match at least once? */
+      if (s >= ms->src_end || !pat_single(cp, it, uchar(*s))) {
+        if (it->rep == '*' || it->rep == '?' || it->rep == '-') {
+          it++; goto init;  /* accept empty */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
+      }
+      else {  /* matched once */
+        switch (it->rep) {  /* handle optional suffix */
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = pat_match(ms, cp, s + 1, it + 1)) != NULL)
+              s = res;
+            else {
+              it++; goto init;  /* else return pat_match(ms, cp, s, it + 1); */
+            }
+            break;
+          }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = pat_max_expand(ms, cp, s, it);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = pat_min_expand(ms, cp, s, it);
+            break;
+          default:  /* no suffix */
+            s++; it++; goto init;  /* return pat_match(ms, cp, s + 1, it + 1); */
+        }
+      }
+      break;
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/* Return the first position at or after s where a match could start */
+static const char *pat_next (const Pattern *cp, const char *s,
+                             const char *e) {
+  if (cp->prefixlen == 0)
+    return s;
+  return lmemfind(s, e-s, pat_prefix(cp), cp->prefixlen);
+}
+
+
+static void pat_prepstate (MatchState *ms, lua_State *L,
+                           const char *s, size_t ls) {
+  ms->L = L;
+  ms->matchdepth = MAXCCALLS;
+  ms->src_init = s;
+  ms->src_end = s + ls;
+  ms->p_end = NULL;  /* not used by compiled patterns */
+}
+
+
+static int str_compile (lua_State *L) {
+  size_t lp;
+  const char *p = luaL_checklstring(L, 1, &lp);
+  Pattern hdr, *cp;
+  PatItem *it;
+  size_t i;
+  pat_decode(L, p, lp, &hdr, NULL, NULL);
+  cp = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                                     (hdr.nitems+1)*sizeof(PatItem) +
+                                     hdr.nsets*32 + hdr.prefixlen);
+  *cp = hdr;
+  it = pat_items(cp);
+  pat_decode(L, p, lp, cp, it, pat_sets(cp));
+  for (i = 0; i < cp->prefixlen; i++)
+    pat_prefix(cp)[i] = it[i].a;
+  luaL_getmetatable(L, PATTERN_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+static int pat_find_aux (lua_State *L, int find) {
+  const Pattern *cp = (const Pattern *)luaL_checkudata(L, 1, PATTERN_MT);
+  size_t ls;
+  const char *s = luaL_checklstring(L, 2, &ls);
+  lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
+  MatchState ms;
+  const char *s1;
+  if (init < 1) init = 1;
+  else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
+    lua_pushnil(L);  /* cannot find anything */
+    return 1;
+  }
+  s1 = s + init - 1;
+  pat_prepstate(&ms, L, s, ls);
+  do {
+    const char *res;
+    if (!cp->anchor && (s1 = pat_next(cp, s1, ms.src_end)) == NULL)
+      break;
+    reprepstate(&ms);
+    if ((res=pat_match(&ms, cp, s1, pat_items(cp))) != NULL) {
+      if (find) {
+        lua_pushinteger(L, (s1 - s) + 1);  /* start */
+        lua_pushinteger(L, res - s);   /* end */
+        return push_captures(&ms, NULL, 0) + 2;
+      }
+      else
+        return push_captures(&ms, s1, res);
+    }
+  } while (s1++ < ms.src_end && !cp->anchor);
+  lua_pushnil(L);  /* not found */
+  return 1;
+}
+
+
+static int pat_find (lua_State *L) {
+  return pat_find_aux(L, 1);
+}
+
+
+static int pat_matchf (lua_State *L) {
+  return pat_find_aux(L, 0);
+}
+
+
+/* state for compiled pattern 'gmatch' */
+typedef struct PGMatchState {
+  const char *src;  /* current position */
+  const Pattern *cp;  /* pattern */
+  const char *lastmatch;  /* end of last match */
+  MatchState ms;  /* match state */
+} PGMatchState;
+
+
+static int pat_gmatch_aux (lua_State *L) {
+  PGMatchState *gm = (PGMatchState *)lua_touserdata(L, lua_upvalueindex(3));
+  const char *src;
+  gm->ms.L = L;
+  for (src = gm->src;
+       src <= gm->ms.src_end &&
+       (src = pat_next(gm->cp, src, gm->ms.src_end)) != NULL;
+       src++) {
+    const char *e;
+    if (gm->cp->anchor && src > gm->ms.src_init)
+      break;  /* an anchored pattern can only match at the start */
+    reprepstate(&gm->ms);
+    if ((e = pat_match(&gm->ms, gm->cp, src, pat_items(gm->cp))) != NULL &&
+        e != gm->lastmatch) {
+      gm->src = gm->lastmatch = e;
+      return push_captures(&gm->ms, src, e);
+    }
+  }
+  gm->src = gm->ms.src_end + 1;  /* no more matches */
+  return 0;  /* not found */
+}
+
+
+static int pat_gmatch (lua_State *L) {
+  const Pattern *cp = (const Pattern *)luaL_checkudata(L, 1, PATTERN_MT);
+  size_t ls;
+  const char *s = luaL_checklstring(L, 2, &ls);
+  PGMatchState *gm;
+  lua_settop(L, 2);  /* keep them on closure to avoid being collected */
+  gm = (PGMatchState *)lua_newuserdata(L, sizeof(PGMatchState));
+  pat_prepstate(&gm->ms, L, s, ls);
+  gm->src = s; gm->cp = cp; gm->lastmatch = NULL;
+  lua_pushcclosure(L, pat_gmatch_aux, 3);
+  return 1;
+}
+
+
+static int pat_gsub (lua_State *L) {
+  const Pattern *cp = (const Pattern *)luaL_checkudata(L, 1, PATTERN_MT);
+  size_t srcl;
+  const char *src = luaL_checklstring(L, 2, &srcl);  /* subject */
+  const char *lastmatch = NULL;  /* end of last match */
+  int tr = lua_type(L, 3);  /* replacement type */
+  lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
+  lua_Integer n = 0;  /* replacement count */
+  MatchState ms;
+  luaL_Buffer b;
+  luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
+                   tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
+                      "string/function/table expected");
+  luaL_buffinit(L, &b);
+  pat_prepstate(&ms, L, src, srcl);
+  while (n < max_s) {
+    const char *e;
+    if (!cp->anchor) {  /* copy up to the next possible match */
+      const char *next = pat_next(cp, src, ms.src_end);
+      if (next == NULL) break;
+      luaL_addlstring(&b, src, next - src);
+      src = next;
+    }
+    reprepstate(&ms);  /* (re)prepare state for new match */
+    if ((e = pat_match(&ms, cp, src, pat_items(cp))) != NULL &&
+        e != lastmatch) {  /* match? */
+      n++;
+      add_value(&ms, &b, src, e, tr);  /* add replacement to buffer */
+      src = lastmatch = e;
+    }
+    else if (src < ms.src_end)  /* otherwise, skip one character */
+      luaL_addchar(&b, *src++);
+    else break;  /* end of subject */
+    if (cp->anchor) break;
+  }
+  luaL_addlstring(&b, src, ms.src_end-src);
+  luaL_pushresult(&b);
+  lua_pushinteger(L, n);  /* number of substitutions */
+  return 2;
+}
+
+
+LROT_BEGIN(pattern, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY( __index, pattern )
+  LROT_FUNCENTRY( find, pat_find )
+  LROT_FUNCENTRY( gmatch, pat_gmatch )
+  LROT_FUNCENTRY( gsub, pat_gsub )
+  LROT_FUNCENTRY( match, pat_matchf )
+LROT_END(pattern, NULL, LROT_MASK_INDEX)
+
+/* }====================================================== */
+
+
 
 /*
 ** {======================================================
@@ -1559,6 +2037,7 @@ LROT_BEGIN(strlib, NULL, LROT_MASK_INDEX)
   LROT_FUNCENTRY( __mod, str_format2 )
   LROT_FUNCENTRY( byte, str_byte )
   LROT_FUNCENTRY( char, str_char )
+  LROT_FUNCENTRY( compile, str_compile )
   LROT_FUNCENTRY( dump, str_dump )
   LROT_FUNCENTRY( find, str_find )
   LROT_FUNCENTRY( format, str_format )
@@ -1585,6 +2064,8 @@ LUAMOD_API int luaopen_string (lua_State *L) {
   lua_pushrotable(L, LROT_TABLEREF(strlib));
   lua_setmetatable(L, -2);  /* set table as metatable for strings */
   lua_pop(L, 1);  /* pop dummy string */
+  luaL_rometatable(L, PATTERN_MT, LROT_TABLEREF(pattern));
+  lua_pop(L, 1);  /* pop pattern metatable */
   return 0;
 }
 
@@ -219,7 +219,9 @@ static int pmain (lua_State *L) {
   STARTUP_COUNT;
 
   lua_gc(L, LUA_GCSTOP, 0);                  /* stop GC during initialization */
+  STARTUP_BEGIN("luaL_openlibs");
   luaL_openlibs(L);        /* Nodemcu open will throw to signal an LFS reload */
+  STARTUP_END("luaL_openlibs");
 #ifdef LUA_VERSION_51
   lua_setegcmode( L, EGC_ALWAYS, 4096 );
 #else
@@ -242,7 +244,7 @@ static int pmain (lua_State *L) {
   * then attempting the open will trigger a file system format.
   */
   platform_rcr_read(PLATFORM_RCR_INITSTR, (void**) &init);
-  STARTUP_COUNT;
+  STARTUP_BEGIN("init_load");
   if (init[0] == '!') { /* !module is a compile-free way of executing LFS module */
     luaL_pushlfsmodule(L);
     lua_pushstring(L, init+1);
@@ -257,12 +259,13 @@ static int pmain (lua_State *L) {
              luaL_loadfile(L, init+1) :
              luaL_loadbuffer(L, init, strlen(init), "=INIT");
   }
-  STARTUP_COUNT;
+  STARTUP_END("init_load");
+  STARTUP_BEGIN("init_run");
   if (status == LUA_OK)
     status = docall(L, 0);
   if (status != LUA_OK)
     l_print (L, 1);
-  STARTUP_COUNT;
+  STARTUP_END("init_run");
   return 0;
 }
 
@@ -275,7 +278,9 @@ static int pmain (lua_State *L) {
 ** through the LUA_INIT_STRING hook.
 */
 int lua_main (void) {
+  STARTUP_BEGIN("luaL_newstate");
   lua_State *L = luaL_newstate();
+  STARTUP_END("luaL_newstate");
   if (L == NULL) {
     lua_writestringerror( "cannot create state: %s", "not enough memory");
     return 0;
@@ -490,6 +490,30 @@ dns_lookup(const char *name)
   return IPADDR_NONE;
 }
 
+/**
+ * Look up a hostname in the array of completed entries and return its time to
+ * live. Called from a found callback, this is the TTL of the answer just
+ * received.
+ *
+ * @param name the hostname to look up
+ * @return the remaining time to live in seconds, or 0 if the hostname is not
+ *         in the dns_table or must not be cached
+ */
+u32_t ICACHE_FLASH_ATTR
+dns_getttl(const char *name)
+{
+  u8_t i;
+
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    if ((dns_table[i].state == DNS_STATE_DONE) &&
+        (strcmp(name, dns_table[i].name) == 0)) {
+      return dns_table[i].ttl;
+    }
+  }
+
+  return 0;
+}
+
 #if DNS_DOES_NAME_CHECK
 /**
  * Compare the "dotted" name "query" with the encoded name "response"
@@ -260,7 +260,7 @@ void
 lwip_init(void)
 {
   MEMP_NUM_TCP_PCB = 5;
-  TCP_WND = (4 * TCP_MSS);
+  TCP_WND = TCP_WND_DEFAULT;
   TCP_MAXRTX = 12;
   TCP_SYNMAXRTX = 6;
 
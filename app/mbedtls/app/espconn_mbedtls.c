@@ -614,7 +614,7 @@ mbedtls_dbg(void *p, int level, const char *file, int line, const char *str)
 	os_printf("TLS<%d> (heap=%d): %s:%d %s", level, system_get_free_heap_size(), file, line, str);
 }
 
-static bool mbedtls_msg_config(mbedtls_msg *msg)
+static bool mbedtls_msg_config(mbedtls_msg *msg, struct espconn *pespconn)
 {
 	bool load_flag = false;
 	int ret = ESPCONN_OK;
@@ -688,6 +688,9 @@ static bool mbedtls_msg_config(mbedtls_msg *msg)
 	mbedtls_ssl_conf_rng(&msg->conf, mbedtls_ctr_drbg_random, &msg->ctr_drbg);
 	mbedtls_ssl_conf_dbg(&msg->conf, mbedtls_dbg, NULL);
 
+	/*Offer the server's last session, to skip the key exchange*/
+	espconn_ssl_session_offer(pespconn, &msg->ssl);
+
 	mbedtls_ssl_set_bio(&msg->ssl, &msg->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
 
 exit:
@@ -738,7 +741,7 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 		} else {
 			if (TLSmsg->ssl.state == MBEDTLS_SSL_HELLO_REQUEST) {
 				os_printf("client handshake start.\n");
-				config_flag = mbedtls_msg_config(TLSmsg);
+				config_flag = mbedtls_msg_config(TLSmsg, Threadmsg->pespconn);
 				if (config_flag) {
 //					mbedtls_keep_alive(TLSmsg->fd.fd, 1, SSL_KEEP_IDLE, SSL_KEEP_INTVL, SSL_KEEP_CNT);
 					system_overclock();
@@ -769,6 +772,7 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 			if (TLSmsg->quiet) {
 				os_printf("client handshake ok!\n");
 //				mbedtls_keep_alive(TLSmsg->fd.fd, 0, SSL_KEEP_IDLE, SSL_KEEP_INTVL, SSL_KEEP_CNT);
+				espconn_ssl_session_store(Threadmsg->pespconn, &TLSmsg->ssl);
 				mbedtls_session_free(&TLSmsg->psession);
 				mbedtls_handshake_succ(&TLSmsg->ssl);
 				system_restoreclock();
@@ -791,6 +795,9 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 
 exit:
 	if (ret != ESPCONN_OK) {
+		/*Offer no session to the server after a failed handshake*/
+		if (TLSmsg != NULL && !TLSmsg->quiet)
+			espconn_ssl_session_drop(Threadmsg->pespconn);
 		mbedtls_fail_info(Threadmsg, ret);
 		if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
 			Threadmsg->hs_status = ESPCONN_OK;
@@ -0,0 +1,345 @@
+/*
+ * Client TLS session cache.
+ *
+ * A full handshake costs a (EC)DHE key exchange and the verification of the
+ * server's certificate chain, seconds of CPU time at 80MHz.  After each
+ * handshake the session ID, master secret and any RFC 5077 ticket are kept
+ * here by the server's address and port, and the next connection to that
+ * server offers them.  If the server still knows the session, it skips
+ * straight to its Finished message.
+ *
+ * Only what resumption needs is kept, not the server's certificate, so a
+ * session resumed from here has no peer_cert.  That is how a resumed
+ * handshake is told from a full one, which always receives the certificate.
+ *
+ * The cache can be saved to a buffer and restored from one, to keep it in
+ * RTC memory or a file over deep sleep.  mbedTLS is built without time, so
+ * ticket lifetimes are not checked here: the server refuses a stale ticket,
+ * and a full handshake follows.
+ */
+
+#if !defined(ESPCONN_MBEDTLS)
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#include "mbedtls/platform_util.h"
+
+#include "mem.h"
+
+#include "sys/espconn_mbedtls.h"
+#include "metrics.h"
+
+#ifndef SSL_SESSION_CACHE_SIZE
+#define SSL_SESSION_CACHE_SIZE 0
+#endif
+#ifndef SSL_SESSION_TICKET_MAX
+#define SSL_SESSION_TICKET_MAX 512
+#endif
+
+#define SSL_SESSION_MAGIC	0x01534c54	/* "TLS" and the format version */
+#define SSL_SESSION_PAD(n)	(((n) + 3) & ~3)
+
+/* A session as saved, followed by its ticket padded to a word */
+typedef struct {
+	uint32 ip;
+	uint32 verify_result;
+	uint32 ticket_lifetime;
+	uint16 port;
+	uint16 ciphersuite;
+	uint16 ticket_len;
+	uint8 compression;
+	uint8 id_len;
+	uint8 mfl_code;
+	uint8 trunc_hmac;
+	uint8 encrypt_then_mac;
+	uint8 verified;			/* made with VERIFY_REQUIRED */
+	unsigned char id[32];
+	unsigned char master[48];
+} ssl_session_rec;
+
+typedef struct {
+	ssl_session_rec rec;
+	uint32 used;			/* cache_clock when last stored or offered */
+	unsigned char *ticket;
+} ssl_session_entry;
+
+espconn_ssl_session_stats_t espconn_ssl_session_stats;
+
+static ssl_session_entry *cache[SSL_SESSION_CACHE_SIZE > 0 ? SSL_SESSION_CACHE_SIZE : 1];
+static uint32 cache_clock;
+
+static uint32 session_ip(const struct espconn *pespconn)
+{
+	uint32 ip;
+	os_memcpy(&ip, pespconn->proto.tcp->remote_ip, sizeof(ip));
+	return ip;
+}
+
+/* Returns the server's entry, or else a free one or the least recently used */
+static ssl_session_entry **session_slot(uint32 ip, uint16 port)
+{
+	ssl_session_entry **slot = NULL;
+	int i;
+
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++) {
+		ssl_session_entry *e = cache[i];
+		if (e != NULL && e->rec.ip == ip && e->rec.port == port)
+			return &cache[i];
+		if (slot == NULL || (*slot != NULL && (e == NULL || e->used < (*slot)->used)))
+			slot = &cache[i];
+	}
+	return slot;
+}
+
+static ssl_session_entry **session_find(const struct espconn *pespconn)
+{
+	uint32 ip = session_ip(pespconn);
+	int i;
+
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++) {
+		if (cache[i] != NULL && cache[i]->rec.ip == ip &&
+		    cache[i]->rec.port == pespconn->proto.tcp->remote_port)
+			return &cache[i];
+	}
+	return NULL;
+}
+
+static void session_free(ssl_session_entry **pe)
+{
+	if (*pe == NULL)
+		return;
+	if ((*pe)->ticket != NULL)
+		os_free((*pe)->ticket);
+	mbedtls_platform_zeroize(*pe, sizeof(ssl_session_entry));
+	os_free(*pe);
+	*pe = NULL;
+}
+
+/* Keeps the session, with a copy of its ticket */
+static bool session_put(const ssl_session_rec *rec, const unsigned char *ticket, uint32 used)
+{
+	ssl_session_entry **slot = session_slot(rec->ip, rec->port);
+	unsigned char *copy = NULL;
+
+	if (slot == NULL)
+		return false;
+	if (rec->ticket_len != 0) {
+		copy = (unsigned char *)os_malloc(rec->ticket_len);
+		if (copy == NULL)
+			return false;
+		os_memcpy(copy, ticket, rec->ticket_len);
+	}
+	if (*slot == NULL)
+		*slot = (ssl_session_entry *)os_zalloc(sizeof(ssl_session_entry));
+	if (*slot == NULL) {
+		if (copy != NULL)
+			os_free(copy);
+		return false;
+	}
+	if ((*slot)->ticket != NULL)
+		os_free((*slot)->ticket);
+	(*slot)->rec = *rec;
+	(*slot)->ticket = copy;
+	(*slot)->used = used;
+	return true;
+}
+
+/* Offers the server's session, if there is one, for the coming handshake */
+void espconn_ssl_session_offer(const struct espconn *pespconn, mbedtls_ssl_context *ssl)
+{
+	ssl_session_entry **slot = session_find(pespconn);
+	ssl_session_entry *e;
+	mbedtls_ssl_session session;
+
+	if (slot == NULL)
+		return;
+	e = *slot;
+	/* One made without verification isn't resumed once it is required */
+	if (!e->rec.verified && ssl->conf->authmode == MBEDTLS_SSL_VERIFY_REQUIRED)
+		return;
+
+	mbedtls_ssl_session_init(&session);
+	session.ciphersuite = e->rec.ciphersuite;
+	session.compression = e->rec.compression;
+	session.id_len = e->rec.id_len;
+	os_memcpy(session.id, e->rec.id, sizeof(session.id));
+	os_memcpy(session.master, e->rec.master, sizeof(session.master));
+	session.verify_result = e->rec.verify_result;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	session.ticket = e->ticket;
+	session.ticket_len = e->rec.ticket_len;
+	session.ticket_lifetime = e->rec.ticket_lifetime;
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+	session.mfl_code = e->rec.mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+	session.trunc_hmac = e->rec.trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+	session.encrypt_then_mac = e->rec.encrypt_then_mac;
+#endif
+	/* The session is copied, its ticket too */
+	if (mbedtls_ssl_set_session(ssl, &session) == 0)
+		e->used = ++cache_clock;
+	mbedtls_platform_zeroize(&session, sizeof(session));
+}
+
+/* Counts the handshake just completed, and keeps its session */
+void espconn_ssl_session_store(const struct espconn *pespconn, const mbedtls_ssl_context *ssl)
+{
+	const mbedtls_ssl_session *s = ssl->session;
+	ssl_session_entry **slot = session_find(pespconn);
+	const unsigned char *ticket = NULL;
+	ssl_session_rec rec;
+
+	if (s == NULL)
+		return;
+	os_memset(&rec, 0, sizeof(rec));
+	/* Verification is skipped, not failed, without VERIFY_REQUIRED */
+	rec.verified = ssl->conf->authmode == MBEDTLS_SSL_VERIFY_REQUIRED;
+	if (s->peer_cert == NULL) {
+		if (slot != NULL)
+			rec.verified |= (*slot)->rec.verified;
+		espconn_ssl_session_stats.resumed++;
+		METRIC_INC(METRIC_TLS_RESUMED_HANDSHAKES, 1);
+	} else {
+		espconn_ssl_session_stats.full++;
+		METRIC_INC(METRIC_TLS_FULL_HANDSHAKES, 1);
+	}
+
+	rec.ip = session_ip(pespconn);
+	rec.port = pespconn->proto.tcp->remote_port;
+	rec.verify_result = s->verify_result;
+	rec.ciphersuite = s->ciphersuite;
+	rec.compression = s->compression;
+	rec.id_len = s->id_len;
+	os_memcpy(rec.id, s->id, sizeof(rec.id));
+	os_memcpy(rec.master, s->master, sizeof(rec.master));
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	if (s->ticket != NULL && s->ticket_len <= SSL_SESSION_TICKET_MAX) {
+		ticket = s->ticket;
+		rec.ticket_len = s->ticket_len;
+		rec.ticket_lifetime = s->ticket_lifetime;
+	}
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+	rec.mfl_code = s->mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+	rec.trunc_hmac = s->trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+	rec.encrypt_then_mac = s->encrypt_then_mac;
+#endif
+
+	/* A server which offers neither IDs nor tickets can't resume */
+	if (rec.id_len == 0 && rec.ticket_len == 0)
+		espconn_ssl_session_drop(pespconn);
+	else
+		session_put(&rec, ticket, ++cache_clock);
+	mbedtls_platform_zeroize(&rec, sizeof(rec));
+}
+
+/* Forgets the server's session, after a failed handshake */
+void espconn_ssl_session_drop(const struct espconn *pespconn)
+{
+	ssl_session_entry **slot = session_find(pespconn);
+	if (slot != NULL)
+		session_free(slot);
+}
+
+void espconn_ssl_session_flush(void)
+{
+	int i;
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+		session_free(&cache[i]);
+}
+
+uint32 espconn_ssl_session_count(void)
+{
+	uint32 n = 0;
+	int i;
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+		n += cache[i] != NULL;
+	return n;
+}
+
+/*
+ * Writes the sessions to buf, the most recently used first and as many as
+ * fit in len bytes, and returns the bytes written.  With a NULL buf, returns
+ * the bytes needed for them all.
+ */
+uint32 espconn_ssl_session_save(uint8 *buf, uint32 len, uint32 *count)
+{
+	ssl_session_entry *order[SSL_SESSION_CACHE_SIZE > 0 ? SSL_SESSION_CACHE_SIZE : 1];
+	uint32 header[2] = { SSL_SESSION_MAGIC, 0 };
+	uint32 n = sizeof(header);
+	int i, j, k = 0;
+
+	if (buf != NULL && len < n)
+		return 0;
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++) {
+		if (cache[i] == NULL)
+			continue;
+		for (j = k++; j > 0 && order[j - 1]->used < cache[i]->used; j--)
+			order[j] = order[j - 1];
+		order[j] = cache[i];
+	}
+
+	for (i = 0; i < k; i++) {
+		uint32 size = sizeof(ssl_session_rec) + SSL_SESSION_PAD(order[i]->rec.ticket_len);
+		if (buf != NULL) {
+			if (len - n < size)
+				break;
+			os_memset(buf + n, 0, size);
+			os_memcpy(buf + n, &order[i]->rec, sizeof(ssl_session_rec));
+			if (order[i]->rec.ticket_len != 0)
+				os_memcpy(buf + n + sizeof(ssl_session_rec), order[i]->ticket, order[i]->rec.ticket_len);
+		}
+		n += size;
+		header[1]++;
+	}
+	if (buf != NULL)
+		os_memcpy(buf, header, sizeof(header));
+	if (count != NULL)
+		*count = header[1];
+	return n;
+}
+
+/* Adds the sessions written by espconn_ssl_session_save(), returning how many */
+uint32 espconn_ssl_session_restore(const uint8 *buf, uint32 len)
+{
+	uint32 header[2];
+	uint32 n = sizeof(header), restored = 0, i;
+	ssl_session_rec rec;
+
+	if (len < n)
+		return 0;
+	os_memcpy(header, buf, sizeof(header));
+	if (header[0] != SSL_SESSION_MAGIC)
+		return 0;
+
+	/* Most recently used first */
+	cache_clock += SSL_SESSION_CACHE_SIZE;
+	for (i = 0; i < header[1] && restored < SSL_SESSION_CACHE_SIZE; i++) {
+		if (len - n < sizeof(rec))
+			break;
+		os_memcpy(&rec, buf + n, sizeof(rec));
+		n += sizeof(rec);
+		if (rec.id_len > sizeof(rec.id) || rec.ticket_len > SSL_SESSION_TICKET_MAX ||
+		    len - n < SSL_SESSION_PAD(rec.ticket_len))
+			break;
+		if (session_put(&rec, buf + n, cache_clock - i))
+			restored++;
+		n += SSL_SESSION_PAD(rec.ticket_len);
+	}
+	mbedtls_platform_zeroize(&rec, sizeof(rec));
+	return restored;
+}
+
+#endif
@@ -270,6 +270,149 @@ static unsigned int ssl_mfl_code_to_length( int mfl )
 }
 #endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+/*
+ * Record buffers sized to the records in use.
+ *
+ * During a handshake in_buf and out_buf are MBEDTLS_SSL_IN_BUFFER_LEN and
+ * MBEDTLS_SSL_OUT_BUFFER_LEN long, as without this option.  Once it is over
+ * each is freed when no record is in it, and allocated again at the size of
+ * the next record read or written.  With TLS, in_hdr and out_hdr are always
+ * 8 bytes into their buffers, and the 8 bytes before in_hdr hold the
+ * incoming message counter, which is kept in in_ctr_idle meanwhile.
+ */
+#define SSL_BUF_HDR_OFFSET  8
+
+static int ssl_buf_resize( const mbedtls_ssl_context *ssl,
+                           unsigned char **buf, size_t *buf_len,
+                           size_t new_len, size_t keep )
+{
+    unsigned char *resized = NULL;
+
+    if( new_len != 0 )
+    {
+        resized = mbedtls_calloc( 1, new_len );
+        if( resized == NULL )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", new_len ) );
+            return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+        }
+    }
+
+    if( *buf != NULL )
+    {
+        if( keep != 0 )
+            memcpy( resized, *buf, keep );
+        mbedtls_platform_zeroize( *buf, *buf_len );
+        mbedtls_free( *buf );
+    }
+
+    *buf = resized;
+    *buf_len = new_len;
+
+    return( 0 );
+}
+
+/* The most in_buf can need to hold */
+static size_t ssl_in_buf_max( const mbedtls_ssl_context *ssl )
+{
+    if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
+        return( MBEDTLS_SSL_IN_BUFFER_LEN );
+
+    return( MBEDTLS_SSL_IN_BUFFER_LEN - MBEDTLS_SSL_IN_CONTENT_LEN +
+            ssl->in_content_max );
+}
+
+/* Make in_buf hold len bytes from in_hdr, keeping what was read so far */
+static int ssl_in_buf_fit( mbedtls_ssl_context *ssl, size_t len )
+{
+    int ret;
+    size_t need = SSL_BUF_HDR_OFFSET + len;
+    size_t keep = 0;
+
+    if( ssl->in_buf != NULL && need <= ssl->in_buf_len )
+        return( 0 );
+
+    if( need > ssl_in_buf_max( ssl ) )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "requesting more data than fits" ) );
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    if( ssl->in_buf != NULL )
+        keep = SSL_BUF_HDR_OFFSET + ssl->in_left;
+
+    if( ( ret = ssl_buf_resize( ssl, &ssl->in_buf, &ssl->in_buf_len,
+                                need, keep ) ) != 0 )
+        return( ret );
+
+    if( keep == 0 )
+        memcpy( ssl->in_buf, ssl->in_ctr_idle, 8 );
+
+    ssl->in_hdr = ssl->in_buf + SSL_BUF_HDR_OFFSET;
+    ssl_update_in_pointers( ssl, ssl->transform_in );
+
+    return( 0 );
+}
+
+/* Make out_buf hold a record of len bytes of content */
+static int ssl_out_buf_fit( mbedtls_ssl_context *ssl, size_t len )
+{
+    int ret;
+    size_t need = MBEDTLS_SSL_OUT_BUFFER_LEN - MBEDTLS_SSL_OUT_CONTENT_LEN + len;
+
+    if( ssl->out_buf != NULL && need <= ssl->out_buf_len )
+        return( 0 );
+
+    if( ssl->out_left != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
+        return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+    }
+
+    if( ( ret = ssl_buf_resize( ssl, &ssl->out_buf, &ssl->out_buf_len,
+                                need, 0 ) ) != 0 )
+        return( ret );
+
+    ssl->out_hdr = ssl->out_buf + SSL_BUF_HDR_OFFSET;
+    ssl_update_out_pointers( ssl, ssl->transform_out );
+
+    return( 0 );
+}
+
+/* Free the buffers which hold nothing still to be read or sent */
+static void ssl_buf_release_idle( mbedtls_ssl_context *ssl )
+{
+    if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
+        return;
+
+    /* A handshake message still to be consumed needs no buffer unless
+     * another follows it in the record */
+    if( ssl->in_buf != NULL && ssl->in_left == 0 && ssl->in_offt == NULL &&
+        ssl->keep_current_message == 0 &&
+        ( ssl->in_hslen == 0 || ssl->in_hslen >= ssl->in_msglen ) )
+    {
+        memcpy( ssl->in_ctr_idle, ssl->in_buf, 8 );
+        ssl_buf_resize( ssl, &ssl->in_buf, &ssl->in_buf_len, 0, 0 );
+        ssl->in_hdr = NULL;
+        ssl->in_ctr = NULL;
+        ssl->in_len = NULL;
+        ssl->in_iv = NULL;
+        ssl->in_msg = NULL;
+    }
+
+    if( ssl->out_buf != NULL && ssl->out_left == 0 )
+    {
+        ssl_buf_resize( ssl, &ssl->out_buf, &ssl->out_buf_len, 0, 0 );
+        ssl->out_hdr = NULL;
+        ssl->out_ctr = NULL;
+        ssl->out_len = NULL;
+        ssl->out_iv = NULL;
+        ssl->out_msg = NULL;
+    }
+}
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
 #if defined(MBEDTLS_SSL_CLI_C)
 static int ssl_session_copy( mbedtls_ssl_session *dst, const mbedtls_ssl_session *src )
 {
@@ -2542,11 +2685,16 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    if( ( ret = ssl_in_buf_fit( ssl, nb_want ) ) != 0 )
+        return( ret );
+#else
     if( nb_want > MBEDTLS_SSL_IN_BUFFER_LEN - (size_t)( ssl->in_hdr - ssl->in_buf ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "requesting more data than fits" ) );
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
+#endif
 
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
@@ -4088,8 +4236,13 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
     }
 
     /* Check length against the size of our buffer */
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    if( ssl->in_msglen > ssl_in_buf_max( ssl )
+                         - (size_t)( ssl->in_msg - ssl->in_buf ) )
+#else
     if( ssl->in_msglen > MBEDTLS_SSL_IN_BUFFER_LEN
                          - (size_t)( ssl->in_msg - ssl->in_buf ) )
+#endif
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
         return( MBEDTLS_ERR_SSL_INVALID_RECORD );
@@ -5250,6 +5403,11 @@ int mbedtls_ssl_send_alert_message( mbedtls_ssl_context *ssl,
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> send alert message" ) );
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "send alert level=%u message=%u", level, message ));
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    if( ( ret = ssl_out_buf_fit( ssl, 2 ) ) != 0 )
+        return( ret );
+#endif
+
     ssl->out_msgtype = MBEDTLS_SSL_MSG_ALERT;
     ssl->out_msglen = 2;
     ssl->out_msg[0] = level;
@@ -5260,6 +5418,9 @@ int mbedtls_ssl_send_alert_message( mbedtls_ssl_context *ssl,
         MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_write_record", ret );
         return( ret );
     }
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl_buf_release_idle( ssl );
+#endif
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= send alert message" ) );
 
     return( 0 );
@@ -6388,6 +6549,19 @@ void mbedtls_ssl_handshake_wrapup( mbedtls_ssl_context *ssl )
 
     ssl->state++;
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    /* From now on records are no larger than the peers agreed */
+    ssl->in_content_max = MBEDTLS_SSL_IN_CONTENT_LEN;
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    if( ssl->session->mfl_code != MBEDTLS_SSL_MAX_FRAG_LEN_NONE &&
+        ssl_mfl_code_to_length( ssl->session->mfl_code ) < ssl->in_content_max )
+    {
+        ssl->in_content_max = ssl_mfl_code_to_length( ssl->session->mfl_code );
+    }
+#endif
+    ssl_buf_release_idle( ssl );
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "<= handshake wrapup" ) );
 }
 
@@ -6895,6 +7069,11 @@ int mbedtls_ssl_setup( mbedtls_ssl_context *ssl,
         goto error;
     }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl->in_buf_len = MBEDTLS_SSL_IN_BUFFER_LEN;
+    ssl->out_buf_len = MBEDTLS_SSL_OUT_BUFFER_LEN;
+#endif
+
     ssl_reset_in_out_pointers( ssl );
 
     if( ( ret = ssl_handshake_init( ssl ) ) != 0 )
@@ -6957,6 +7136,18 @@ static int ssl_session_reset_int( mbedtls_ssl_context *ssl, int partial )
 #endif
     ssl->secure_renegotiation = MBEDTLS_SSL_LEGACY_RENEGOTIATION;
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    /* The next handshake needs the buffers at their full size */
+    if( ssl->in_buf_len != MBEDTLS_SSL_IN_BUFFER_LEN &&
+        ( ret = ssl_buf_resize( ssl, &ssl->in_buf, &ssl->in_buf_len,
+                                MBEDTLS_SSL_IN_BUFFER_LEN, 0 ) ) != 0 )
+        return( ret );
+    if( ssl->out_buf_len != MBEDTLS_SSL_OUT_BUFFER_LEN &&
+        ( ret = ssl_buf_resize( ssl, &ssl->out_buf, &ssl->out_buf_len,
+                                MBEDTLS_SSL_OUT_BUFFER_LEN, 0 ) ) != 0 )
+        return( ret );
+#endif
+
     ssl->in_offt = NULL;
     ssl_reset_in_out_pointers( ssl );
 
@@ -8259,7 +8450,7 @@ static int ssl_check_ctr_renegotiate( mbedtls_ssl_context *ssl )
 /*
  * Receive application data decrypted from the SSL layer
  */
-int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
+static int ssl_read_real( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
 {
     int ret;
     size_t n;
@@ -8560,6 +8751,18 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
     return( (int) n );
 }
 
+int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
+{
+    int ret = ssl_read_real( ssl, buf, len );
+
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    if( ssl != NULL && ssl->conf != NULL )
+        ssl_buf_release_idle( ssl );
+#endif
+
+    return( ret );
+}
+
 /*
  * Send application data to be encrypted by the SSL layer, taking care of max
  * fragment length and buffer size.
@@ -8620,6 +8823,10 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
          * copy the data into the internal buffers and setup the data structure
          * to keep track of partial writes
          */
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+        if( ( ret = ssl_out_buf_fit( ssl, len ) ) != 0 )
+            return( ret );
+#endif
         ssl->out_msglen  = len;
         ssl->out_msgtype = MBEDTLS_SSL_MSG_APPLICATION_DATA;
         memcpy( ssl->out_msg, buf, len );
@@ -8707,6 +8914,10 @@ int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_
     ret = ssl_write_real( ssl, buf, len );
 #endif
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl_buf_release_idle( ssl );
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write" ) );
 
     return( ret );
@@ -8933,6 +9144,10 @@ void mbedtls_ssl_free( mbedtls_ssl_context *ssl )
 
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> free" ) );
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl_buf_resize( ssl, &ssl->out_buf, &ssl->out_buf_len, 0, 0 );
+    ssl_buf_resize( ssl, &ssl->in_buf, &ssl->in_buf_len, 0, 0 );
+#else
     if( ssl->out_buf != NULL )
     {
         mbedtls_platform_zeroize( ssl->out_buf, MBEDTLS_SSL_OUT_BUFFER_LEN );
@@ -8944,6 +9159,7 @@ void mbedtls_ssl_free( mbedtls_ssl_context *ssl )
         mbedtls_platform_zeroize( ssl->in_buf, MBEDTLS_SSL_IN_BUFFER_LEN );
         mbedtls_free( ssl->in_buf );
     }
+#endif
 
 #if defined(MBEDTLS_ZLIB_SUPPORT)
     if( ssl->compress_buf != NULL )
@@ -9,7 +9,7 @@
 #include "vfs.h"
 #include "../crypto/digests.h"
 #include "../crypto/mech.h"
-#include "lmem.h"
+#include "scratch.h"
 
 #include "user_interface.h"
 
@@ -284,7 +284,9 @@ static int crypto_encdec (lua_State *L, bool enc)
 
   size_t outlen = ((dlen + bs -1) / bs) * bs;
 
-  char *buf = luaM_newvector(L, outlen, char);
+  char *buf = scratch_alloc (outlen);
+  if (!buf)
+    return luaL_error (L, "out of memory");
 
   crypto_op_t op = {
     key, klen,
@@ -297,7 +299,7 @@ static int crypto_encdec (lua_State *L, bool enc)
   int status = mech->run (&op);
 
   lua_pushlstring (L, buf, outlen);  /* discarded on error but what the hell */
-  luaN_freearray(L, buf, outlen);
+  scratch_free (buf);
 
   return status ? 1 : luaL_error (L, "crypto op failed");
 
@@ -2,7 +2,7 @@
 
 #include "module.h"
 #include "lauxlib.h"
-#include "lmem.h"
+#include "scratch.h"
 #include <string.h>
 #define BASE64_INVALID '\xff'
 #define BASE64_PADDING '='
@@ -10,6 +10,18 @@
 
 static const uint8 b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+// The output is built in a scratch buffer, copied into a Lua string and freed
+static uint8 *encoder_alloc (lua_State *L, size_t n) {
+  uint8 *p = (uint8 *) scratch_alloc(n);
+  if (!p) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    p = (uint8 *) scratch_alloc(n);
+    if (!p)
+      luaL_error(L, "out of memory");
+  }
+  return p;
+}
+
 static uint8 *toBase64 ( lua_State* L, const uint8 *msg, size_t *len){
   size_t i, n = *len;
 
@@ -17,7 +29,7 @@ static uint8 *toBase64 ( lua_State* L, const uint8 *msg, size_t *len){
     return NULL;
 
   int buf_size = (n + 2) / 3 * 4; // estimated encoded size
-  uint8 * q, *out = (uint8 *)luaM_malloc(L, buf_size);
+  uint8 * q, *out = encoder_alloc(L, buf_size);
   uint8 bytes64[sizeof(b64)];
   memcpy(bytes64, b64, sizeof(b64));   //Avoid lots of flash unaligned fetches
 
@@ -31,7 +43,6 @@ static uint8 *toBase64 ( lua_State* L, const uint8 *msg, size_t *len){
     *q++ = (i + 2 < n) ? bytes64[(c & 63)] : BASE64_PADDING;
   }
   *len = q - out;
-  out = luaM_realloc_(L, out, buf_size, *len); //reallocate to actual encoded length
   return out;
 }
 
@@ -58,7 +69,7 @@ static uint8 *fromBase64 ( lua_State* L, const uint8 *enc_msg, size_t *len){
   unbytes64[BASE64_PADDING] = 0;
 
   int buf_size=1+ (3 * n / 4); // estimate decoded length
-  msg = q = (uint8 *) luaM_malloc(L, buf_size);
+  msg = q = encoder_alloc(L, buf_size);
   for (i = 0, p = enc_msg; i<blocks; i++)  {
     uint8 a = unbytes64[*p++];
     uint8 b = unbytes64[*p++];
@@ -76,7 +87,6 @@ static uint8 *fromBase64 ( lua_State* L, const uint8 *enc_msg, size_t *len){
     if (pad == 1) *q++ = (b << 4) | (unbytes64[*p] >> 2);
   }
   *len = q - msg;
-  msg = luaM_realloc_(L, msg, buf_size, *len); //reallocate to actual decoded length
   return msg;
 }
 
@@ -87,7 +97,7 @@ static inline uint8 to_hex_nibble(uint8 b) {
 static uint8 *toHex ( lua_State* L, const uint8 *msg, size_t *len){
   int i, n = *len;
   *len <<= 1;
-  uint8 *q, *out = (uint8 *)luaM_malloc(L, *len);
+  uint8 *q, *out = encoder_alloc(L, *len);
   for (i = 0, q = out; i < n; i++) {
     *q++ = to_hex_nibble(msg[i] >> 4);
     *q++ = to_hex_nibble(msg[i] & 0xf);
@@ -103,7 +113,7 @@ static uint8 *fromHex ( lua_State* L, const uint8 *msg, size_t *len){
     luaL_error (L, "Invalid hex string");
 
   *len >>= 1;
-  uint8 b, *q, *out = (uint8 *)luaM_malloc(L, *len);
+  uint8 b, *q, *out = encoder_alloc(L, *len);
   uint8 c = 0;
 
   for (i = 0, p = msg, q = out; i < n; i++) {
@@ -114,7 +124,7 @@ static uint8 *fromHex ( lua_State* L, const uint8 *msg, size_t *len){
      } else if (*p >= 'A' && *p <= 'F') {
        b = *p++ - ('A' - 10);
      } else {
-       luaN_freearray(L, out, *len);
+       scratch_free(out);
        luaL_error (L, "Invalid hex string");
      }
      if ((i&1) == 0) {
@@ -137,7 +147,7 @@ static int do_func (lua_State *L, uint8 * (*conv_func)(lua_State *, const uint8
 
   if (output) {
     lua_pushlstring(L, output, len);
-    luaN_freearray(L, output, len);
+    scratch_free(output);
   } else {
     lua_pushstring(L, "");
   }
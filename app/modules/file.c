@@ -4,6 +4,7 @@
 #include "lauxlib.h"
 #include "lmem.h"
 #include "platform.h"
+#include "metrics.h"
 #include "spiffs/nodemcu_spiffs.h"
 
 #include <stdint.h>
@@ -215,8 +216,10 @@ static int file_open( lua_State* L )
   file_fd = vfs_open(fname, mode);
 
   if(!file_fd){
+    METRIC_INC(METRIC_FILE_OPEN_FAILS, 1);
     lua_pushnil(L);
   } else {
+    METRIC_INC(METRIC_FILE_OPENS, 1);
     file_fd_ud *ud = (file_fd_ud *) lua_newuserdata( L, sizeof( file_fd_ud ) );
     ud->fd = file_fd;
     luaL_getmetatable( L, "file.obj" );
@@ -453,6 +456,8 @@ static int file_g_read( lua_State* L, int n, int16_t end_char, int fd )
     int nwanted = (n - j >= sizeof(p)) ? sizeof(p) : n - j;
     int nread   = vfs_read(fd, p, nwanted);
 
+    if (nread > 0)
+      METRIC_INC(METRIC_FILE_READ_BYTES, nread);
     if (nread == VFS_RES_ERR || nread == 0) {
       if (j > 0) {
         break;
@@ -545,8 +550,10 @@ static int file_write( lua_State* L )
   size_t l, rl;
   const char *s = luaL_checklstring(L, argpos, &l);
   rl = vfs_write(fd, s, l);
-  if(rl==l)
+  if(rl==l) {
+    METRIC_INC(METRIC_FILE_WRITE_BYTES, l);
     lua_pushboolean(L, 1);
+  }
   else
     lua_pushnil(L);
   return 1;
@@ -564,8 +571,10 @@ static int file_writeline( lua_State* L )
   rl = vfs_write(fd, s, l);
   if(rl==l){
     rl = vfs_write(fd, "\n", 1);
-    if(rl==1)
+    if(rl==1) {
+      METRIC_INC(METRIC_FILE_WRITE_BYTES, l + 1);
       lua_pushboolean(L, 1);
+    }
     else
       lua_pushnil(L);
   }
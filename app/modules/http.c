@@ -11,11 +11,22 @@
 #include "cpu_esp8266.h"
 #include "http/httpclient.h"
 #include <ctype.h>
-static int http_callback_registry  = LUA_NOREF;
+static lua_State *http_await_issuing = NULL; // coroutine in http.await() before it yields
 
-static void http_callback( char * response, int http_status, char ** full_response_p, int body_size )
+// Each request carries the registry reference of its callback, or of the
+// coroutine waiting in http.await(), as the argument of http_callback().
+static int http_callback_ref( lua_State *L, int idx )
+{
+  if (!lua_isfunction(L, idx))
+    return LUA_NOREF;
+  lua_pushvalue(L, idx);  // copy argument (func) to the top of stack
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static void http_callback( char * response, int http_status, char ** full_response_p, int body_size, void * arg )
 {
   const char *full_response = full_response_p ? *full_response_p : NULL;
+  int ref = (int)arg;
 
 #if defined(HTTPCLIENT_DEBUG_ON)
   dbg_printf( "http_status=%d\n", http_status );
@@ -27,11 +38,15 @@ static void http_callback( char * response, int http_status, char ** full_respon
     dbg_printf( "response=%s<EOF>\n", response );
   }
 #endif
-  if (http_callback_registry != LUA_NOREF)
+  if (ref != LUA_NOREF)
   {
     lua_State *L = lua_getstate();
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, http_callback_registry);
+    // The registered callback may be a coroutine waiting in http.await()
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_State *co = lua_tothread(L, -1);
+    if (co)
+      lua_pop(L, 1);
 
     lua_pushinteger(L, http_status);
     if ( http_status != HTTP_STATUS_GENERIC_ERROR && response)
@@ -97,10 +112,17 @@ static void http_callback( char * response, int http_status, char ** full_respon
       *full_response_p = NULL;
     }
 
-    luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = LUA_NOREF;
-
-    luaL_pcallx(L, 3, 0); // With 3 arguments and 0 result
+    if (co && co == http_await_issuing) {
+      // Failed before http.await() yielded, so return the results directly
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+      lua_xmove(L, co, 3);
+      http_await_issuing = NULL;
+    } else if (co) {
+      luaL_awaitresume(L, ref, 3);
+    } else {
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+      luaL_pcallx(L, 3, 0); // With 3 arguments and 0 result
+    }
   }
 }
 
@@ -128,14 +150,38 @@ static int http_lapi_request( lua_State *L )
     body = luaL_checklstring(L, 4, &length);
   }
 
-  if (lua_isfunction(L, 5)) {
-    lua_pushvalue(L, 5);  // copy argument (func) to the top of stack
-    luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
+  int ref = http_callback_ref(L, 5);
+  http_request(url, method, headers, body, http_callback, (void *)ref, 0);
+  return 0;
+}
+
+// Lua: status, body, headers = http.await( url [, method, header, body] )
+// Only from within a coroutine, which is suspended until the request completes
+static int http_lapi_await( lua_State *L )
+{
+  int length;
+  const char * url     = luaL_checklstring(L, 1, &length);
+  const char * method  = luaL_optlstring(L, 2, "GET", &length);
+  const char * headers = NULL;
+  const char * body    = NULL;
+
+  if (lua_isstring(L, 3))
+  {
+    headers = luaL_checklstring(L, 3, &length);
+  }
+  if (lua_isstring(L, 4))
+  {
+    body = luaL_checklstring(L, 4, &length);
   }
 
-  http_request(url, method, headers, body, http_callback, 0);
-  return 0;
+  int ref = luaL_awaitref(L);
+
+  http_await_issuing = L;
+  http_request(url, method, headers, body, http_callback, (void *)ref, 0);
+  if (http_await_issuing == NULL)
+    return 3;
+  http_await_issuing = NULL;
+  return lua_yield(L, 0);
 }
 
 // Lua: http.post( url, header, body, function(status, reponse) end )
@@ -161,14 +207,8 @@ static int http_lapi_post( lua_State *L )
     body = luaL_checklstring(L, 3, &length);
   }
 
-  if (lua_isfunction(L, 4)) {
-    lua_pushvalue(L, 4);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
-
-  http_post(url, headers, body, http_callback);
+  int ref = http_callback_ref(L, 4);
+  http_post(url, headers, body, http_callback, (void *)ref);
   return 0;
 }
 
@@ -195,14 +235,8 @@ static int http_lapi_put( lua_State *L )
     body = luaL_checklstring(L, 3, &length);
   }
 
-  if (lua_isfunction(L, 4)) {
-    lua_pushvalue(L, 4);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
-
-  http_put(url, headers, body, http_callback);
+  int ref = http_callback_ref(L, 4);
+  http_put(url, headers, body, http_callback, (void *)ref);
   return 0;
 }
 
@@ -229,14 +263,8 @@ static int http_lapi_delete( lua_State *L )
     body = luaL_checklstring(L, 3, &length);
   }
 
-  if (lua_isfunction(L, 4)) {
-    lua_pushvalue(L, 4);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
-
-  http_delete(url, headers, body, http_callback);
+  int ref = http_callback_ref(L, 4);
+  http_delete(url, headers, body, http_callback, (void *)ref);
   return 0;
 }
 
@@ -258,24 +286,50 @@ static int http_lapi_get( lua_State *L )
     headers = luaL_checklstring(L, 2, &length);
   }
 
-  if (lua_isfunction(L, 3)) {
-    lua_pushvalue(L, 3);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
+  int ref = http_callback_ref(L, 3);
+  http_get(url, headers, http_callback, (void *)ref);
+  return 0;
+}
 
-  http_get(url, headers, http_callback);
+// Lua: http.keepalive( idle_ms [, pipeline] )
+static int http_lapi_keepalive( lua_State *L )
+{
+  int idle_ms = luaL_checkinteger(L, 1);
+  int pipeline = luaL_optinteger(L, 2, 1);
+  luaL_argcheck(L, idle_ms >= 0, 1, "must not be negative");
+  luaL_argcheck(L, pipeline >= 1 && pipeline <= HTTP_PIPELINE_MAX, 2, "out of range");
+  http_keepalive(idle_ms, pipeline);
   return 0;
 }
 
+// Lua: t = http.stats( [reset] )
+static int http_lapi_stats( lua_State *L )
+{
+  bool reset = lua_toboolean(L, 1);
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, http_stats.connects);
+  lua_setfield(L, -2, "connects");
+  lua_pushinteger(L, http_stats.requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, http_stats.reused);
+  lua_setfield(L, -2, "reused");
+  lua_pushinteger(L, http_stats.pipelined);
+  lua_setfield(L, -2, "pipelined");
+  if (reset)
+    memset(&http_stats, 0, sizeof(http_stats));
+  return 1;
+}
+
 // Module function map
 LROT_BEGIN(http, NULL, 0)
   LROT_FUNCENTRY( request, http_lapi_request )
+  LROT_FUNCENTRY( await, http_lapi_await )
   LROT_FUNCENTRY( post, http_lapi_post )
   LROT_FUNCENTRY( put, http_lapi_put )
   LROT_FUNCENTRY( delete, http_lapi_delete )
   LROT_FUNCENTRY( get, http_lapi_get )
+  LROT_FUNCENTRY( keepalive, http_lapi_keepalive )
+  LROT_FUNCENTRY( stats, http_lapi_stats )
 
   LROT_NUMENTRY( OK, 0 )
   LROT_NUMENTRY( ERROR, HTTP_STATUS_GENERIC_ERROR )
@@ -0,0 +1,1238 @@
+// Module for a native HTTP/1.1 server
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "vfs.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <stdint.h>
+#include "osapi.h"
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/tcp.h"
+
+/* Defaults for the httpd.start() options */
+#define HTTPD_MAX_CONNS   4       /* concurrent connections */
+#define HTTPD_MEM_MAX     16384   /* bytes buffered for all connections */
+#define HTTPD_REQUEST_MAX 2048    /* largest request, head and body */
+#define HTTPD_IDLE_SECS   10      /* to wait for a request */
+
+#define HTTPD_BUF_MIN     256
+#define HTTPD_PATH_MAX    64
+#define HTTPD_POLL        2       /* lwIP poll interval, 1s */
+
+#define HTTPD_TABLE_REQ   "httpd.req"
+#define HTTPD_TABLE_RES   "httpd.res"
+
+/*
+ * A connection's state is that of its current request: its head or body is
+ * being read, the handler has it, or the response is finished and is being
+ * written.  Requests are taken one at a time, so a pipelined request waits in
+ * the buffer, or in lwIP's pbufs, until the one before it is done.
+ */
+enum { HC_HEAD, HC_BODY, HC_HANDLER, HC_DONE };
+
+/*
+ * A static file being written.  It has an entry of true in the output FIFO,
+ * and when that reaches the head the file is read a segment at a time into
+ * buf and written to the PCB.
+ */
+typedef struct httpd_file {
+  int fd;
+  uint32_t remaining;
+  uint16_t held, off;           /* bytes read into buf, and those written */
+  char buf[TCP_MSS];
+} httpd_file;
+
+/*
+ * The request is parsed in place as it arrives, scanning each byte once.
+ * Each line is terminated with a null, so that req:header() can look through
+ * the head when asked, rather than each header being made a Lua string.
+ */
+typedef struct httpd_conn {
+  struct httpd_conn *next;
+  struct tcp_pcb *pcb;
+  struct pbuf *rx;              /* received, not yet in buf */
+  uint16_t rx_off;              /* bytes of rx already taken */
+  char *buf;
+  uint16_t size, len;           /* of buf, and the bytes in it */
+  uint16_t scan, line;          /* parsed up to, and the line's start */
+  uint16_t mlen, ulen;          /* the method, and the target after it */
+  uint16_t hdrs, hend, hlen;    /* first header line, empty line, body */
+  uint32_t clen;                /* Content-Length */
+  uint32_t seq;                 /* of the request, see httpd_check() */
+  uint32_t mem;                 /* bytes accounted to the connection */
+  uint16_t status;
+  uint8_t state;
+  uint8_t idle;                 /* seconds waiting for the client */
+  bool http10;
+  bool keep;                    /* keep the connection after this request */
+  bool gzip;                    /* Accept-Encoding: gzip */
+  bool expect;                  /* Expect: 100-continue */
+  bool head;                    /* a HEAD request */
+  bool busy;                    /* in its handler */
+  bool abort;                   /* to be closed, see httpd_process() */
+  bool committed;               /* the status line and headers are queued */
+  bool chunked;
+  int hdr_ref;                  /* from res:send_header() */
+  int out_ref;                  /* output FIFO, of strings and true */
+  int out_head, out_tail;
+  uint32_t out_off;             /* bytes of the head string written */
+  httpd_file *file;
+} httpd_conn;
+
+typedef struct httpd_route {
+  struct httpd_route *next;
+  char *method;                 /* NULL for any */
+  char *path;
+  uint16_t plen;
+  bool prefix;                  /* path ended with '*', or static */
+  bool is_static;
+  char *dir;                    /* static: directory prefix, or */
+  int ref;                      /* handler, or static source function */
+} httpd_route;
+
+typedef struct httpd_handle {
+  httpd_conn *hc;
+  uint32_t seq;
+} httpd_handle;
+
+static struct {
+  uint32_t accepted;
+  uint32_t refused;             /* over the connection or memory limit */
+  uint32_t requests;
+  uint32_t statics;             /* served from a static route */
+  uint32_t gzip;                /* of which gzipped */
+  uint32_t errors;              /* error responses from the server */
+  uint32_t peak;                /* most memory accounted */
+} httpd_stats;
+
+static struct tcp_pcb *httpd_listen_pcb;
+static httpd_conn *httpd_conns;
+static httpd_route *httpd_routes;
+static unsigned httpd_nconns;
+static uint32_t httpd_mem;
+static uint32_t httpd_seq;
+
+static unsigned httpd_max_conns = HTTPD_MAX_CONNS;
+static uint32_t httpd_mem_max = HTTPD_MEM_MAX;
+static uint16_t httpd_request_max = HTTPD_REQUEST_MAX;
+static uint8_t httpd_idle_secs = HTTPD_IDLE_SECS;
+
+static err_t httpd_process(httpd_conn *hc);
+
+#pragma mark - Memory
+
+static void httpd_account(httpd_conn *hc, int32_t bytes) {
+  hc->mem += bytes;
+  httpd_mem += bytes;
+  if (httpd_mem > httpd_stats.peak)
+    httpd_stats.peak = httpd_mem;
+}
+
+static bool httpd_mem_room(uint32_t bytes) {
+  return httpd_mem + bytes <= httpd_mem_max;
+}
+
+/*
+ * Room in the buffer for up to want more bytes, growing it as far as the
+ * request and memory limits allow.
+ */
+static uint16_t httpd_room(httpd_conn *hc, uint32_t want) {
+  uint32_t need = hc->len + want;
+  if (need > httpd_request_max)
+    need = httpd_request_max;
+  if (need > hc->size) {
+    uint32_t size = hc->size ? hc->size : HTTPD_BUF_MIN;
+    while (size < need)
+      size *= 2;
+    if (size > httpd_request_max)
+      size = httpd_request_max;
+    if (!httpd_mem_room(size - hc->size))
+      size = need;
+    char *buf;
+    if (httpd_mem_room(size - hc->size) && (buf = (char *) realloc(hc->buf, size))) {
+      httpd_account(hc, size - hc->size);
+      hc->buf = buf;
+      hc->size = size;
+    }
+  }
+  return LWIP_MIN(hc->size - hc->len, want);
+}
+
+static void httpd_buf_free(httpd_conn *hc) {
+  httpd_account(hc, -(int32_t) hc->size);
+  free(hc->buf);
+  hc->buf = NULL;
+  hc->size = hc->len = 0;
+}
+
+static void httpd_file_free(httpd_conn *hc) {
+  if (!hc->file)
+    return;
+  vfs_close(hc->file->fd);
+  free(hc->file);
+  hc->file = NULL;
+  httpd_account(hc, -(int32_t) sizeof(httpd_file));
+}
+
+static void httpd_conn_free(httpd_conn *hc) {
+  lua_State *L = lua_getstate();
+  httpd_conn **p = &httpd_conns;
+  while (*p && *p != hc)
+    p = &(*p)->next;
+  if (*p)
+    *p = hc->next;
+  httpd_nconns--;
+  if (hc->rx)
+    pbuf_free(hc->rx);
+  httpd_file_free(hc);
+  luaL_unref(L, LUA_REGISTRYINDEX, hc->out_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, hc->hdr_ref);
+  httpd_mem -= hc->mem;
+  free(hc->buf);
+  free(hc);
+}
+
+/* Close the connection, returning ERR_ABRT if it had to be aborted */
+static err_t httpd_close(httpd_conn *hc) {
+  struct tcp_pcb *pcb = hc->pcb;
+  err_t err = ERR_CLSD;
+  tcp_arg(pcb, NULL);
+  tcp_recv(pcb, NULL);
+  tcp_sent(pcb, NULL);
+  tcp_err(pcb, NULL);
+  tcp_poll(pcb, NULL, 0);
+  /* lwIP resets rather than closes while received data is unacknowledged */
+  if (hc->rx)
+    tcp_recved(pcb, hc->rx->tot_len - hc->rx_off);
+  if (tcp_close(pcb) != ERR_OK) {
+    tcp_abort(pcb);
+    err = ERR_ABRT;
+  }
+  httpd_conn_free(hc);
+  return err;
+}
+
+#pragma mark - Output
+
+/* Queue the string at idx */
+static void httpd_queue(lua_State *L, httpd_conn *hc, int idx) {
+  size_t len = lua_objlen(L, idx);
+  if (len == 0)
+    return;
+  if (idx < 0)
+    idx = lua_gettop(L) + idx + 1;
+  if (hc->out_ref == LUA_NOREF) {
+    lua_newtable(L);
+    hc->out_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, hc->out_ref);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, hc->out_tail++);
+  lua_pop(L, 1);
+  httpd_account(hc, len);
+}
+
+static void httpd_queue_str(lua_State *L, httpd_conn *hc, const char *s) {
+  lua_pushstring(L, s);
+  httpd_queue(L, hc, -1);
+  lua_pop(L, 1);
+}
+
+static void httpd_queue_file(lua_State *L, httpd_conn *hc) {
+  if (hc->out_ref == LUA_NOREF) {
+    lua_newtable(L);
+    hc->out_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, hc->out_ref);
+  lua_pushboolean(L, 1);
+  lua_rawseti(L, -2, hc->out_tail++);
+  lua_pop(L, 1);
+}
+
+/*
+ * Write file data while the send buffer has room.  Returns true once all of
+ * it has been written, or reading has failed, which leaves the response short
+ * of its Content-Length so the connection has to be closed.
+ */
+static bool httpd_file_pump(httpd_conn *hc, bool more) {
+  httpd_file *f = hc->file;
+  struct tcp_pcb *pcb = hc->pcb;
+  while (f->remaining) {
+    size_t n = tcp_sndbuf(pcb);
+    if (n == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN)
+      return false;
+    if (f->held == 0) {
+      int32_t got = vfs_read(f->fd, f->buf, LWIP_MIN(sizeof(f->buf), f->remaining));
+      if (got <= 0)
+        break;
+      f->held = got;
+    }
+    if (n > f->held - f->off)
+      n = f->held - f->off;
+    u8_t flags = TCP_WRITE_FLAG_COPY;
+    if (more || n < f->remaining)
+      flags |= TCP_WRITE_FLAG_MORE;
+    if (tcp_write(pcb, f->buf + f->off, n, flags) != ERR_OK)
+      return false;
+    f->off += n;
+    f->remaining -= n;
+    if (f->off == f->held)
+      f->off = f->held = 0;
+  }
+  if (f->remaining)
+    hc->keep = false;
+  httpd_file_free(hc);
+  return true;
+}
+
+/*
+ * Feed the output FIFO to the PCB as far as its send buffer allows.  Data is
+ * always copied, as lwIP builds a single pbuf for the driver in any case.
+ */
+static void httpd_pump(httpd_conn *hc) {
+  if (hc->out_head == hc->out_tail)
+    return;
+  lua_State *L = lua_getstate();
+  struct tcp_pcb *pcb = hc->pcb;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, hc->out_ref);
+  int t = lua_gettop(L);
+  while (hc->out_head < hc->out_tail) {
+    bool more = hc->out_head + 1 < hc->out_tail;
+    lua_rawgeti(L, t, hc->out_head);
+    if (lua_isboolean(L, t + 1)) {
+      lua_pop(L, 1);
+      if (!httpd_file_pump(hc, more))
+        break;
+    } else {
+      size_t len;
+      const char *data = lua_tolstring(L, t + 1, &len);
+      size_t n = LWIP_MIN(tcp_sndbuf(pcb), len - hc->out_off);
+      u8_t flags = TCP_WRITE_FLAG_COPY;
+      if (more || n < len - hc->out_off)
+        flags |= TCP_WRITE_FLAG_MORE;
+      if (n == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN ||
+          tcp_write(pcb, data + hc->out_off, n, flags) != ERR_OK) {
+        lua_pop(L, 1);
+        break;
+      }
+      lua_pop(L, 1);
+      hc->out_off += n;
+      httpd_account(hc, -(int32_t) n);
+      if (hc->out_off < len)
+        break;
+      hc->out_off = 0;
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, t, hc->out_head++);
+  }
+  if (hc->out_head == hc->out_tail)
+    hc->out_head = hc->out_tail = 1;
+  lua_pop(L, 1);
+}
+
+static const char *httpd_reason(int status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default:  return "";
+  }
+}
+
+/*
+ * Queue the status line and headers, giving the body's length if it is known
+ * and otherwise sending it chunked, or to a HTTP/1.0 client until the close.
+ */
+static void httpd_commit(lua_State *L, httpd_conn *hc, int32_t length, const char *extra) {
+  luaL_Buffer b;
+  char line[64];
+  luaL_buffinit(L, &b);
+  sprintf(line, "HTTP/1.1 %d %s\r\n", hc->status, httpd_reason(hc->status));
+  luaL_addstring(&b, line);
+  if (hc->hdr_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hc->hdr_ref);
+    luaL_addvalue(&b);
+    luaL_unref(L, LUA_REGISTRYINDEX, hc->hdr_ref);
+    hc->hdr_ref = LUA_NOREF;
+  }
+  if (extra)
+    luaL_addstring(&b, extra);
+  if (length >= 0) {
+    sprintf(line, "Content-Length: %d\r\n", length);
+    luaL_addstring(&b, line);
+  } else if (!hc->http10) {
+    luaL_addstring(&b, "Transfer-Encoding: chunked\r\n");
+    hc->chunked = true;
+  } else {
+    hc->keep = false;
+  }
+  if (!hc->keep)
+    luaL_addstring(&b, "Connection: close\r\n");
+  else if (hc->http10)
+    luaL_addstring(&b, "Connection: keep-alive\r\n");
+  luaL_addstring(&b, "\r\n");
+  luaL_pushresult(&b);
+  httpd_queue(L, hc, -1);
+  lua_pop(L, 1);
+  hc->committed = true;
+}
+
+/* Queue the len bytes of body at idx, as a chunk if need be */
+static void httpd_body(lua_State *L, httpd_conn *hc, int idx, size_t len) {
+  if (len == 0 || hc->head)
+    return;
+  if (hc->chunked) {
+    char size[12];
+    sprintf(size, "%X\r\n", (unsigned) len);
+    httpd_queue_str(L, hc, size);
+  }
+  httpd_queue(L, hc, idx);
+  if (hc->chunked)
+    httpd_queue_str(L, hc, "\r\n");
+}
+
+/* Respond with the status and a short text body, ending the request */
+static void httpd_error(httpd_conn *hc, int status) {
+  lua_State *L = lua_getstate();
+  char text[48];
+  int len = sprintf(text, "%d %s\n", status, httpd_reason(status));
+  httpd_stats.errors++;
+  hc->status = status;
+  httpd_commit(L, hc, len, "Content-Type: text/plain\r\n");
+  lua_pushlstring(L, text, len);
+  httpd_body(L, hc, -1, len);
+  lua_pop(L, 1);
+  hc->state = HC_DONE;
+}
+
+#pragma mark - Request parser
+
+/* Whether the comma separated list has the token, ignoring any parameters */
+static bool httpd_token(const char *v, const char *tok) {
+  size_t n = strlen(tok);
+  while (*v) {
+    while (*v == ' ' || *v == '\t' || *v == ',')
+      v++;
+    if (strncasecmp(v, tok, n) == 0 &&
+        (v[n] == '\0' || v[n] == ',' || v[n] == ';' || v[n] == ' '))
+      return true;
+    while (*v && *v != ',')
+      v++;
+  }
+  return false;
+}
+
+#define HTTPD_IS(p, n, name) ((n) == sizeof(name) - 1 && strncasecmp((p), (name), (n)) == 0)
+
+/* Note the headers which the server acts on; returns an error status or 0 */
+static int httpd_header_line(httpd_conn *hc, const char *p) {
+  const char *v = strchr(p, ':');
+  if (!v)
+    return 400;
+  size_t n = v - p;
+  for (v++; *v == ' ' || *v == '\t'; v++) {}
+  if (HTTPD_IS(p, n, "Content-Length")) {
+    hc->clen = strtoul(v, NULL, 10);
+  } else if (HTTPD_IS(p, n, "Connection")) {
+    if (httpd_token(v, "close"))
+      hc->keep = false;
+    else if (httpd_token(v, "keep-alive"))
+      hc->keep = true;
+  } else if (HTTPD_IS(p, n, "Accept-Encoding")) {
+    hc->gzip = httpd_token(v, "gzip");
+  } else if (HTTPD_IS(p, n, "Expect")) {
+    hc->expect = httpd_token(v, "100-continue");
+  } else if (HTTPD_IS(p, n, "Transfer-Encoding")) {
+    return 501;                 /* chunked request bodies aren't taken */
+  }
+  return 0;
+}
+
+/* Parse the request line; returns an error status or 0 */
+static int httpd_request_line(httpd_conn *hc, uint16_t end) {
+  char *b = hc->buf;
+  char *sp1 = memchr(b, ' ', end);
+  char *sp2 = sp1 ? memchr(sp1 + 1, ' ', b + end - sp1 - 1) : NULL;
+  if (!sp1 || !sp2 || sp1 == b || sp2 == sp1 + 1 ||
+      b + end - sp2 != 9 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0)
+    return 400;
+  *sp1 = *sp2 = '\0';
+  hc->mlen = sp1 - b;
+  hc->ulen = sp2 - sp1 - 1;
+  hc->http10 = sp2[8] == '0';
+  hc->keep = !hc->http10;
+  return 0;
+}
+
+/*
+ * Scan the bytes received since the last call.  Returns 0 while the request
+ * is incomplete, 1 once it has all arrived, or the status to refuse it with.
+ */
+static int httpd_parse(httpd_conn *hc) {
+  char *b = hc->buf;
+  while (hc->state == HC_HEAD && hc->scan < hc->len) {
+    if (b[hc->scan++] != '\n')
+      continue;
+    uint16_t start = hc->line, end = hc->scan - 1;
+    if (end > start && b[end - 1] == '\r')
+      end--;
+    hc->line = hc->scan;
+    int err = 0;
+    if (hc->mlen == 0) {
+      if (end == start) {
+        /* an empty line before the request, see RFC 7230 3.5 */
+        memmove(b, b + hc->scan, hc->len - hc->scan);
+        hc->len -= hc->scan;
+        hc->scan = hc->line = 0;
+        continue;
+      }
+      b[end] = '\0';
+      err = httpd_request_line(hc, end);
+      hc->hdrs = hc->scan;
+    } else if (end > start) {
+      b[end] = '\0';
+      err = httpd_header_line(hc, b + start);
+    } else {
+      hc->hend = start;
+      hc->hlen = hc->scan;
+      if (hc->clen > httpd_request_max - hc->hlen)
+        return 413;
+      hc->state = HC_BODY;
+      if (hc->expect && hc->clen > hc->len - hc->hlen)
+        tcp_write(hc->pcb, "HTTP/1.1 100 Continue\r\n\r\n", 25, TCP_WRITE_FLAG_COPY);
+    }
+    if (err)
+      return err;
+  }
+  if (hc->state == HC_BODY && hc->len - hc->hlen >= hc->clen)
+    return 1;
+  return 0;
+}
+
+/* Move received data into the buffer, as far as it has room */
+static void httpd_feed(httpd_conn *hc) {
+  while (hc->rx) {
+    uint16_t n = httpd_room(hc, hc->rx->tot_len - hc->rx_off);
+    if (n == 0)
+      break;
+    pbuf_copy_partial(hc->rx, hc->buf + hc->len, n, hc->rx_off);
+    hc->len += n;
+    hc->rx_off += n;
+    tcp_recved(hc->pcb, n);
+    if (hc->rx_off == hc->rx->tot_len) {
+      pbuf_free(hc->rx);
+      hc->rx = NULL;
+      hc->rx_off = 0;
+    }
+  }
+}
+
+/* Drop the finished request from the buffer, ready for the next */
+static void httpd_reset(httpd_conn *hc) {
+  uint32_t used = hc->hlen + hc->clen;
+  if (used > hc->len)
+    used = hc->len;
+  memmove(hc->buf, hc->buf + used, hc->len - used);
+  hc->len -= used;
+  hc->scan = hc->line = 0;
+  hc->mlen = hc->ulen = hc->hdrs = hc->hend = hc->hlen = 0;
+  hc->clen = 0;
+  hc->gzip = hc->expect = hc->head = false;
+  hc->committed = hc->chunked = false;
+  hc->idle = 0;
+  hc->state = HC_HEAD;
+  if (hc->len == 0 && !hc->rx)
+    httpd_buf_free(hc);
+}
+
+#pragma mark - Dispatch
+
+static const struct {
+  const char *ext, *type;
+} httpd_types[] = {
+  { "html", "text/html" },
+  { "htm",  "text/html" },
+  { "css",  "text/css" },
+  { "js",   "application/javascript" },
+  { "json", "application/json" },
+  { "txt",  "text/plain" },
+  { "svg",  "image/svg+xml" },
+  { "png",  "image/png" },
+  { "jpg",  "image/jpeg" },
+  { "gif",  "image/gif" },
+  { "ico",  "image/x-icon" },
+};
+
+static const char *httpd_type(const char *name) {
+  const char *ext = strrchr(name, '.');
+  if (ext && !strchr(ext, '/'))
+    for (unsigned i = 0; i < sizeof(httpd_types) / sizeof(httpd_types[0]); i++)
+      if (strcasecmp(ext + 1, httpd_types[i].ext) == 0)
+        return httpd_types[i].type;
+  return "application/octet-stream";
+}
+
+/*
+ * Serve name from a static route: a file in its directory, preferring the
+ * gzipped name.gz if the client accepts it, or the string which the source
+ * function returns.  Content starting with the gzip magic number is sent as
+ * such, as enduser_setup does with its page.
+ */
+static void httpd_static(httpd_conn *hc, httpd_route *r, const char *name, size_t nlen) {
+  lua_State *L = lua_getstate();
+  char path[HTTPD_PATH_MAX + 4];
+  size_t dlen = r->dir ? strlen(r->dir) : 0;
+  const char *index = nlen == 0 || name[nlen - 1] == '/' ? "index.html" : "";
+  if (dlen + nlen + strlen(index) > HTTPD_PATH_MAX) {
+    httpd_error(hc, 404);
+    return;
+  }
+  memcpy(path, r->dir, dlen);
+  memcpy(path + dlen, name, nlen);
+  strcpy(path + dlen + nlen, index);
+  if (strstr(path, "..")) {
+    httpd_error(hc, 404);
+    return;
+  }
+
+  int top = lua_gettop(L);
+  int fd = 0;
+  bool gzip = false, negotiated = false;
+  uint32_t length;
+  char magic[2] = { 0, 0 };
+  if (r->dir) {
+    size_t plen = strlen(path);
+    strcpy(path + plen, ".gz");
+    if (hc->gzip && (fd = vfs_open(path, "r")))
+      negotiated = true;
+    path[plen] = '\0';
+    if (!fd && !(fd = vfs_open(path, "r"))) {
+      strcpy(path + plen, ".gz");
+      fd = vfs_open(path, "r");
+      path[plen] = '\0';
+    }
+    if (!fd) {
+      httpd_error(hc, 404);
+      return;
+    }
+    length = vfs_size(fd);
+    vfs_read(fd, magic, 2);
+    vfs_lseek(fd, 0, VFS_SEEK_SET);
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, r->ref);
+    lua_pushstring(L, path);
+    hc->busy = true;
+    int err = luaL_pcallx(L, 1, 1);
+    hc->busy = false;
+    if (hc->abort) {            /* httpd.stop(), closed by httpd_process() */
+      lua_settop(L, top);
+      hc->state = HC_DONE;
+      return;
+    }
+    if (err != 0) {
+      lua_settop(L, top);
+      httpd_error(hc, 500);
+      return;
+    }
+    if (!lua_isstring(L, -1)) {
+      lua_settop(L, top);
+      httpd_error(hc, 404);
+      return;
+    }
+    const char *body = lua_tolstring(L, -1, &nlen);
+    length = nlen;
+    memcpy(magic, body, LWIP_MIN(nlen, 2));
+  }
+  gzip = magic[0] == 0x1f && magic[1] == (char) 0x8b;
+
+  if (fd && !hc->head) {
+    if (!httpd_mem_room(sizeof(httpd_file)) ||
+        !(hc->file = (httpd_file *) malloc(sizeof(httpd_file)))) {
+      vfs_close(fd);
+      hc->keep = false;
+      httpd_error(hc, 503);
+      return;
+    }
+    httpd_account(hc, sizeof(httpd_file));
+    hc->file->fd = fd;
+    hc->file->remaining = length;
+    hc->file->held = hc->file->off = 0;
+  } else if (fd) {
+    vfs_close(fd);
+  }
+
+  char extra[96];
+  sprintf(extra, "Content-Type: %s\r\n%s%s", httpd_type(path),
+          gzip ? "Content-Encoding: gzip\r\n" : "",
+          negotiated ? "Vary: Accept-Encoding\r\n" : "");
+  hc->status = 200;
+  httpd_commit(L, hc, length, extra);
+  if (hc->file)
+    httpd_queue_file(L, hc);
+  else if (!r->dir && !hc->head)
+    httpd_queue(L, hc, -1);
+  lua_settop(L, top);
+  httpd_stats.statics++;
+  if (gzip)
+    httpd_stats.gzip++;
+  hc->state = HC_DONE;
+}
+
+static void httpd_push_handle(lua_State *L, httpd_conn *hc, const char *mt) {
+  httpd_handle *h = (httpd_handle *) lua_newuserdata(L, sizeof(httpd_handle));
+  h->hc = hc;
+  h->seq = hc->seq;
+  luaL_getmetatable(L, mt);
+  lua_setmetatable(L, -2);
+}
+
+/* Find the request's route and hand it over */
+static void httpd_dispatch(httpd_conn *hc) {
+  const char *method = hc->buf;
+  const char *url = hc->buf + hc->mlen + 1;
+  const char *q = memchr(url, '?', hc->ulen);
+  size_t plen = q ? (size_t)(q - url) : hc->ulen;
+  bool get = strcmp(method, "GET") == 0;
+
+  hc->state = HC_HANDLER;
+  hc->seq = ++httpd_seq;
+  hc->head = strcmp(method, "HEAD") == 0;
+  hc->status = 200;
+  httpd_stats.requests++;
+
+  httpd_route *r;
+  bool other = false;
+  for (r = httpd_routes; r; r = r->next) {
+    if (r->prefix ? plen < r->plen || strncmp(url, r->path, r->plen) != 0
+                  : plen != r->plen || strncmp(url, r->path, plen) != 0)
+      continue;
+    if (r->is_static ? !get && !hc->head
+                     : r->method && strcmp(r->method, method) != 0 &&
+                       !(hc->head && strcmp(r->method, "GET") == 0)) {
+      other = true;
+      continue;
+    }
+    break;
+  }
+  if (!r) {
+    httpd_error(hc, other ? 405 : 404);
+    return;
+  }
+  if (r->is_static) {
+    httpd_static(hc, r, url + r->plen, plen - r->plen);
+    return;
+  }
+
+  lua_State *L = lua_getstate();
+  int top = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, r->ref);
+  httpd_push_handle(L, hc, HTTPD_TABLE_REQ);
+  httpd_push_handle(L, hc, HTTPD_TABLE_RES);
+  hc->busy = true;
+  int err = luaL_pcallx(L, 2, 0);
+  hc->busy = false;
+  lua_settop(L, top);
+  if (err && hc->state == HC_HANDLER) {
+    if (!hc->committed) {
+      httpd_error(hc, 500);
+    } else {
+      hc->keep = false;
+      hc->state = HC_DONE;
+    }
+  }
+}
+
+/*
+ * Move the connection on as far as it can go: read and dispatch requests
+ * and, once a response has been written, close the connection or make ready
+ * for the next.  Returns ERR_CLSD or ERR_ABRT if the connection has gone.
+ */
+static err_t httpd_process(httpd_conn *hc) {
+  for (;;) {
+    if (hc->abort)
+      return httpd_close(hc);
+    httpd_pump(hc);
+    if (hc->state == HC_HANDLER)
+      return ERR_OK;
+    if (hc->state == HC_DONE) {
+      if (hc->file)
+        return ERR_OK;
+      if (!hc->keep)
+        return hc->out_head == hc->out_tail ? httpd_close(hc) : ERR_OK;
+      httpd_reset(hc);
+    }
+    httpd_feed(hc);
+    int r = httpd_parse(hc);
+    if (r == 0 && hc->rx && hc->len == hc->size)
+      r = hc->size < httpd_request_max ? 503 : 431;
+    if (r == 0)
+      return ERR_OK;
+    if (r == 1) {
+      httpd_dispatch(hc);
+    } else {
+      hc->keep = false;
+      httpd_error(hc, r);
+    }
+  }
+}
+
+#pragma mark - LWIP callbacks
+
+static err_t httpd_result(err_t err) {
+  return err == ERR_ABRT ? ERR_ABRT : ERR_OK;
+}
+
+static void httpd_err_cb(void *arg, err_t err) {
+  httpd_conn *hc = (httpd_conn *) arg;
+  if (!hc)
+    return;
+  hc->pcb = NULL;               /* freed by lwIP */
+  httpd_conn_free(hc);
+}
+
+static err_t httpd_recv_cb(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+  httpd_conn *hc = (httpd_conn *) arg;
+  if (!hc) {
+    if (p)
+      pbuf_free(p);
+    return ERR_OK;
+  }
+  if (!p) {
+    /* the client has finished sending: answer what it has sent, then close */
+    hc->keep = false;
+    if (hc->state >= HC_HANDLER)
+      return ERR_OK;
+    return httpd_result(httpd_close(hc));
+  }
+  if (hc->rx)
+    pbuf_cat(hc->rx, p);
+  else
+    hc->rx = p;
+  hc->idle = 0;
+  return httpd_result(httpd_process(hc));
+}
+
+static err_t httpd_sent_cb(void *arg, struct tcp_pcb *pcb, u16_t len) {
+  httpd_conn *hc = (httpd_conn *) arg;
+  if (!hc)
+    return ERR_OK;
+  return httpd_result(httpd_process(hc));
+}
+
+/* Every second: time out clients which are slow to send a request */
+static err_t httpd_poll_cb(void *arg, struct tcp_pcb *pcb) {
+  httpd_conn *hc = (httpd_conn *) arg;
+  if (!hc)
+    return ERR_OK;
+  if (hc->state < HC_HANDLER && ++hc->idle >= httpd_idle_secs)
+    return httpd_result(httpd_close(hc));
+  return httpd_result(httpd_process(hc));
+}
+
+static err_t httpd_accept_cb(void *arg, struct tcp_pcb *pcb, err_t err) {
+  tcp_accepted(httpd_listen_pcb);
+  if (err != ERR_OK || !pcb)
+    return ERR_VAL;
+  httpd_conn *hc = NULL;
+  if (httpd_nconns < httpd_max_conns &&
+      httpd_mem_room(sizeof(httpd_conn) + HTTPD_BUF_MIN))
+    hc = (httpd_conn *) calloc(1, sizeof(httpd_conn));
+  if (!hc) {
+    httpd_stats.refused++;
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+  hc->pcb = pcb;
+  hc->hdr_ref = hc->out_ref = LUA_NOREF;
+  hc->out_head = hc->out_tail = 1;
+  hc->next = httpd_conns;
+  httpd_conns = hc;
+  httpd_nconns++;
+  httpd_account(hc, sizeof(httpd_conn));
+  httpd_stats.accepted++;
+
+  tcp_arg(pcb, hc);
+  tcp_err(pcb, httpd_err_cb);
+  tcp_recv(pcb, httpd_recv_cb);
+  tcp_sent(pcb, httpd_sent_cb);
+  tcp_poll(pcb, httpd_poll_cb, HTTPD_POLL);
+  return ERR_OK;
+}
+
+#pragma mark - Lua API - request and response
+
+/* The connection, while the handle's request is still with its handler */
+static httpd_conn *httpd_check(lua_State *L, int idx, const char *mt) {
+  httpd_handle *h = (httpd_handle *) luaL_checkudata(L, idx, mt);
+  for (httpd_conn *hc = httpd_conns; hc; hc = hc->next)
+    if (hc == h->hc)
+      return hc->seq == h->seq && hc->state == HC_HANDLER ? hc : NULL;
+  return NULL;
+}
+
+// Lua: value = req:header(name)
+static int httpd_req_header(lua_State *L) {
+  httpd_conn *hc = httpd_check(L, 1, HTTPD_TABLE_REQ);
+  const char *name = luaL_checkstring(L, 2);
+  size_t n = strlen(name);
+  lua_pushnil(L);
+  if (!hc)
+    return 1;
+  const char *p = hc->buf + hc->hdrs, *end = hc->buf + hc->hend;
+  while (p < end) {
+    if (strncasecmp(p, name, n) == 0 && p[n] == ':') {
+      for (p += n + 1; *p == ' ' || *p == '\t'; p++) {}
+      lua_pushstring(L, p);
+      return 1;
+    }
+    p += strlen(p) + 1;
+    if (*p == '\n')
+      p++;
+  }
+  return 1;
+}
+
+LROT_BEGIN(httpd_req_funcs, NULL, 0)
+  LROT_FUNCENTRY( header, httpd_req_header )
+LROT_END(httpd_req_funcs, NULL, 0)
+
+// Lua: req.method, req.url, req.path, req.query, req.body
+static int httpd_req_index(lua_State *L) {
+  lua_settop(L, 2);
+  const char *k = luaL_checkstring(L, 2);
+  httpd_conn *hc = httpd_check(L, 1, HTTPD_TABLE_REQ);
+  const char *url = hc ? hc->buf + hc->mlen + 1 : NULL;
+  const char *q = hc ? memchr(url, '?', hc->ulen) : NULL;
+  if (hc && strcmp(k, "method") == 0) {
+    lua_pushlstring(L, hc->buf, hc->mlen);
+  } else if (hc && strcmp(k, "url") == 0) {
+    lua_pushlstring(L, url, hc->ulen);
+  } else if (hc && strcmp(k, "path") == 0) {
+    lua_pushlstring(L, url, q ? (size_t)(q - url) : hc->ulen);
+  } else if (hc && strcmp(k, "query") == 0) {
+    if (!q)
+      return 0;
+    lua_pushlstring(L, q + 1, url + hc->ulen - q - 1);
+  } else if (hc && strcmp(k, "body") == 0) {
+    lua_pushlstring(L, hc->buf + hc->hlen, hc->clen);
+  } else {
+    lua_pushrotable(L, LROT_TABLEREF(httpd_req_funcs));
+    lua_replace(L, 1);
+    lua_rawget(L, 1);
+  }
+  return 1;
+}
+
+/* Write what has been queued, from outside lwIP's callbacks too */
+static void httpd_flush(httpd_conn *hc) {
+  struct tcp_pcb *pcb = hc->pcb;
+  if (hc->busy) {
+    httpd_pump(hc);
+    tcp_output(pcb);
+  } else if (httpd_process(hc) == ERR_OK) {
+    tcp_output(pcb);
+  }
+}
+
+// Lua: res:send_header(name, value)
+static int httpd_res_send_header(lua_State *L) {
+  httpd_conn *hc = httpd_check(L, 1, HTTPD_TABLE_RES);
+  luaL_checkstring(L, 2);
+  luaL_checkstring(L, 3);
+  if (!hc)
+    return 0;
+  if (hc->committed)
+    return luaL_error(L, "headers already sent");
+  lua_settop(L, 3);
+  if (hc->hdr_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hc->hdr_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, hc->hdr_ref);
+  } else {
+    lua_pushliteral(L, "");
+  }
+  lua_pushvalue(L, 2);
+  lua_pushliteral(L, ": ");
+  lua_pushvalue(L, 3);
+  lua_pushliteral(L, "\r\n");
+  lua_concat(L, 5);
+  hc->hdr_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+// Lua: ok = res:send([data[, status]])
+static int httpd_res_send(lua_State *L) {
+  httpd_conn *hc = httpd_check(L, 1, HTTPD_TABLE_RES);
+  size_t len = 0;
+  if (!lua_isnoneornil(L, 2))
+    luaL_checklstring(L, 2, &len);
+  int status = luaL_optinteger(L, 3, 200);
+  lua_pushboolean(L, hc != NULL);
+  if (!hc)
+    return 1;
+  if (!hc->committed) {
+    hc->status = status;
+    httpd_commit(L, hc, -1, NULL);
+  }
+  httpd_body(L, hc, 2, len);
+  httpd_flush(hc);
+  return 1;
+}
+
+// Lua: ok = res:finish([data[, status]])
+static int httpd_res_finish(lua_State *L) {
+  httpd_conn *hc = httpd_check(L, 1, HTTPD_TABLE_RES);
+  size_t len = 0;
+  if (!lua_isnoneornil(L, 2))
+    luaL_checklstring(L, 2, &len);
+  int status = luaL_optinteger(L, 3, 200);
+  lua_pushboolean(L, hc != NULL);
+  if (!hc)
+    return 1;
+  if (!hc->committed) {
+    hc->status = status;
+    httpd_commit(L, hc, len, NULL);
+  }
+  httpd_body(L, hc, 2, len);
+  if (hc->chunked && !hc->head)
+    httpd_queue_str(L, hc, "0\r\n\r\n");
+  hc->state = HC_DONE;
+  httpd_flush(hc);
+  return 1;
+}
+
+/*
+ * A response which is collected unfinished has been abandoned by its handler.
+ * The connection is left for the next poll to close, as this may run in the
+ * middle of anything which allocates.
+ */
+static int httpd_res_gc(lua_State *L) {
+  httpd_conn *hc = httpd_check(L, 1, HTTPD_TABLE_RES);
+  if (hc)
+    hc->abort = true;
+  return 0;
+}
+
+#pragma mark - Lua API
+
+/* Add or replace a route, or remove it if there is neither handler nor dir */
+static void httpd_route_set(lua_State *L, const char *method, const char *path,
+                            bool is_static, int fn, const char *dir) {
+  size_t plen = strlen(path);
+  bool prefix = is_static || (plen && path[plen - 1] == '*');
+  if (prefix && !is_static)
+    plen--;
+  httpd_route **p = &httpd_routes, *r;
+  for (; (r = *p); p = &r->next) {
+    if (r->is_static == is_static && r->prefix == prefix && r->plen == plen &&
+        strncmp(r->path, path, plen) == 0 &&
+        (r->method == method || (r->method && method && strcmp(r->method, method) == 0)))
+      break;
+  }
+  if (r) {
+    *p = r->next;
+    luaL_unref(L, LUA_REGISTRYINDEX, r->ref);
+    free(r->method);
+    free(r->path);
+    free(r->dir);
+    free(r);
+  }
+  if (!fn && !dir)
+    return;
+  r = (httpd_route *) calloc(1, sizeof(httpd_route));
+  if (r) {
+    r->path = (char *) malloc(plen + 1);
+    r->method = method ? strdup(method) : NULL;
+    r->dir = dir ? strdup(dir) : NULL;
+  }
+  if (!r || !r->path || (method && !r->method) || (dir && !r->dir)) {
+    if (r) {
+      free(r->path);
+      free(r->method);
+      free(r->dir);
+      free(r);
+    }
+    luaL_error(L, "out of memory");
+  }
+  memcpy(r->path, path, plen);
+  r->path[plen] = '\0';
+  r->plen = plen;
+  r->prefix = prefix;
+  r->is_static = is_static;
+  r->ref = LUA_NOREF;
+  if (fn) {
+    lua_pushvalue(L, fn);
+    r->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  for (p = &httpd_routes; *p; p = &(*p)->next) {}
+  *p = r;
+}
+
+// Lua: httpd.route([method, ]path, function(req, res))
+static int httpd_route_l(lua_State *L) {
+  int i = 1;
+  const char *method = NULL;
+  if (lua_gettop(L) >= 3) {
+    method = luaL_checkstring(L, i++);
+    if (strcmp(method, "*") == 0)
+      method = NULL;
+  }
+  const char *path = luaL_checkstring(L, i++);
+  if (!lua_isnoneornil(L, i))
+    luaL_checktype(L, i, LUA_TFUNCTION);
+  httpd_route_set(L, method, path, false, lua_isfunction(L, i) ? i : 0, NULL);
+  return 0;
+}
+
+// Lua: httpd.static(prefix, dir|function(name))
+static int httpd_static_l(lua_State *L) {
+  const char *prefix = luaL_checkstring(L, 1);
+  int fn = 0;
+  const char *dir = NULL;
+  if (lua_isfunction(L, 2))
+    fn = 2;
+  else if (!lua_isnoneornil(L, 2))
+    dir = luaL_checkstring(L, 2);
+  if (dir && strlen(dir) >= HTTPD_PATH_MAX)
+    return luaL_argerror(L, 2, "too long");
+  httpd_route_set(L, NULL, prefix, true, fn, dir);
+  return 0;
+}
+
+static int httpd_opt(lua_State *L, const char *name, int def, int min, int max) {
+  int v = def;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, name);
+    v = luaL_optinteger(L, -1, def);
+    lua_pop(L, 1);
+  }
+  if (v < min || v > max)
+    luaL_error(L, "%s out of range", name);
+  return v;
+}
+
+// Lua: httpd.start([port[, {maxconn=, memory=, request=, idle=}]])
+static int httpd_start(lua_State *L) {
+  if (httpd_listen_pcb)
+    return luaL_error(L, "already running");
+  int port = luaL_optinteger(L, 1, 80);
+  httpd_max_conns = httpd_opt(L, "maxconn", HTTPD_MAX_CONNS, 1, MEMP_NUM_TCP_PCB);
+  httpd_mem_max = httpd_opt(L, "memory", HTTPD_MEM_MAX, 1024, 1 << 20);
+  httpd_request_max = httpd_opt(L, "request", HTTPD_REQUEST_MAX, HTTPD_BUF_MIN, 32768);
+  httpd_idle_secs = httpd_opt(L, "idle", HTTPD_IDLE_SECS, 1, 255);
+
+  struct tcp_pcb *pcb = tcp_new();
+  if (!pcb)
+    return luaL_error(L, "cannot allocate PCB");
+  pcb->so_options |= SOF_REUSEADDR;
+  err_t err = tcp_bind(pcb, IP_ADDR_ANY, port);
+  if (err == ERR_OK) {
+    struct tcp_pcb *lpcb = tcp_listen(pcb);
+    if (lpcb) {
+      httpd_listen_pcb = lpcb;
+      tcp_accept(lpcb, httpd_accept_cb);
+      return 0;
+    }
+    err = ERR_MEM;
+  }
+  tcp_close(pcb);
+  return luaL_error(L, err == ERR_USE ? "address in use" : "cannot listen");
+}
+
+// Lua: httpd.stop()
+static int httpd_stop(lua_State *L) {
+  if (httpd_listen_pcb) {
+    tcp_close(httpd_listen_pcb);
+    httpd_listen_pcb = NULL;
+  }
+  httpd_conn *hc = httpd_conns;
+  while (hc) {
+    httpd_conn *next = hc->next;
+    if (hc->busy)
+      hc->abort = true;         /* closed once its handler returns */
+    else
+      httpd_close(hc);
+    hc = next;
+  }
+  return 0;
+}
+
+// Lua: t = httpd.stats([reset])
+static int httpd_stats_l(lua_State *L) {
+  bool reset = lua_toboolean(L, 1);
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, httpd_stats.accepted);
+  lua_setfield(L, -2, "accepted");
+  lua_pushinteger(L, httpd_stats.refused);
+  lua_setfield(L, -2, "refused");
+  lua_pushinteger(L, httpd_stats.requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, httpd_stats.statics);
+  lua_setfield(L, -2, "static");
+  lua_pushinteger(L, httpd_stats.gzip);
+  lua_setfield(L, -2, "gzip");
+  lua_pushinteger(L, httpd_stats.errors);
+  lua_setfield(L, -2, "errors");
+  lua_pushinteger(L, httpd_nconns);
+  lua_setfield(L, -2, "active");
+  lua_pushinteger(L, httpd_mem);
+  lua_setfield(L, -2, "memory");
+  lua_pushinteger(L, httpd_stats.peak);
+  lua_setfield(L, -2, "peak");
+  if (reset) {
+    memset(&httpd_stats, 0, sizeof(httpd_stats));
+    httpd_stats.peak = httpd_mem;
+  }
+  return 1;
+}
+
+#pragma mark - Tables
+
+LROT_BEGIN(httpd_req, NULL, LROT_MASK_INDEX)
+  LROT_FUNCENTRY( __index, httpd_req_index )
+LROT_END(httpd_req, NULL, LROT_MASK_INDEX)
+
+LROT_BEGIN(httpd_res, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, httpd_res_gc )
+  LROT_TABENTRY(  __index, httpd_res )
+  LROT_FUNCENTRY( send_header, httpd_res_send_header )
+  LROT_FUNCENTRY( send, httpd_res_send )
+  LROT_FUNCENTRY( finish, httpd_res_finish )
+LROT_END(httpd_res, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(httpd, NULL, 0)
+  LROT_FUNCENTRY( start, httpd_start )
+  LROT_FUNCENTRY( stop, httpd_stop )
+  LROT_FUNCENTRY( route, httpd_route_l )
+  LROT_FUNCENTRY( static, httpd_static_l )
+  LROT_FUNCENTRY( stats, httpd_stats_l )
+LROT_END(httpd, NULL, 0)
+
+int luaopen_httpd( lua_State *L ) {
+  luaL_rometatable(L, HTTPD_TABLE_REQ, LROT_TABLEREF(httpd_req));
+  luaL_rometatable(L, HTTPD_TABLE_RES, LROT_TABLEREF(httpd_res));
+  return 0;
+}
+
+NODEMCU_MODULE(HTTPD, "httpd", httpd, luaopen_httpd);
@@ -0,0 +1,239 @@
+// Module for counters, gauges and histograms, see app/platform/metrics.h
+//
+// The registry is a flat array of preallocated metrics, so updating a metric
+// from Lua, by id or by name, allocates nothing.  Snapshots are formatted as
+// compact text or JSON, for instance to publish over MQTT.
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "metrics.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(LUA_USE_MODULES_METRICS) && !defined(METRICS_ENABLE)
+#error Must have METRICS_ENABLE set for METRICS module
+#endif
+
+static int names_ref = LUA_NOREF;       /* name -> id, anchoring Lua names */
+
+/* Return the id of the metric given by id or name at index i */
+static int metrics_checkid(lua_State *L, int i) {
+  int id;
+  if (lua_type(L, i) != LUA_TSTRING) {
+    id = luaL_checkinteger(L, i);
+    luaL_argcheck(L, id >= 0 && id < metrics_count, i, "invalid metric");
+    return id;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, names_ref);
+  lua_pushvalue(L, i);
+  lua_rawget(L, -2);
+  if (lua_isnumber(L, -1)) {
+    id = lua_tointeger(L, -1);
+  } else {
+    id = metrics_find(lua_tostring(L, i));
+    luaL_argcheck(L, id >= 0, i, "unknown metric");
+    lua_pushvalue(L, i);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -4);
+  }
+  lua_pop(L, 2);
+  return id;
+}
+
+static int metrics_checktype(lua_State *L, int i, metric_type_t type) {
+  int id = metrics_checkid(L, i);
+  luaL_argcheck(L, metrics[id].type == type, i, "wrong metric type");
+  return id;
+}
+
+static int metrics_lregister(lua_State *L, metric_type_t type,
+                             const uint32_t *bounds, unsigned nbounds) {
+  int id;
+  luaL_checkstring(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, names_ref);
+  lua_pushvalue(L, 1);                  /* the table key anchors the name */
+  lua_rawget(L, -2);
+  if (lua_isnumber(L, -1)) {
+    id = lua_tointeger(L, -1);
+    if (metrics[id].type != type)
+      return luaL_error(L, "metric %s is of another type", lua_tostring(L, 1));
+  } else {
+    id = metrics_register(lua_tostring(L, 1), type, bounds, nbounds);
+    if (id < 0)
+      return luaL_error(L, "can't register %s", lua_tostring(L, 1));
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -4);
+  }
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+// Lua: id = metrics.counter(name)
+static int metrics_counter(lua_State *L) {
+  return metrics_lregister(L, METRIC_COUNTER, NULL, 0);
+}
+
+// Lua: id = metrics.gauge(name)
+static int metrics_gauge(lua_State *L) {
+  return metrics_lregister(L, METRIC_GAUGE, NULL, 0);
+}
+
+// Lua: id = metrics.histogram(name, {bound, ...})
+static int metrics_histogram(lua_State *L) {
+  uint32_t bounds[METRICS_BUCKETS_MAX];
+  unsigned i, n;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
+  luaL_argcheck(L, n > 0 && n <= METRICS_BUCKETS_MAX, 2, "1 to 16 bounds");
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    bounds[i] = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    luaL_argcheck(L, i == 0 || bounds[i] > bounds[i-1], 2, "bounds not ascending");
+  }
+  return metrics_lregister(L, METRIC_HISTOGRAM, bounds, n);
+}
+
+// Lua: metrics.inc(metric[, n])
+static int metrics_inc(lua_State *L) {
+  int id = metrics_checkid(L, 1);
+  luaL_argcheck(L, metrics[id].type != METRIC_HISTOGRAM, 1, "wrong metric type");
+  metrics[id].value += (uint32_t) luaL_optinteger(L, 2, 1);
+  return 0;
+}
+
+// Lua: metrics.set(metric, value)
+static int metrics_set(lua_State *L) {
+  int id = metrics_checktype(L, 1, METRIC_GAUGE);
+  metrics[id].value = (uint32_t) luaL_checkinteger(L, 2);
+  return 0;
+}
+
+// Lua: metrics.observe(metric, value)
+static int metrics_lobserve(lua_State *L) {
+  int id = metrics_checktype(L, 1, METRIC_HISTOGRAM);
+  lua_Integer v = luaL_checkinteger(L, 2);
+  metrics_observe(id, v < 0 ? 0 : v);
+  return 0;
+}
+
+// Lua: value = metrics.get(metric) or count, sum, {bucket, ...} for histograms
+static int metrics_get(lua_State *L) {
+  int id = metrics_checkid(L, 1);
+  metric_t *m = metrics + id;
+  unsigned b;
+  if (m->type == METRIC_GAUGE) {
+    lua_pushinteger(L, (int32_t) m->value);
+    return 1;
+  }
+  lua_pushinteger(L, metrics_read(id));
+  if (m->type == METRIC_COUNTER)
+    return 1;
+  lua_pushinteger(L, m->value);
+  lua_createtable(L, m->nbounds + 1, 0);
+  for (b = 0; b <= m->nbounds; b++) {
+    lua_pushinteger(L, metrics_buckets(m)[b]);
+    lua_rawseti(L, -2, b + 1);
+  }
+  return 3;
+}
+
+// Lua: metrics.reset([metric])
+static int metrics_lreset(lua_State *L) {
+  int id;
+  if (!lua_isnoneornil(L, 1)) {
+    metrics_reset(metrics_checkid(L, 1));
+    return 0;
+  }
+  for (id = 0; id < metrics_count; id++)
+    metrics_reset(id);
+  return 0;
+}
+
+/* Room for the longest format below, a histogram's JSON head with two %u */
+static void addf(luaL_Buffer *b, const char *fmt, ...) {
+  char s[48];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(s, sizeof(s), fmt, ap);
+  va_end(ap);
+  luaL_addstring(b, s);
+}
+
+/*
+ * Text is one line per metric: "name value" for counters and gauges, and
+ * "name count sum b1 .. bn+1" for histograms.  JSON is an object keyed by
+ * name, with histograms as {"count":,"sum":,"le":[bounds],"buckets":[]}.
+ */
+static void metrics_format(luaL_Buffer *b, int id, bool json) {
+  metric_t *m = metrics + id;
+  unsigned i;
+  if (json) {
+    luaL_addstring(b, id ? ",\"" : "{\"");
+    luaL_addstring(b, m->name);
+    luaL_addstring(b, "\":");
+  } else {
+    luaL_addstring(b, m->name);
+    luaL_addchar(b, ' ');
+  }
+  if (m->type == METRIC_GAUGE) {
+    addf(b, "%d", (int32_t) m->value);
+  } else if (m->type == METRIC_COUNTER) {
+    addf(b, "%u", metrics_read(id));
+  } else {
+    addf(b, json ? "{\"count\":%u,\"sum\":%u," : "%u %u", metrics_read(id), m->value);
+    if (json) {
+      for (i = 0; i < m->nbounds; i++)
+        addf(b, "%c%u", i ? ',' : '[', metrics_bounds(m)[i]);
+      luaL_addstring(b, "],\"buckets\":");
+    }
+    for (i = 0; i <= m->nbounds; i++)
+      addf(b, "%c%u", json ? (i ? ',' : '[') : ' ', metrics_buckets(m)[i]);
+    if (json)
+      luaL_addstring(b, "]}");
+  }
+  if (!json)
+    luaL_addchar(b, '\n');
+}
+
+// Lua: s = metrics.snapshot([format[, reset]])
+static int metrics_snapshot(lua_State *L) {
+  static const char * const formats[] = {"text", "json", NULL};
+  bool json = luaL_checkoption(L, 1, "text", formats);
+  bool reset = lua_toboolean(L, 2);
+  luaL_Buffer b;
+  int id;
+  luaL_buffinit(L, &b);
+  for (id = 0; id < metrics_count; id++) {
+    metrics_format(&b, id, json);
+    if (reset)
+      metrics_reset(id);
+  }
+  if (json)
+    luaL_addchar(&b, '}');
+  luaL_pushresult(&b);
+  return 1;
+}
+
+int luaopen_metrics(lua_State *L) {
+  lua_newtable(L);
+  names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+LROT_BEGIN(metrics, NULL, 0)
+  LROT_FUNCENTRY( counter, metrics_counter )
+  LROT_FUNCENTRY( gauge, metrics_gauge )
+  LROT_FUNCENTRY( histogram, metrics_histogram )
+  LROT_FUNCENTRY( inc, metrics_inc )
+  LROT_FUNCENTRY( set, metrics_set )
+  LROT_FUNCENTRY( observe, metrics_lobserve )
+  LROT_FUNCENTRY( get, metrics_get )
+  LROT_FUNCENTRY( reset, metrics_lreset )
+  LROT_FUNCENTRY( snapshot, metrics_snapshot )
+LROT_END(metrics, NULL, 0)
+
+NODEMCU_MODULE(METRICS, "metrics", metrics, luaopen_metrics);
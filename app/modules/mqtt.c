@@ -3,6 +3,7 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "metrics.h"
 
 #include <string.h>
 #include <stddef.h>
@@ -11,6 +12,7 @@
 #include "mem.h"
 #include "lwip/ip_addr.h"
 #include "espconn.h"
+#include "dnscache.h"
 
 #include "mqtt/mqtt_msg.h"
 #include "mqtt/msg_queue.h"
@@ -205,6 +207,7 @@ static void deliver_publish(lmqtt_userdata * mud, uint8_t* message, uint16_t len
   NODE_DBG("enter deliver_publish (len=%d, overflow=%d).\n", length, is_overflow);
   if(mud == NULL)
     return;
+  METRIC_INC(METRIC_MQTT_RECEIVED, 1);
   mqtt_event_data_t event_data;
 
   event_data.topic_length = length;
@@ -241,6 +244,7 @@ static void deliver_publish(lmqtt_userdata * mud, uint8_t* message, uint16_t len
 static void mqtt_connack_fail(lmqtt_userdata * mud, int reason_code)
 {
   NODE_DBG("enter mqtt_connack_fail\n");
+  METRIC_INC(METRIC_MQTT_CONNECT_FAILS, 1);
 
   if(mud->cb_connect_fail_ref == LUA_NOREF || mud->self_ref == LUA_NOREF)
   {
@@ -1131,7 +1135,7 @@ static int mqtt_socket_connect( lua_State* L )
   // timer started in socket_connect()
 
   ip_addr_t host_ip;
-  switch (dns_gethostbyname(domain, &host_ip, socket_dns_found, mud))
+  switch (dnscache_gethostbyname(domain, &host_ip, socket_dns_found, mud))
   {
     case ERR_OK:
       socket_dns_found(domain, &host_ip, mud);  // ip is returned in host_ip.
@@ -1507,6 +1511,7 @@ static int mqtt_socket_publish( lua_State* L )
   if(!node || espconn_status != ESPCONN_OK){
     lua_pushboolean(L, 0);
   } else {
+    METRIC_INC(METRIC_MQTT_PUBLISHED, 1);
     lua_pushboolean(L, 1);  // enqueued succeed.
   }
 
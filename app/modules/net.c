@@ -3,6 +3,9 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "trace.h"
+#include "metrics.h"
+#include "vfs.h"
 #include "lmem.h"
 
 #include <string.h>
@@ -15,8 +18,10 @@
 #include "lwip/err.h"
 #include "lwip/ip_addr.h"
 #include "lwip/dns.h"
+#include "dnscache.h"
 #include "lwip/igmp.h"
 #include "lwip/tcp.h"
+#include "lwip/tcp_impl.h"
 #include "lwip/udp.h"
 #include "lwip/dhcp.h"
 
@@ -42,6 +47,81 @@ static const net_table_name NET_TABLES[] = {
 #define TYPE_TCP TYPE_TCP_CLIENT
 #define TYPE_UDP TYPE_UDP_SOCKET
 
+typedef enum net_await {
+  AWAIT_NONE = 0,
+  AWAIT_CONNECTION,
+  AWAIT_RECEIVE,
+  AWAIT_SENT,
+  AWAIT_DRAIN
+} net_await;
+
+/* Default send queue watermarks, see net_sendq */
+#define NET_SEND_HIGH (4 * TCP_MSS)
+#define NET_SEND_LOW  TCP_MSS
+
+/*
+ * Data which doesn't fit in the PCB's send buffer waits in a FIFO table of
+ * strings, and is fed to tcp_write() from net_sent_cb() as acks free up
+ * space.  send() returns false once the queue reaches the high watermark,
+ * and "drain" fires when it is back down to the low one.
+ */
+typedef struct net_sendq {
+  int fifo_ref;
+  int head, tail;
+  uint32_t offset;              /* bytes of the head string already written */
+  uint32_t bytes;               /* bytes waiting, excluding those */
+  uint16_t high, low;
+  uint8_t drain;                /* send() has returned false */
+  uint8_t closing;              /* close() waits for the queue to empty */
+} net_sendq;
+
+/*
+ * A socket:sendfile() in progress.  It has an entry of true in the send
+ * queue, and when that reaches the head the file is read a segment at a
+ * time into buf and written to the PCB.  The callback fires once the last
+ * byte has been acked.
+ */
+typedef struct net_sendfile {
+  int fd;                       /* opened from a path, else 0 */
+  int file_ref;                 /* or the file object being read */
+  int *fdp;                     /* the fd to read, 0 if closed under us */
+  int cb_ref;
+  uint32_t remaining;           /* bytes still to be written */
+  uint32_t sent;                /* bytes written */
+  uint32_t end;                 /* sequence number after the last byte */
+  uint16_t held, off;           /* bytes read into buf, and those written */
+  bool done;
+  char buf[TCP_MSS];
+} net_sendfile;
+
+/* Default buffer space per datagram of a UDP batch */
+#define NET_BATCH_DGRAM_BYTES 128
+
+/*
+ * A UDP socket in batch mode copies each datagram into its batch as it
+ * arrives, freeing the pbuf at once, and a task then hands the whole batch
+ * to Lua in one callback.  Datagrams which don't fit are dropped.
+ */
+typedef struct net_dgram {
+  ip_addr_t addr;
+  uint16_t port, len;
+} net_dgram;
+
+typedef struct net_batch {
+  struct lnet_userdata *ud;
+  struct net_batch *next;       /* the next batch awaiting delivery */
+  uint32_t dropped;
+  uint16_t size, count;         /* datagrams */
+  uint16_t bytes, used;         /* buffer space */
+  bool pending;                 /* on the delivery list */
+  net_dgram dgram[];            /* followed by the buffer */
+} net_batch;
+#define net_batch_buf(b) ((char *)((b)->dgram + (b)->size))
+
+static net_batch *net_batch_pending;
+static platform_task_handle_t net_batch_task;
+static bool net_batch_posted;
+
 typedef struct lnet_userdata {
   enum net_type type;
   int self_ref;
@@ -60,8 +140,15 @@ typedef struct lnet_userdata {
       int cb_dns_ref;
       int cb_receive_ref;
       int cb_sent_ref;
+      int await_ref;
+      int await_event;
+      // Only for UDP:
+      net_batch *batch;
       // Only for TCP:
       int hold;
+      net_sendq sendq;
+      net_sendfile *sendfile;
+      int cb_drain_ref;
       int cb_connect_ref;
       int cb_disconnect_ref;
       int cb_reconnect_ref;
@@ -112,12 +199,23 @@ lnet_userdata *net_create( lua_State *L, enum net_type type ) {
       ud->client.cb_reconnect_ref = LUA_NOREF;
       ud->client.cb_disconnect_ref = LUA_NOREF;
       ud->client.hold = 0;
+      ud->client.sendq.fifo_ref = LUA_NOREF;
+      ud->client.sendq.head = ud->client.sendq.tail = 1;
+      ud->client.sendq.offset = ud->client.sendq.bytes = 0;
+      ud->client.sendq.high = NET_SEND_HIGH;
+      ud->client.sendq.low = NET_SEND_LOW;
+      ud->client.sendq.drain = ud->client.sendq.closing = 0;
+      ud->client.sendfile = NULL;
+      ud->client.cb_drain_ref = LUA_NOREF;
       /* FALLTHROUGH */
     case TYPE_UDP_SOCKET:
       ud->client.wait_dns = 0;
       ud->client.cb_dns_ref = LUA_NOREF;
       ud->client.cb_receive_ref = LUA_NOREF;
       ud->client.cb_sent_ref = LUA_NOREF;
+      ud->client.await_ref = LUA_NOREF;
+      ud->client.await_event = AWAIT_NONE;
+      ud->client.batch = NULL;
       break;
     case TYPE_TCP_SERVER:
       ud->server.cb_accept_ref = LUA_NOREF;
@@ -126,13 +224,255 @@ lnet_userdata *net_create( lua_State *L, enum net_type type ) {
   return ud;
 }
 
+#pragma mark - Send queue
+
+/* Close a client's PCB, or abort it if that fails, returning ERR_ABRT */
+static err_t net_tcp_close(lnet_userdata *ud) {
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  err_t err = ERR_OK;
+  if (ERR_OK != tcp_close(pcb)) {
+    tcp_arg(pcb, NULL);
+    tcp_abort(pcb);
+    err = ERR_ABRT;
+  }
+  ud->tcp_pcb = NULL;
+  return err;
+}
+
+/*
+ * Write as much of the len bytes at data as the send buffer has room for,
+ * returning the number of bytes written.  *err is ERR_MEM if the send buffer
+ * is full.
+ */
+static size_t net_tcp_write(lnet_userdata *ud, const char *data, size_t len,
+                            bool more, err_t *err) {
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  size_t n = tcp_sndbuf(pcb);
+  u8_t flags = more ? TCP_WRITE_FLAG_MORE : 0;
+  if (len == 0) {
+    *err = ERR_OK;
+    return 0;
+  }
+  if (n == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN) {
+    *err = ERR_MEM;
+    return 0;
+  }
+  if (n < len)
+    flags |= TCP_WRITE_FLAG_MORE;
+  else
+    n = len;
+  *err = tcp_write(pcb, data, n, flags | TCP_WRITE_FLAG_COPY);
+  return *err == ERR_OK ? n : 0;
+}
+
+static void net_sendfile_free(lua_State *L, lnet_userdata *ud) {
+  net_sendfile *sf = ud->client.sendfile;
+  if (!sf)
+    return;
+  if (sf->fd)
+    vfs_close(sf->fd);
+  luaL_unref(L, LUA_REGISTRYINDEX, sf->file_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, sf->cb_ref);
+  free(sf);
+  ud->client.sendfile = NULL;
+}
+
+/*
+ * Write file data while the send buffer has room.  Returns true once all of
+ * it has been written, or reading has failed.
+ */
+static bool net_sendfile_pump(lnet_userdata *ud, bool more) {
+  net_sendfile *sf = ud->client.sendfile;
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  while (sf->remaining) {
+    size_t n = tcp_sndbuf(pcb);
+    if (n == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN)
+      return false;
+    if (sf->held == 0) {
+      int32_t got = *sf->fdp ?
+        vfs_read(*sf->fdp, sf->buf, LWIP_MIN(sizeof(sf->buf), sf->remaining)) : 0;
+      if (got <= 0)
+        break;
+      sf->held = got;
+    }
+    if (n > sf->held - sf->off)
+      n = sf->held - sf->off;
+    u8_t flags = TCP_WRITE_FLAG_COPY;
+    if (more || n < sf->remaining)
+      flags |= TCP_WRITE_FLAG_MORE;
+    if (tcp_write(pcb, sf->buf + sf->off, n, flags) != ERR_OK)
+      return false;
+    sf->off += n;
+    sf->sent += n;
+    sf->remaining -= n;
+    if (sf->off == sf->held)
+      sf->off = sf->held = 0;
+  }
+  sf->remaining = 0;
+  sf->end = pcb->snd_lbb;
+  sf->done = true;
+  return true;
+}
+
+/* Queue the string at idx, of which offset bytes have already been written */
+static void net_sendq_push(lua_State *L, lnet_userdata *ud, int idx, size_t offset) {
+  net_sendq *q = &ud->client.sendq;
+  if (q->fifo_ref == LUA_NOREF) {
+    lua_newtable(L);
+    q->fifo_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->fifo_ref);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, q->tail);
+  lua_pop(L, 1);
+  if (q->head == q->tail++)
+    q->offset = offset;
+  q->bytes += lua_objlen(L, idx) - offset;
+}
+
+/* Feed queued data to the PCB as far as its send buffer allows */
+static void net_sendq_pump(lua_State *L, lnet_userdata *ud) {
+  net_sendq *q = &ud->client.sendq;
+  err_t err;
+  if (q->head == q->tail)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->fifo_ref);
+  int t = lua_gettop(L);
+  while (q->head < q->tail) {
+    size_t len, n;
+    lua_rawgeti(L, t, q->head);
+    if (lua_isboolean(L, t + 1)) {
+      lua_pop(L, 1);
+      if (!net_sendfile_pump(ud, q->head + 1 < q->tail))
+        break;
+      lua_pushnil(L);
+      lua_rawseti(L, t, q->head++);
+      continue;
+    }
+    const char *data = lua_tolstring(L, t + 1, &len);
+    n = net_tcp_write(ud, data + q->offset, len - q->offset,
+                      q->head + 1 < q->tail, &err);
+    lua_pop(L, 1);
+    q->offset += n;
+    q->bytes -= n;
+    if (q->offset < len)
+      break;
+    lua_pushnil(L);
+    lua_rawseti(L, t, q->head++);
+    q->offset = 0;
+  }
+  if (q->head == q->tail)
+    q->head = q->tail = 1;
+  lua_pop(L, 1);
+}
+
+/*
+ * Drop the queued data, when the connection has gone.  If notify, a
+ * sendfile() still waiting for its ack has its callback called with the
+ * bytes written and "closed".
+ */
+static void net_sendq_clear(lua_State *L, lnet_userdata *ud, bool notify) {
+  net_sendq *q = &ud->client.sendq;
+  net_sendfile *sf = ud->client.sendfile;
+  notify = notify && sf && ud->self_ref != LUA_NOREF;
+  if (notify) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sf->cb_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_pushinteger(L, sf->sent);
+    lua_pushliteral(L, "closed");
+  }
+  net_sendfile_free(L, ud);
+  luaL_unref(L, LUA_REGISTRYINDEX, q->fifo_ref);
+  q->fifo_ref = LUA_NOREF;
+  q->head = q->tail = 1;
+  q->offset = q->bytes = 0;
+  q->drain = q->closing = 0;
+  if (!notify)
+    return;
+  if (lua_isfunction(L, -4))
+    lua_call(L, 3, 0);
+  else
+    lua_pop(L, 4);
+}
+
+#pragma mark - UDP batches
+
+static void net_batch_free(lnet_userdata *ud) {
+  net_batch *b = ud->client.batch, **pp;
+  if (!b)
+    return;
+  for (pp = &net_batch_pending; *pp; pp = &(*pp)->next)
+    if (*pp == b) {
+      *pp = b->next;
+      break;
+    }
+  free(b);
+  ud->client.batch = NULL;
+}
+
+static void net_batch_add(lnet_userdata *ud, struct pbuf *p, ip_addr_t *addr, u16_t port) {
+  net_batch *b = ud->client.batch;
+  if (b->count == b->size || p->tot_len > b->bytes - b->used) {
+    b->dropped++;
+    METRIC_INC(METRIC_NET_UDP_RX_DROPS, 1);
+  } else {
+    net_dgram *d = b->dgram + b->count++;
+    d->addr = *addr;
+    d->port = port;
+    d->len = pbuf_copy_partial(p, net_batch_buf(b) + b->used, p->tot_len, 0);
+    b->used += d->len;
+    if (!b->pending) {
+      b->pending = true;
+      b->next = net_batch_pending;
+      net_batch_pending = b;
+    }
+  }
+  pbuf_free(p);
+  if (net_batch_pending && !net_batch_posted)
+    net_batch_posted = platform_post_low(net_batch_task, 0);
+}
+
+/* Push the batch's data, ports and IPs as three arrays, and empty it */
+static void net_batch_push(lua_State *L, net_batch *b) {
+  const char *data = net_batch_buf(b);
+  char iptmp[16];
+  int i;
+  lua_createtable(L, b->count, 0);
+  lua_createtable(L, b->count, 0);
+  lua_createtable(L, b->count, 0);
+  for (i = 0; i < b->count; i++) {
+    net_dgram *d = b->dgram + i;
+    lua_pushlstring(L, data, d->len);
+    lua_rawseti(L, -4, i + 1);
+    lua_pushinteger(L, d->port);
+    lua_rawseti(L, -3, i + 1);
+    ets_sprintf(iptmp, IPSTR, IP2STR(&d->addr.addr));
+    lua_pushstring(L, iptmp);
+    lua_rawseti(L, -2, i + 1);
+    data += d->len;
+  }
+  b->count = b->used = 0;
+}
+
 #pragma mark - LWIP callbacks
 
+/* Resume the coroutine blocked in socket:wait() with the narg values at ToS */
+static void net_await_resume(lua_State *L, lnet_userdata *ud, int narg) {
+  int ref = ud->client.await_ref;
+  ud->client.await_ref = LUA_NOREF;
+  ud->client.await_event = AWAIT_NONE;
+  luaL_awaitresume(L, ref, narg);
+}
+
 static void net_err_cb(void *arg, err_t err) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return;
+  TRACE_INSTANT(TRACE_NET_ERROR, ud, err);
+  if (err != ERR_OK)
+    METRIC_INC(METRIC_NET_ERRORS, 1);
   ud->pcb = NULL; // Will be freed at LWIP level
   lua_State *L = lua_getstate();
+  net_sendq_clear(L, ud, true);
   int ref;
   if (err != ERR_OK && ud->client.cb_reconnect_ref != LUA_NOREF)
     ref = ud->client.cb_reconnect_ref;
@@ -143,6 +483,11 @@ static void net_err_cb(void *arg, err_t err) {
     lua_pushinteger(L, err);
     lua_call(L, 2, 0);
   }
+  if (ud->client.await_event != AWAIT_NONE) {
+    lua_pushnil(L);
+    lua_pushinteger(L, err);
+    net_await_resume(L, ud, 2);
+  }
   if (ud->client.wait_dns == 0) {
     int selfref = ud->self_ref;
     ud->self_ref = LUA_NOREF;
@@ -157,8 +502,13 @@ static err_t net_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
     net_err_cb(arg, err);
     return ERR_ABRT;
   }
+  TRACE_INSTANT(TRACE_NET_CONNECT, ud, err);
+  METRIC_INC(METRIC_NET_CONNECTS, 1);
   lua_State *L = lua_getstate();
-  if (ud->self_ref != LUA_NOREF && ud->client.cb_connect_ref != LUA_NOREF) {
+  if (ud->client.await_event == AWAIT_CONNECTION) {
+    lua_pushboolean(L, 1);
+    net_await_resume(L, ud, 1);
+  } else if (ud->self_ref != LUA_NOREF && ud->client.cb_connect_ref != LUA_NOREF) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
     lua_call(L, 1, 0);
@@ -172,6 +522,7 @@ static void net_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
   else addr.addr = 0xFFFFFFFF;
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud) return;
+  TRACE_INSTANT(TRACE_NET_DNS, ud, addr.addr);
   lua_State *L = lua_getstate();
   if (ud->self_ref != LUA_NOREF && ud->client.cb_dns_ref != LUA_NOREF) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
@@ -197,6 +548,28 @@ static void net_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
 }
 
 static void net_recv_cb(lnet_userdata *ud, struct pbuf *p, ip_addr_t *addr, u16_t port) {
+  TRACE_INSTANT(TRACE_NET_RECV, ud, p->tot_len);
+  if (ud->client.await_event == AWAIT_RECEIVE) {
+    /* a waiting coroutine gets the whole pbuf chain as one string */
+    lua_State *L = lua_getstate();
+    luaL_Buffer b;
+    struct pbuf *pp;
+    luaL_buffinit(L, &b);
+    for (pp = p; pp; pp = pp->next)
+      luaL_addlstring(&b, pp->payload, pp->len);
+    luaL_pushresult(&b);
+    pbuf_free(p);
+    if (ud->type == TYPE_UDP_SOCKET) {
+      char iptmp[16] = { 0, };
+      ets_sprintf(iptmp, IPSTR, IP2STR(&addr->addr));
+      lua_pushinteger(L, port);
+      lua_pushstring(L, iptmp);
+      net_await_resume(L, ud, 3);
+    } else {
+      net_await_resume(L, ud, 1);
+    }
+    return;
+  }
   if (ud->client.cb_receive_ref == LUA_NOREF) {
     pbuf_free(p);
     return;
@@ -233,7 +606,35 @@ static void net_udp_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_a
     if (p) pbuf_free(p);
     return;
   }
-  net_recv_cb(ud, p, addr, port);
+  METRIC_INC(METRIC_NET_UDP_RX_BYTES, p->tot_len);
+  if (ud->client.batch)
+    net_batch_add(ud, p, addr, port);
+  else
+    net_recv_cb(ud, p, addr, port);
+}
+
+/* Task: deliver the pending UDP batches */
+static void net_batch_deliver(platform_task_param_t param, uint8_t prio) {
+  lua_State *L = lua_getstate();
+  UNUSED(param); UNUSED(prio);
+  net_batch_posted = false;
+  while (net_batch_pending) {
+    net_batch *b = net_batch_pending;
+    lnet_userdata *ud = b->ud;
+    net_batch_pending = b->next;
+    b->pending = false;
+    if (ud->client.await_event == AWAIT_RECEIVE) {
+      net_batch_push(L, b);
+      net_await_resume(L, ud, 3);
+    } else if (ud->client.cb_receive_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+      net_batch_push(L, b);
+      luaL_pcallx(L, 4, 0);
+    } else {
+      b->count = b->used = 0;
+    }
+  }
 }
 
 static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
@@ -241,19 +642,96 @@ static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
   if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF)
     return ERR_ABRT;
   if (!p) {
+    err_t cerr = net_tcp_close(ud);
     net_err_cb(arg, err);
-    return tcp_close(tpcb);
+    return cerr;
   }
+  METRIC_INC(METRIC_NET_TCP_RX_BYTES, p->tot_len);
   net_recv_cb(ud, p, 0, 0);
   tcp_recved(tpcb, ud->client.hold ? 0 : TCP_WND);
   return ERR_OK;
 }
 
+/* Call the sendfile callback once the file has been acked; true if called */
+static bool net_sendfile_check(lua_State *L, lnet_userdata *ud) {
+  net_sendfile *sf = ud->client.sendfile;
+  if (!sf || !sf->done || TCP_SEQ_GT(sf->end, ud->tcp_pcb->lastack))
+    return false;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sf->cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+  lua_pushinteger(L, sf->sent);
+  net_sendfile_free(L, ud);
+  if (lua_isfunction(L, -3))
+    lua_call(L, 2, 0);
+  else
+    lua_pop(L, 3);
+  return true;
+}
+
+/* Close the PCB, returning ERR_ABRT if a TCP PCB had to be aborted */
+static err_t net_shut(lua_State *L, lnet_userdata *ud) {
+  err_t err = ERR_OK;
+  switch (ud->type) {
+    case TYPE_TCP_CLIENT:
+      err = net_tcp_close(ud);
+      net_sendq_clear(L, ud, true);
+      break;
+    case TYPE_TCP_SERVER:
+      tcp_close(ud->tcp_pcb);
+      ud->tcp_pcb = NULL;
+      break;
+    case TYPE_UDP_SOCKET:
+      udp_remove(ud->udp_pcb);
+      ud->udp_pcb = NULL;
+      net_batch_free(ud);
+      break;
+  }
+  if (ud->type != TYPE_TCP_SERVER && ud->client.await_event != AWAIT_NONE) {
+    lua_pushnil(L);
+    net_await_resume(L, ud, 1);
+  }
+  if (ud->type == TYPE_TCP_SERVER ||
+     (ud->pcb == NULL && ud->client.wait_dns == 0)) {
+
+    int selfref = ud->self_ref;
+    ud->self_ref = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, selfref);
+  }
+  return err;
+}
+
 static err_t net_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return ERR_ABRT;
-  if (ud->client.cb_sent_ref == LUA_NOREF) return ERR_OK;
+  TRACE_INSTANT(TRACE_NET_SENT, ud, len);
+  METRIC_INC(METRIC_NET_TCP_TX_BYTES, len);
   lua_State *L = lua_getstate();
+  net_sendq *q = &ud->client.sendq;
+  net_sendq_pump(L, ud);
+  if (net_sendfile_check(L, ud) && (!ud->pcb || ud->self_ref == LUA_NOREF))
+    return ERR_OK;
+  /* a close waits for any file to be acked too, so its callback is called */
+  if (q->closing && q->head == q->tail && !ud->client.sendfile)
+    return net_shut(L, ud);
+  if (q->drain && q->bytes <= q->low) {
+    q->drain = 0;
+    if (ud->client.await_event == AWAIT_DRAIN) {
+      lua_pushboolean(L, 1);
+      net_await_resume(L, ud, 1);
+    } else if (ud->client.cb_drain_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_drain_ref);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+      lua_call(L, 1, 0);
+    }
+    if (!ud->pcb || ud->self_ref == LUA_NOREF)
+      return ERR_OK;
+  }
+  if (ud->client.await_event == AWAIT_SENT) {
+    lua_pushboolean(L, 1);
+    net_await_resume(L, ud, 1);
+    return ERR_OK;
+  }
+  if (ud->client.cb_sent_ref == LUA_NOREF) return ERR_OK;
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
   lua_call(L, 1, 0);
@@ -264,6 +742,8 @@ static err_t net_accept_cb(void *arg, struct tcp_pcb *newpcb, err_t err) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || ud->type != TYPE_TCP_SERVER || !ud->pcb) return ERR_ABRT;
   if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF) return ERR_ABRT;
+  TRACE_INSTANT(TRACE_NET_ACCEPT, ud, 0);
+  METRIC_INC(METRIC_NET_ACCEPTS, 1);
 
   lua_State *L = lua_getstate();
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
@@ -444,7 +924,7 @@ int net_connect( lua_State *L ) {
     lua_pushvalue(L, 1);
     ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
-  err_t err = dns_gethostbyname(domain, &addr, net_dns_cb, ud);
+  err_t err = dnscache_gethostbyname(domain, &addr, net_dns_cb, ud);
   if (err == ERR_OK) {
     net_dns_cb(domain, &addr, ud);
   } else if (err != ERR_INPROGRESS) {
@@ -476,6 +956,8 @@ int net_on( lua_State *L ) {
         { refptr = &ud->client.cb_disconnect_ref; break; }
       if (strcmp("reconnection",name)==0)
         { refptr = &ud->client.cb_reconnect_ref; break; }
+      if (strcmp("drain",name)==0)
+        { refptr = &ud->client.cb_drain_ref; break; }
     case TYPE_UDP_SOCKET:
       if (strcmp("dns",name)==0)
         { refptr = &ud->client.cb_dns_ref; break; }
@@ -501,16 +983,88 @@ int net_on( lua_State *L ) {
   return 0;
 }
 
-// Lua: client:send(data, function(c)), socket:send(port, ip, data, function(s))
+/*
+ * Push the data to send from the arguments first..last, as strings, draining
+ * pipes of up to room bytes.  Returns the total length.
+ */
+static size_t net_push_data(lua_State *L, int first, int last, size_t room) {
+  size_t total = 0, len;
+  int i;
+  for (i = first; i <= last; i++) {
+    luaL_checkstack(L, 2, "too many strings");
+    if (lua_istable(L, i)) {
+      /* a pipe, read in segment sized chunks */
+      while (total < room) {
+        lua_getfield(L, i, "read");
+        luaL_argcheck(L, lua_isfunction(L, -1), i, "not a pipe");
+        lua_pushvalue(L, i);
+        lua_pushinteger(L, room - total < TCP_MSS ? room - total : TCP_MSS);
+        lua_call(L, 2, 1);
+        if (!lua_isstring(L, -1)) {
+          lua_pop(L, 1);
+          break;
+        }
+        total += lua_objlen(L, -1);
+        luaL_checkstack(L, 2, "too many strings");
+      }
+    } else {
+      luaL_checklstring(L, i, &len);
+      lua_pushvalue(L, i);
+      total += len;
+    }
+  }
+  return total;
+}
+
+/* Queue the strings from index first to the top of the stack */
+static err_t net_tcp_send(lua_State *L, lnet_userdata *ud, int first) {
+  net_sendq *q = &ud->client.sendq;
+  int i, top = lua_gettop(L);
+  for (i = first; i <= top; i++) {
+    size_t len, n = 0;
+    const char *data = lua_tolstring(L, i, &len);
+    if (q->head == q->tail) {
+      err_t err;
+      n = net_tcp_write(ud, data, len, i < top, &err);
+      if (err != ERR_OK && err != ERR_MEM)
+        return err;
+    }
+    if (n < len)
+      net_sendq_push(L, ud, i, n);
+  }
+  return ERR_OK;
+}
+
+/* Bind an unbound UDP socket to an ephemeral port, so that it can send */
+static void net_udp_bind_any(lua_State *L, lnet_userdata *ud) {
+  if (ud->pcb)
+    return;
+  ud->udp_pcb = udp_new();
+  if (!ud->udp_pcb)
+    luaL_error(L, "cannot allocate PCB");
+  udp_recv(ud->udp_pcb, net_udp_recv_cb, ud);
+  ip_addr_t laddr = {0};
+  err_t err = udp_bind(ud->udp_pcb, &laddr, 0);
+  if (err != ERR_OK) {
+    udp_remove(ud->udp_pcb);
+    ud->udp_pcb = NULL;
+    lwip_lua_checkerr(L, err);
+  }
+  if (ud->self_ref == LUA_NOREF) {
+    lua_pushvalue(L, 1);
+    ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+}
+
+// Lua: client:send(data[, ...][, function(c)]), socket:send(port, ip, data[, ...][, function(s)])
 int net_send( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
   if (!ud || ud->type == TYPE_TCP_SERVER)
     return luaL_error(L, "invalid user data");
   ip_addr_t addr;
   uint16_t port;
-  const char *data;
   size_t datalen = 0;
-  int stack = 2;
+  int stack = 2, last = lua_gettop(L), first;
   if (ud->type == TYPE_UDP_SOCKET) {
     size_t dl = 0;
     port = luaL_checkinteger(L, stack++);
@@ -519,30 +1073,33 @@ int net_send( lua_State *L ) {
     if (!domain) return luaL_error(L, "need IP address");
     if (!ipaddr_aton(domain, &addr)) return luaL_error(L, "invalid IP address");
   }
-  data = luaL_checklstring(L, stack++, &datalen);
-  if (!data || datalen == 0) return luaL_error(L, "no data to send");
-  if (lua_isfunction(L, stack)) {
-    lua_pushvalue(L, stack++);
+  if (ud->type == TYPE_TCP_CLIENT) {
+    /* before reading any pipe, which would be left drained */
+    if (!ud->pcb || ud->self_ref == LUA_NOREF)
+      return luaL_error(L, "not connected");
+    if (ud->client.sendq.closing)
+      return luaL_error(L, "closing");
+  }
+  while (last > stack && lua_isnil(L, last))
+    last--;
+  int cb = last > stack && lua_isfunction(L, last) ? last-- : 0;
+  first = lua_gettop(L) + 1;
+  if (ud->type == TYPE_UDP_SOCKET) {
+    datalen = net_push_data(L, stack, last, 0xFFFF);
+  } else {
+    /* pipes are read up to the high watermark, beyond the send buffer */
+    net_sendq *q = &ud->client.sendq;
+    size_t room = q->bytes < q->high ? q->high - q->bytes : 0;
+    datalen = net_push_data(L, stack, last, tcp_sndbuf(ud->tcp_pcb) + room);
+  }
+  if (datalen == 0) return luaL_error(L, "no data to send");
+  if (cb) {
+    lua_pushvalue(L, cb);
     luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
     ud->client.cb_sent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
-  if (ud->type == TYPE_UDP_SOCKET && !ud->pcb) {
-    ud->udp_pcb = udp_new();
-    if (!ud->udp_pcb)
-      return luaL_error(L, "cannot allocate PCB");
-    udp_recv(ud->udp_pcb, net_udp_recv_cb, ud);
-    ip_addr_t laddr = {0};
-    err_t err = udp_bind(ud->udp_pcb, &laddr, 0);
-    if (err != ERR_OK) {
-      udp_remove(ud->udp_pcb);
-      ud->udp_pcb = NULL;
-      return lwip_lua_checkerr(L, err);
-    }
-    if (ud->self_ref == LUA_NOREF) {
-      lua_pushvalue(L, 1);
-      ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    }
-  }
+  if (ud->type == TYPE_UDP_SOCKET)
+    net_udp_bind_any(L, ud);
   if (!ud->pcb || ud->self_ref == LUA_NOREF)
     return luaL_error(L, "not connected");
   err_t err;
@@ -550,20 +1107,230 @@ int net_send( lua_State *L ) {
     struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT, datalen, PBUF_RAM);
     if (!pb)
       return luaL_error(L, "cannot allocate message buffer");
-    pbuf_take(pb, data, datalen);
+    char *payload = pb->payload;
+    for (; first <= lua_gettop(L); first++) {
+      size_t len;
+      const char *data = lua_tolstring(L, first, &len);
+      memcpy(payload, data, len);
+      payload += len;
+    }
     err = udp_sendto(ud->udp_pcb, pb, &addr, port);
     pbuf_free(pb);
+    if (err == ERR_OK)
+      METRIC_INC(METRIC_NET_UDP_TX_BYTES, datalen);
     if (ud->client.cb_sent_ref != LUA_NOREF) {
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
       lua_call(L, 1, 0);
     }
   } else if (ud->type == TYPE_TCP_CLIENT) {
-    err = tcp_write(ud->tcp_pcb, data, datalen, TCP_WRITE_FLAG_COPY);
+    net_sendq *q = &ud->client.sendq;
+    lwip_lua_checkerr(L, net_tcp_send(L, ud, first));
+    if (q->bytes >= q->high)
+      q->drain = 1;
+    lua_pushboolean(L, !q->drain);
+    return 1;
   }
   return lwip_lua_checkerr(L, err);
 }
 
+/* Check a sendmany() entry {port, ip, data}, leaving them on the stack */
+static void net_checkdgram(lua_State *L, int i, ip_addr_t *addr, uint16_t *port) {
+  lua_rawgeti(L, 2, i);
+  if (!lua_istable(L, -1))
+    luaL_error(L, "datagram %d: not a table", i);
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 2);
+  lua_rawgeti(L, -3, 3);
+  *port = lua_tointeger(L, -3);
+  if (*port == 0)
+    luaL_error(L, "datagram %d: need port", i);
+  if (!lua_isstring(L, -2) || !ipaddr_aton(lua_tostring(L, -2), addr))
+    luaL_error(L, "datagram %d: invalid IP address", i);
+  if (!lua_isstring(L, -1))
+    luaL_error(L, "datagram %d: need data", i);
+}
+
+// Lua: n = socket:sendmany({{port, ip, data}, ...}[, function(s)])
+int net_sendmany( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_UDP_SOCKET)
+    return luaL_error(L, "invalid user data");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int i, n = lua_objlen(L, 2), sent = 0, top = lua_gettop(L);
+  size_t bytes = 0;
+  ip_addr_t addr;
+  uint16_t port;
+  err_t err = ERR_OK;
+  /* check everything before sending anything */
+  for (i = 1; i <= n; i++) {
+    net_checkdgram(L, i, &addr, &port);
+    lua_settop(L, top);
+  }
+  if (lua_isfunction(L, 3)) {
+    lua_pushvalue(L, 3);
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+    ud->client.cb_sent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  net_udp_bind_any(L, ud);
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  for (i = 1; i <= n && err == ERR_OK; i++) {
+    size_t len;
+    const char *data;
+    struct pbuf *pb;
+    net_checkdgram(L, i, &addr, &port);
+    data = lua_tolstring(L, -1, &len);
+    pb = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (!pb) {
+      err = ERR_MEM;
+    } else {
+      memcpy(pb->payload, data, len);
+      err = udp_sendto(ud->udp_pcb, pb, &addr, port);
+      pbuf_free(pb);
+    }
+    if (err == ERR_OK) {
+      sent++;
+      bytes += len;
+    }
+    lua_settop(L, top);
+  }
+  METRIC_INC(METRIC_NET_UDP_TX_BYTES, bytes);
+  if (sent && ud->client.cb_sent_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_call(L, 1, 0);
+  }
+  lua_pushinteger(L, sent);
+  return 1;
+}
+
+// Lua: size, dropped = socket:batch([size[, bytes]])
+int net_batch_l( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_UDP_SOCKET)
+    return luaL_error(L, "invalid user data");
+  net_batch *b = ud->client.batch;
+  if (!lua_isnoneornil(L, 2)) {
+    int size = luaL_checkinteger(L, 2);
+    int bytes = luaL_optinteger(L, 3, size * NET_BATCH_DGRAM_BYTES);
+    luaL_argcheck(L, size >= 0 && size <= 0xFFFF, 2, "out of range");
+    luaL_argcheck(L, size == 0 || (bytes > 0 && bytes <= 0xFFFF), 3, "out of range");
+    net_batch_free(ud);
+    if (size > 0) {
+      b = malloc(sizeof(net_batch) + size * sizeof(net_dgram) + bytes);
+      if (!b)
+        return luaL_error(L, "out of memory");
+      b->ud = ud;
+      b->next = NULL;
+      b->dropped = 0;
+      b->size = size;
+      b->bytes = bytes;
+      b->count = b->used = 0;
+      b->pending = false;
+      ud->client.batch = b;
+    }
+    b = ud->client.batch;
+  }
+  lua_pushinteger(L, b ? b->size : 0);
+  lua_pushinteger(L, b ? b->dropped : 0);
+  return 2;
+}
+
+// Lua: client:sendfile(path|file[, offset[, len]][, function(c, sent)])
+int net_sendfile_l( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  if (ud->client.sendfile)
+    return luaL_error(L, "sendfile in progress");
+  if (ud->client.sendq.closing)
+    return luaL_error(L, "closing");
+  int top = lua_gettop(L);
+  int cb = lua_isfunction(L, top) ? top-- : 0;
+  net_sendfile *sf = (net_sendfile *) malloc(sizeof(net_sendfile));
+  if (!sf)
+    return luaL_error(L, "out of memory");
+  memset(sf, 0, sizeof(net_sendfile));
+  sf->file_ref = sf->cb_ref = LUA_NOREF;
+  ud->client.sendfile = sf;             /* so that errors free it */
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    sf->fd = vfs_open(lua_tostring(L, 2), "r");
+    if (!sf->fd) {
+      net_sendfile_free(L, ud);
+      return luaL_error(L, "cannot open %s", lua_tostring(L, 2));
+    }
+    sf->fdp = &sf->fd;
+  } else {
+    int *fdp = (int *) luaL_checkudata(L, 2, "file.obj");   /* file_fd_ud */
+    if (!*fdp) {
+      net_sendfile_free(L, ud);
+      return luaL_argerror(L, 2, "file is closed");
+    }
+    lua_pushvalue(L, 2);
+    sf->file_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    sf->fdp = fdp;
+  }
+  int32_t size = vfs_size(*sf->fdp);
+  int32_t offset = top >= 3 && !lua_isnil(L, 3) ?
+                   luaL_checkinteger(L, 3) : vfs_tell(*sf->fdp);
+  if (offset < 0 || offset > size || vfs_lseek(*sf->fdp, offset, VFS_SEEK_SET) < 0) {
+    net_sendfile_free(L, ud);
+    return luaL_argerror(L, 3, "invalid offset");
+  }
+  sf->remaining = size - offset;
+  if (top >= 4 && !lua_isnil(L, 4)) {
+    int32_t len = luaL_checkinteger(L, 4);
+    if (len >= 0 && (uint32_t) len < sf->remaining)
+      sf->remaining = len;
+  }
+  if (sf->remaining == 0) {
+    net_sendfile_free(L, ud);
+    return luaL_error(L, "no data to send");
+  }
+  if (cb) {
+    lua_pushvalue(L, cb);
+    sf->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pushboolean(L, 1);
+  net_sendq_push(L, ud, lua_gettop(L), 0);
+  net_sendq_pump(L, ud);
+  net_sendfile_check(L, ud);          /* in case reading failed at once */
+  return 0;
+}
+
+// Lua: client:wait(event), socket:wait("receive") -- only from within a coroutine
+int net_wait( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type == TYPE_TCP_SERVER)
+    return luaL_error(L, "invalid user data");
+  const char *name = luaL_checkstring(L, 2);
+  int event;
+  if (strcmp("receive",name)==0)
+    event = AWAIT_RECEIVE;
+  else if (ud->type == TYPE_TCP_CLIENT && strcmp("connection",name)==0)
+    event = AWAIT_CONNECTION;
+  else if (ud->type == TYPE_TCP_CLIENT && strcmp("sent",name)==0)
+    event = AWAIT_SENT;
+  else if (ud->type == TYPE_TCP_CLIENT && strcmp("drain",name)==0)
+    event = AWAIT_DRAIN;
+  else
+    return luaL_error(L, "invalid event name");
+  if (ud->client.await_event != AWAIT_NONE)
+    return luaL_error(L, "socket is already being waited on");
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  if (event == AWAIT_DRAIN && !ud->client.sendq.drain) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  ud->client.await_ref = luaL_awaitref(L);
+  ud->client.await_event = event;
+  return lua_yield(L, 0);
+}
+
 // Lua: client:hold()
 int net_hold( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
@@ -588,6 +1355,26 @@ int net_unhold( lua_State *L ) {
   return 0;
 }
 
+// Lua: high, low, queued = client:watermarks([high[, low]])
+int net_watermarks( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  net_sendq *q = &ud->client.sendq;
+  if (!lua_isnoneornil(L, 2)) {
+    int high = luaL_checkinteger(L, 2);
+    int low = luaL_optinteger(L, 3, high / 4);
+    luaL_argcheck(L, high > 0 && high <= 0xFFFF, 2, "out of range");
+    luaL_argcheck(L, low >= 0 && low < high, 3, "out of range");
+    q->high = high;
+    q->low = low;
+  }
+  lua_pushinteger(L, q->high);
+  lua_pushinteger(L, q->low);
+  lua_pushinteger(L, q->bytes);
+  return 3;
+}
+
 // Lua: client/socket:dns(domain, callback(socket, addr))
 int net_dns( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
@@ -612,7 +1399,7 @@ int net_dns( lua_State *L ) {
     ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
   ip_addr_t addr;
-  err_t err = dns_gethostbyname(domain, &addr, net_dns_cb, ud);
+  err_t err = dnscache_gethostbyname(domain, &addr, net_dns_cb, ud);
   if (err == ERR_OK) {
     net_dns_cb(domain, &addr, ud);
   } else if (err != ERR_INPROGRESS) {
@@ -719,34 +1506,14 @@ static void dbg_print_ud(const char *title, lnet_userdata *ud) {
 int net_close( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
   if (!ud) return luaL_error(L, "invalid user data");
-  if (ud->pcb) {
-    switch (ud->type) {
-      case TYPE_TCP_CLIENT:
-        if (ERR_OK != tcp_close(ud->tcp_pcb)) {
-          tcp_arg(ud->tcp_pcb, NULL);
-          tcp_abort(ud->tcp_pcb);
-        }
-        ud->tcp_pcb = NULL;
-        break;
-      case TYPE_TCP_SERVER:
-        tcp_close(ud->tcp_pcb);
-        ud->tcp_pcb = NULL;
-        break;
-      case TYPE_UDP_SOCKET:
-        udp_remove(ud->udp_pcb);
-        ud->udp_pcb = NULL;
-        break;
-    }
-  } else {
+  if (!ud->pcb)
     return luaL_error(L, "not connected");
+  if (ud->type == TYPE_TCP_CLIENT &&
+      (ud->client.sendq.head < ud->client.sendq.tail || ud->client.sendfile)) {
+    ud->client.sendq.closing = 1;       /* net_sent_cb() closes once it's sent */
+    return 0;
   }
-  if (ud->type == TYPE_TCP_SERVER ||
-     (ud->pcb == NULL && ud->client.wait_dns == 0)) {
-
-    int selfref = ud->self_ref;
-    ud->self_ref = LUA_NOREF;
-    luaL_unref(L, LUA_REGISTRYINDEX, selfref);
-  }
+  net_shut(L, ud);
 #if 0
   dbg_print_ud("close exit", ud);
 #endif
@@ -781,13 +1548,20 @@ int net_delete( lua_State *L ) {
       ud->client.cb_disconnect_ref = LUA_NOREF;
       luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_reconnect_ref);
       ud->client.cb_reconnect_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_drain_ref);
+      ud->client.cb_drain_ref = LUA_NOREF;
+      net_sendq_clear(L, ud, false);
     case TYPE_UDP_SOCKET:
+      net_batch_free(ud);
       luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
       ud->client.cb_dns_ref = LUA_NOREF;
       luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
       ud->client.cb_receive_ref = LUA_NOREF;
       luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
       ud->client.cb_sent_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.await_ref);
+      ud->client.await_ref = LUA_NOREF;
+      ud->client.await_event = AWAIT_NONE;
       break;
     case TYPE_TCP_SERVER:
       luaL_unref(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
@@ -898,7 +1672,7 @@ static int net_dns_static( lua_State* L ) {
   _Static_assert(sizeof(void *) >= sizeof(typeof(cbref)),
                  "Can't upcast int to ptr");
 
-  err_t err = dns_gethostbyname(domain, &addr, net_dns_static_cb, (void *)cbref);
+  err_t err = dnscache_gethostbyname(domain, &addr, net_dns_static_cb, (void *)cbref);
   if (err == ERR_OK) {
     net_dns_static_cb(domain, &addr, (void *)cbref);
     return 0;
@@ -928,6 +1702,7 @@ static int net_setdnsserver( lua_State* L ) {
   ip_addr_t ipaddr;
   ip4_addr_set_u32(&ipaddr, ip32);
   dns_setserver(numdns,&ipaddr);
+  dnscache_flush();
 
   return 0;
 }
@@ -954,6 +1729,23 @@ static int net_getdnsserver( lua_State* L ) {
   return 1;
 }
 
+// Lua: t = net.dns.stats([reset])
+static int net_dns_stats( lua_State* L ) {
+  bool reset = lua_toboolean(L, 1);
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, dnscache_stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, dnscache_stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, dnscache_stats.shared);
+  lua_setfield(L, -2, "shared");
+  lua_pushinteger(L, dnscache_count());
+  lua_setfield(L, -2, "cached");
+  if (reset)
+    memset(&dnscache_stats, 0, sizeof(dnscache_stats));
+  return 1;
+}
+
 #pragma mark - netif info
 
 /*
@@ -1034,8 +1826,11 @@ LROT_BEGIN(net_tcpsocket, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( close, net_close )
   LROT_FUNCENTRY( on, net_on )
   LROT_FUNCENTRY( send, net_send )
+  LROT_FUNCENTRY( sendfile, net_sendfile_l )
   LROT_FUNCENTRY( hold, net_hold )
   LROT_FUNCENTRY( unhold, net_unhold )
+  LROT_FUNCENTRY( watermarks, net_watermarks )
+  LROT_FUNCENTRY( wait, net_wait )
   LROT_FUNCENTRY( dns, net_dns )
   LROT_FUNCENTRY( ttl, net_ttl )
   LROT_FUNCENTRY( getpeer, net_getpeer )
@@ -1051,9 +1846,12 @@ LROT_BEGIN(net_udpsocket, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( close, net_close )
   LROT_FUNCENTRY( on, net_on )
   LROT_FUNCENTRY( send, net_send )
+  LROT_FUNCENTRY( sendmany, net_sendmany )
+  LROT_FUNCENTRY( batch, net_batch_l )
   LROT_FUNCENTRY( dns, net_dns )
   LROT_FUNCENTRY( ttl, net_ttl )
   LROT_FUNCENTRY( getaddr, net_getaddr )
+  LROT_FUNCENTRY( wait, net_wait )
 LROT_END(net_udpsocket, NULL, LROT_MASK_GC_INDEX)
 
 
@@ -1061,6 +1859,7 @@ LROT_BEGIN(net_dns_map, NULL, 0)
   LROT_FUNCENTRY( setdnsserver, net_setdnsserver )
   LROT_FUNCENTRY( getdnsserver, net_getdnsserver )
   LROT_FUNCENTRY( resolve, net_dns_static )
+  LROT_FUNCENTRY( stats, net_dns_stats )
 LROT_END(net_dns_map, NULL, 0)
 
 
@@ -1089,6 +1888,7 @@ LROT_END(net, NULL, 0)
 
 int luaopen_net( lua_State *L ) {
   igmp_init();
+  net_batch_task = platform_task_get_id(net_batch_deliver);
 
   luaL_rometatable(L, NET_TABLE_TCP_SERVER, LROT_TABLEREF(net_tcpserver));
   luaL_rometatable(L, NET_TABLE_TCP_CLIENT, LROT_TABLEREF(net_tcpsocket));
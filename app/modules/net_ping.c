@@ -13,7 +13,8 @@
 
 #include "lwip/ip_addr.h"
 #include "espconn.h"
-#include "lwip/dns.h" 
+#include "lwip/dns.h"
+#include "dnscache.h"
 #include "lwip/app/ping.h"
 
 /* 
@@ -142,7 +143,7 @@ int net_ping(lua_State *L)
     
     NODE_DBG("[net_ping] nip = %p, nip->ping_callback_ref = %p\n", nip, nip->ping_callback_ref);
 
-    err_t err = dns_gethostbyname(ping_target, &addr, (dns_found_callback) net_ping_raw, nip);
+    err_t err = dnscache_gethostbyname(ping_target, &addr, (dns_found_callback) net_ping_raw, nip);
     if (err != ERR_OK && err != ERR_INPROGRESS) {
         luaL_unref(L, LUA_REGISTRYINDEX, nip->ping_callback_ref);
         return luaL_error(L, "lwip error %d", err);
@@ -2,6 +2,9 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "lmem.h"
+#if LUA_VERSION_NUM == 501
+#include "lstate.h"
+#endif
 
 #include "platform.h"
 #include <stdint.h>
@@ -12,6 +15,7 @@
 #include "user_version.h"
 #include "rom.h"
 #include "task/task.h"
+#include "scratch.h"
 
 #define CPU80MHZ 80
 #define CPU160MHZ 160
@@ -22,6 +26,8 @@ platform_startup_counts_t platform_startup_counts;
 
 #define DELAY2SEC 2000
 
+#define TASK_BUDGET_DEFAULT 10000      /* VM instructions between preemptions */
+
 #ifndef LUA_MAXINTEGER
 #define LUA_MAXINTEGER INT_MAX
 #endif
@@ -254,6 +260,13 @@ static void get_lfs_config ( lua_State* L ){
     add_int_field(L, config[1], "lfs_base");
     add_int_field(L, config[2], "lfs_size");
     add_int_field(L, config[3], "lfs_used");
+#if LUA_VERSION_NUM == 501
+    lua_getoverlayconfig(L, config);
+    add_int_field(L, config[0], "overlay_mapped");
+    add_int_field(L, config[1], "overlay_base");
+    add_int_field(L, config[2], "overlay_size");
+    add_int_field(L, config[3], "overlay_used");
+#endif
 }
 
 static int node_info( lua_State* L ){
@@ -350,6 +363,116 @@ static int node_heap( lua_State* L )
   return 1;
 }
 
+static void node_push_heapinfo( lua_State* L, const platform_heap_info_t *info )
+{
+  int b;
+  lua_createtable(L, 0, 10);
+  lua_pushinteger(L, info->total);
+  lua_setfield(L, -2, "free");
+  lua_pushinteger(L, info->largest);
+  lua_setfield(L, -2, "largest");
+  lua_pushinteger(L, info->blocks);
+  lua_setfield(L, -2, "blocks");
+  lua_pushinteger(L, info->counted);
+  lua_setfield(L, -2, "counted");
+  lua_pushinteger(L, info->total ? 100 - info->largest * 100 / info->total : 0);
+  lua_setfield(L, -2, "frag");
+  lua_createtable(L, PLATFORM_HEAP_BUCKETS, 0);
+  for (b = 0; b < PLATFORM_HEAP_BUCKETS; b++) {
+    lua_pushinteger(L, info->hist[b]);
+    lua_rawseti(L, -2, b + 1);
+  }
+  lua_setfield(L, -2, "histogram");
+  lua_pushinteger(L, platform_heap_counts.allocs);
+  lua_setfield(L, -2, "allocs");
+  lua_pushinteger(L, platform_heap_counts.frees);
+  lua_setfield(L, -2, "frees");
+  lua_pushinteger(L, platform_heap_counts.fails);
+  lua_setfield(L, -2, "fails");
+}
+
+// Lua: node.heapinfo() -- largest free block, free block histogram and allocation counts
+static int node_heapinfo( lua_State* L )
+{
+  platform_heap_info_t info;
+  platform_heap_info(&info);
+  node_push_heapinfo(L, &info);
+  return 1;
+}
+
+/*
+ * An allocation failure is reported from inside the Lua allocator, so the
+ * heap's state then is kept and passed to the Lua handler from a task.
+ * Further failures are ignored until that task has run.
+ */
+static int heapfail_ref = LUA_NOREF;
+static platform_task_handle_t heapfail_task;
+static struct {
+  uint32_t size;
+  platform_heap_info_t info;
+  bool pending;
+} heapfail;
+
+static void node_heapfail_task( platform_task_param_t param, uint8_t prio )
+{
+  lua_State *L = lua_getstate();
+  UNUSED(param); UNUSED(prio);
+  if (heapfail_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, heapfail_ref);
+    lua_pushinteger(L, heapfail.size);
+    node_push_heapinfo(L, &heapfail.info);
+  }
+  heapfail.pending = false;
+  if (heapfail_ref != LUA_NOREF)
+    luaL_pcallx(L, 2, 0);
+}
+
+static void node_heapfail_cb( uint32_t size, const platform_heap_info_t *info )
+{
+  if (heapfail.pending)
+    return;
+  heapfail.size = size;
+  heapfail.info = *info;
+  heapfail.pending = platform_post_low(heapfail_task, 0);
+}
+
+// Lua: node.setonheapfail([function]) -- called after a Lua allocation fails
+static int node_setonheapfail( lua_State* L )
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, heapfail_ref);
+  heapfail_ref = LUA_NOREF;
+  if (lua_isnoneornil(L, 1)) {
+    platform_heap_set_failure_cb(NULL);
+    return 0;
+  }
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_settop(L, 1);
+  heapfail_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!heapfail_task)
+    heapfail_task = platform_task_get_id(node_heapfail_task);
+  platform_heap_set_failure_cb(node_heapfail_cb);
+  return 0;
+}
+
+// Lua: node.scratchinfo([reset]) -- scratch arena use and high water marks
+static int node_scratchinfo( lua_State* L )
+{
+  scratch_stats_t st;
+  scratch_stats(&st, lua_toboolean(L, 1));
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, st.size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, st.used);
+  lua_setfield(L, -2, "used");
+  lua_pushinteger(L, st.peak);
+  lua_setfield(L, -2, "peak");
+  lua_pushinteger(L, st.fallbacks);
+  lua_setfield(L, -2, "fallbacks");
+  lua_pushinteger(L, st.fallback_peak);
+  lua_setfield(L, -2, "fallbackpeak");
+  return 1;
+}
+
 // Lua: input("string")
 static int node_input( lua_State* L ) {
   luaL_checkstring(L, 1);
@@ -491,7 +614,7 @@ static int node_compile( lua_State* L )
   return 0;
 }
 
-// Lua: node.task.post([priority],task_cb) -- schedule a task for execution next
+// Lua: node.task.post([priority],task_cb|co) -- schedule a task for execution next
 static int node_task_post( lua_State* L )
 {
   int n=1;
@@ -501,12 +624,107 @@ static int node_task_post( lua_State* L )
     luaL_argcheck(L, priority <= TASK_PRIORITY_HIGH, 1, "invalid  priority");
     n++;
   }
-  luaL_checktype(L, n, LUA_TFUNCTION);
+  if (!lua_isthread(L, n))
+    luaL_checktype(L, n, LUA_TFUNCTION);
   lua_settop(L, n);
   (void) luaL_posttask(L, priority);
   return 0;
 }
 
+// Whether the running coroutine can yield, so not from inside a call made from C
+static int node_isyieldable( lua_State* L )
+{
+#if LUA_VERSION_NUM == 501
+  return L != G(L)->mainthread && L->nCcalls <= L->baseCcalls;
+#else
+  return lua_isyieldable(L);
+#endif
+}
+
+// Lua: node.task.yield([priority]) -- resume the running coroutine from a new task
+static int node_task_yield( lua_State* L )
+{
+  unsigned priority = TASK_PRIORITY_MEDIUM;
+  if (!lua_isnoneornil(L, 1)) {
+    priority = (unsigned) luaL_checkint(L, 1);
+    luaL_argcheck(L, priority <= TASK_PRIORITY_HIGH, 1, "invalid  priority");
+  }
+  // check before posting, so that no task is left to resume a coroutine
+  // which never yielded
+  if (!node_isyieldable(L))
+    return luaL_error(L, "attempt to yield from outside a coroutine");
+  lua_pushthread(L);
+  if (luaL_posttask(L, priority) < 0)
+    return luaL_error(L, "task not posted");
+  return lua_yield(L, 0);
+}
+
+// Lua: co = node.task.spawn([priority],function[,budget]) -- run as a preemptible coroutine
+static int node_task_spawn( lua_State* L )
+{
+  int n=1, budget;
+  unsigned priority = TASK_PRIORITY_MEDIUM;
+  lua_State *co;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    priority = (unsigned) luaL_checkint(L, 1);
+    luaL_argcheck(L, priority <= TASK_PRIORITY_HIGH, 1, "invalid  priority");
+    n++;
+  }
+  luaL_checktype(L, n, LUA_TFUNCTION);
+  budget = luaL_optint(L, n+1, TASK_BUDGET_DEFAULT);
+  luaL_argcheck(L, budget >= 0, n+1, "invalid budget");
+  co = lua_newthread(L);
+  lua_pushvalue(L, n);
+  lua_xmove(L, co, 1);
+  lua_pushvalue(L, -1);
+  if (luaL_posttask(L, priority) < 0)
+    return luaL_error(L, "task not posted");
+  luaL_setbudget(L, -1, budget, priority);
+  return 1;
+}
+
+// Lua: node.task.budget(co[,budget[,priority]]) -- set and read a coroutine's instruction budget
+static int node_task_budget( lua_State* L )
+{
+  luaL_checktype(L, 1, LUA_TTHREAD);
+  if (!lua_isnoneornil(L, 2)) {
+    unsigned priority = (unsigned) luaL_optint(L, 3, TASK_PRIORITY_MEDIUM);
+    luaL_argcheck(L, priority <= TASK_PRIORITY_HIGH, 3, "invalid  priority");
+    luaL_setbudget(L, 1, luaL_checkint(L, 2), priority);
+  }
+  return luaL_pushbudget(L, 1);
+}
+
+// Lua: node.task.stats([reset]) -- per priority task queue statistics
+static int node_task_stats( lua_State* L )
+{
+  bool reset = lua_toboolean(L, 1);
+  platform_task_stats_t st;
+  int prio;
+  lua_createtable(L, 0, TASK_PRIORITY_HIGH + 1);
+  for (prio = TASK_PRIORITY_LOW; prio <= TASK_PRIORITY_HIGH; prio++) {
+    if (platform_task_stats(prio, &st, reset) != PLATFORM_OK)
+      continue;
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, st.posts);
+    lua_setfield(L, -2, "posts");
+    lua_pushinteger(L, st.drops);
+    lua_setfield(L, -2, "drops");
+    lua_pushinteger(L, st.depth);
+    lua_setfield(L, -2, "depth");
+    lua_pushinteger(L, st.max_depth);
+    lua_setfield(L, -2, "maxdepth");
+    lua_pushinteger(L, st.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, st.p50);
+    lua_setfield(L, -2, "p50");
+    lua_pushinteger(L, st.p99);
+    lua_setfield(L, -2, "p99");
+    lua_rawseti(L, -2, prio);
+  }
+  return 1;
+}
+
 // Lua: setcpufreq(mhz)
 // mhz is either CPU80MHZ od CPU160MHZ
 static int node_setcpufreq(lua_State* L)
@@ -732,11 +950,110 @@ static int node_startup_counts(lua_State *L) {
     lua_setfield(L, -2, "line");
     lua_pushinteger(L, p->ccount);
     lua_setfield(L, -2, "ccount");
+    lua_pushinteger(L, p->us);
+    lua_setfield(L, -2, "us");
+    lua_pushlstring(L, &p->phase, 1);
+    lua_setfield(L, -2, "phase");
+
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+#ifdef PLATFORM_STARTUP_COUNT
+typedef struct {
+  const char *name;
+  uint32_t start, dur;
+  int depth;
+} startup_span_t;
+
+/*
+ * Pair up the STARTUP_BEGIN and STARTUP_END entries into spans, in order of
+ * their start.  A phase which is still open, such as init_run when called
+ * from init.lua, is treated as ending now.
+ */
+static int startup_spans (startup_span_t *span) {
+  int open[PLATFORM_STARTUP_COUNT_SIZE];
+  int i, n = 0, depth = 0;
+  uint32_t now = system_get_time();
+  for (i = 0; i < platform_startup_counts.used; i++) {
+    const platform_count_entry_t *p = &platform_startup_counts.entries[i];
+    if (p->phase == 'B') {
+      span[n] = (startup_span_t) {p->name, p->us, now - p->us, depth};
+      open[depth++] = n++;
+    } else if (p->phase == 'E') {
+      int d = depth;
+      while (d > 0 && strcmp(span[open[d-1]].name, p->name))
+        d--;                          /* skip any phase left open by an error */
+      if (d > 0) {
+        depth = d - 1;
+        span[open[depth]].dur = p->us - span[open[depth]].start;
+      }
+    }
+  }
+  return n;
+}
+
+static void startup_json (lua_State *L, startup_span_t *span) {
+  luaL_Buffer b;
+  int i, n = 0;
+  const char *sep = "";
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (i = 0; i < platform_startup_counts.used; i++) {
+    const platform_count_entry_t *p = &platform_startup_counts.entries[i];
+    if (p->phase == 'B') {
+      startup_span_t *s = span + n++;
+      lua_pushfstring(L, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%d,\"dur\":%d,",
+                      sep, s->name, (int) s->start, (int) s->dur);
+    } else if (p->phase == 'I') {
+      lua_pushfstring(L, "%s{\"name\":\"%s:%d\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%d,",
+                      sep, p->name, p->line, (int) p->us);
+    } else {
+      continue;
+    }
+    luaL_addvalue(&b);
+    luaL_addstring(&b, "\"pid\":1,\"tid\":1}");
+    sep = ",";
+  }
+  luaL_addstring(&b, "]}");
+  luaL_pushresult(&b);
+}
 
+// Lua: node.startupprofile([format]) -- spans by duration, or "json" trace
+static int node_startup_profile(lua_State *L) {
+  static const char * const formats[] = {"table", "json", NULL};
+  int json = luaL_checkoption(L, 1, "table", formats);
+  startup_span_t *span = (startup_span_t *) lua_newuserdata(L,
+                       PLATFORM_STARTUP_COUNT_SIZE * sizeof(startup_span_t));
+  int i, j, n = startup_spans(span);
+
+  if (json) {
+    startup_json(L, span);
+    return 1;
+  }
+  for (i = 1; i < n; i++) {            /* insertion sort, longest first */
+    startup_span_t s = span[i];
+    for (j = i; j > 0 && span[j-1].dur < s.dur; j--)
+      span[j] = span[j-1];
+    span[j] = s;
+  }
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, span[i].name);
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, span[i].start);
+    lua_setfield(L, -2, "start");
+    lua_pushinteger(L, span[i].dur);
+    lua_setfield(L, -2, "dur");
+    lua_pushinteger(L, span[i].depth);
+    lua_setfield(L, -2, "depth");
     lua_rawseti(L, -2, i + 1);
   }
   return 1;
 }
+#endif
 
 #ifdef DEVELOPMENT_TOOLS
 // Lua: rec = node.readrcr(id)
@@ -789,6 +1106,15 @@ static int node_lfsreload (lua_State *L) {
   return 1;
 }
 
+#if LUA_VERSION_NUM == 501
+// Lua: n = node.LFS.overlay(overlayimage)
+static int node_overlayreload (lua_State *L) {
+  lua_settop(L, 1);
+  luaL_overlayreload(L);
+  return 1;
+}
+#endif
+
 // Lua: n = node.flashreload(lfsimage)
 static int lua_lfsreload_deprecated (lua_State *L) {
   platform_print_deprecation_note("node.flashreload", "soon. Use node.LFS interface instead");
@@ -804,9 +1130,15 @@ static int node_lfsindex (lua_State *L) {
 }
 
 // Lua: n = node.LFS.list([option])
-// Note that option is ignored in this release
+// option "overlay" lists the overlay region; any other option is ignored
 static int node_lfslist (lua_State *L) {
   lua_settop(L, 1);
+#if LUA_VERSION_NUM == 501
+  const char *opt = lua_tostring(L, 1);
+  if (opt && !strcmp(opt, "overlay"))
+    luaL_pushoverlaymodules(L);
+  else
+#endif
   luaL_pushlfsmodules(L);
   if (lua_istable(L, -1) && lua_getglobal(L, "table") == LUA_TTABLE) {
     lua_getfield(L, -1, "sort");
@@ -843,14 +1175,20 @@ LROT_BEGIN(node_lfs, LROT_TABLEREF(node_lfs_meta), 0)
   LROT_FUNCENTRY( list, node_lfslist)
   LROT_FUNCENTRY( get, node_lfsindex)
   LROT_FUNCENTRY( reload, node_lfsreload )
+#if LUA_VERSION_NUM == 501
+  LROT_FUNCENTRY( overlay, node_overlayreload )
+#endif
 LROT_END(node_lfs, LROT_TABLEREF(node_lfs_meta), 0)
 
 
-typedef enum pt_t { lfs_addr=0, lfs_size, spiffs_addr, spiffs_size, max_pt} pt_t;
+typedef enum pt_t { lfs_addr=0, lfs_size, spiffs_addr, spiffs_size,
+                   overlay_addr, overlay_size, max_pt} pt_t;
 
 LROT_BEGIN(pt_map, NULL, 0)
   LROT_NUMENTRY( lfs_addr, lfs_addr )
   LROT_NUMENTRY( lfs_size, lfs_size )
+  LROT_NUMENTRY( overlay_addr, overlay_addr )
+  LROT_NUMENTRY( overlay_size, overlay_size )
   LROT_NUMENTRY( spiffs_addr, spiffs_addr )
   LROT_NUMENTRY( spiffs_size, spiffs_size )
 LROT_END(pt_map, NULL, 0)
@@ -861,6 +1199,7 @@ static int node_getpartitiontable (lua_State *L) {
   uint32_t param[max_pt] = {0};
   param[lfs_size]    = platform_flash_get_partition(NODEMCU_LFS0_PARTITION, param + lfs_addr);
   param[spiffs_size] = platform_flash_get_partition(NODEMCU_SPIFFS0_PARTITION, param + spiffs_addr);
+  param[overlay_size] = platform_flash_get_partition(NODEMCU_LFS1_PARTITION, param + overlay_addr);
 
   lua_settop(L, 0);
   lua_createtable (L, 0, max_pt);                   /* at index 1 */
@@ -892,6 +1231,7 @@ static void delete_partition(partition_item_t *p, int n) {
 #define SKIP (~0)
 #define IROM0_PARTITION  (SYSTEM_PARTITION_CUSTOMER_BEGIN + NODEMCU_IROM0TEXT_PARTITION)
 #define LFS_PARTITION    (SYSTEM_PARTITION_CUSTOMER_BEGIN + NODEMCU_LFS0_PARTITION)
+#define OVERLAY_PARTITION (SYSTEM_PARTITION_CUSTOMER_BEGIN + NODEMCU_LFS1_PARTITION)
 #define SPIFFS_PARTITION (SYSTEM_PARTITION_CUSTOMER_BEGIN + NODEMCU_SPIFFS0_PARTITION)
 #define SYSTEM_PARAMETER_SIZE  0x3000
 
@@ -902,7 +1242,7 @@ static int node_setpartitiontable (lua_State *L) {
   uint32_t i = platform_rcr_read(PLATFORM_RCR_PT, (void **) &rcr_pt);
   uint32_t last = 0;
   uint32_t n = i / sizeof(partition_item_t);
-  uint32_t param[max_pt] = {SKIP, SKIP, SKIP, SKIP};
+  uint32_t param[max_pt] = {SKIP, SKIP, SKIP, SKIP, SKIP, SKIP};
 
 /* stack 1=ptvals, 2=pt_map, 3=key, 4=ptval[key], 5=pt_map[key] */ 
   luaL_argcheck(L, lua_istable(L, 1), 1, "must be table");
@@ -923,10 +1263,10 @@ static int node_setpartitiontable (lua_State *L) {
   * Allocate a scratch Partition Table as userdata on the Lua stack, and copy the
   * current Flash PT into this for manipulation
   */
-  lua_newuserdata(L, (n+2)*sizeof(partition_item_t));
+  lua_newuserdata(L, (n+3)*sizeof(partition_item_t));
   pt = lua_touserdata (L, -1);
   memcpy(pt, rcr_pt, n*sizeof(partition_item_t));
-  pt[n].type = 0; pt[n+1].type = 0;
+  pt[n].type = 0; pt[n+1].type = 0; pt[n+2].type = 0;
 
   for (i = 0; i < n; i ++) {
     partition_item_t *p = pt + i;
@@ -942,12 +1282,29 @@ static int node_setpartitiontable (lua_State *L) {
         p->addr = param[lfs_addr];
       if (param[lfs_size] != SKIP) 
         p->size = param[lfs_size];
-      if (p[1].type != SPIFFS_PARTITION) {
+      if (p[1].type != OVERLAY_PARTITION &&
+          param[overlay_size] != SKIP && param[overlay_size] != 0) {
+        // if an overlay is requested and not following LFS then slot one in
+        insert_partition(p + 1, n-i-1, OVERLAY_PARTITION, p->addr + p->size);
+        n++;
+      } else if (p[1].type != SPIFFS_PARTITION && p[1].type != OVERLAY_PARTITION) {
         // if the SPIFFS partition is not following LFS then slot a blank one in
         insert_partition(p + 1, n-i-1, SPIFFS_PARTITION, 0);
         n++;
       }
 
+    } else if (p->type == OVERLAY_PARTITION) {
+      // update the overlay options if set
+      if (param[overlay_addr] != SKIP)
+        p->addr = param[overlay_addr];
+      if (param[overlay_size] != SKIP)
+        p->size = param[overlay_size];
+      if (p[1].type != SPIFFS_PARTITION) {
+        // if the SPIFFS partition is not following the overlay then slot a blank one in
+        insert_partition(p + 1, n-i-1, SPIFFS_PARTITION, 0);
+        n++;
+      }
+
     } else if (p->type == SPIFFS_PARTITION) {
       // update the SPIFFS options if set
       if (param[spiffs_size] != SKIP) {
@@ -1006,6 +1363,10 @@ LROT_END(node_egc, NULL, 0)
 
 LROT_BEGIN(node_task, NULL, 0)
   LROT_FUNCENTRY( post, node_task_post )
+  LROT_FUNCENTRY( spawn, node_task_spawn )
+  LROT_FUNCENTRY( budget, node_task_budget )
+  LROT_FUNCENTRY( stats, node_task_stats )
+  LROT_FUNCENTRY( yield, node_task_yield )
   LROT_NUMENTRY( LOW_PRIORITY, TASK_PRIORITY_LOW )
   LROT_NUMENTRY( MEDIUM_PRIORITY, TASK_PRIORITY_MEDIUM )
   LROT_NUMENTRY( HIGH_PRIORITY, TASK_PRIORITY_HIGH )
@@ -1013,12 +1374,15 @@ LROT_END(node_task, NULL, 0)
 
 LROT_BEGIN(node, NULL, 0)
   LROT_FUNCENTRY( heap, node_heap )
+  LROT_FUNCENTRY( heapinfo, node_heapinfo )
+  LROT_FUNCENTRY( scratchinfo, node_scratchinfo )
   LROT_FUNCENTRY( info, node_info )
   LROT_TABENTRY( task, node_task )
   LROT_FUNCENTRY( flashreload, lua_lfsreload_deprecated )
   LROT_FUNCENTRY( flashindex, node_lfsindex )
   LROT_TABENTRY( LFS, node_lfs )
   LROT_FUNCENTRY( setonerror, node_setonerror )
+  LROT_FUNCENTRY( setonheapfail, node_setonheapfail )
   LROT_FUNCENTRY( startupcommand, node_startupcommand )
   LROT_FUNCENTRY( startup, node_startup )
   LROT_FUNCENTRY( restart, node_restart )
@@ -1034,6 +1398,7 @@ LROT_BEGIN(node, NULL, 0)
 #endif
 #ifdef PLATFORM_STARTUP_COUNT
   LROT_FUNCENTRY( startupcounts, node_startup_counts )
+  LROT_FUNCENTRY( startupprofile, node_startup_profile )
 #endif
   LROT_FUNCENTRY( chipid, node_chipid )
   LROT_FUNCENTRY( flashid, node_flashid )
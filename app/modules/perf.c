@@ -4,19 +4,79 @@
 //
 // perf.start(start, end, nbins[, pc offset on stack])
 // perf.stop()  -> total sample, samples outside range, table { addr -> count , .. }
+//
+// It can also sample the Lua call stack, to show which Lua functions are hot
+// rather than just that time is being spent in luaV_execute.  This part also
+// works in the host luac.cross -e environment.
+//
+// perf.luastart([{interval=us, slots=n, depth=n, count=n}])
+// perf.luastop()  -> samples, idle samples, lost samples, table { folded stack -> count, .. }
+
 
+#include "module.h"
+#include "lauxlib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
+#ifdef LUA_USE_ESP
 #include "ets_sys.h"
 #include "os_type.h"
 #include "osapi.h"
-#include <stdlib.h>
-
-#include "module.h"
-#include "lauxlib.h"
 #include "platform.h"
 #include "hw_timer.h"
 #include "cpu_esp8266.h"
+#elif defined(__unix__)
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+/*
+** The Lua sampler.  The timer tick can't safely touch the Lua VM, so it only
+** sets a flag.  This is polled by a count hook every `count` VM instructions,
+** which then walks the Lua stack.  The stack is hashed, and each distinct
+** stack is formatted once as a folded stack string (root first, frames
+** separated by ';'), which is anchored in the registry.  Repeat samples of
+** the same stack just bump the count in a fixed-size open-addressed table.
+**
+** Each frame is a function, labelled name@source:linedefined, or without the
+** name when it is unknown (as it always is for the hooked function).  The
+** current line of the innermost function is added as a final source:line
+** frame, so that a flame graph also breaks the time down by line.
+**
+** Count hooks are per thread but are inherited by new coroutines, so
+** coroutines created after luastart() are sampled too.  On the ESP, a tick
+** which isn't picked up by the hook within one interval was taken whilst
+** Lua wasn't running (SDK tasks, or idle) and is counted as idle.
+*/
+#define LPROF_DEPTH_DEF  12
+#define LPROF_DEPTH_MAX  32
+#define LPROF_SLOTS_DEF  128
+#define LPROF_COUNT_DEF  1000
+#define LPROF_INTERVAL   1000   /* us */
 
+typedef struct {
+  uint32_t hash;                /* 0 for an empty slot */
+  uint32_t count;
+  int ref;                      /* folded stack string */
+} lprof_slot_t;
+
+typedef struct {
+  lua_State *L;
+  int ref;
+  volatile uint8_t tick;
+  uint8_t depth;
+  uint16_t every, countdown;    /* ticks per sample, when sharing the timer */
+  uint32_t interval;
+  uint32_t ticked_at;           /* CCOUNT of the pending tick */
+  uint32_t samples, idle, lost;
+  uint32_t nslots;              /* a power of 2 */
+  lprof_slot_t slot[1];
+} LPROF;
+
+static LPROF *lprof;
+
+#ifdef LUA_USE_ESP
 typedef struct {
   int ref;
   uint32_t start;
@@ -31,6 +91,21 @@ static DATA *data;
 extern char _flash_used_end[];
 
 #define TIMER_OWNER ((os_param_t) 'p')
+#define PC_INTERVAL 50          /* us */
+
+static bool timer_running;
+
+static inline void ICACHE_RAM_ATTR lprof_tick(void)
+{
+  LPROF *p = lprof;
+  if (p && --p->countdown == 0) {
+    p->countdown = p->every;
+    if (p->tick)
+      p->idle++;                /* the last tick wasn't taken by Lua */
+    p->ticked_at = CCOUNT_REG;
+    p->tick = 1;
+  }
+}
 
 static void ICACHE_RAM_ATTR hw_timer_cb(os_param_t p)
 {
@@ -52,6 +127,33 @@ static void ICACHE_RAM_ATTR hw_timer_cb(os_param_t p)
     }
     data->total_samples++;
   }
+  lprof_tick();
+}
+
+/*
+** The PC and Lua samplers share the one hardware timer, which runs at the
+** PC sampling rate whilst that is active, with Lua sampled every Nth tick.
+*/
+static bool perf_timer_update(void)
+{
+  if (!data && !lprof) {
+    if (timer_running)
+      platform_hw_timer_close(TIMER_OWNER);
+    timer_running = false;
+    return true;
+  }
+  if (!timer_running) {
+    if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE))
+      return false;
+    platform_hw_timer_set_func(TIMER_OWNER, hw_timer_cb, 0);
+    timer_running = true;
+  }
+  if (lprof) {
+    lprof->every = data ? (lprof->interval + PC_INTERVAL - 1) / PC_INTERVAL : 1;
+    lprof->countdown = lprof->every;
+  }
+  platform_hw_timer_arm_us(TIMER_OWNER, data ? PC_INTERVAL : lprof->interval);
+  return true;
 }
 
 static int perf_start(lua_State *L)
@@ -90,16 +192,13 @@ static int perf_start(lua_State *L)
   data = d;
 
   // Start the timer
-  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE)) {
+  if (!perf_timer_update()) {
     // Failed to init the timer
     data = NULL;
     luaL_unref(L, LUA_REGISTRYINDEX, d->ref);
     luaL_error(L, "Unable to initialize timer");
   }
 
-  platform_hw_timer_set_func(TIMER_OWNER, hw_timer_cb, 0);
-  platform_hw_timer_arm_us(TIMER_OWNER, 50);
-
   return 0;
 }
 
@@ -109,12 +208,12 @@ static int perf_stop(lua_State *L)
     return 0;
   }
 
-  // stop the timer
-  platform_hw_timer_close(TIMER_OWNER);
-
   DATA *d = data;
   data = NULL;
 
+  // stop the timer, or slow it down for the Lua sampler
+  perf_timer_update();
+
   lua_pushunsigned(L, d->total_samples);
   lua_pushunsigned(L, d->outside_samples);
   lua_newtable(L);
@@ -135,9 +234,235 @@ static int perf_stop(lua_State *L)
   return 4;
 }
 
+#define lprof_stale(p) (CCOUNT_REG - (p)->ticked_at > \
+                        (p)->interval * system_get_cpu_freq())
+
+#else  /* LUA_USE_HOST */
+
+/*
+** On the host, SIGPROF ticks on consumed CPU time so there are no idle
+** ticks.  Without setitimer(), every hook call is taken as a sample.
+*/
+#ifdef __unix__
+static void lprof_signal(int sig)
+{
+  (void) sig;
+  if (lprof)
+    lprof->tick = 1;
+}
+#endif
+
+static bool perf_timer_update(void)
+{
+#ifdef __unix__
+  struct itimerval it = {{0, 0}, {0, 0}};
+  if (lprof) {
+    it.it_interval.tv_sec = lprof->interval / 1000000;
+    it.it_interval.tv_usec = lprof->interval % 1000000;
+    it.it_value = it.it_interval;
+    signal(SIGPROF, lprof_signal);
+  }
+  return setitimer(ITIMER_PROF, &it, NULL) == 0;
+#else
+  return true;
+#endif
+}
+
+#define lprof_stale(p) 0
+#ifndef __unix__
+#define LPROF_NO_TIMER
+#endif
+
+#endif
+
+/* FNV-1a, one 32-bit word at a time */
+#define lprof_mix(h, v) (((h) ^ (uint32_t)(v)) * 16777619u)
+
+static void lprof_addframe(lua_State *L, luaL_Buffer *b, lua_Debug *ar)
+{
+  lua_getinfo(L, "nS", ar);
+  if (*ar->what == 'm') {
+    luaL_addstring(b, "main@");
+  } else if (ar->name && strcmp(ar->namewhat, "hook")) {
+    luaL_addstring(b, ar->name);
+    luaL_addchar(b, '@');
+  }
+  luaL_addstring(b, ar->short_src);
+  if (ar->linedefined > 0) {
+    lua_pushfstring(L, ":%d", ar->linedefined);
+    luaL_addvalue(b);
+  }
+}
+
+/* Format the folded stack of `n` levels, root first */
+static void lprof_folded(lua_State *L, int n, int truncated)
+{
+  luaL_Buffer b;
+  lua_Debug ar;
+  int level;
+  luaL_buffinit(L, &b);
+  if (truncated)
+    luaL_addstring(&b, "...;");
+  for (level = n - 1; level >= 0; level--) {
+    lua_getstack(L, level, &ar);
+    lprof_addframe(L, &b, &ar);
+    luaL_addchar(&b, ';');
+  }
+  lua_getinfo(L, "Sl", &ar);                /* the line within level 0 */
+  lua_pushfstring(L, "%s:%d", ar.short_src, ar.currentline);
+  luaL_addvalue(&b);
+  luaL_pushresult(&b);
+}
+
+static void lprof_hook(lua_State *L, lua_Debug *hookar)
+{
+  LPROF *p = lprof;
+  lua_Debug ar;
+  uint32_t h = 2166136261u, i;
+  int n;
+  (void) hookar;
+
+#ifdef LPROF_NO_TIMER
+  if (!p)
+    return;
+#else
+  if (!p || !p->tick)
+    return;
+  p->tick = 0;
+#endif
+  if (lprof_stale(p)) {
+    p->idle++;
+    return;
+  }
+  p->samples++;
+  for (n = 0; n < p->depth && lua_getstack(L, n, &ar); n++) {
+    lua_getinfo(L, n ? "Sn" : "Sl", &ar);
+    h = lprof_mix(h, (uintptr_t) ar.source);
+    h = lprof_mix(h, ar.linedefined);
+    h = lprof_mix(h, n ? (uintptr_t) ar.name : (uintptr_t) ar.currentline);
+  }
+  if (h == 0)
+    h = 1;
+  for (i = h; ; i++) {
+    lprof_slot_t *s = &p->slot[i & (p->nslots - 1)];
+    if (s->hash == h) {
+      s->count++;
+      return;
+    }
+    if (s->hash == 0) {
+      lprof_folded(L, n, lua_getstack(L, n, &ar));
+      s->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      s->hash = h;
+      s->count = 1;
+      return;
+    }
+    if (i - h >= p->nslots / 2) {           /* keep probe sequences short */
+      p->lost++;
+      return;
+    }
+  }
+}
+
+// Lua: perf.luastart([{interval=us, slots=n, depth=n, count=n}])
+static int perf_luastart(lua_State *L)
+{
+  uint32_t interval = LPROF_INTERVAL, slots = LPROF_SLOTS_DEF;
+  uint32_t depth = LPROF_DEPTH_DEF, count = LPROF_COUNT_DEF, n;
+  lua_State *ML = L;
+
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "interval");
+    interval = luaL_optinteger(L, -1, interval);
+    lua_getfield(L, 1, "slots");
+    slots = luaL_optinteger(L, -1, slots);
+    lua_getfield(L, 1, "depth");
+    depth = luaL_optinteger(L, -1, depth);
+    lua_getfield(L, 1, "count");
+    count = luaL_optinteger(L, -1, count);
+    lua_pop(L, 4);
+  }
+  luaL_argcheck(L, interval >= 100 && interval <= 1000000, 1, "invalid interval");
+  luaL_argcheck(L, slots >= 16 && slots <= 4096, 1, "invalid slots");
+  luaL_argcheck(L, depth >= 1 && depth <= LPROF_DEPTH_MAX, 1, "invalid depth");
+  luaL_argcheck(L, count >= 100, 1, "invalid count");
+  if (lprof)
+    return luaL_error(L, "Lua profiler already running");
+#ifdef LUA_RIDX_MAINTHREAD
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  ML = lua_tothread(L, -1);
+  lua_pop(L, 1);
+#endif
+  if (lua_gethook(ML) || lua_gethook(L))   /* such as a coroutine's budget */
+    return luaL_error(L, "a debug hook is already set");
+
+  for (n = 16; n < slots; n <<= 1) {}
+  size_t size = sizeof(LPROF) + (n - 1) * sizeof(lprof_slot_t);
+  LPROF *p = (LPROF *) lua_newuserdata(L, size);
+  memset(p, 0, size);
+  p->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  p->L = ML;
+  p->interval = interval;
+  p->depth = depth;
+  p->nslots = n;
+  p->every = p->countdown = 1;
+
+  lprof = p;
+  if (!perf_timer_update()) {
+    lprof = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, p->ref);
+    return luaL_error(L, "Unable to initialize timer");
+  }
+  lua_sethook(ML, lprof_hook, LUA_MASKCOUNT, count);
+  if (L != ML)
+    lua_sethook(L, lprof_hook, LUA_MASKCOUNT, count);
+  return 0;
+}
+
+// Lua: samples, idle, lost, stacks = perf.luastop()
+static int perf_luastop(lua_State *L)
+{
+  LPROF *p = lprof;
+  uint32_t i;
+
+  if (!p) {
+    return 0;
+  }
+  lprof = NULL;
+  perf_timer_update();
+  if (lua_gethook(p->L) == lprof_hook)
+    lua_sethook(p->L, NULL, 0, 0);
+  if (lua_gethook(L) == lprof_hook)
+    lua_sethook(L, NULL, 0, 0);
+
+  lua_pushinteger(L, p->samples);
+  lua_pushinteger(L, p->idle);
+  lua_pushinteger(L, p->lost);
+  lua_newtable(L);
+  for (i = 0; i < p->nslots; i++) {
+    lprof_slot_t *s = &p->slot[i];
+    if (s->hash) {           /* two hashes can share a string, so add up */
+      lua_rawgeti(L, LUA_REGISTRYINDEX, s->ref);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, -3);
+      lua_pushinteger(L, s->count + lua_tointeger(L, -1));
+      lua_remove(L, -2);
+      lua_rawset(L, -3);
+      luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+    }
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, p->ref);
+
+  return 4;
+}
+
 LROT_BEGIN(perf, NULL, 0)
+#ifdef LUA_USE_ESP
   LROT_FUNCENTRY( start, perf_start )
   LROT_FUNCENTRY( stop, perf_stop )
+#endif
+  LROT_FUNCENTRY( luastart, perf_luastart )
+  LROT_FUNCENTRY( luastop, perf_luastop )
 LROT_END(perf, NULL, 0)
 
 
@@ -43,6 +43,7 @@
 #include "lwip/dhcp.h"
 #include "user_modules.h"
 #include "lwip/dns.h"
+#include "dnscache.h"
 #include "task/task.h"
 #include "user_interface.h"
 
@@ -662,7 +663,7 @@ static void sntp_dolookups (lua_State *L) {
       handle_error(L, NTP_DNS_ERR, hostname);
       break;
     }
-    err_t err = dns_gethostbyname(hostname, get_free_server(), sntp_dns_found, state);
+    err_t err = dnscache_gethostbyname(hostname, get_free_server(), sntp_dns_found, state);
     if (err == ERR_INPROGRESS)
       break;  // Callback function sntp_dns_found will handle sntp_dosend for us
     else if (err == ERR_ARG) {
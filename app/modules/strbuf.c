@@ -0,0 +1,309 @@
+/*
+** The strbuf module implements a rope style string builder.  Content is held
+** in a linked list of fixed-size chunks allocated from the C heap, so a large
+** response or document can be assembled piecemeal without creating any
+** intermediate Lua strings or ever needing one contiguous allocation to hold
+** the result.  The content can be streamed out a chunk at a time to anything
+** with a write method (file objects and pipes), or to a net socket, where
+** each segment is sent from the sent callback of the previous one.
+**
+** Read the docs/modules/strbuf.md documentation for a functional description.
+*/
+
+#include "module.h"
+#include "lauxlib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define STRBUF_MT           "strbuf.buf"
+#define DEFAULT_CHUNK_SIZE  512
+#define MIN_CHUNK_SIZE      64
+#define MAX_CHUNK_SIZE      4096
+#define SEND_SEGMENT_SIZE   1460        /* one TCP MSS per net send */
+
+typedef struct chunk {
+  struct chunk *next;
+  uint16_t start, end;                 /* unread content is buf[start..end) */
+  char buf[];
+} chunk_t;
+
+typedef struct {
+  chunk_t *head, *tail;
+  size_t len;                          /* total unread content */
+  uint32_t gen;                        /* bumped whenever chunks are freed */
+  uint16_t chunksize;
+} strbuf_t;
+
+static strbuf_t *checkbuf (lua_State *L, int ndx) {
+  return (strbuf_t *)luaL_checkudata(L, ndx, STRBUF_MT);
+}
+
+static void freehead (strbuf_t *sb) {
+  chunk_t *c = sb->head;
+  sb->head = c->next;
+  if (!sb->head)
+    sb->tail = NULL;
+  free(c);
+  sb->gen++;
+}
+
+static void addlstring (lua_State *L, strbuf_t *sb, const char *s, size_t l) {
+  while (l) {
+    chunk_t *c = sb->tail;
+    size_t n;
+    if (!c || c->end == sb->chunksize) {
+      c = (chunk_t *)malloc(sizeof(chunk_t) + sb->chunksize);
+      if (!c)
+        luaL_error(L, "out of memory");
+      c->next = NULL;
+      c->start = c->end = 0;
+      if (sb->tail)
+        sb->tail->next = c;
+      else
+        sb->head = c;
+      sb->tail = c;
+    }
+    n = sb->chunksize - c->end;
+    if (n > l)
+      n = l;
+    memcpy(c->buf + c->end, s, n);
+    c->end += n;
+    sb->len += n;
+    s += n;
+    l -= n;
+  }
+}
+
+/* Remove up to n bytes from the head and push them as a string */
+static void pushhead (lua_State *L, strbuf_t *sb, size_t n) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  while (n && sb->head) {
+    chunk_t *c = sb->head;
+    size_t avail = c->end - c->start;
+    size_t used = n < avail ? n : avail;
+    luaL_addlstring(&b, c->buf + c->start, used);
+    c->start += used;
+    sb->len -= used;
+    n -= used;
+    if (c->start == c->end)
+      freehead(sb);
+  }
+  luaL_pushresult(&b);
+}
+
+// Lua: sb = strbuf.new([chunksize])
+static int strbuf_new (lua_State *L) {
+  int size = luaL_optinteger(L, 1, DEFAULT_CHUNK_SIZE);
+  strbuf_t *sb;
+  luaL_argcheck(L, size >= MIN_CHUNK_SIZE && size <= MAX_CHUNK_SIZE, 1,
+                "invalid chunk size");
+  sb = (strbuf_t *)lua_newuserdata(L, sizeof(strbuf_t));
+  memset(sb, 0, sizeof(*sb));
+  sb->chunksize = size;
+  luaL_getmetatable(L, STRBUF_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// Lua: sb:append(s1, ...) -- also accepts numbers and other strbufs
+static int strbuf_append (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  int i, n = lua_gettop(L);
+  for (i = 2; i <= n; i++) {
+    strbuf_t *src = (strbuf_t *)luaL_testudata(L, i, STRBUF_MT);
+    if (src) {
+      chunk_t *c;
+      luaL_argcheck(L, src != sb, i, "cannot append to itself");
+      for (c = src->head; c; c = c->next)
+        addlstring(L, sb, c->buf + c->start, c->end - c->start);
+    } else {
+      size_t l;
+      const char *s = luaL_checklstring(L, i, &l);
+      addlstring(L, sb, s, l);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// Lua: sb:format(fmt, ...) -- append string.format(fmt, ...)
+static int strbuf_format (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  size_t l;
+  const char *s;
+  luaL_checkstring(L, 2);
+  lua_getglobal(L, "string");
+  lua_getfield(L, -1, "format");
+  lua_replace(L, -2);
+  lua_insert(L, 2);
+  lua_call(L, lua_gettop(L) - 2, 1);
+  s = lua_tolstring(L, 2, &l);
+  addlstring(L, sb, s, l);
+  lua_settop(L, 1);
+  return 1;
+}
+
+// Lua: s = sb:read([n]) -- consume up to n bytes, nil if empty
+static int strbuf_read (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  int n = luaL_optinteger(L, 2, sb->chunksize);
+  luaL_argcheck(L, n > 0, 2, "invalid length");
+  if (sb->len == 0) {
+    lua_pushnil(L);
+  } else {
+    pushhead(L, sb, n);
+  }
+  return 1;
+}
+
+// Lua: s = sb:tostring() -- also __tostring
+static int strbuf_tostring (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  chunk_t *c;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (c = sb->head; c; c = c->next)
+    luaL_addlstring(&b, c->buf + c->start, c->end - c->start);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// Lua: n = sb:len() -- also #sb
+static int strbuf_len (lua_State *L) {
+  lua_pushinteger(L, checkbuf(L, 1)->len);
+  return 1;
+}
+
+// Lua: sb:clear()
+static int strbuf_clear (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  while (sb->head)
+    freehead(sb);
+  sb->len = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int strbuf_gc (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  while (sb->head)
+    freehead(sb);
+  return 0;
+}
+
+/*
+** The chunk iterator keeps a pointer to the next chunk, so it is invalidated
+** if any chunk is freed by a read or clear during the iteration.
+*/
+static int strbuf_chunks_aux (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, lua_upvalueindex(1));
+  chunk_t *c = (chunk_t *)lua_touserdata(L, lua_upvalueindex(2));
+  if ((uint32_t)lua_tointeger(L, lua_upvalueindex(3)) != sb->gen)
+    return luaL_error(L, "strbuf modified during iteration");
+  c = c ? c->next : sb->head;
+  if (!c)
+    return 0;
+  lua_pushlightuserdata(L, c);
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushlstring(L, c->buf + c->start, c->end - c->start);
+  return 1;
+}
+
+// Lua: for s in sb:chunks() do ... end
+static int strbuf_chunks (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  lua_settop(L, 1);
+  lua_pushlightuserdata(L, NULL);
+  lua_pushinteger(L, sb->gen);
+  lua_pushcclosure(L, strbuf_chunks_aux, 3);
+  return 1;
+}
+
+// Lua: sb:writeto(obj) -- calls obj:write(chunk) for each chunk
+static int strbuf_writeto (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, 1);
+  uint32_t gen = sb->gen;
+  chunk_t *c;
+  lua_settop(L, 2);
+  for (c = sb->head; c; c = c->next) {
+    lua_getfield(L, 2, "write");
+    lua_pushvalue(L, 2);
+    lua_pushlstring(L, c->buf + c->start, c->end - c->start);
+    lua_call(L, 2, 0);
+    if (gen != sb->gen)
+      return luaL_error(L, "strbuf modified during write");
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+** Streaming to a net socket.  Each segment is sent with the next step of the
+** send chain as the socket's sent callback; once the buffer is empty the
+** optional user callback is called with the socket.
+**   UV1 = strbuf, UV2 = done callback (or nil)
+*/
+static int strbuf_send_next (lua_State *L) {
+  strbuf_t *sb = checkbuf(L, lua_upvalueindex(1));
+  lua_settop(L, 1);                                         /* the socket */
+  if (sb->len == 0) {
+    if (!lua_isnil(L, lua_upvalueindex(2))) {
+      lua_pushvalue(L, lua_upvalueindex(2));
+      lua_pushvalue(L, 1);
+      lua_call(L, 1, 0);
+    }
+    return 0;
+  }
+  lua_getfield(L, 1, "send");
+  lua_pushvalue(L, 1);
+  pushhead(L, sb, SEND_SEGMENT_SIZE);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_pushcclosure(L, strbuf_send_next, 2);    /* sent CB for next segment */
+  lua_call(L, 3, 0);
+  return 0;
+}
+
+// Lua: sb:send(socket [, function(socket) end])
+static int strbuf_send (lua_State *L) {
+  checkbuf(L, 1);
+  luaL_checkany(L, 2);
+  luaL_argcheck(L, lua_isnoneornil(L, 3) || lua_isfunction(L, 3), 3,
+                "function expected");
+  lua_settop(L, 3);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 3);
+  lua_pushcclosure(L, strbuf_send_next, 2);
+  lua_pushvalue(L, 2);
+  lua_call(L, 1, 0);
+  return 0;
+}
+
+LROT_BEGIN(strbuf_buf, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, strbuf_gc )
+  LROT_TABENTRY( __index, strbuf_buf )
+  LROT_FUNCENTRY( __len, strbuf_len )
+  LROT_FUNCENTRY( __tostring, strbuf_tostring )
+  LROT_FUNCENTRY( append, strbuf_append )
+  LROT_FUNCENTRY( chunks, strbuf_chunks )
+  LROT_FUNCENTRY( clear, strbuf_clear )
+  LROT_FUNCENTRY( format, strbuf_format )
+  LROT_FUNCENTRY( len, strbuf_len )
+  LROT_FUNCENTRY( read, strbuf_read )
+  LROT_FUNCENTRY( send, strbuf_send )
+  LROT_FUNCENTRY( tostring, strbuf_tostring )
+  LROT_FUNCENTRY( writeto, strbuf_writeto )
+LROT_END(strbuf_buf, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(strbuf, NULL, 0)
+  LROT_FUNCENTRY( new, strbuf_new )
+LROT_END(strbuf, NULL, 0)
+
+int luaopen_strbuf (lua_State *L) {
+  luaL_rometatable(L, STRBUF_MT, LROT_TABLEREF(strbuf_buf));
+  return 0;
+}
+
+NODEMCU_MODULE(STRBUF, "strbuf", strbuf, luaopen_strbuf);
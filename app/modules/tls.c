@@ -19,6 +19,8 @@
 #include "sys/espconn_mbedtls.h"
 #include "lwip/err.h"
 #include "lwip/dns.h"
+#include "dnscache.h"
+#include "rtc/rtcaccess.h"
 
 #include "mbedtls/debug.h"
 #include "user_mbedtls.h"
@@ -214,7 +216,7 @@ static int tls_socket_connect( lua_State *L ) {
   }
 
   ip_addr_t addr;
-  err_t err = dns_gethostbyname(domain, &addr, (dns_found_callback)tls_socket_dns_cb, ud);
+  err_t err = dnscache_gethostbyname(domain, &addr, (dns_found_callback)tls_socket_dns_cb, ud);
   if (err == ERR_OK) {
     tls_socket_dns_cb(domain, &addr, ud);
   } else if (err != ERR_INPROGRESS) {
@@ -463,6 +465,8 @@ static const char *fill_page_with_pem(lua_State *L, const unsigned char *flash_m
 // Lua: tls.cert.auth(true / false)
 static int tls_cert_auth(lua_State *L)
 {
+  // Sessions were established with the old certificates
+  espconn_ssl_session_flush();
   if (ssl_client_options.cert_auth_callback != LUA_NOREF) {
     luaL_unref(L, LUA_REGISTRYINDEX, ssl_client_options.cert_auth_callback);
     ssl_client_options.cert_auth_callback = LUA_NOREF;
@@ -517,6 +521,8 @@ static int tls_cert_auth(lua_State *L)
 // Lua: tls.cert.verify(true / false)
 static int tls_cert_verify(lua_State *L)
 {
+  // Sessions were established with the old certificates
+  espconn_ssl_session_flush();
   if (ssl_client_options.cert_verify_callback != LUA_NOREF) {
     luaL_unref(L, LUA_REGISTRYINDEX, ssl_client_options.cert_verify_callback);
     ssl_client_options.cert_verify_callback = LUA_NOREF;
@@ -567,6 +573,88 @@ static int tls_cert_verify(lua_State *L)
   return 1;
 }
 
+// Lua: s = tls.session.save()
+// Lua: count, slots = tls.session.save(rtcslot)
+static int tls_session_save(lua_State *L)
+{
+  uint32_t count;
+  if (lua_isnoneornil(L, 1)) {
+    uint32_t len = espconn_ssl_session_save(NULL, 0, NULL);
+    uint8_t *buf = luaM_malloc(L, len);
+    espconn_ssl_session_save(buf, len, NULL);
+    lua_pushlstring(L, (const char *)buf, len);
+    memset(buf, 0, len);
+    luaM_free(L, buf);
+    return 1;
+  }
+
+  // In RTC memory, a slot with the length in bytes and then the sessions
+  int slot = luaL_checkint(L, 1);
+  luaL_argcheck(L, slot >= 0 && slot < RTC_USER_MEM_NUM_DWORDS - 1, 1, "out of range");
+  uint32_t room = (RTC_USER_MEM_NUM_DWORDS - 1 - slot) * sizeof(uint32_t);
+  uint32_t *buf = luaM_malloc(L, room);
+  uint32_t len = espconn_ssl_session_save((uint8_t *)buf, room, &count);
+  uint32_t words = (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+  rtc_mem_write(slot, len);
+  for (uint32_t i = 0; i < words; i++)
+    rtc_mem_write(slot + 1 + i, buf[i]);
+  memset(buf, 0, room);
+  luaM_free(L, buf);
+  lua_pushinteger(L, count);
+  lua_pushinteger(L, 1 + words);
+  return 2;
+}
+
+// Lua: count = tls.session.restore(s | rtcslot)
+static int tls_session_restore(lua_State *L)
+{
+  uint32_t count;
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    size_t len;
+    const char *s = lua_tolstring(L, 1, &len);
+    count = espconn_ssl_session_restore((const uint8_t *)s, len);
+  } else {
+    int slot = luaL_checkint(L, 1);
+    luaL_argcheck(L, slot >= 0 && slot < RTC_USER_MEM_NUM_DWORDS - 1, 1, "out of range");
+    uint32_t room = (RTC_USER_MEM_NUM_DWORDS - 1 - slot) * sizeof(uint32_t);
+    uint32_t len = rtc_mem_read(slot);
+    if (len > room)
+      len = 0;
+    uint32_t words = (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    uint32_t *buf = luaM_malloc(L, words * sizeof(uint32_t) + 1);
+    for (uint32_t i = 0; i < words; i++)
+      buf[i] = rtc_mem_read(slot + 1 + i);
+    count = espconn_ssl_session_restore((const uint8_t *)buf, len);
+    memset(buf, 0, words * sizeof(uint32_t));
+    luaM_free(L, buf);
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+// Lua: tls.session.clear()
+static int tls_session_clear(lua_State *L)
+{
+  espconn_ssl_session_flush();
+  return 0;
+}
+
+// Lua: t = tls.session.stats([reset])
+static int tls_session_stats(lua_State *L)
+{
+  bool reset = lua_toboolean(L, 1);
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, espconn_ssl_session_stats.full);
+  lua_setfield(L, -2, "full");
+  lua_pushinteger(L, espconn_ssl_session_stats.resumed);
+  lua_setfield(L, -2, "resumed");
+  lua_pushinteger(L, espconn_ssl_session_count());
+  lua_setfield(L, -2, "cached");
+  if (reset)
+    memset(&espconn_ssl_session_stats, 0, sizeof(espconn_ssl_session_stats));
+  return 1;
+}
+
 #if defined(MBEDTLS_DEBUG_C)
 static int tls_set_debug_threshold(lua_State *L) {
   mbedtls_debug_set_threshold(luaL_checkint( L, 1 ));
@@ -595,12 +683,22 @@ LROT_BEGIN(tls_cert, NULL, LROT_MASK_INDEX)
 LROT_END(tls_cert, NULL, LROT_MASK_INDEX)
 
 
+LROT_BEGIN(tls_session, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY( __index, tls_session )
+  LROT_FUNCENTRY( save, tls_session_save )
+  LROT_FUNCENTRY( restore, tls_session_restore )
+  LROT_FUNCENTRY( clear, tls_session_clear )
+  LROT_FUNCENTRY( stats, tls_session_stats )
+LROT_END(tls_session, NULL, LROT_MASK_INDEX)
+
+
 LROT_BEGIN(tls, NULL, 0)
   LROT_FUNCENTRY( createConnection, tls_socket_create )
 #if defined(MBEDTLS_DEBUG_C)
   LROT_FUNCENTRY( setDebug, tls_set_debug_threshold )
 #endif
   LROT_TABENTRY( cert, tls_cert )
+  LROT_TABENTRY( session, tls_session )
 LROT_END(tls, NULL, 0)
 
 
@@ -10,9 +10,14 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "metrics.h"
 #include <stdint.h>
+#include <stdlib.h>
 #include "user_interface.h"
 #include "pm/swtimer.h"
+#ifdef TIMER_WHEEL_ENABLE
+#include "timer_wheel.h"
+#endif
 
 #define TIMER_MODE_SINGLE 0
 #define TIMER_MODE_AUTO   1
@@ -29,8 +34,145 @@
 static const uint32 MAX_TIMEOUT=MAX_TIMEOUT_DEF;
 static const char* MAX_TIMEOUT_ERR_STR = "Range: 1-"STRINGIFY(MAX_TIMEOUT_DEF);
 
+#ifndef TIMER_WHEEL_SLACK
+#define TIMER_WHEEL_SLACK 0
+#endif
+
+#ifdef TIMER_WHEEL_ENABLE
+/*
+** With TIMER_WHEEL_ENABLE, Lua timers are not individual SDK os_timers, but
+** entries in a hierarchical timer wheel (see app/platform/timer_wheel.c)
+** which is driven by a single os_timer.  Inserting and cancelling a timer is
+** O(1), rather than a walk of the SDK's sorted timer list from within its
+** timer ISR, and timers due at the same wheel time are expired together in
+** one wake-up.  The tmr_os_*() calls mirror the os_timer_*() ones they
+** replace.
+**
+** A timer's slack lets its expiry be deferred to coalesce wake-ups: each
+** expiry is aligned to the time in [due, due + slack] with the most trailing
+** zero bits, so timers whose windows overlap tend to land on the same wheel
+** time.  A repeating timer's period is still kept relative to its nominal
+** due time, so the slack never accumulates as drift.
+*/
+#define WHEEL_MAX_SLEEP  (30*60*1000)  // re-sync the wheel clock at least this often
+
 typedef struct{
-  os_timer_t os;
+  tw_timer_t tw;
+  os_timer_func_t *fn;
+  void *arg;
+  uint32_t due;     /* nominal expiry, before any slack is applied */
+  uint32_t period;  /* 0 for a one-shot timer */
+  uint32_t slack;   /* ms that the expiry may be deferred to coalesce wake-ups */
+} tmr_os_t;
+
+static tw_wheel_t wheel;
+static os_timer_t wheel_timer;
+static uint32_t wheel_ms, wheel_last_us;
+static uint32_t wheel_armed_for;
+static bool wheel_armed, wheel_running;
+static uint32_t wheel_wakeups, wheel_expiries;  /* for tmr.stats() */
+
+/* A millisecond clock which, unlike system_get_time(), wraps after 49 days */
+static uint32_t wheel_now(void){
+  uint32_t us = system_get_time();
+  uint32_t ms = (us - wheel_last_us) / 1000;
+  wheel_last_us += ms * 1000;
+  wheel_ms += ms;
+  return wheel_ms;
+}
+
+static bool wheel_empty(void){
+  int l;
+  for (l = 0; l < TW_LEVELS; l++)
+    if (wheel.bitmap[l])
+      return false;
+  return true;
+}
+
+static void wheel_rearm(void){
+  uint32_t due, now, delay;
+  if (wheel_running)
+    return;               /* wheel_run() rearms once all due timers are done */
+  if (!tw_next(&wheel, &due)) {
+    if (wheel_armed)
+      os_timer_disarm(&wheel_timer);
+    wheel_armed = false;
+    return;
+  }
+  if (wheel_armed && due == wheel_armed_for)
+    return;
+  now = wheel_now();
+  delay = (int32_t)(due - now) > 0 ? due - now : 0;
+  if (delay > WHEEL_MAX_SLEEP)
+    delay = WHEEL_MAX_SLEEP;
+  os_timer_disarm(&wheel_timer);
+  os_timer_arm(&wheel_timer, delay, 0);
+  wheel_armed = true;
+  wheel_armed_for = due;
+}
+
+static void wheel_run(void *arg){
+  uint32_t now = wheel_now();
+  tw_timer_t *t;
+  bool woken = false;
+  wheel_armed = false;
+  wheel_running = true;
+  while ((t = tw_expire(&wheel, now)) != NULL) {
+    tmr_os_t *o = (tmr_os_t *) t;
+    if (!woken) {
+      woken = true;
+      wheel_wakeups++;
+    }
+    wheel_expiries++;
+    if (o->period) {
+      o->due += o->period;
+      if ((int32_t)(o->due - now) <= 0)       /* don't try to catch up */
+        o->due = now + o->period;
+      tw_add(&wheel, &o->tw, tw_align(o->due, o->slack));
+    }
+    o->fn(o->arg);
+  }
+  wheel_running = false;
+  wheel_rearm();
+}
+
+static void tmr_os_setfn(tmr_os_t *o, os_timer_func_t *fn, void *arg){
+  o->fn = fn;
+  o->arg = arg;
+  o->slack = TIMER_WHEEL_SLACK;
+}
+
+static void tmr_os_setslack(tmr_os_t *o, uint32_t ms){
+  o->slack = ms;
+}
+
+static void tmr_os_arm(tmr_os_t *o, uint32_t ms, bool repeat){
+  uint32_t now = wheel_now();
+  if (wheel_empty())
+    tw_init(&wheel, now);
+  o->due = now + ms;
+  o->period = repeat ? ms : 0;
+  tw_add(&wheel, &o->tw, tw_align(o->due, o->slack));
+  wheel_rearm();
+}
+
+static void tmr_os_disarm(tmr_os_t *o){
+  if (tw_pending(&o->tw)) {
+    tw_del(&wheel, &o->tw);
+    wheel_rearm();
+  }
+  o->period = 0;
+}
+#else
+typedef os_timer_t tmr_os_t;
+#define tmr_os_setfn  os_timer_setfn
+#define tmr_os_arm    os_timer_arm
+#define tmr_os_disarm os_timer_disarm
+#define tmr_os_setslack(o, ms) ((void)(ms))  // expiries are always exact
+#endif
+
+typedef struct{
+  tmr_os_t os;
   sint32_t lua_ref;  /* Reference to registered callback function */
   sint32_t self_ref;  /* Reference to UD registered slot */
   uint32_t interval;
@@ -71,7 +213,15 @@ static void alarm_timer_common(void* arg){
       luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
       }
     }
+#ifdef METRICS_ENABLE
+    uint32_t start = system_get_time();
+    if (luaL_pcallx(L, 1, 0) != 0)
+      METRIC_INC(METRIC_TMR_ERRORS, 1);
+    METRIC_INC(METRIC_TMR_FIRES, 1);
+    METRIC_OBSERVE(METRIC_TMR_CALLBACK_US, system_get_time() - start);
+#else
     luaL_pcallx(L, 1, 0);
+#endif
   }
 }
 
@@ -87,6 +237,38 @@ static int tmr_delay( lua_State* L ){
   return 0;
 }
 
+/*
+** tmr.wait() suspends the calling coroutine on a one-shot OS timer which
+** resumes it directly, so no timer object or callback closure is created.
+*/
+typedef struct{
+  tmr_os_t os;
+  int co_ref;  /* Reference to the waiting coroutine */
+} tmr_wait_t;
+
+static void tmr_wait_done(void* arg){
+  tmr_wait_t *w = (tmr_wait_t *) arg;
+  int ref = w->co_ref;
+  free(w);
+  luaL_awaitresume(lua_getstate(), ref, 0);
+}
+
+// Lua: tmr.wait( ms ) -- only from within a coroutine
+static int tmr_wait(lua_State* L){
+  uint32_t interval = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, (interval > 0 && interval <= MAX_TIMEOUT), 1, MAX_TIMEOUT_ERR_STR);
+  int ref = luaL_awaitref(L);
+  tmr_wait_t *w = (tmr_wait_t *) malloc(sizeof(tmr_wait_t));
+  if (!w) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return luaL_error(L, "out of memory");
+  }
+  w->co_ref = ref;
+  tmr_os_setfn(&w->os, tmr_wait_done, w);
+  tmr_os_arm(&w->os, interval, 0);
+  return lua_yield(L, 0);
+}
+
 // Lua: tmr.now() , return system timer in us
 static int tmr_now(lua_State* L){
   lua_pushinteger(L, (uint32_t) (0x7FFFFFFF & system_get_time()));
@@ -104,24 +286,33 @@ static int tmr_ccount(lua_State* L){
 ** stack is preserved for the following start(), so the stack MUST be balanced here.
 */
 
-// Lua: t:register( interval, mode, function )
+// Lua: t:register( interval, mode, function [, {slack = ms}] )
 static int tmr_register(lua_State* L) {
   tmr_t *tmr = (tmr_t *) luaL_checkudata(L, 1, "tmr.timer");
   uint32_t interval = luaL_checkinteger(L, 2);
   uint8_t mode = luaL_checkinteger(L, 3);
+  lua_Integer slack = TIMER_WHEEL_SLACK;
 
   luaL_argcheck(L, (interval > 0 && interval <= MAX_TIMEOUT), 2, MAX_TIMEOUT_ERR_STR);
   luaL_argcheck(L, (mode == TIMER_MODE_SINGLE || mode == TIMER_MODE_SEMI || mode == TIMER_MODE_AUTO), 3, "Invalid mode");
   luaL_argcheck(L, lua_isfunction(L, 4), 4, "Must be function");
+  if (!lua_isnoneornil(L, 5)) {
+    luaL_checktype(L, 5, LUA_TTABLE);
+    lua_getfield(L, 5, "slack");
+    slack = luaL_optinteger(L, -1, slack);
+    luaL_argcheck(L, (slack >= 0 && slack <= MAX_TIMEOUT), 5, "invalid slack");
+    lua_pop(L, 1);
+  }
 
   //get the lua function reference
   lua_pushvalue(L, 4);
   if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-    os_timer_disarm(&tmr->os);
+    tmr_os_disarm(&tmr->os);
   luaL_reref(L, LUA_REGISTRYINDEX, &tmr->lua_ref);
   tmr->mode = mode|TIMER_IDLE_FLAG;
   tmr->interval = interval;
-  os_timer_setfn(&tmr->os, alarm_timer_common, tmr);
+  tmr_os_setfn(&tmr->os, alarm_timer_common, tmr);
+  tmr_os_setslack(&tmr->os, slack);
   return 0;
 }
 
@@ -141,9 +332,9 @@ static int tmr_start(lua_State* L){
   if(!(idle || restart)){
     lua_pushboolean(L, false);
   }else{
-    if (!idle) {os_timer_disarm(&tmr->os);}
+    if (!idle) {tmr_os_disarm(&tmr->os);}
     tmr->mode &= ~TIMER_IDLE_FLAG;
-    os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
+    tmr_os_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
     lua_pushboolean(L, true);
   }
   return 1;
@@ -165,7 +356,7 @@ static int tmr_stop(lua_State* L){
   luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
 
   if(!idle)
-    os_timer_disarm(&tmr->os);
+    tmr_os_disarm(&tmr->os);
   tmr->mode |= TIMER_IDLE_FLAG;
   lua_pushboolean(L, !idle);  /* return false if the timer is idle (or not registered) */
   return 1;
@@ -189,7 +380,7 @@ static int tmr_unregister(lua_State* L){
   luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
   luaL_unref2(L, LUA_REGISTRYINDEX, tmr->lua_ref);
   if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-    os_timer_disarm(&tmr->os);
+    tmr_os_disarm(&tmr->os);
   tmr->mode = TIMER_MODE_OFF;
   return 0;
 }
@@ -202,8 +393,8 @@ static int tmr_interval(lua_State* L){
   if(tmr->mode != TIMER_MODE_OFF){
     tmr->interval = interval;
     if(!(tmr->mode&TIMER_IDLE_FLAG)){
-      os_timer_disarm(&tmr->os);
-      os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
+      tmr_os_disarm(&tmr->os);
+      tmr_os_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
     }
   }
   return 0;
@@ -222,6 +413,22 @@ static int tmr_state(lua_State* L){
   return 2;
 }
 
+#ifdef TIMER_WHEEL_ENABLE
+// Lua: tmr.stats( [reset] )
+static int tmr_stats( lua_State* L ){
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, wheel_wakeups);
+  lua_setfield(L, -2, "wakeups");
+  lua_pushinteger(L, wheel_expiries);
+  lua_setfield(L, -2, "expiries");
+  lua_pushinteger(L, wheel_expiries - wheel_wakeups);
+  lua_setfield(L, -2, "avoided");
+  if (lua_toboolean(L, 1))
+    wheel_wakeups = wheel_expiries = 0;
+  return 1;
+}
+#endif
+
 // Lua: tmr.wdclr()
 static int tmr_wdclr( lua_State* L ){
   system_soft_wdt_feed ();
@@ -283,7 +490,7 @@ static int tmr_create( lua_State *L ) {
   tmr_t *ud = (tmr_t *)lua_newuserdata(L, sizeof(*ud));
   luaL_getmetatable(L, "tmr.timer");
   lua_setmetatable(L, -2);
-  *ud = (tmr_t) {{0}, LUA_NOREF, LUA_NOREF, 0, TIMER_MODE_OFF};
+  *ud = (tmr_t) {.lua_ref = LUA_NOREF, .self_ref = LUA_NOREF, .mode = TIMER_MODE_OFF};
   return 1;
 }
 
@@ -309,6 +516,7 @@ LROT_END(tmr_dyn, NULL, LROT_MASK_GC_INDEX)
 
 LROT_BEGIN(tmr, NULL, 0)
   LROT_FUNCENTRY( delay, tmr_delay )
+  LROT_FUNCENTRY( wait, tmr_wait )
   LROT_FUNCENTRY( now, tmr_now )
   LROT_FUNCENTRY( wdclr, tmr_wdclr )
   LROT_FUNCENTRY( softwd, tmr_softwd )
@@ -319,6 +527,9 @@ LROT_BEGIN(tmr, NULL, 0)
   LROT_FUNCENTRY( resume_all, tmr_resume_all )
 #endif
   LROT_FUNCENTRY( create, tmr_create )
+#ifdef TIMER_WHEEL_ENABLE
+  LROT_FUNCENTRY( stats, tmr_stats )
+#endif
   LROT_NUMENTRY( ALARM_SINGLE, TIMER_MODE_SINGLE )
   LROT_NUMENTRY( ALARM_SEMI, TIMER_MODE_SEMI )
   LROT_NUMENTRY( ALARM_AUTO, TIMER_MODE_AUTO )
@@ -341,9 +552,16 @@ int luaopen_tmr( lua_State *L ){
   // there is bound to be some drift in the clock, so a calibration is due.
   SWTIMER_REG_CB(rtc_callback, SWTIMER_RESUME);
 
+#ifdef TIMER_WHEEL_ENABLE
+  // All timers created via tmr.create() run off the wheel's single os_timer,
+  // so resuming that resumes them all.
+  os_timer_setfn(&wheel_timer, wheel_run, NULL);
+  SWTIMER_REG_CB(wheel_run, SWTIMER_RESUME);
+#else
   // The function alarm_timer_common handles timers created by the developer via
   // tmr.create().  No reason not to resume the timers, so resume em'.
   SWTIMER_REG_CB(alarm_timer_common, SWTIMER_RESUME);
+#endif
 
   return 0;
 }
@@ -0,0 +1,258 @@
+// Module for binary event tracing, see app/platform/trace.h
+//
+// trace.start([events])         -- (re)start recording into an empty ring
+// trace.stop()                  -- stop recording, keeping the events
+// trace.clear()                 -- stop and free the ring
+// trace.event(id[, a[, b]])     -- record an instant
+// trace.enter(id[, a[, b]])     -- record the start of a span
+// trace.leave(id[, a[, b]])     -- record the end of a span
+// trace.stats()                 -> recorded, dropped, size, running
+// trace.dump()                  -> { {t=us, ph=, name=, a=, b=}, ... }
+// trace.dump(filename)          -> events written, in the format read by
+//                                  tools/trace2chrome.py
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "trace.h"
+#include "vfs.h"
+#include "user_interface.h"
+#include <string.h>
+
+#if defined(LUA_USE_MODULES_TRACE) && !defined(TRACE_ENABLE)
+#error Must have TRACE_ENABLE set for TRACE module
+#endif
+
+#define TRACE_FILE_MAGIC   "NTRC"
+#define TRACE_FILE_VERSION 1
+
+/*
+ * Lua events are identified by a number or by a name.  Numbers are added to
+ * TRACE_USER, and names are given ids from TRACE_NAMED up, which are kept
+ * in a registry table mapped both name -> id and id -> name.
+ */
+#define TRACE_NAMED (TRACE_USER + 0x8000)
+static int names_ref = LUA_NOREF;
+static uint32_t names_next = TRACE_NAMED;
+
+/* Return the event id for the number or name at index i */
+static uint16_t trace_checkid(lua_State *L, int i) {
+  uint16_t id;
+  if (lua_type(L, i) != LUA_TSTRING) {
+    lua_Integer n = luaL_checkinteger(L, i);
+    luaL_argcheck(L, n >= 0 && n < TRACE_NAMED - TRACE_USER, i, "invalid id");
+    return TRACE_USER + n;
+  }
+  if (names_ref == LUA_NOREF) {
+    lua_newtable(L);
+    names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, names_ref);
+  lua_pushvalue(L, i);
+  lua_rawget(L, -2);
+  if (lua_isnumber(L, -1)) {
+    id = lua_tointeger(L, -1);
+  } else {
+    if (names_next > 0xFFFF)
+      return luaL_error(L, "too many event names");
+    id = names_next++;
+    lua_pushvalue(L, i);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -4);
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -3, id);
+  }
+  lua_pop(L, 2);
+  return id;
+}
+
+static int trace_lua_event(lua_State *L, uint8_t phase) {
+  uint16_t id = trace_checkid(L, 1);
+  uint32_t a = luaL_optinteger(L, 2, 0);
+  uint32_t b = luaL_optinteger(L, 3, 0);
+  TRACE_EVENT(id, phase, a, b);
+  return 0;
+}
+
+// Lua: trace.event(id[, a[, b]])
+static int trace_event(lua_State *L) {
+  return trace_lua_event(L, 'I');
+}
+
+// Lua: trace.enter(id[, a[, b]])
+static int trace_enter(lua_State *L) {
+  return trace_lua_event(L, 'B');
+}
+
+// Lua: trace.leave(id[, a[, b]])
+static int trace_leave(lua_State *L) {
+  return trace_lua_event(L, 'E');
+}
+
+// Lua: trace.start([events])
+static int trace_lstart(lua_State *L) {
+  lua_Integer events = luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, events >= 0 && events <= 0x4000, 1, "invalid size");
+  if (!trace_start(events))
+    return luaL_error(L, "out of memory");
+  return 0;
+}
+
+// Lua: trace.stop()
+static int trace_lstop(lua_State *L) {
+  trace_stop();
+  return 0;
+}
+
+// Lua: trace.clear()
+static int trace_clear(lua_State *L) {
+  trace_release();
+  return 0;
+}
+
+// Lua: recorded, dropped, size, running = trace.stats()
+static int trace_stats(lua_State *L) {
+  uint32_t size = trace_ring.ring ? trace_ring.mask + 1 : 0;
+  lua_pushinteger(L, trace_ring.head);
+  lua_pushinteger(L, trace_ring.head > size ? trace_ring.head - size : 0);
+  lua_pushinteger(L, size);
+  lua_pushboolean(L, trace_enabled);
+  return 4;
+}
+
+/* Push the name of an event id, or nil if it has none */
+static void trace_pushname(lua_State *L, uint16_t id) {
+  const char *name = trace_name(id);
+  if (name) {
+    lua_pushstring(L, name);
+  } else if (names_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, names_ref);
+    lua_rawgeti(L, -1, id);
+    lua_remove(L, -2);
+  } else {
+    lua_pushnil(L);
+  }
+}
+
+static bool trace_write(int fd, const void *p, size_t len) {
+  return vfs_write(fd, p, len) == len;
+}
+
+static bool trace_write_name(lua_State *L, int fd, uint16_t id) {
+  size_t len;
+  const char *name;
+  uint8_t len8;
+  bool ok;
+  trace_pushname(L, id);
+  name = lua_tolstring(L, -1, &len);
+  len8 = len > 255 ? 255 : len;
+  ok = trace_write(fd, &id, sizeof(id)) && trace_write(fd, &len8, 1) &&
+       trace_write(fd, name, len8);
+  lua_pop(L, 1);
+  return ok;
+}
+
+/*
+ * Write the binary dump: a header, the event names and then the events,
+ * oldest first.  All fields are little endian.
+ *
+ *   char magic[4]; uint16 version, names; uint32 cpu_mhz, recorded, events;
+ *   names x { uint16 id; uint8 len; char name[len]; }
+ *   events x trace_event_t
+ */
+static int trace_dump_file(lua_State *L, const char *filename,
+                           uint32_t first, uint32_t n) {
+  struct {
+    char magic[4];
+    uint16_t version, names;
+    uint32_t cpu_mhz, recorded, events;
+  } hdr = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION, 0,
+           system_get_cpu_freq(), trace_ring.head, n};
+  uint32_t i, id;
+  bool ok;
+  int fd = vfs_open(filename, "w");
+  if (!fd)
+    return luaL_error(L, "can't open %s", filename);
+
+  hdr.names = TRACE_SYSTEM_MAX - 1 + names_next - TRACE_NAMED;
+  ok = trace_write(fd, &hdr, sizeof(hdr));
+  for (id = 1; ok && id < TRACE_SYSTEM_MAX; id++)
+    ok = trace_write_name(L, fd, id);
+  for (id = TRACE_NAMED; ok && id < names_next; id++)
+    ok = trace_write_name(L, fd, id);
+  for (i = 0; ok && i < n; i++)
+    ok = trace_write(fd, trace_ring.ring + ((first + i) & trace_ring.mask),
+                     sizeof(trace_event_t));
+  vfs_close(fd);
+  if (!ok)
+    return luaL_error(L, "write failed");
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+// Lua: trace.dump([filename])
+static int trace_dump(lua_State *L) {
+  const char *filename = luaL_optstring(L, 1, NULL);
+  bool running = trace_enabled;
+  uint32_t size, n, first, i, mhz = system_get_cpu_freq();
+  uint32_t last;
+  uint64_t cycles = 0;
+  int ret;
+
+  if (!trace_ring.ring)
+    return luaL_error(L, "no trace");
+  trace_stop();                      /* the ring mustn't move under us */
+  size = trace_ring.mask + 1;
+  n = trace_ring.head < size ? trace_ring.head : size;
+  first = trace_ring.head - n;
+
+  if (filename) {
+    ret = trace_dump_file(L, filename, first, n);
+    trace_enabled = running;
+    return ret;
+  }
+  /*
+   * Times are in us from the first event.  CCOUNT wraps every 2^32 cycles
+   * (~27s at 160MHz) so it is unwrapped from event to event, which assumes
+   * that consecutive events are less than that apart.
+   */
+  lua_createtable(L, n, 0);
+  last = n ? trace_ring.ring[first & trace_ring.mask].ccount : 0;
+  for (i = 0; i < n; i++) {
+    const trace_event_t *e = trace_ring.ring + ((first + i) & trace_ring.mask);
+    char ph[2] = {e->phase, 0};
+    cycles += (uint32_t)(e->ccount - last);
+    last = e->ccount;
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, cycles / mhz);
+    lua_setfield(L, -2, "t");
+    lua_pushstring(L, ph);
+    lua_setfield(L, -2, "ph");
+    trace_pushname(L, e->id);
+    if (lua_isnil(L, -1)) {            /* a numbered Lua event */
+      lua_pop(L, 1);
+      lua_pushinteger(L, e->id - TRACE_USER);
+    }
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, e->a);
+    lua_setfield(L, -2, "a");
+    lua_pushinteger(L, e->b);
+    lua_setfield(L, -2, "b");
+    lua_rawseti(L, -2, i + 1);
+  }
+  trace_enabled = running;
+  return 1;
+}
+
+LROT_BEGIN(trace, NULL, 0)
+  LROT_FUNCENTRY( start, trace_lstart )
+  LROT_FUNCENTRY( stop, trace_lstop )
+  LROT_FUNCENTRY( clear, trace_clear )
+  LROT_FUNCENTRY( event, trace_event )
+  LROT_FUNCENTRY( enter, trace_enter )
+  LROT_FUNCENTRY( leave, trace_leave )
+  LROT_FUNCENTRY( stats, trace_stats )
+  LROT_FUNCENTRY( dump, trace_dump )
+LROT_END(trace, NULL, 0)
+
+NODEMCU_MODULE(TRACE, "trace", trace, NULL);
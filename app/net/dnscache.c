@@ -0,0 +1,320 @@
+/*
+ * Shared DNS resolver front-end, see dnscache.h.
+ *
+ * lwIP's own table is only DNS_TABLE_SIZE entries and its cache lookup is
+ * disabled, so each dns_gethostbyname() sends a query.  Here answers are kept
+ * in a small array, evicting the least recently used name, and expire after
+ * the TTL which lwIP read from the answer.  An entry which is being looked up
+ * holds the list of requesters waiting for it.
+ *
+ * Expiry times are in seconds on a clock kept from system_get_time().  That
+ * wraps after 71 minutes, so a timer reads it every minute while there are
+ * names in the cache, and also drops those which have expired.
+ *
+ * With DNS_CACHE_RTC_BASE, each entry is mirrored in three RTC memory slots
+ * as the hash of its name, its address and its expiry in rtctime seconds.
+ * After a deep sleep the entries still valid are restored without their
+ * names, and are matched on the hash until a lookup supplies the name again.
+ */
+
+#include "dnscache.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "user_modules.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(DNS_CACHE_RTC_BASE) && defined(LUA_USE_MODULES_RTCTIME)
+#include "rtc/rtcaccess.h"
+#include "rtc/rtctime.h"
+#define DNS_CACHE_RTC
+#define DNS_CACHE_RTC_MAGIC   (0x444e5300 + DNS_CACHE_RTC_ENTRIES)
+#define DNS_CACHE_RTC_MAX     ((RTC_USER_MEM_NUM_DWORDS - DNS_CACHE_RTC_BASE - 1) / 3)
+#define DNS_CACHE_RTC_ENTRIES (DNS_CACHE_SIZE < DNS_CACHE_RTC_MAX ? DNS_CACHE_SIZE : DNS_CACHE_RTC_MAX)
+#define DNS_CACHE_RTC_SLOT(i) (DNS_CACHE_RTC_BASE + 1 + 3 * (i))
+#endif
+
+#define DNS_CACHE_TICK_MS 60000
+
+/* as lwIP's dns.c */
+#ifndef DNS_MAX_TTL
+#define DNS_MAX_TTL 604800
+#endif
+
+enum { DC_FREE, DC_PENDING, DC_DONE };
+
+typedef struct dnscache_waiter {
+  struct dnscache_waiter *next;
+  dns_found_callback found;
+  void *arg;
+} dnscache_waiter_t;
+
+typedef struct {
+  char *name;                   /* NULL if restored from RTC memory */
+  uint32_t hash;
+  ip_addr_t addr;
+  uint32_t expires;             /* dnscache_now() seconds */
+  uint32_t used;                /* for LRU eviction */
+  dnscache_waiter_t *waiters;   /* pending: all requesters */
+  uint8_t state;
+} dnscache_entry_t;
+
+dnscache_stats_t dnscache_stats;
+
+static dnscache_entry_t dc_table[DNS_CACHE_SIZE];
+static uint32_t dc_seq;
+static uint32_t dc_secs, dc_last_us;
+static os_timer_t dc_timer;
+static bool dc_timer_armed;
+#ifdef DNS_CACHE_RTC
+static bool dc_restored;
+#endif
+
+static void dnscache_arm(void);
+
+static uint32_t dnscache_now(void) {
+  uint32_t secs = (system_get_time() - dc_last_us) / 1000000;
+  dc_secs += secs;
+  dc_last_us += secs * 1000000;
+  return dc_secs;
+}
+
+/* FNV-1a, never 0 as that marks an empty RTC memory entry */
+static uint32_t dnscache_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (uint8_t)*name) * 16777619u;
+  return h ? h : 1;
+}
+
+#pragma mark - RTC memory
+
+#ifdef DNS_CACHE_RTC
+static void dnscache_save(unsigned i) {
+  dnscache_entry_t *e = &dc_table[i];
+  if (i >= DNS_CACHE_RTC_ENTRIES)
+    return;
+  uint32_t hash = 0;
+  if (e->state == DC_DONE && rtctime_have_time()) {
+    struct rtc_timeval tv;
+    rtctime_gettimeofday(&tv);
+    hash = e->hash;
+    rtc_mem_write(DNS_CACHE_RTC_SLOT(i) + 1, ip4_addr_get_u32(&e->addr));
+    rtc_mem_write(DNS_CACHE_RTC_SLOT(i) + 2, tv.tv_sec + (e->expires - dnscache_now()));
+  }
+  rtc_mem_write(DNS_CACHE_RTC_SLOT(i), hash);
+  rtc_mem_write(DNS_CACHE_RTC_BASE, DNS_CACHE_RTC_MAGIC);
+}
+
+static void dnscache_restore(void) {
+  dc_restored = true;
+  if (rtc_mem_read(DNS_CACHE_RTC_BASE) != DNS_CACHE_RTC_MAGIC || !rtctime_have_time())
+    return;
+  struct rtc_timeval tv;
+  rtctime_gettimeofday(&tv);
+  uint32_t now = dnscache_now();
+  for (unsigned i = 0; i < DNS_CACHE_RTC_ENTRIES; i++) {
+    uint32_t hash = rtc_mem_read(DNS_CACHE_RTC_SLOT(i));
+    int32_t ttl = rtc_mem_read(DNS_CACHE_RTC_SLOT(i) + 2) - tv.tv_sec;
+    if (hash && ttl > 0 && ttl <= DNS_MAX_TTL) {
+      dnscache_entry_t *e = &dc_table[i];
+      e->hash = hash;
+      ip4_addr_set_u32(&e->addr, rtc_mem_read(DNS_CACHE_RTC_SLOT(i) + 1));
+      e->expires = now + ttl;
+      e->used = dc_seq++;
+      e->state = DC_DONE;
+    }
+  }
+  if (dnscache_count())
+    dnscache_arm();
+}
+#else
+#define dnscache_save(i)
+#endif
+
+#pragma mark - Cache
+
+static void dnscache_free(dnscache_entry_t *e) {
+  free(e->name);
+  e->name = NULL;
+  e->state = DC_FREE;
+  dnscache_save(e - dc_table);
+}
+
+static void dnscache_tick(void *arg) {
+  (void)arg;
+  uint32_t now = dnscache_now();
+  for (unsigned i = 0; i < DNS_CACHE_SIZE; i++) {
+    dnscache_entry_t *e = &dc_table[i];
+    if (e->state == DC_DONE && (int32_t)(e->expires - now) <= 0)
+      dnscache_free(e);
+  }
+  if (!dnscache_count()) {
+    os_timer_disarm(&dc_timer);
+    dc_timer_armed = false;
+  }
+}
+
+static void dnscache_arm(void) {
+  if (!dc_timer_armed) {
+    os_timer_setfn(&dc_timer, dnscache_tick, NULL);
+    os_timer_arm(&dc_timer, DNS_CACHE_TICK_MS, 1);
+    dc_timer_armed = true;
+  }
+}
+
+unsigned dnscache_count(void) {
+  unsigned n = 0;
+  for (unsigned i = 0; i < DNS_CACHE_SIZE; i++)
+    if (dc_table[i].state == DC_DONE)
+      n++;
+  return n;
+}
+
+void dnscache_flush(void) {
+  for (unsigned i = 0; i < DNS_CACHE_SIZE; i++)
+    if (dc_table[i].state == DC_DONE)
+      dnscache_free(&dc_table[i]);
+}
+
+static dnscache_entry_t *dnscache_find(const char *name, uint32_t hash) {
+  uint32_t now = dnscache_now();
+  for (unsigned i = 0; i < DNS_CACHE_SIZE; i++) {
+    dnscache_entry_t *e = &dc_table[i];
+    if (e->state == DC_FREE || e->hash != hash)
+      continue;
+    if (e->name && strcmp(e->name, name) != 0)
+      continue;
+    if (e->state == DC_DONE && (int32_t)(e->expires - now) <= 0) {
+      dnscache_free(e);
+      return NULL;
+    }
+    return e;
+  }
+  return NULL;
+}
+
+/* A free entry, or else the least recently used answer */
+static dnscache_entry_t *dnscache_alloc(void) {
+  dnscache_entry_t *lru = NULL;
+  for (unsigned i = 0; i < DNS_CACHE_SIZE; i++) {
+    dnscache_entry_t *e = &dc_table[i];
+    if (e->state == DC_FREE)
+      return e;
+    if (e->state == DC_DONE && (!lru || (int32_t)(e->used - lru->used) < 0))
+      lru = e;
+  }
+  if (lru)
+    dnscache_free(lru);
+  return lru;
+}
+
+static void dnscache_found(const char *name, ip_addr_t *ipaddr, void *arg) {
+  dnscache_entry_t *e = (dnscache_entry_t *)arg;
+  dnscache_waiter_t *w = e->waiters;
+  uint32_t ttl = ipaddr ? dns_getttl(name) : 0;
+  ip_addr_t addr;
+  if (ipaddr)
+    addr = *ipaddr;
+
+  /*
+   * The waiters are called with our copy of the name, which lwIP may reuse
+   * its own for, and which is taken out of the entry so that a callback
+   * which flushes the cache can't free it under us.
+   */
+  char *ours = e->name;
+  uint32_t hash = e->hash;
+  e->name = NULL;
+  e->waiters = NULL;
+  if (ttl) {
+    if (ttl > DNS_MAX_TTL)
+      ttl = DNS_MAX_TTL;
+    e->addr = addr;
+    e->expires = dnscache_now() + ttl;
+    e->used = dc_seq++;
+    e->state = DC_DONE;
+    dnscache_save(e - dc_table);
+    dnscache_arm();
+  } else {
+    e->state = DC_FREE;
+  }
+
+  while (w) {
+    dnscache_waiter_t *next = w->next;
+    dns_found_callback found = w->found;
+    void *found_arg = w->arg;
+    free(w);
+    w = next;
+    found(ours, ipaddr ? &addr : NULL, found_arg);
+  }
+
+  if (e->state == DC_DONE && e->hash == hash && !e->name)
+    e->name = ours;
+  else
+    free(ours);
+}
+
+err_t dnscache_gethostbyname(const char *hostname, ip_addr_t *addr,
+                             dns_found_callback found, void *callback_arg) {
+  if (!addr || !hostname || !hostname[0] || strlen(hostname) >= DNS_MAX_NAME_LENGTH)
+    return ERR_ARG;
+  if (ipaddr_aton(hostname, addr))
+    return ERR_OK;
+#ifdef DNS_CACHE_RTC
+  if (!dc_restored)
+    dnscache_restore();
+#endif
+
+  uint32_t hash = dnscache_hash(hostname);
+  dnscache_entry_t *e = dnscache_find(hostname, hash);
+  if (e && e->state == DC_DONE) {
+    if (!e->name)
+      e->name = strdup(hostname);
+    e->used = dc_seq++;
+    *addr = e->addr;
+    dnscache_stats.hits++;
+    METRIC_INC(METRIC_NET_DNS_HITS, 1);
+    return ERR_OK;
+  }
+
+  dnscache_waiter_t *w = malloc(sizeof(*w));
+  if (!w)
+    return ERR_MEM;
+  w->found = found;
+  w->arg = callback_arg;
+  w->next = NULL;
+  if (e) {
+    dnscache_waiter_t **pw = &e->waiters;
+    while (*pw)
+      pw = &(*pw)->next;
+    *pw = w;
+    dnscache_stats.shared++;
+    METRIC_INC(METRIC_NET_DNS_SHARED, 1);
+    return ERR_INPROGRESS;
+  }
+
+  /* every entry is pending: pass the request straight through */
+  e = dnscache_alloc();
+  char *name = e ? strdup(hostname) : NULL;
+  if (!name) {
+    free(w);
+    return dns_gethostbyname(hostname, addr, found, callback_arg);
+  }
+  e->name = name;
+  e->hash = hash;
+  e->waiters = w;
+  e->state = DC_PENDING;
+  err_t err = dns_gethostbyname(hostname, addr, dnscache_found, e);
+  if (err == ERR_INPROGRESS) {
+    dnscache_stats.misses++;
+    METRIC_INC(METRIC_NET_DNS_MISSES, 1);
+  } else {
+    /* answered locally, or failed */
+    e->waiters = NULL;
+    free(w);
+    dnscache_free(e);
+  }
+  return err;
+}
@@ -0,0 +1,130 @@
+/*
+ * Metrics registry, see metrics.h.
+ */
+#include "platform.h"
+#include "metrics.h"
+#include "cpu_esp8266_irq.h"
+#include <string.h>
+
+#ifdef METRICS_ENABLE
+
+#define COUNTER(nm)  {.name = nm, .type = METRIC_COUNTER}
+#define HISTOGRAM(nm, at, n) {.name = nm, .type = METRIC_HISTOGRAM, .pool = at, .nbounds = n}
+
+/* tmr.callback_us bounds, with their counts following */
+#define TMR_CALLBACK_BOUNDS 100, 1000, 10000, 100000
+#define TMR_CALLBACK_NBOUNDS 4
+
+metric_t metrics[METRICS_MAX] = {
+  [METRIC_NET_TCP_RX_BYTES]   = COUNTER("net.tcp.rx_bytes"),
+  [METRIC_NET_TCP_TX_BYTES]   = COUNTER("net.tcp.tx_bytes"),
+  [METRIC_NET_UDP_RX_BYTES]   = COUNTER("net.udp.rx_bytes"),
+  [METRIC_NET_UDP_TX_BYTES]   = COUNTER("net.udp.tx_bytes"),
+  [METRIC_NET_UDP_RX_DROPS]   = COUNTER("net.udp.rx_drops"),
+  [METRIC_NET_ACCEPTS]        = COUNTER("net.accepts"),
+  [METRIC_NET_CONNECTS]       = COUNTER("net.connects"),
+  [METRIC_NET_ERRORS]         = COUNTER("net.errors"),
+  [METRIC_NET_DNS_HITS]       = COUNTER("net.dns.hits"),
+  [METRIC_NET_DNS_MISSES]     = COUNTER("net.dns.misses"),
+  [METRIC_NET_DNS_SHARED]     = COUNTER("net.dns.shared"),
+  [METRIC_MQTT_PUBLISHED]     = COUNTER("mqtt.published"),
+  [METRIC_MQTT_RECEIVED]      = COUNTER("mqtt.received"),
+  [METRIC_MQTT_CONNECT_FAILS] = COUNTER("mqtt.connect_fails"),
+  [METRIC_TLS_FULL_HANDSHAKES] = COUNTER("tls.full_handshakes"),
+  [METRIC_TLS_RESUMED_HANDSHAKES] = COUNTER("tls.resumed_handshakes"),
+  [METRIC_FILE_OPENS]         = COUNTER("file.opens"),
+  [METRIC_FILE_OPEN_FAILS]    = COUNTER("file.open_fails"),
+  [METRIC_FILE_READ_BYTES]    = COUNTER("file.read_bytes"),
+  [METRIC_FILE_WRITE_BYTES]   = COUNTER("file.write_bytes"),
+  [METRIC_TMR_FIRES]          = COUNTER("tmr.fires"),
+  [METRIC_TMR_ERRORS]         = COUNTER("tmr.errors"),
+  [METRIC_TMR_CALLBACK_US]    = HISTOGRAM("tmr.callback_us", 0, TMR_CALLBACK_NBOUNDS),
+  [METRIC_GPIO_INTERRUPTS]    = COUNTER("gpio.interrupts"),
+};
+uint32_t metrics_pool[METRICS_POOL_WORDS] = {TMR_CALLBACK_BOUNDS};
+uint16_t metrics_count = METRIC_CORE_COUNT;
+static uint16_t pool_used = 2 * TMR_CALLBACK_NBOUNDS + 1;
+
+/*
+ * Register a metric, or return the existing one of that name if it has the
+ * same type (and for histograms, bounds).  The name is not copied so must
+ * outlive the metric.  Histogram bounds must be ascending.  Returns the
+ * metric's id, or -1 if the registry is full or the name is taken.
+ */
+int metrics_register(const char *name, metric_type_t type,
+                     const uint32_t *bounds, unsigned nbounds) {
+  int id = metrics_find(name);
+  metric_t *m;
+  if (id >= 0) {
+    m = metrics + id;
+    if (m->type != type || (type == METRIC_HISTOGRAM &&
+        (m->nbounds != nbounds ||
+         memcmp(metrics_bounds(m), bounds, nbounds * sizeof(uint32_t)))))
+      return -1;
+    return id;
+  }
+  if (metrics_count == METRICS_MAX)
+    return -1;
+  m = metrics + metrics_count;
+  if (type == METRIC_HISTOGRAM) {
+    if (nbounds == 0 || nbounds > METRICS_BUCKETS_MAX ||
+        pool_used + 2 * nbounds + 1 > METRICS_POOL_WORDS)
+      return -1;
+    m->pool = pool_used;
+    m->nbounds = nbounds;
+    memcpy(metrics_bounds(m), bounds, nbounds * sizeof(uint32_t));
+    memset(metrics_buckets(m), 0, (nbounds + 1) * sizeof(uint32_t));
+    pool_used += 2 * nbounds + 1;
+  }
+  m->name = name;
+  m->type = type;
+  m->value = m->isr = 0;
+  return metrics_count++;
+}
+
+int metrics_find(const char *name) {
+  int i;
+  for (i = 0; i < metrics_count; i++)
+    if (!strcmp(metrics[i].name, name))
+      return i;
+  return -1;
+}
+
+void metrics_observe(int id, uint32_t v) {
+  metric_t *m = metrics + id;
+  const uint32_t *bounds = metrics_bounds(m);
+  unsigned b = 0;
+  while (b < m->nbounds && v > bounds[b])
+    b++;
+  metrics_buckets(m)[b]++;
+  m->value += v;
+}
+
+/* The value of a counter or gauge, or the number of histogram samples */
+uint32_t metrics_read(int id) {
+  metric_t *m = metrics + id;
+  uint32_t n = 0;
+  unsigned b;
+  if (m->type == METRIC_COUNTER)
+    return m->value + m->isr;
+  if (m->type == METRIC_GAUGE)
+    return m->value;
+  for (b = 0; b <= m->nbounds; b++)
+    n += metrics_buckets(m)[b];
+  return n;
+}
+
+/* Zero a counter or histogram.  Gauges keep their value. */
+void metrics_reset(int id) {
+  metric_t *m = metrics + id;
+  if (m->type == METRIC_COUNTER) {
+    uint32_t state = esp8266_defer_irqs();
+    m->value = m->isr = 0;
+    esp8266_restore_irqs(state);
+  } else if (m->type == METRIC_HISTOGRAM) {
+    m->value = 0;
+    memset(metrics_buckets(m), 0, (m->nbounds + 1) * sizeof(uint32_t));
+  }
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+/*
+ * Metrics registry.  Counters, gauges and fixed-bucket histograms are held in
+ * one flat array and are identified by their index in it.  The firmware's own
+ * metrics have fixed indices (metric_id_t), and more can be registered at run
+ * time, mostly from Lua.  Updates are O(1) and allocate nothing.
+ *
+ * A counter has two words: one which is only written at task level and one
+ * which is only written by ISRs, so neither needs a lock and the two are
+ * summed when read.  Gauges and histograms are task level only.
+ *
+ * The METRIC_* macros compile to nothing unless METRICS_ENABLE is defined in
+ * user_config.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "user_config.h"
+
+typedef enum {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM
+} metric_type_t;
+
+/* The firmware's metrics, see the table in metrics.c */
+typedef enum {
+  METRIC_NET_TCP_RX_BYTES,
+  METRIC_NET_TCP_TX_BYTES,
+  METRIC_NET_UDP_RX_BYTES,
+  METRIC_NET_UDP_TX_BYTES,
+  METRIC_NET_UDP_RX_DROPS,
+  METRIC_NET_ACCEPTS,
+  METRIC_NET_CONNECTS,
+  METRIC_NET_ERRORS,
+  METRIC_NET_DNS_HITS,
+  METRIC_NET_DNS_MISSES,
+  METRIC_NET_DNS_SHARED,
+  METRIC_MQTT_PUBLISHED,
+  METRIC_MQTT_RECEIVED,
+  METRIC_MQTT_CONNECT_FAILS,
+  METRIC_TLS_FULL_HANDSHAKES,
+  METRIC_TLS_RESUMED_HANDSHAKES,
+  METRIC_FILE_OPENS,
+  METRIC_FILE_OPEN_FAILS,
+  METRIC_FILE_READ_BYTES,
+  METRIC_FILE_WRITE_BYTES,
+  METRIC_TMR_FIRES,
+  METRIC_TMR_ERRORS,
+  METRIC_TMR_CALLBACK_US,
+  METRIC_GPIO_INTERRUPTS,
+  METRIC_CORE_COUNT
+} metric_id_t;
+
+#ifndef METRICS_MAX
+#define METRICS_MAX 48                  /* including the firmware's metrics */
+#endif
+#ifndef METRICS_POOL_WORDS
+#define METRICS_POOL_WORDS 96           /* histogram bucket bounds and counts */
+#endif
+#define METRICS_BUCKETS_MAX 16
+
+typedef struct {
+  const char *name;
+  uint8_t type;
+  uint8_t nbounds;              /* histogram: buckets are nbounds + 1 */
+  uint16_t pool;                /* histogram: bounds then counts in the pool */
+  volatile uint32_t value;      /* counter, gauge (as int32_t) or sum */
+  volatile uint32_t isr;        /* counter increments made by ISRs */
+} metric_t;
+
+extern metric_t metrics[METRICS_MAX];
+extern uint32_t metrics_pool[METRICS_POOL_WORDS];
+extern uint16_t metrics_count;
+
+int metrics_register(const char *name, metric_type_t type,
+                     const uint32_t *bounds, unsigned nbounds);
+int metrics_find(const char *name);
+void metrics_observe(int id, uint32_t v);
+uint32_t metrics_read(int id);
+void metrics_reset(int id);
+
+/* A histogram's bounds, and its counts with the last for the overflow bucket */
+#define metrics_bounds(m)  (metrics_pool + (m)->pool)
+#define metrics_buckets(m) (metrics_pool + (m)->pool + (m)->nbounds)
+
+#ifdef METRICS_ENABLE
+#define METRIC_INC(id, n)     (metrics[id].value += (n))
+#define METRIC_INC_ISR(id, n) (metrics[id].isr += (n))
+#define METRIC_SET(id, v)     (metrics[id].value = (uint32_t)(v))
+#define METRIC_OBSERVE(id, v) metrics_observe(id, v)
+#else
+#define METRIC_INC(id, n)     ((void)0)
+#define METRIC_INC_ISR(id, n) ((void)0)
+#define METRIC_SET(id, v)     ((void)0)
+#define METRIC_OBSERVE(id, v) ((void)0)
+#endif
+
+#endif
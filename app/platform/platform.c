@@ -13,6 +13,10 @@
 #include "driver/spi.h"
 #include "driver/uart.h"
 #include "driver/sigma_delta.h"
+#include "cpu_esp8266_irq.h"
+#include "trace.h"
+#include "metrics.h"
+#include "scratch.h"
 
 #define INTERRUPT_TYPE_IS_LEVEL(x)   ((x) >= GPIO_PIN_INTR_LOLEVEL)
 
@@ -216,6 +220,8 @@ static void ICACHE_RAM_ATTR platform_gpio_intr_dispatcher (void *dummy){
   uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
   uint32_t now = system_get_time();
   (void)(dummy);
+  TRACE_INSTANT(TRACE_GPIO_ISR, gpio_status, 0);
+  METRIC_INC_ISR(METRIC_GPIO_INTERRUPTS, 1);
 
 #ifdef GPIO_INTERRUPT_HOOK_ENABLE
   if (gpio_status & platform_gpio_hook->all_bits) {
@@ -1094,29 +1100,135 @@ void* platform_print_deprecation_note( const char *msg, const char *time_frame)
 #define TH_UNMASK  (~TH_MASK)
 #define TH_SHIFT   2
 #define TH_ALLOCATION_BRICK 4   // must be a power of 2
+#define TH_DOORBELL (TH_MONIKER - 4)
 #define TASK_DEFAULT_QUEUE_LEN 8
 #define TASK_PRIORITY_MASK    3
 #define TASK_PRIORITY_COUNT   3
+#define TASK_LATENCY_BUCKETS  32
+
+#ifndef PLATFORM_TASK_QUEUE_LOW
+# define PLATFORM_TASK_QUEUE_LOW     16
+#endif
+#ifndef PLATFORM_TASK_QUEUE_MEDIUM
+# define PLATFORM_TASK_QUEUE_MEDIUM  16
+#endif
+#ifndef PLATFORM_TASK_QUEUE_HIGH
+# define PLATFORM_TASK_QUEUE_HIGH    32
+#endif
+
+/*
+ * Each priority has a platform ring of posted tasks in front of its SDK event
+ * queue.  A post is added to the ring together with its CCOUNT, and the SDK
+ * queue only carries "doorbell" events: at most one per queued task, up to the
+ * SDK queue length.  Each doorbell dispatches the oldest task in the ring and
+ * rings again if tasks are still waiting without a doorbell.  So a burst of
+ * posts is only dropped once the ring overflows, rather than the 8 entry SDK
+ * queue, and the post-to-dispatch latency of every task can be measured.
+ *
+ * platform_post() can be called from ISRs, so ring updates are done with
+ * interrupts deferred, but the SDK post itself is done outside this.
+ */
+typedef struct {
+  platform_task_handle_t handle;
+  platform_task_param_t  par;
+  uint32_t ccount;
+} task_entry_t;
+
+typedef struct {
+  task_entry_t *ring;
+  uint16_t size, head, count;
+  uint16_t bells;                                 /* doorbells in SDK queue */
+  uint16_t max_depth;
+  uint32_t posts, drops;
+  uint32_t latency[TASK_LATENCY_BUCKETS];     /* log2 histogram of CCOUNT */
+} task_queue_t;
 
 /*
  * Private struct to hold the 3 event task queues and the dispatch callbacks
  */
 static struct taskQblock {
-  os_event_t *task_Q[TASK_PRIORITY_COUNT];
+  os_event_t *sdk_Q[TASK_PRIORITY_COUNT];
+  task_queue_t task_Q[TASK_PRIORITY_COUNT];
   platform_task_callback_t *task_func;
   int task_count;
   } TQB = {0};
 
+static void ICACHE_RAM_ATTR task_ring_doorbell (uint8 prio) {
+  if (!system_os_post(prio, TH_DOORBELL | prio, 0)) {
+    uint32_t state = esp8266_defer_irqs();
+    TQB.task_Q[prio].bells--;
+    esp8266_restore_irqs(state);
+  }
+}
+
+bool ICACHE_RAM_ATTR platform_post (uint8 prio, platform_task_handle_t handle, platform_task_param_t par) {
+  task_queue_t *q = TQB.task_Q + prio;
+  bool ring = false;
+  if (prio >= TASK_PRIORITY_COUNT || !q->ring)
+    return false;
+  uint32_t state = esp8266_defer_irqs();
+  if (q->count == q->size) {
+    q->drops++;
+    esp8266_restore_irqs(state);
+    return false;
+  }
+  uint16_t tail = q->head + q->count;
+  task_entry_t *e = q->ring + (tail >= q->size ? tail - q->size : tail);
+  e->handle = handle;
+  e->par    = par;
+  e->ccount = CCOUNT_REG;
+  q->posts++;
+  if (++q->count > q->max_depth)
+    q->max_depth = q->count;
+  if (q->bells < TASK_DEFAULT_QUEUE_LEN) {
+    q->bells++;
+    ring = true;
+  }
+  esp8266_restore_irqs(state);
+  if (ring)
+    task_ring_doorbell(prio);
+  return true;
+}
+
 static void platform_task_dispatch (os_event_t *e) {
-  platform_task_handle_t handle = e->sig;
+  uint8_t prio = e->sig & TASK_PRIORITY_MASK;
+  task_queue_t *q = TQB.task_Q + prio;
+  task_entry_t t;
+  bool ring = false;
+  if ((e->sig & ~TASK_PRIORITY_MASK) != TH_DOORBELL || prio >= TASK_PRIORITY_COUNT)
+    return;
+
+  uint32_t state = esp8266_defer_irqs();
+  q->bells--;
+  if (q->count == 0) {
+    esp8266_restore_irqs(state);
+    return;
+  }
+  t = q->ring[q->head];
+  if (++q->head == q->size)
+    q->head = 0;
+  q->count--;
+  if (q->count > q->bells && q->bells < TASK_DEFAULT_QUEUE_LEN) {
+    q->bells++;
+    ring = true;
+  }
+  esp8266_restore_irqs(state);
+  if (ring)
+    task_ring_doorbell(prio);
+
+  uint32_t latency = CCOUNT_REG - t.ccount;
+  q->latency[31 - __builtin_clz(latency | 1)]++;
+
+  platform_task_handle_t handle = t.handle;
   if ( (handle & TH_MASK) == TH_MONIKER) {
     uint16_t entry    = (handle & TH_UNMASK) >> TH_SHIFT;
-    uint8_t  priority = handle & TASK_PRIORITY_MASK;
-    if ( priority <= PLATFORM_TASK_PRIORITY_HIGH &&
-         TQB.task_func &&
+    if ( TQB.task_func &&
          entry < TQB.task_count ){
       /* call the registered task handler with the specified parameter and priority */
-      TQB.task_func[entry](e->par, priority);
+      TRACE_BEGIN(TRACE_TASK, handle, prio);
+      TQB.task_func[entry](t.par, prio);
+      TRACE_END(TRACE_TASK, handle, prio);
+      scratch_reset();
       return;
     }
   }
@@ -1128,17 +1240,201 @@ static void platform_task_dispatch (os_event_t *e) {
  * Initialise the task handle callback for a given priority.
  */
 static int task_init_handler (void) {
+  static const uint16_t ring_size[TASK_PRIORITY_COUNT] = {
+    PLATFORM_TASK_QUEUE_LOW, PLATFORM_TASK_QUEUE_MEDIUM, PLATFORM_TASK_QUEUE_HIGH};
   int p, qlen = TASK_DEFAULT_QUEUE_LEN;
   for (p = 0; p < TASK_PRIORITY_COUNT; p++){
-    TQB.task_Q[p] = (os_event_t *) malloc( sizeof(os_event_t)*qlen );
-    if (TQB.task_Q[p]) {
-      os_memset(TQB.task_Q[p], 0, sizeof(os_event_t)*qlen);
-      system_os_task(platform_task_dispatch, p, TQB.task_Q[p], TASK_DEFAULT_QUEUE_LEN);
+    TQB.sdk_Q[p] = (os_event_t *) malloc( sizeof(os_event_t)*qlen );
+    TQB.task_Q[p].ring = (task_entry_t *) malloc( sizeof(task_entry_t)*ring_size[p] );
+    if (TQB.sdk_Q[p] && TQB.task_Q[p].ring) {
+      os_memset(TQB.sdk_Q[p], 0, sizeof(os_event_t)*qlen);
+      TQB.task_Q[p].size = ring_size[p];
+      system_os_task(platform_task_dispatch, p, TQB.sdk_Q[p], TASK_DEFAULT_QUEUE_LEN);
     } else {
       NODE_DBG ( "Malloc failure in platform_task_init_handler" );
       return PLATFORM_ERR;
     }
   }
+  return PLATFORM_OK;
+}
+
+/*
+ * Return the queue statistics for a priority, with the latency percentiles
+ * given as the upper bound of the histogram bucket that they fall in.
+ */
+int platform_task_stats (uint8 prio, platform_task_stats_t *stats, bool reset) {
+  task_queue_t *q = TQB.task_Q + prio;
+  uint32_t hist[TASK_LATENCY_BUCKETS];
+  uint64_t n = 0, cum = 0;
+  int b;
+  if (prio >= TASK_PRIORITY_COUNT)
+    return PLATFORM_ERR;
+  uint32_t state = esp8266_defer_irqs();
+  stats->posts     = q->posts;
+  stats->drops     = q->drops;
+  stats->depth     = q->count;
+  stats->max_depth = q->max_depth;
+  stats->size      = q->size;
+  if (reset) {
+    q->posts = q->drops = 0;
+    q->max_depth = q->count;
+  }
+  esp8266_restore_irqs(state);
+  /* the histogram is only updated at task level, so needs no locking */
+  memcpy(hist, q->latency, sizeof(hist));
+  if (reset)
+    memset(q->latency, 0, sizeof(q->latency));
+  for (b = 0; b < TASK_LATENCY_BUCKETS; b++)
+    n += hist[b];
+  stats->p50 = stats->p99 = 0;
+  for (b = 0; b < TASK_LATENCY_BUCKETS && n; b++) {
+    uint32_t upper = b == 31 ? 0xFFFFFFFF : (2u << b) - 1;
+    cum += hist[b];
+    if (!stats->p50 && cum * 2 >= n)
+      stats->p50 = upper;
+    if (cum * 100 >= n * 99) {
+      stats->p99 = upper;
+      break;
+    }
+  }
+  return PLATFORM_OK;
+}
+
+
+platform_heap_counts_t platform_heap_counts;
+static platform_heap_failure_cb_t heap_failure_cb;
+
+/* The heap lies in dram0_0_seg, from _heap_start, see ld/nodemcu.ld */
+#define HEAP_BASE     0x3FFE8000
+#define HEAP_END      0x3FFFC000
+#define HEAP_GRANULES ((HEAP_END - HEAP_BASE) / PLATFORM_HEAP_GRANULE)
+extern char _heap_start[];
+
+static uint32_t heap_used[HEAP_GRANULES / 32];   /* granule is in a block */
+static uint32_t heap_first[HEAP_GRANULES / 32];  /* granule starts a block */
+
+#define heap_bit(map, g)  ((map)[(g) >> 5] & (1u << ((g) & 31)))
+#define heap_set(map, g)  ((map)[(g) >> 5] |= 1u << ((g) & 31))
+#define heap_clr(map, g)  ((map)[(g) >> 5] &= ~(1u << ((g) & 31)))
+
+/* Mark the n byte block at p in use; blocks from IRAM aren't tracked */
+static void heap_mark (void *p, size_t n) {
+  uint32_t a = (uint32_t) p, g, e;
+  if (a < HEAP_BASE || a >= HEAP_END)
+    return;
+  g = (a - HEAP_BASE) / PLATFORM_HEAP_GRANULE;
+  e = (a + (n ? n : 1) - HEAP_BASE + PLATFORM_HEAP_GRANULE - 1) / PLATFORM_HEAP_GRANULE;
+  heap_set(heap_first, g);
+  for (; g < e && g < HEAP_GRANULES; g++)
+    heap_set(heap_used, g);
+}
+
+/* Clear the block at p, up to the next block or free granule */
+static void heap_unmark (void *p) {
+  uint32_t a = (uint32_t) p, g;
+  if (a < HEAP_BASE || a >= HEAP_END)
+    return;
+  g = (a - HEAP_BASE) / PLATFORM_HEAP_GRANULE;
+  if (!heap_bit(heap_first, g))
+    return;
+  heap_clr(heap_first, g);
+  do {
+    heap_clr(heap_used, g);
+    g++;
+  } while (g < HEAP_GRANULES && heap_bit(heap_used, g) && !heap_bit(heap_first, g));
+}
+
+static void *heap_alloced (void *p, size_t n) {
+  if (p) {
+    platform_heap_counts.allocs++;
+    heap_mark(p, n);
+  } else {
+    platform_heap_counts.fails++;
+  }
+  return p;
+}
+
+/* The SDK allocator, wrapped with -Wl,--wrap by app/Makefile */
+void *__real_pvPortMalloc (size_t sz, const char *file, unsigned line, bool iram);
+void *__real_pvPortZalloc (size_t sz, const char *file, unsigned line);
+void *__real_pvPortCalloc (size_t count, size_t sz, const char *file, unsigned line);
+void *__real_pvPortRealloc (void *p, size_t sz, const char *file, unsigned line);
+void __real_vPortFree (void *p, const char *file, unsigned line);
+
+void *__wrap_pvPortMalloc (size_t sz, const char *file, unsigned line, bool iram) {
+  return heap_alloced(__real_pvPortMalloc(sz, file, line, iram), sz);
+}
+
+void *__wrap_pvPortZalloc (size_t sz, const char *file, unsigned line) {
+  return heap_alloced(__real_pvPortZalloc(sz, file, line), sz);
+}
+
+void *__wrap_pvPortCalloc (size_t count, size_t sz, const char *file, unsigned line) {
+  return heap_alloced(__real_pvPortCalloc(count, sz, file, line), count * sz);
+}
+
+void *__wrap_pvPortRealloc (void *p, size_t sz, const char *file, unsigned line) {
+  void *q = __real_pvPortRealloc(p, sz, file, line);
+  if (!p)
+    return heap_alloced(q, sz);
+  if (sz == 0) {
+    platform_heap_counts.frees++;
+    heap_unmark(p);
+  } else if (!q) {
+    platform_heap_counts.fails++;
+  } else {
+    heap_unmark(p);
+    heap_mark(q, sz);
+  }
+  return q;
+}
+
+void __wrap_vPortFree (void *p, const char *file, unsigned line) {
+  if (p) {
+    platform_heap_counts.frees++;
+    heap_unmark(p);
+  }
+  __real_vPortFree(p, file, line);
+}
+
+static void heap_count_block (platform_heap_info_t *info, uint32_t n) {
+  int b = 31 - __builtin_clz(n) - 5;
+  if (n > info->largest)
+    info->largest = n;
+  info->counted += n;
+  info->blocks++;
+  info->hist[b < PLATFORM_HEAP_BUCKETS ? b : PLATFORM_HEAP_BUCKETS - 1]++;
+}
+
+void platform_heap_info (platform_heap_info_t *info) {
+  uint32_t g = ((uint32_t) _heap_start - HEAP_BASE + PLATFORM_HEAP_GRANULE - 1) /
+               PLATFORM_HEAP_GRANULE;
+  uint32_t run = 0;
+  memset(info, 0, sizeof(*info));
+  info->total = system_get_free_heap_size();
+  for (; g < HEAP_GRANULES; g++) {
+    if (!heap_bit(heap_used, g)) {
+      run++;
+    } else if (run) {
+      if (run * PLATFORM_HEAP_GRANULE >= PLATFORM_HEAP_MINBLOCK)
+        heap_count_block(info, run * PLATFORM_HEAP_GRANULE);
+      run = 0;
+    }
+  }
+  if (run * PLATFORM_HEAP_GRANULE >= PLATFORM_HEAP_MINBLOCK)
+    heap_count_block(info, run * PLATFORM_HEAP_GRANULE);
+}
+
+void platform_heap_failure (uint32_t size) {
+  platform_heap_info_t info;
+  if (heap_failure_cb) {
+    platform_heap_info(&info);
+    heap_failure_cb(size, &info);
+  }
+}
+
+void platform_heap_set_failure_cb (platform_heap_failure_cb_t cb) {
+  heap_failure_cb = cb;
 }
 
 
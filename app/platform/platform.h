@@ -382,23 +382,83 @@ uint32_t platform_rcr_write (uint8_t rec_id, const void *rec, uint8_t size);
 typedef void (*platform_task_callback_t)(platform_task_param_t param, uint8 prio);
 platform_task_handle_t platform_task_get_id(platform_task_callback_t t);
 
-static inline bool platform_post(uint8 prio, platform_task_handle_t handle, platform_task_param_t par) {
-  return system_os_post(prio, handle | prio, par);
-}
+bool platform_post(uint8 prio, platform_task_handle_t handle, platform_task_param_t par);
+
+typedef struct {
+  uint32_t posts;      /* tasks posted */
+  uint32_t drops;      /* posts rejected because the queue was full */
+  uint16_t depth;      /* tasks currently queued */
+  uint16_t max_depth;  /* high water mark of depth */
+  uint16_t size;       /* queue capacity */
+  uint32_t p50, p99;   /* post-to-dispatch latency percentiles in CCOUNT cycles */
+} platform_task_stats_t;
+
+int platform_task_stats(uint8 prio, platform_task_stats_t *stats, bool reset);
 #define platform_freeheap() system_get_free_heap_size()
 
+/*
+ * Heap fragmentation.  The SDK heap can't be walked, so the SDK allocator is
+ * wrapped at link time, see -Wl,--wrap in app/Makefile, and the wrappers keep
+ * a bitmap of the heap's granules in use, with a second bitmap marking where
+ * each block starts so that a free knows how far its block goes.  The free
+ * blocks are the runs of clear bits, which platform_heap_info() counts in
+ * log2 size buckets from 32 bytes without allocating anything, so it may be
+ * called from inside an allocator.  Sizes are to within a granule, as the
+ * allocator's headers and rounding aren't seen.
+ *
+ * The wrappers also count all allocations, frees and failures.  The Lua
+ * allocator calls platform_heap_failure() when an allocation fails, before
+ * any emergency GC, which passes the size and the heap's state to the
+ * failure callback if set.
+ */
+#define PLATFORM_HEAP_BUCKETS  11      /* 32-63, 64-127, ... 32K and over */
+#define PLATFORM_HEAP_GRANULE  16
+#define PLATFORM_HEAP_MINBLOCK 32
+
+typedef struct {
+  uint32_t total;      /* free heap reported by the SDK */
+  uint32_t largest;    /* largest free block */
+  uint32_t counted;    /* total size of the blocks counted */
+  uint16_t blocks;     /* number of free blocks of MINBLOCK or more */
+  uint16_t hist[PLATFORM_HEAP_BUCKETS];
+} platform_heap_info_t;
+
+typedef struct {
+  uint32_t allocs, frees, fails;
+} platform_heap_counts_t;
+
+extern platform_heap_counts_t platform_heap_counts;
+
+typedef void (*platform_heap_failure_cb_t)(uint32_t size, const platform_heap_info_t *info);
+
+void platform_heap_info(platform_heap_info_t *info);
+void platform_heap_failure(uint32_t size);
+void platform_heap_set_failure_cb(platform_heap_failure_cb_t cb);
+
 // Get current value of CCOUNt register
 #define CCOUNT_REG ({ int32_t r; asm volatile("rsr %0, ccount" : "=r"(r)); r;})
 
+/*
+ * Boot profiling.  STARTUP_COUNT records an instant at the current line, and
+ * STARTUP_BEGIN / STARTUP_END bracket a named boot phase.  Each entry holds
+ * both CCOUNT and system_get_time(), as the CPU clock changes during boot.
+ * The name must be a string constant (or otherwise outlive the boot).
+ */
 typedef struct {
   const char *name;
   int line;
   int32_t ccount;
+  uint32_t us;
+  char phase;            /* 'B'egin, 'E'nd or 'I'nstant */
 } platform_count_entry_t;
 
+#ifndef PLATFORM_STARTUP_COUNT_SIZE
+#define PLATFORM_STARTUP_COUNT_SIZE 80
+#endif
+
 typedef struct {
   int used;
-  platform_count_entry_t entries[32];
+  platform_count_entry_t entries[PLATFORM_STARTUP_COUNT_SIZE];
 } platform_startup_counts_t;
 
 extern platform_startup_counts_t platform_startup_counts;
@@ -407,12 +467,17 @@ extern platform_startup_counts_t platform_startup_counts;
                                         / sizeof(platform_startup_counts.entries[0]))
 
 #ifdef PLATFORM_STARTUP_COUNT
-#define STARTUP_ENTRY(lineno) do { if (platform_startup_counts.used < PLATFORM_STARTUP_COUNT_ENTRIES) {\
-        platform_count_entry_t *p = &platform_startup_counts.entries[platform_startup_counts.used++]; \
-        p->name = __func__; p->ccount = CCOUNT_REG; p->line = lineno; }  } while(0)
+#define STARTUP_EVENT(nm, lineno, ph) do { if (platform_startup_counts.used < PLATFORM_STARTUP_COUNT_ENTRIES) {\
+        const char *_n = (nm); \
+        platform_count_entry_t *_e = &platform_startup_counts.entries[platform_startup_counts.used++]; \
+        _e->name = _n; _e->ccount = CCOUNT_REG; _e->us = system_get_time(); \
+        _e->line = lineno; _e->phase = ph; }  } while(0)
 #else
-#define STARTUP_ENTRY(line)
+#define STARTUP_EVENT(nm, lineno, ph)
 #endif
+#define STARTUP_ENTRY(lineno) STARTUP_EVENT(__func__, lineno, 'I')
 #define STARTUP_COUNT   STARTUP_ENTRY(__LINE__)
+#define STARTUP_BEGIN(nm) STARTUP_EVENT(nm, __LINE__, 'B')
+#define STARTUP_END(nm)   STARTUP_EVENT(nm, __LINE__, 'E')
 
 #endif
@@ -0,0 +1,82 @@
+/*
+ * Scratch arena, see scratch.h.
+ *
+ * Each buffer is preceded by a header word holding the offset of the previous
+ * buffer's header, so that the most recent buffers can be popped as they are
+ * freed, and a flag marking buffers freed out of order, which are popped once
+ * everything above them has gone.
+ */
+#include "platform.h"
+#include "scratch.h"
+#include <stdlib.h>
+
+#define HDR        sizeof(uint32_t)
+#define FREED      0x80000000u
+#define NONE       0x7FFFFFFFu
+#define ALIGN4(n)  (((n) + 3) & ~3u)
+
+#if PLATFORM_SCRATCH_SIZE > 0
+static uint32_t arena[ALIGN4(PLATFORM_SCRATCH_SIZE) / 4];
+#define ARENA_BYTES sizeof(arena)
+#else
+static uint32_t arena[1];
+#define ARENA_BYTES 0
+#endif
+
+static uint32_t top;                    /* bytes used */
+static uint32_t last = NONE;            /* offset of the latest header */
+static scratch_stats_t st = {ARENA_BYTES};
+
+#define hdr_at(off)  (arena + (off) / 4)
+
+static bool in_arena(void *p) {
+  return (uint32_t *) p > arena && (uint32_t *) p < arena + ARENA_BYTES / 4;
+}
+
+void *scratch_alloc(size_t n) {
+  uint32_t need = ALIGN4(n) + HDR;
+  void *p;
+  if (n > 0 && need <= ARENA_BYTES - top) {
+    *hdr_at(top) = last;
+    last = top;
+    top += need;
+    if (top > st.peak)
+      st.peak = top;
+    return hdr_at(last) + 1;
+  }
+  p = malloc(n);
+  if (p) {
+    st.fallbacks++;
+    if (n > st.fallback_peak)
+      st.fallback_peak = n;
+  }
+  return p;
+}
+
+void scratch_free(void *p) {
+  if (!in_arena(p)) {
+    free(p);
+    return;
+  }
+  uint32_t *h = (uint32_t *) p - 1;
+  *h |= FREED;
+  while (last != NONE && (*hdr_at(last) & FREED)) {
+    top = last;
+    last = *hdr_at(last) & ~FREED;
+  }
+}
+
+/* Called after each task, when no scratch buffer can still be in use */
+void scratch_reset(void) {
+  top = 0;
+  last = NONE;
+}
+
+void scratch_stats(scratch_stats_t *stats, bool reset) {
+  st.used = top;
+  *stats = st;
+  if (reset) {
+    st.peak = top;
+    st.fallbacks = st.fallback_peak = 0;
+  }
+}
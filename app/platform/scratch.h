@@ -0,0 +1,44 @@
+#ifndef _SCRATCH_H
+#define _SCRATCH_H
+
+/*
+ * Scratch arena for temporary buffers.  C modules often need a buffer for the
+ * length of a single call: to build a frame, hold a hash context or decode a
+ * chunk before handing the result on.  Taking these from the heap fragments
+ * it, so they can instead be taken from a fixed block of RAM by bumping a
+ * pointer.  The arena is reset after every task dispatched by the platform,
+ * so a scratch buffer must never be kept beyond the task or callback that
+ * allocated it.
+ *
+ * Buffers should still be released with scratch_free(), which reclaims them
+ * at once if they are the most recent, and frees requests which didn't fit
+ * and so fell back to malloc().  The reset also reclaims buffers lost when a
+ * Lua error unwinds past their scratch_free().
+ *
+ * PLATFORM_SCRATCH_SIZE in user_config.h sets the size of the arena; with 0,
+ * all requests go to malloc().  Use is only at task level, never from ISRs.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "user_config.h"
+
+#ifndef PLATFORM_SCRATCH_SIZE
+#define PLATFORM_SCRATCH_SIZE 0
+#endif
+
+typedef struct {
+  uint32_t size;                /* arena size in bytes */
+  uint32_t used;                /* bytes now in use, including headers */
+  uint32_t peak;                /* high water mark of used */
+  uint32_t fallbacks;           /* requests which went to malloc() */
+  uint32_t fallback_peak;       /* the largest of these */
+} scratch_stats_t;
+
+void *scratch_alloc(size_t n);
+void scratch_free(void *p);
+void scratch_reset(void);
+void scratch_stats(scratch_stats_t *stats, bool reset);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Hierarchical timer wheel, see timer_wheel.h.
+ *
+ * Level L has TW_SLOTS slots each spanning 32^L ms, so level 0 resolves
+ * single milliseconds over the next 32 ms and level 4 spans 2^25 ms.  A timer
+ * is held at the lowest level whose slot number (expires >> 5L) is less than
+ * 32 slots ahead of the wheel time's slot number at that level.  So a level 0
+ * slot only holds timers for one exact expiry time, whilst the timers in a
+ * higher level slot are "cascaded" when the wheel time reaches the slot's
+ * start: they are re-added and so move down to lower levels.
+ *
+ * The wheel is tickless: rather than stepping through every millisecond, it
+ * advances straight to the next event (an expiry or a cascade) which is
+ * found from the per-level occupancy bitmaps.
+ */
+#include "timer_wheel.h"
+#include <string.h>
+
+#define before(a,b)     ((int32_t)((a) - (b)) < 0)
+#define SHIFT(level)    ((level) * TW_SLOT_BITS)
+#define SLOT_MASK       (TW_SLOTS - 1)
+
+static inline uint32_t ror32 (uint32_t x, unsigned n) {
+  return n ? (x >> n) | (x << (32 - n)) : x;
+}
+
+void tw_init (tw_wheel_t *w, uint32_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void tw_add (tw_wheel_t *w, tw_timer_t *t, uint32_t expires) {
+  int level;
+  uint32_t ahead;
+  if (tw_pending(t))
+    tw_del(w, t);
+  if (before(expires, w->now))
+    expires = w->now;
+  for (level = 0; ; level++) {
+    unsigned shift = SHIFT(level);
+    ahead = ((expires >> shift) - (w->now >> shift)) & (0xFFFFFFFFu >> shift);
+    if (ahead < TW_SLOTS)
+      break;
+    if (level == TW_LEVELS - 1) {
+      ahead = TW_SLOTS - 1;     /* too far ahead: park it in the last slot */
+      break;
+    }
+  }
+  t->expires = expires;
+  t->level   = level;
+  t->slot    = ((w->now >> SHIFT(level)) + ahead) & SLOT_MASK;
+  tw_timer_t **head = &w->slot[level][t->slot];
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  w->bitmap[level] |= 1u << t->slot;
+}
+
+void tw_del (tw_wheel_t *w, tw_timer_t *t) {
+  if (!tw_pending(t))
+    return;
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  if (!w->slot[t->level][t->slot])
+    w->bitmap[t->level] &= ~(1u << t->slot);
+  t->next  = NULL;
+  t->pprev = NULL;
+}
+
+/*
+ * Return the number of slots from the wheel time's slot to the first
+ * non-empty slot at the given level, or -1 if the level is empty.
+ */
+static int first_slot (tw_wheel_t *w, int level) {
+  uint32_t cur = (w->now >> SHIFT(level)) & SLOT_MASK;
+  if (!w->bitmap[level])
+    return -1;
+  return __builtin_ctz(ror32(w->bitmap[level], cur));
+}
+
+/*
+ * Find the next event: the exact expiry for level 0, or the start of the
+ * first non-empty slot for higher levels, when it must be cascaded.  Higher
+ * levels win ties so that cascades are done before expiries.
+ */
+static bool next_event (tw_wheel_t *w, uint32_t *when, int *level) {
+  bool found = false;
+  int l;
+  for (l = TW_LEVELS - 1; l >= 0; l--) {
+    int k = first_slot(w, l);
+    if (k < 0)
+      continue;
+    uint32_t t = k ? ((w->now >> SHIFT(l)) + k) << SHIFT(l) : w->now;
+    if (!found || before(t, *when)) {
+      *when  = t;
+      *level = l;
+      found  = true;
+    }
+  }
+  return found;
+}
+
+/*
+ * Return the earliest expiry time of all queued timers.  This only needs a
+ * scan of the first non-empty slot of each level, except that the top level
+ * is scanned in full as it can hold parked timers which are out of order.
+ */
+bool tw_next (tw_wheel_t *w, uint32_t *expires) {
+  bool found = false;
+  int l;
+  for (l = 0; l < TW_LEVELS; l++) {
+    uint32_t bits = w->bitmap[l];
+    while (bits) {
+      int slot = __builtin_ctz(bits);
+      tw_timer_t *t;
+      if (l < TW_LEVELS - 1)
+        slot = ((w->now >> SHIFT(l)) + first_slot(w, l)) & SLOT_MASK;
+      for (t = w->slot[l][slot]; t; t = t->next) {
+        if (!found || before(t->expires, *expires)) {
+          *expires = t->expires;
+          found = true;
+        }
+      }
+      if (l < TW_LEVELS - 1)
+        break;
+      bits &= bits - 1;
+    }
+  }
+  return found;
+}
+
+/*
+ * Advance the wheel to now, cascading slots as their start time is reached,
+ * and return the next timer due at or before now, or NULL once there are
+ * none.  The timer is dequeued before being returned, so its callback can
+ * freely add or delete timers, including itself.
+ */
+tw_timer_t *tw_expire (tw_wheel_t *w, uint32_t now) {
+  uint32_t when = 0;
+  int level = 0;
+  while (next_event(w, &when, &level) && !before(now, when)) {
+    tw_timer_t *t;
+    uint32_t slot = (when >> SHIFT(level)) & SLOT_MASK;
+    if (before(w->now, when))
+      w->now = when;
+    t = w->slot[level][slot];
+    if (level == 0) {
+      tw_del(w, t);
+      return t;
+    }
+    w->slot[level][slot] = NULL;
+    w->bitmap[level] &= ~(1u << slot);
+    while (t) {
+      tw_timer_t *next = t->next;
+      t->pprev = NULL;
+      tw_add(w, t, t->expires);
+      t = next;
+    }
+  }
+  if (before(w->now, now))
+    w->now = now;
+  return NULL;
+}
+
+/*
+ * Return the time in [expires, expires + slack] with the most trailing zero
+ * bits.  Timers whose slack windows overlap tend to be aligned to the same
+ * time, so they are expired together in one wake-up.
+ */
+uint32_t tw_align (uint32_t expires, uint32_t slack) {
+  uint32_t last = expires + slack;
+  if (slack == 0)
+    return expires;
+  if (last < expires)
+    return 0;                                    /* the window spans a wrap */
+  return last & ~((1u << (31 - __builtin_clz((expires - 1) ^ last))) - 1);
+}
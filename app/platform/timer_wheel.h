@@ -0,0 +1,44 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+/*
+ * Hierarchical timer wheel.  This is a pure data structure with no SDK
+ * dependencies: time is an unsigned 32-bit millisecond count supplied by the
+ * caller, which wraps after ~49 days, and expiry times must be less than
+ * 2^25 ms (~9 hours) ahead of the wheel's current time.
+ *
+ * Timers are held in doubly linked slot lists, so adding and deleting a timer
+ * are O(1).  The caller arms a single OS timer for tw_next() and calls
+ * tw_expire() when it fires to collect the due timers one by one.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TW_LEVELS      5
+#define TW_SLOT_BITS   5
+#define TW_SLOTS       (1 << TW_SLOT_BITS)
+
+typedef struct tw_timer {
+  struct tw_timer *next;
+  struct tw_timer **pprev;       /* NULL when the timer is not queued */
+  uint32_t expires;
+  uint8_t level, slot;
+} tw_timer_t;
+
+typedef struct {
+  uint32_t now;                              /* wheel time */
+  uint32_t bitmap[TW_LEVELS];                /* non-empty slots per level */
+  tw_timer_t *slot[TW_LEVELS][TW_SLOTS];
+} tw_wheel_t;
+
+void tw_init(tw_wheel_t *w, uint32_t now);
+void tw_add(tw_wheel_t *w, tw_timer_t *t, uint32_t expires);
+void tw_del(tw_wheel_t *w, tw_timer_t *t);
+bool tw_next(tw_wheel_t *w, uint32_t *expires);
+tw_timer_t *tw_expire(tw_wheel_t *w, uint32_t now);
+uint32_t tw_align(uint32_t expires, uint32_t slack);
+
+#define tw_pending(t) ((t)->pprev != NULL)
+
+#endif
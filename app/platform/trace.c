@@ -0,0 +1,91 @@
+/*
+ * Binary event tracing ring, see trace.h.
+ */
+#include "platform.h"
+#include "trace.h"
+#include "cpu_esp8266_irq.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef TRACE_ENABLE
+
+volatile bool trace_enabled;
+trace_ring_t trace_ring;
+
+static const char *const trace_names[TRACE_SYSTEM_MAX] = {
+  [TRACE_TASK]        = "task",
+  [TRACE_GPIO_ISR]    = "gpio_isr",
+  [TRACE_GC_STEP]     = "gc_step",
+  [TRACE_NET_ACCEPT]  = "net_accept",
+  [TRACE_NET_CONNECT] = "net_connect",
+  [TRACE_NET_RECV]    = "net_recv",
+  [TRACE_NET_SENT]    = "net_sent",
+  [TRACE_NET_DNS]     = "net_dns",
+  [TRACE_NET_ERROR]   = "net_error",
+};
+
+/*
+ * Record an event.  The slot is claimed and filled with interrupts deferred,
+ * so that an ISR event can't be torn by, or tear, a task level event.
+ */
+void ICACHE_RAM_ATTR trace_record(uint16_t id, uint8_t phase, uint32_t a, uint32_t b) {
+  uint32_t state = esp8266_defer_irqs();
+  if (trace_ring.ring) {
+    trace_event_t *e = trace_ring.ring + (trace_ring.head++ & trace_ring.mask);
+    e->ccount = CCOUNT_REG;
+    e->id     = id;
+    e->phase  = phase;
+    e->spare  = 0;
+    e->a      = a;
+    e->b      = b;
+  }
+  esp8266_restore_irqs(state);
+}
+
+/*
+ * (Re)start tracing into an empty ring of at least the given number of
+ * events (or the default if 0).  The ring is only reallocated if its size
+ * changes.  Returns false if it can't be allocated.
+ */
+bool trace_start(uint32_t events) {
+  uint32_t size = 16;
+  if (!events)
+    events = TRACE_BUFFER_DEFAULT;
+  while (size < events)
+    size <<= 1;
+  trace_stop();
+  if (trace_ring.ring && trace_ring.mask != size - 1)
+    trace_release();
+  if (!trace_ring.ring) {
+    trace_event_t *ring = malloc(size * sizeof(trace_event_t));
+    if (!ring)
+      return false;
+    trace_ring.mask = size - 1;
+    trace_ring.ring = ring;
+  }
+  trace_ring.head = 0;
+  trace_enabled = true;
+  return true;
+}
+
+/* Stop recording, but keep the ring so that it can still be dumped */
+void trace_stop(void) {
+  trace_enabled = false;
+}
+
+void trace_release(void) {
+  trace_event_t *ring = trace_ring.ring;
+  uint32_t state = esp8266_defer_irqs();
+  trace_enabled = false;
+  trace_ring.ring = NULL;
+  trace_ring.head = 0;
+  esp8266_restore_irqs(state);
+  free(ring);
+}
+
+/* Return the name of a system event, or NULL for user or unknown ids */
+const char *trace_name(uint16_t id) {
+  return id < TRACE_SYSTEM_MAX ? trace_names[id] : NULL;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Binary event tracing.  Each event is a fixed 16 byte record of CCOUNT, an
+ * event id, a phase and two 32-bit arguments, written into a RAM ring which
+ * overwrites the oldest events once full.  Recording is a handful of stores
+ * with interrupts deferred, so it can be used from tasks, ISRs and the Lua VM
+ * alike; all formatting is left until the ring is dumped.
+ *
+ * The TRACE_* macros compile to nothing unless TRACE_ENABLE is defined in
+ * user_config.h, and only cost a test of trace_enabled until tracing is
+ * started with trace_start().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "user_config.h"
+
+typedef struct {
+  uint32_t ccount;
+  uint16_t id;
+  uint8_t  phase;        /* 'B'egin, 'E'nd or 'I'nstant */
+  uint8_t  spare;
+  uint32_t a, b;
+} trace_event_t;
+
+/* The arguments recorded for each event are given alongside it */
+enum {
+  TRACE_TASK = 1,        /* B/E  a = task handle, b = priority */
+  TRACE_GPIO_ISR,        /* I    a = GPIO status bits */
+  TRACE_GC_STEP,         /* B/E  a = Lua heap bytes */
+  TRACE_NET_ACCEPT,      /* I    a = server userdata */
+  TRACE_NET_CONNECT,     /* I    a = socket userdata, b = err */
+  TRACE_NET_RECV,        /* I    a = socket userdata, b = bytes */
+  TRACE_NET_SENT,        /* I    a = socket userdata, b = bytes */
+  TRACE_NET_DNS,         /* I    a = socket userdata, b = address */
+  TRACE_NET_ERROR,       /* I    a = socket userdata, b = err */
+  TRACE_SYSTEM_MAX,
+  TRACE_USER = 0x100     /* trace.event() ids from Lua are added to this */
+};
+
+#define TRACE_BUFFER_DEFAULT 256          /* events, rounded to a power of 2 */
+
+/* Event n (counting from 0 at trace_start) is in ring[n & mask] */
+typedef struct {
+  trace_event_t *ring;
+  uint32_t mask;
+  uint32_t head;                          /* events recorded */
+} trace_ring_t;
+
+extern volatile bool trace_enabled;
+extern trace_ring_t trace_ring;
+
+void trace_record(uint16_t id, uint8_t phase, uint32_t a, uint32_t b);
+bool trace_start(uint32_t events);
+void trace_stop(void);
+void trace_release(void);
+const char *trace_name(uint16_t id);
+
+#ifdef TRACE_ENABLE
+#define TRACE_EVENT(id, ph, a, b) do { if (trace_enabled) \
+        trace_record((id), (ph), (uint32_t)(a), (uint32_t)(b)); } while (0)
+#else
+#define TRACE_EVENT(id, ph, a, b)
+#endif
+#define TRACE_BEGIN(id, a, b)   TRACE_EVENT(id, 'B', a, b)
+#define TRACE_END(id, a, b)     TRACE_EVENT(id, 'E', a, b)
+#define TRACE_INSTANT(id, a, b) TRACE_EVENT(id, 'I', a, b)
+
+#endif
@@ -123,9 +123,10 @@ static bool myspiffs_set_cfg(spiffs_config *cfg, bool force_create) {
 
 
 static bool myspiffs_mount(bool force_mount) {
-  STARTUP_COUNT;
+  STARTUP_BEGIN("spiffs_mount");
   spiffs_config cfg;
   if (!myspiffs_set_cfg(&cfg, force_mount) && !force_mount) {
+    STARTUP_END("spiffs_mount");
     return FALSE;
   }
 
@@ -145,7 +146,7 @@ static bool myspiffs_mount(bool force_mount) {
     // myspiffs_check_callback);
     0);
   NODE_DBG("mount res: %d, %d\n", res, fs.err_code);
-  STARTUP_COUNT;
+  STARTUP_END("spiffs_mount");
   return res == SPIFFS_OK;
 }
 
@@ -59,6 +59,7 @@ extern const char _irom0_text_start[], _irom0_text_end[], _flash_used_end[];
 #define NODEMCU_PARTITION_EAGLEROM  PLATFORM_PARTITION(NODEMCU_EAGLEROM_PARTITION)
 #define NODEMCU_PARTITION_IROM0TEXT PLATFORM_PARTITION(NODEMCU_IROM0TEXT_PARTITION)
 #define NODEMCU_PARTITION_LFS       PLATFORM_PARTITION(NODEMCU_LFS0_PARTITION)
+#define NODEMCU_PARTITION_OVERLAY   PLATFORM_PARTITION(NODEMCU_LFS1_PARTITION)
 #define NODEMCU_PARTITION_SPIFFS    PLATFORM_PARTITION(NODEMCU_SPIFFS0_PARTITION)
 
 #define RF_CAL_SIZE            0x1000
@@ -67,7 +68,7 @@ extern const char _irom0_text_start[], _irom0_text_end[], _flash_used_end[];
 
 #define MAX_PARTITIONS 20
 #define WORDSIZE       sizeof(uint32_t)
-#define PTABLE_SIZE    7   /** THIS MUST BE MATCHED TO NO OF PT ENTRIES BELOW **/
+#define PTABLE_SIZE    8   /** THIS MUST BE MATCHED TO NO OF PT ENTRIES BELOW **/
 
 struct defaultpt {
   platform_rcr_t hdr;
@@ -88,6 +89,7 @@ static const struct defaultpt rompt IROM_PTABLE_ATTR USED_ATTR  = {
     { SYSTEM_PARTITION_PHY_DATA,          0x0F000,     PHY_DATA_SIZE},
     { NODEMCU_PARTITION_IROM0TEXT,        0x10000,     0x0000},
     { NODEMCU_PARTITION_LFS,              0x0,         LUA_FLASH_STORE},
+    { NODEMCU_PARTITION_OVERLAY,          0x0,         LUA_FLASH_OVERLAY},
     { NODEMCU_PARTITION_SPIFFS,           0x0,         SPIFFS_MAX_FILESYSTEM_SIZE},
     { SYSTEM_PARTITION_SYSTEM_PARAMETER,  0x0,         SYSTEM_PARAMETER_SIZE},
     {0,(uint32_t) &_irom0_text_end,0}
@@ -127,7 +129,7 @@ extern void _ResetHandler(void);
  * configure the PT, etc during provisioning.
  */
 void user_pre_init(void) {
-    STARTUP_COUNT; 
+    STARTUP_BEGIN("user_pre_init");
 #ifdef LUA_USE_MODULES_RTCTIME
   // Note: Keep this as close to call_user_start() as possible, since it
   // is where the cpu clock actually gets bumped to 80MHz.
@@ -142,6 +144,7 @@ void user_pre_init(void) {
     int no_banner = startup_option & STARTUP_OPTION_NO_BANNER;
 
     partition_item_t *rcr_pt = NULL, *pt;
+    STARTUP_BEGIN("flash_detect");
     enum flash_size_map fs_size_code = system_get_flash_size_map();
 // Flash size lookup is SIZE_256K*2^N where N is as follows (see SDK/user_interface.h)
                                      /*   0   1   2   3   4   5   6   7   8   9  */
@@ -151,6 +154,7 @@ void user_pre_init(void) {
 
     uint32_t i = platform_rcr_read(PLATFORM_RCR_PT, (void **) &rcr_pt);
     uint32_t n = i / sizeof(partition_item_t);
+    STARTUP_END("flash_detect");
 
     if (flash_size < SIZE_1024K) {
         os_printf("Flash size (%u) too small to support NodeMCU\n", flash_size);
@@ -182,7 +186,8 @@ void user_pre_init(void) {
         if (no_banner) {
             system_set_os_print(0);
         }
-        STARTUP_COUNT;
+        STARTUP_END("user_pre_init");
+        STARTUP_BEGIN("sdk_init");
         return;
     }
     os_printf("Invalid system partition table\n");
@@ -243,8 +248,9 @@ static uint32_t first_time_setup(partition_item_t *pt, uint32_t n, uint32_t flas
             break;
 
           case NODEMCU_PARTITION_LFS:
-            // Properly align the LFS partition size and make it consecutive to
-            // the previous partition.
+          case NODEMCU_PARTITION_OVERLAY:
+            // Properly align the LFS (and overlay) partition size and make it
+            // consecutive to the previous partition.
             p->size = PT_ALIGN(p->size);
             if (p->addr == 0)
                 p->addr = last;
@@ -309,7 +315,7 @@ uint32 ICACHE_RAM_ATTR user_iram_memory_is_enabled(void) {
 }
 
 void nodemcu_init(void) {
-  STARTUP_COUNT; 
+  STARTUP_END("sdk_init");
    NODE_DBG("Task task_lua starting.\n");
    // Call the Lua bootstrap startup directly.  This uses the task interface
    // internally to carry out the main lua libraries initialisation.
@@ -324,14 +330,17 @@ void nodemcu_init(void) {
  * Returns      : none
 *******************************************************************************/
 void user_init(void) {
+    STARTUP_COUNT;
 #ifdef LUA_USE_MODULES_RTCTIME
     rtctime_late_startup ();
 #endif
+    STARTUP_BEGIN("platform_init");
     if( platform_init() != PLATFORM_OK ) {
         // This should never happen
         NODE_DBG("Can not init platform for modules.\n");
         return;
     }
+    STARTUP_END("platform_init");
     UartBautRate br = BIT_RATE_DEFAULT;
     uart_init (br, br);
 #ifdef LUA_USE_MODULES_WIFI
@@ -25,6 +25,7 @@
 #include "osapi.h"
 #include "user_interface.h"
 #include "espconn.h"
+#include "dnscache.h"
 #include "mem.h"
 #include <stdint.h>
 #include <stddef.h>
@@ -165,6 +166,65 @@ skip:;
   return dst;
 }
 
+/*
+ * espconn keeps a pointer to the data of each send until all of it has been
+ * written, which may take several goes as the TCP send buffer frees up, so
+ * what is sent is held in a frame until espconn's sent callback.  There is
+ * one callback for each send it accepts, in order, so each frees the oldest
+ * frame.  A frame which espconn may have queued in spite of an error is
+ * held too, which at worst frees later frames late, and the rest are freed
+ * on disconnect.
+ */
+typedef struct ws_frame {
+  struct ws_frame *next;
+  char data[];
+} ws_frame;
+
+static ws_frame *ws_frameAlloc(size_t len) {
+  ws_frame *f = (ws_frame *) malloc(sizeof(ws_frame) + len);
+  if (f)
+    f->next = NULL;
+  return f;
+}
+
+static void ws_frameSend(struct espconn *conn, ws_frame *f, unsigned short len) {
+  ws_info *ws = (ws_info *) conn->reverse;
+  sint8 err;
+  if (ws->isSecure)
+    err = espconn_secure_send(conn, (uint8_t *) f->data, len);
+  else
+    err = espconn_send(conn, (uint8_t *) f->data, len);
+
+  if (err == ESPCONN_ARG || err == ESPCONN_MAXNUM || err == ESPCONN_INPROGRESS) {
+    NODE_DBG("frame not sent %d\n", err);
+    os_free(f);
+    return;
+  }
+  ws_frame **pp = &ws->sendQueue;
+  while (*pp)
+    pp = &(*pp)->next;
+  *pp = f;
+}
+
+static void ws_freeFrames(ws_info *ws) {
+  while (ws->sendQueue) {
+    ws_frame *f = ws->sendQueue;
+    ws->sendQueue = f->next;
+    os_free(f);
+  }
+}
+
+static void ws_sentCallback(void *arg) {
+  struct espconn *conn = (struct espconn *) arg;
+  ws_info *ws = (ws_info *) conn->reverse;
+
+  if (ws != NULL && ws->sendQueue != NULL) {
+    ws_frame *f = ws->sendQueue;
+    ws->sendQueue = f->next;
+    os_free(f);
+  }
+}
+
 static void ws_closeSentCallback(void *arg) {
   NODE_DBG("ws_closeSentCallback \n");
   struct espconn *conn = (struct espconn *) arg;
@@ -174,6 +234,7 @@ static void ws_closeSentCallback(void *arg) {
     NODE_DBG("ws is unexpectly null\n");
     return;
   }
+  ws_sentCallback(arg);
 
   ws->knownFailureCode = -6;
 
@@ -195,8 +256,8 @@ static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, uns
     return;
   }
 
-  char *b = calloc(1,10 + len); // 10 bytes = worst case scenario for framming
-  if (b == NULL) {
+  ws_frame *f = ws_frameAlloc(10 + len); // 10 bytes = worst case scenario for framming
+  if (f == NULL) {
     NODE_DBG("Out of memory when receiving message, disconnecting...\n");
 
     ws->knownFailureCode = -16;
@@ -206,6 +267,7 @@ static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, uns
       espconn_disconnect(conn);
     return;
   }
+  char *b = f->data;
 
   b[0] = 1 << 7; // has fin
   b[0] += opCode;
@@ -257,12 +319,7 @@ static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, uns
   NODE_DBG("b[9] = %d \n", b[9]);
 
   NODE_DBG("sending message\n");
-  if (ws->isSecure)
-    espconn_secure_send(conn, (uint8_t *) b, bufOffset);
-  else
-    espconn_send(conn, (uint8_t *) b, bufOffset);
-
-  os_free(b);
+  ws_frameSend(conn, f, bufOffset);
 }
 
 static void ws_sendPingTimeout(void *arg) {
@@ -584,6 +641,7 @@ static void connect_callback(void *arg) {
   ws->connectionState = 3;
 
   espconn_regist_recvcb(conn, ws_initReceiveCallback);
+  espconn_regist_sentcb(conn, ws_sentCallback);
 
   char *key;
   generateSecKeys(&key, &ws->expectedSecKey);
@@ -598,8 +656,19 @@ static void connect_callback(void *arg) {
 
   const header_t *extraHeaders = ws->extraHeaders ? ws->extraHeaders : EMPTY_HEADERS;
 
-  char buf[WS_INIT_REQUEST_LENGTH + strlen(ws->path) + strlen(ws->hostname) +
-	  headers_length(DEFAULT_HEADERS) + headers_length(headers) + headers_length(extraHeaders) + 2];
+  ws_frame *f = ws_frameAlloc(WS_INIT_REQUEST_LENGTH + strlen(ws->path) + strlen(ws->hostname) +
+	  headers_length(DEFAULT_HEADERS) + headers_length(headers) + headers_length(extraHeaders) + 2);
+  if (f == NULL) {
+    NODE_DBG("Out of memory for the handshake, disconnecting...\n");
+    os_free(key);
+    ws->knownFailureCode = -16;
+    if (ws->isSecure)
+      espconn_secure_disconnect(conn);
+    else
+      espconn_disconnect(conn);
+    return;
+  }
+  char *buf = f->data;
 
   int len = os_sprintf(
                   buf,
@@ -613,10 +682,7 @@ static void connect_callback(void *arg) {
 
   os_free(key);
   NODE_DBG("request: %s", buf);
-  if (ws->isSecure)
-    espconn_secure_send(conn, (uint8_t *) buf, len);
-  else
-    espconn_send(conn, (uint8_t *) buf, len);
+  ws_frameSend(conn, f, len);
 }
 
 static void disconnect_callback(void *arg) {
@@ -645,6 +711,8 @@ static void disconnect_callback(void *arg) {
     os_free(ws->payloadBuffer);
   }
 
+  ws_freeFrames(ws);
+
   if (conn->proto.tcp != NULL) {
     os_free(conn->proto.tcp);
   }
@@ -808,6 +876,7 @@ void ws_connect(ws_info *ws, const char *url) {
   ws->payloadBuffer = NULL;
   ws->payloadBufferLen = 0;
   ws->payloadOriginalOpCode = 0;
+  ws->sendQueue = NULL;
   ws->unhealthyPoints = 0;
 
   // Prepare espconn
@@ -823,7 +892,7 @@ void ws_connect(ws_info *ws, const char *url) {
 
   // Attempt to resolve hostname address
   ip_addr_t  addr;
-  err_t result = dns_gethostbyname(hostname, &addr, dns_callback, conn);
+  err_t result = dnscache_gethostbyname(hostname, &addr, dns_callback, conn);
 
   if (result == ERR_INPROGRESS) {
     NODE_DBG("DNS pending\n");
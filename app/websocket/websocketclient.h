@@ -38,6 +38,7 @@
 #endif
 
 struct ws_info;
+struct ws_frame;
 
 typedef void (*ws_onConnectionCallback)(struct ws_info *wsInfo);
 typedef void (*ws_onReceiveCallback)(struct ws_info *wsInfo, int len, char *message, int opCode);
@@ -69,6 +70,8 @@ typedef struct ws_info {
   int payloadBufferLen;
   int payloadOriginalOpCode;
 
+  struct ws_frame *sendQueue; // sent, awaiting espconn's sent callback
+
   os_timer_t  timeoutTimer;
   int unhealthyPoints;
 
@@ -0,0 +1,59 @@
+local N = ...
+N = (N or require "NTest")("metrics")
+
+N.test('counters and gauges', function()
+  local c = metrics.counter("test.count")
+  ok(eq(metrics.counter("test.count"), c), "registering again returns the same id")
+  metrics.reset(c)
+  metrics.inc(c)
+  metrics.inc("test.count", 4)
+  ok(eq(metrics.get(c), 5), "counter")
+
+  local g = metrics.gauge("test.level")
+  metrics.set(g, -3)
+  metrics.inc(g, 5)
+  ok(eq(metrics.get("test.level"), 2), "gauge")
+
+  fail(function() metrics.gauge("test.count") end, "another type")
+  fail(function() metrics.set(c, 1) end, "wrong metric type")
+  fail(function() metrics.inc("no.such.metric") end, "unknown metric")
+end)
+
+N.test('histograms', function()
+  local h = metrics.histogram("test.ms", {10, 100})
+  metrics.reset(h)
+  for _, v in ipairs({1, 10, 11, 100, 1000}) do metrics.observe(h, v) end
+  local count, sum, buckets = metrics.get(h)
+  ok(eq(count, 5), "count")
+  ok(eq(sum, 1122), "sum")
+  ok(eq(buckets, {2, 2, 1}), "buckets")
+  fail(function() metrics.histogram("test.bad", {10, 5}) end, "bounds not ascending")
+end)
+
+N.test('snapshot', function()
+  local c = metrics.counter("test.count")
+  metrics.reset(c)
+  metrics.inc(c, 7)
+  ok(metrics.snapshot():find("\ntest.count 7\n", 1, true), "text")
+  local json = metrics.snapshot("json", true)
+  ok(json:find('"test.count":7', 1, true), "json")
+  ok(json:find('"test.ms":{"count":5,"sum":1122,"le":[10,100],"buckets":[2,2,1]}', 1, true),
+     "json histogram")
+  ok(json:find('"tmr.fires":', 1, true), "firmware metrics")
+  ok(eq(metrics.get(c), 0), "reset by snapshot")
+end)
+
+N.test('snapshot of large values', function()
+  local h = metrics.histogram("test.big", {1000000000})
+  metrics.reset(h)
+  metrics.observe(h, 2000000000)
+  metrics.observe(h, 2000000000)
+  local json = metrics.snapshot("json")
+  ok(json:find('"test.big":{"count":2,"sum":4000000000,"le":[1000000000],"buckets":[0,2]}', 1, true),
+     "json histogram")
+  if sjson then
+    local t = sjson.decode(json)
+    ok(eq(t["test.big"].sum, 4000000000), "json parses")
+  end
+  ok(metrics.snapshot():find("\ntest.big 2 4000000000 0 2\n", 1, true), "text")
+end)
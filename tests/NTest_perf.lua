@@ -0,0 +1,66 @@
+local N = ...
+N = (N or require "NTest")("perf")
+
+-- The line number of the caller (debug.getinfo is not in every build)
+local function line()
+  local _, e = pcall(error, "", 3)
+  return tonumber(e:match(":(%d+):"))
+end
+
+-- A deliberately hot function, so that it dominates the samples
+local spin_line = line() + 1
+local function spin(n)
+  local x = 0
+  for i = 1, n do x = x + i % 7 end
+  return x
+end
+
+local function busy(ms)
+  local t0 = os and os.clock and os.clock() or tmr.now() / 1e6
+  repeat
+    spin(1000)
+  until (os and os.clock and os.clock() or tmr.now() / 1e6) - t0 > ms / 1000
+end
+
+N.test('Lua sampler', function()
+  local spin_at = ":" .. spin_line .. ";"
+  perf.luastart({interval = 1000})
+  fail(function() perf.luastart() end, "already running")
+  busy(300)
+  local samples, idle, lost, stacks = perf.luastop()
+  ok(samples > 10, "samples taken")
+  ok(eq(lost, 0), "no stacks lost")
+  ok(eq(type(idle), "number"), "idle count")
+
+  local hot, total = 0, 0
+  for stack, n in pairs(stacks) do
+    ok(stack:find("^.*;[^;]+:%d+$"), "stack ends with a source line")
+    total = total + n
+    if stack:find(spin_at, 1, true) then hot = hot + n end
+  end
+  ok(eq(total, samples), "samples add up")
+  ok(hot * 2 > samples, "spin() is the hot function")
+  ok(eq(perf.luastop(), nil), "stop when stopped")
+end)
+
+N.test('Lua sampler options', function()
+  fail(function() perf.luastart({interval = 1}) end, "invalid interval")
+  fail(function() perf.luastart({depth = 0}) end, "invalid depth")
+  perf.luastart({slots = 16, depth = 2})
+  busy(100)
+  local _, _, _, stacks = perf.luastop()
+  for stack in pairs(stacks) do
+    -- two function frames, the line frame and perhaps a truncation marker
+    ok(not stack:find(";.*;.*;.*;"), "depth is limited")
+  end
+end)
+
+N.test('Lua sampler keeps a coroutine budget', function()
+  if not (node and node.task and node.task.budget) then return end
+  local co = coroutine.create(function() return pcall(perf.luastart) end)
+  node.task.budget(co, 100000)
+  local _, started, err = coroutine.resume(co)
+  ok(not started and tostring(err):find("debug hook", 1, true), "not started over a budget")
+  ok(node.task.budget(co), "budget kept")
+  ok(eq(perf.luastop(), nil), "not running")
+end)
@@ -0,0 +1,74 @@
+local N = ...
+N = (N or require "NTest")("strbuf")
+
+local function lines(n)
+  local t = {}
+  for i = 1, n do t[i] = "line " .. i .. "\n" end
+  return table.concat(t)
+end
+
+N.test('append and tostring', function()
+  local sb = strbuf.new(64)
+  for i = 1, 100 do sb:append("line ", i, "\n") end
+  ok(eq(sb:tostring(), lines(100)), "content")
+  ok(eq(#sb, #lines(100)), "length")
+  ok(eq(sb:len(), #sb), "len()")
+  ok(eq(tostring(sb), lines(100)), "tostring()")
+
+  fail(function() strbuf.new(1) end, "invalid chunk size")
+  fail(function() sb:append({}) end, "string expected")
+end)
+
+N.test('format and append strbuf', function()
+  local sb = strbuf.new():format("%d-%s", 42, "x")
+  ok(eq(sb:tostring(), "42-x"), "format")
+  local sb2 = strbuf.new():append("<", sb, ">")
+  ok(eq(sb2:tostring(), "<42-x>"), "append strbuf")
+  fail(function() sb:append(sb) end, "cannot append to itself")
+end)
+
+N.test('chunks', function()
+  local sb = strbuf.new(64):append(lines(50))
+  local t = {}
+  for s in sb:chunks() do
+    ok(#s <= 64, "chunk size")
+    t[#t+1] = s
+  end
+  ok(eq(table.concat(t), lines(50)), "chunks")
+  fail(function() for s in sb:chunks() do sb:read(64) end end,
+       "modified during iteration")
+end)
+
+N.test('read consumes', function()
+  local sb = strbuf.new(64):append(lines(50))
+  local t = {}
+  repeat
+    local s = sb:read(100)
+    t[#t+1] = s
+  until not s
+  ok(eq(table.concat(t), lines(50)), "read")
+  ok(eq(#sb, 0), "empty after read")
+  nok(sb:read(), "nil when empty")
+  sb:append("abc"):clear()
+  ok(eq(#sb, 0), "clear")
+end)
+
+N.test('writeto pipe', function()
+  local sb = strbuf.new(64):append(lines(20))
+  local p = pipe.create()
+  sb:writeto(p)
+  ok(eq(p:read(10000), lines(20)), "pipe content")
+  ok(eq(#sb, #lines(20)), "writeto does not consume")
+end)
+
+N.test('send', function()
+  local sb = strbuf.new():append(lines(400))
+  local sent, done = {}
+  local sock = setmetatable({}, {__index = {
+    send = function(self, s, cb) sent[#sent+1] = s; cb(self) end}})
+  sb:send(sock, function(s) done = s end)
+  ok(eq(done, sock), "done callback")
+  ok(eq(#sent[1], 1460), "segment size")
+  ok(eq(table.concat(sent), lines(400)), "content sent")
+  ok(eq(#sb, 0), "send consumes")
+end)
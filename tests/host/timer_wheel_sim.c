@@ -0,0 +1,127 @@
+/*
+ * Host simulation of the timer wheel (app/platform/timer_wheel.c) and of its
+ * slack alignment, as used by the tmr module's TIMER_WHEEL_ENABLE backend.
+ *
+ *   gcc -I app/platform tests/host/timer_wheel_sim.c app/platform/timer_wheel.c
+ *
+ * It checks that tw_align() picks the time in each slack window with the
+ * most trailing zero bits, then runs a set of periodic timers through the
+ * wheel exactly as tmr.c's wheel_run() does, once without and once with
+ * slack.  Every expiry must fall within its slack window, and the slack run
+ * must need at least 25% fewer wake-ups.  The exit status is the number of failures.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "timer_wheel.h"
+
+#define NTIMERS   40
+#define SIM_MS    (3600*1000u)     /* one hour */
+#define START_MS  0xFFF00000u      /* the ms clock wraps after ~17 minutes */
+
+typedef struct {
+  tw_timer_t tw;
+  uint32_t due, period, slack;
+  unsigned fired;
+} sim_timer_t;
+
+static int failures;
+
+#define check(cond, ...) do { \
+  if (!(cond)) { \
+    if (failures++ < 10) { printf("FAIL: " __VA_ARGS__); putchar('\n'); } \
+  } \
+} while (0)
+
+static int tz (uint32_t x) {
+  return x ? __builtin_ctz(x) : 32;
+}
+
+static void test_align (void) {
+  unsigned i;
+  srand(1);
+  for (i = 0; i < 20000; i++) {
+    uint32_t e = (uint32_t)rand() * 2654435761u;
+    uint32_t s = rand() % (i & 1 ? 64 : 10000), a, best, t;
+    if (e + s < e)
+      continue;
+    a = tw_align(e, s);
+    for (best = e, t = e; t != e + s + 1; t++)
+      if (tz(t) > tz(best))
+        best = t;
+    check(a == best, "tw_align(%u, %u) = %u, expected %u", e, s, a, best);
+  }
+  check(tw_align(1000, 0) == 1000, "zero slack must not move the expiry");
+}
+
+/*
+ * Run the timers for SIM_MS.  The simulated OS timer always fires exactly at
+ * tw_next(), so each loop iteration is one wake-up.
+ */
+static unsigned simulate (sim_timer_t *tm, int n, int with_slack,
+                          unsigned *fires) {
+  tw_wheel_t w;
+  uint32_t now = START_MS, end = START_MS + SIM_MS, next;
+  unsigned wakeups = 0;
+  int i;
+  tw_init(&w, now);
+  *fires = 0;
+  for (i = 0; i < n; i++) {
+    tm[i].tw = (tw_timer_t){0};               /* forget any previous wheel */
+    tm[i].due = now + tm[i].period;
+    tm[i].fired = 0;
+    tw_add(&w, &tm[i].tw, tw_align(tm[i].due, with_slack ? tm[i].slack : 0));
+  }
+  while (tw_next(&w, &next) && (int32_t)(next - end) < 0) {
+    tw_timer_t *t;
+    check((int32_t)(next - now) >= 0, "time went backwards");
+    now = next;
+    wakeups++;
+    while ((t = tw_expire(&w, now)) != NULL) {
+      sim_timer_t *s = (sim_timer_t *)t;
+      uint32_t late = now - s->due;
+      check((int32_t)late >= 0, "timer %d fired %d ms early",
+            (int)(s - tm), -(int32_t)late);
+      check(late <= (with_slack ? s->slack : 0),
+            "timer %d fired %u ms late with slack %u", (int)(s - tm), late,
+            with_slack ? s->slack : 0);
+      s->fired++;
+      (*fires)++;
+      s->due += s->period;
+      tw_add(&w, t, tw_align(s->due, with_slack ? s->slack : 0));
+    }
+  }
+  for (i = 0; i < n; i++) {
+    unsigned expect = SIM_MS / tm[i].period;
+    check(tm[i].fired + 1 >= expect && tm[i].fired <= expect,
+          "timer %d fired %u times, expected %u", i, tm[i].fired, expect);
+  }
+  return wakeups;
+}
+
+int main (void) {
+  static sim_timer_t tm[NTIMERS];
+  unsigned exact, coalesced, fires0, fires1;
+  int i;
+
+  test_align();
+
+  /* A mix of debounce, poll, retry and watchdog style periods, each allowed
+   * to run up to 10% late */
+  srand(2);
+  for (i = 0; i < NTIMERS; i++) {
+    static const uint32_t base[] = {50, 200, 1000, 5000, 60000};
+    tm[i].period = base[i % 5] + rand() % base[i % 5];
+    tm[i].slack  = tm[i].period / 10;
+  }
+  exact     = simulate(tm, NTIMERS, 0, &fires0);
+  coalesced = simulate(tm, NTIMERS, 1, &fires1);
+  check(fires1 <= fires0 && fires1 + NTIMERS >= fires0,
+        "fire counts differ: %u vs %u", fires0, fires1);
+  check(coalesced * 4 < exact * 3, "slack saved too few wake-ups: %u vs %u",
+        coalesced, exact);
+
+  printf("%u expiries: %u wake-ups exact, %u with slack (%u avoided)\n",
+         fires1, exact, coalesced, exact - coalesced);
+  printf("%s: %d failures\n", failures ? "FAILED" : "passed", failures);
+  return failures;
+}
@@ -360,6 +360,19 @@ stds.nodemcu_libs = {
         register = empty
       }
     },
+    metrics = {
+      fields = {
+        counter = empty,
+        gauge = empty,
+        get = empty,
+        histogram = empty,
+        inc = empty,
+        observe = empty,
+        reset = empty,
+        set = empty,
+        snapshot = empty
+      }
+    },
     mqtt = {
       fields = {
         CONNACK_ACCEPTED = empty,
@@ -708,6 +721,18 @@ stds.nodemcu_libs = {
         wdclr = empty
       }
     },
+    trace = {
+      fields = {
+        clear = empty,
+        dump = empty,
+        enter = empty,
+        event = empty,
+        leave = empty,
+        start = empty,
+        stats = empty,
+        stop = empty
+      }
+    },
     tsl2561 = {
       fields = {
         ADDRESS_FLOAT = empty,
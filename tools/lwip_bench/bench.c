@@ -0,0 +1,540 @@
+/*
+ * Host benchmark for the firmware's lwIP stack and its lwipopts.h profiles.
+ *
+ * app/lwip is built for Linux with a netif whose output is copied onto a
+ * simulated link and delivered back to ip_input() once the link's bandwidth
+ * and latency allow.  Time is virtual, so results are deterministic and
+ * don't depend on the speed of the host.  Both ends of each connection are
+ * in the one stack, which allocates as the firmware does: pool objects come
+ * from the heap (MEMP_MEM_MALLOC), optionally capped at a given size.
+ *
+ * Two benchmarks are run: a bulk transfer, written from the sent callback
+ * as net.socket:send() does, and a series of short request/response
+ * connections.  Each reports its rate, heap high water mark and allocation
+ * failures, and the high water marks of the pool objects which lwipopts.h
+ * sizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lwip/init.h"
+#include "lwip/tcp_impl.h"
+#include "lwip/timers.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/memp.h"
+
+#ifndef BENCH_PROFILE
+#define BENCH_PROFILE "default"
+#endif
+
+#define BULK_PORT       80
+#define CONNECT_PORT    81
+#define LINK_OVERHEAD   64      /* bytes of framing and preamble per packet */
+#define RUN_LIMIT_US    (600 * 1000000ULL)
+
+/* The SDK's register values, see include/lwipopts.h */
+uint32_t bench_regs[5];
+uint8_t timer2_ms_flag;
+
+static uint64_t now_us;
+
+uint32_t bench_now_us(void) {
+  return (uint32_t) now_us;
+}
+
+void bench_assert(const char *msg, const char *file, int line) {
+  fprintf(stderr, "lwIP assertion \"%s\" failed at %s:%d\n", msg, file, line);
+  abort();
+}
+
+static uint32_t seed = 1;
+
+int r_rand(void) {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+unsigned long os_random(void) {
+  return r_rand() << 15 | r_rand();
+}
+
+void system_station_got_ip_set(void *ip, void *mask, void *gw) {
+}
+
+void dhcps_coarse_tmr(void) {
+}
+
+/* The WiFi driver's free receive buffers, below 2 of which lwIP drops ooseq */
+char RxNodeNum(void) {
+  return 8;
+}
+
+/* Heap */
+
+/*
+ * The heap counts the bytes asked for, so its figures are host sizes: lwIP's
+ * structures hold pointers and are larger than on the ESP8266.  They are for
+ * comparing profiles rather than for sizing the firmware's heap.
+ */
+typedef union block {
+  size_t size;
+  max_align_t align;
+} block;
+
+static struct {
+  size_t limit, used, peak;
+  unsigned allocs, fails;
+} heap;
+
+void *pvPortMalloc(size_t sz, const char *file, unsigned line, bool iram) {
+  block *b = NULL;
+  if (!heap.limit || heap.used + sz <= heap.limit)
+    b = malloc(sizeof(block) + sz);
+  if (!b) {
+    heap.fails++;
+    return NULL;
+  }
+  b->size = sz;
+  heap.allocs++;
+  heap.used += sz;
+  if (heap.used > heap.peak)
+    heap.peak = heap.used;
+  return b + 1;
+}
+
+void vPortFree(void *p, const char *file, unsigned line) {
+  block *b = (block *)p - 1;
+  if (!p)
+    return;
+  heap.used -= b->size;
+  free(b);
+}
+
+void *pvPortZalloc(size_t sz, const char *file, unsigned line) {
+  void *p = pvPortMalloc(sz, file, line, false);
+  if (p)
+    memset(p, 0, sz);
+  return p;
+}
+
+void *pvPortCalloc(size_t count, size_t size, const char *file, unsigned line) {
+  return pvPortZalloc(count * size, file, line);
+}
+
+void *pvPortRealloc(void *p, size_t n, const char *file, unsigned line) {
+  void *q = pvPortMalloc(n, file, line, false);
+  if (q && p) {
+    size_t old = ((block *)p - 1)->size;
+    memcpy(q, p, old < n ? old : n);
+    vPortFree(p, file, line);
+  }
+  return q;
+}
+
+static const char * const memp_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc,attr) desc,
+#include "lwip/memp_std.h"
+};
+static unsigned memp_used[MEMP_MAX], memp_peak[MEMP_MAX];
+
+void *bench_memp_malloc(memp_t type) {
+  void *p = mem_malloc(memp_sizes[type]);
+  if (p && ++memp_used[type] > memp_peak[type])
+    memp_peak[type] = memp_used[type];
+  return p;
+}
+
+void bench_memp_free(memp_t type, void *mem) {
+  if (mem)
+    memp_used[type]--;
+  mem_free(mem);
+}
+
+/* Link */
+
+typedef struct packet {
+  struct packet *next;
+  uint64_t due;
+  u16_t len;
+  u8_t data[];
+} packet;
+
+static struct {
+  uint32_t kbps, latency_us, loss;      /* loss in packets per 1000 */
+  uint64_t idle_at;                     /* when the medium is next free */
+  packet *head, *tail;
+  unsigned packets, lost, dropped;
+} wire = {20000, 2000, 0};
+
+static struct netif bench_if;
+
+/* Half duplex: packets in either direction share the medium in turn */
+static err_t link_output(struct netif *netif, struct pbuf *p, ip_addr_t *dst) {
+  packet *pk;
+  if (wire.idle_at < now_us)
+    wire.idle_at = now_us;
+  wire.idle_at += (uint64_t)(p->tot_len + LINK_OVERHEAD) * 8000 / wire.kbps;
+  wire.packets++;
+  if (wire.loss && r_rand() % 1000 < wire.loss) {
+    wire.lost++;
+    return ERR_OK;
+  }
+  pk = malloc(sizeof(packet) + p->tot_len);
+  pk->next = NULL;
+  pk->due = wire.idle_at + wire.latency_us;
+  pk->len = pbuf_copy_partial(p, pk->data, p->tot_len, 0);
+  if (wire.tail)
+    wire.tail->next = pk;
+  else
+    wire.head = pk;
+  wire.tail = pk;
+  return ERR_OK;
+}
+
+/* Deliver the packets which have arrived, as the WiFi driver would */
+static void link_deliver(void) {
+  while (wire.head && wire.head->due <= now_us) {
+    packet *pk = wire.head;
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, pk->len, PBUF_POOL);
+    if (!(wire.head = pk->next))
+      wire.tail = NULL;
+    if (!p) {
+      wire.dropped++;
+    } else {
+      pbuf_take(p, pk->data, pk->len);
+      if (bench_if.input(p, &bench_if) != ERR_OK)
+        pbuf_free(p);
+    }
+    free(pk);
+  }
+}
+
+struct netif *eagle_lwip_getif(uint8 index) {
+  return &bench_if;
+}
+
+static err_t bench_if_init(struct netif *netif) {
+  netif->name[0] = 'b';
+  netif->name[1] = 'n';
+  netif->output = link_output;
+  netif->mtu = TCP_MSS + 40;
+  return ERR_OK;
+}
+
+static void stack_init(void) {
+  ip_addr_t ip, mask, gw;
+  IP4_ADDR(&ip, 10, 0, 0, 1);
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 10, 0, 0, 254);
+  lwip_init();
+  netif_add(&bench_if, &ip, &mask, &gw, NULL, bench_if_init, ip_input);
+  netif_set_default(&bench_if);
+  netif_set_up(&bench_if);
+}
+
+/* Start a benchmark's high water marks and counts from now */
+static void reset_stats(void) {
+  int i;
+  heap.peak = heap.used;
+  heap.fails = 0;
+  wire.packets = wire.lost = wire.dropped = 0;
+  for (i = 0; i < MEMP_MAX; i++)
+    memp_peak[i] = memp_used[i];
+}
+
+/*
+ * Run the stack until done() returns true, stepping virtual time to the next
+ * packet arrival or millisecond timer tick.  Returns false on timing out.
+ */
+static bool run(bool (*done)(void)) {
+  uint64_t deadline = now_us + RUN_LIMIT_US;
+  while (!done()) {
+    uint64_t next = (now_us / 1000 + 1) * 1000;
+    if (now_us >= deadline)
+      return false;
+    if (wire.head && wire.head->due < next)
+      next = wire.head->due;
+    now_us = next;
+    link_deliver();
+    sys_check_timeouts();
+  }
+  return true;
+}
+
+static void report(bool ok) {
+  printf("  heap peak %zu, alloc failures %u, packets %u (lost %u, dropped %u)%s\n",
+         heap.peak, heap.fails, wire.packets, wire.lost, wire.dropped,
+         ok ? "" : ", TIMED OUT");
+  printf("  peaks: %s %u, %s %u, %s %u, %s %u\n",
+         memp_names[MEMP_TCP_PCB], memp_peak[MEMP_TCP_PCB],
+         memp_names[MEMP_TCP_SEG], memp_peak[MEMP_TCP_SEG],
+         memp_names[MEMP_PBUF], memp_peak[MEMP_PBUF],
+         memp_names[MEMP_PBUF_POOL], memp_peak[MEMP_PBUF_POOL]);
+}
+
+static ip_addr_t server_ip;
+
+static struct tcp_pcb *listen_on(u16_t port, tcp_accept_fn accept) {
+  struct tcp_pcb *pcb = tcp_new();
+  tcp_bind(pcb, IP_ADDR_ANY, port);
+  pcb = tcp_listen(pcb);
+  tcp_accept(pcb, accept);
+  return pcb;
+}
+
+/* Bulk transfer */
+
+static struct {
+  uint32_t size, chunk, queued, received;
+  uint64_t start, end;
+  u16_t queuelen_peak;
+  bool failed;
+} bulk;
+
+static u8_t payload[TCP_MSS * 4];
+
+/* Queue as much as lwIP takes, as net.c does, in the sender's chunks */
+static void bulk_fill(struct tcp_pcb *pcb) {
+  while (bulk.queued < bulk.size) {
+    u32_t n = bulk.size - bulk.queued;
+    if (n > bulk.chunk)
+      n = bulk.chunk;
+    if (n > tcp_sndbuf(pcb))
+      n = tcp_sndbuf(pcb);
+    if (n == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN)
+      break;
+    if (tcp_write(pcb, payload, n, 0) != ERR_OK)
+      break;
+    bulk.queued += n;
+  }
+  if (pcb->snd_queuelen > bulk.queuelen_peak)
+    bulk.queuelen_peak = pcb->snd_queuelen;
+  tcp_output(pcb);
+}
+
+static err_t bulk_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
+  bulk_fill(pcb);
+  return ERR_OK;
+}
+
+static err_t bulk_connected(void *arg, struct tcp_pcb *pcb, err_t err) {
+  tcp_sent(pcb, bulk_sent);
+  bulk_fill(pcb);
+  return ERR_OK;
+}
+
+static void bulk_err(void *arg, err_t err) {
+  bulk.failed = true;
+}
+
+static err_t sink_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+  if (!p)
+    return tcp_close(pcb);
+  bulk.received += p->tot_len;
+  if (bulk.received >= bulk.size && !bulk.end)
+    bulk.end = now_us;
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+static err_t sink_accept(void *arg, struct tcp_pcb *pcb, err_t err) {
+  tcp_recv(pcb, sink_recv);
+  return ERR_OK;
+}
+
+static bool bulk_done(void) {
+  return bulk.end || bulk.failed;
+}
+
+static void bench_bulk(uint32_t size, uint32_t chunk) {
+  struct tcp_pcb *server = listen_on(BULK_PORT, sink_accept);
+  struct tcp_pcb *pcb = tcp_new();
+  bool ok;
+  memset(&bulk, 0, sizeof(bulk));
+  bulk.size = size;
+  bulk.chunk = chunk > sizeof(payload) ? sizeof(payload) : chunk;
+  reset_stats();
+  bulk.start = now_us;
+  tcp_err(pcb, bulk_err);
+  tcp_connect(pcb, &server_ip, BULK_PORT, bulk_connected);
+  ok = run(bulk_done) && !bulk.failed;
+  printf("bulk: %u bytes in %u byte writes, ", size, bulk.chunk);
+  if (ok)
+    printf("%.3f s, %.0f kbit/s, snd_queuelen peak %u\n",
+           (bulk.end - bulk.start) / 1e6,
+           bulk.received * 8000.0 / (bulk.end - bulk.start), bulk.queuelen_peak);
+  else
+    printf("failed after %u bytes\n", bulk.received);
+  report(ok);
+  if (!bulk.failed)
+    tcp_close(pcb);
+  tcp_close(server);
+}
+
+/* Connection setup */
+
+/*
+ * Each connection sends a short request and closes once it has the answer,
+ * as the firmware does as an HTTP client, so the TIME_WAIT PCBs are on the
+ * client side.  Up to `parallel` connections are open at once.
+ */
+#define REQUEST_SIZE  128
+#define RESPONSE_SIZE 512
+
+static struct {
+  unsigned total, started, completed, failed, parallel;
+} conns;
+
+static err_t conn_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err);
+static err_t conn_connected(void *arg, struct tcp_pcb *pcb, err_t err);
+static void conn_err(void *arg, err_t err);
+
+static void conn_start(void) {
+  struct tcp_pcb *pcb;
+  while (conns.started < conns.total &&
+         conns.started - conns.completed - conns.failed < conns.parallel) {
+    conns.started++;
+    if (!(pcb = tcp_new())) {
+      conns.failed++;
+      continue;
+    }
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, conn_recv);
+    tcp_err(pcb, conn_err);
+    if (tcp_connect(pcb, &server_ip, CONNECT_PORT, conn_connected) != ERR_OK) {
+      tcp_abort(pcb);
+      conns.failed++;
+    }
+  }
+}
+
+static void conn_err(void *arg, err_t err) {
+  conns.failed++;
+  conn_start();
+}
+
+static err_t conn_connected(void *arg, struct tcp_pcb *pcb, err_t err) {
+  tcp_write(pcb, payload, REQUEST_SIZE, 0);
+  tcp_output(pcb);
+  return ERR_OK;
+}
+
+/* Client side: the response is counted in the callback argument */
+static err_t conn_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+  uintptr_t got = (uintptr_t) arg;
+  if (p) {
+    got += p->tot_len;
+    tcp_arg(pcb, (void *) got);
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    if (got < RESPONSE_SIZE)
+      return ERR_OK;
+  }
+  tcp_err(pcb, NULL);
+  tcp_recv(pcb, NULL);
+  if (got >= RESPONSE_SIZE)
+    conns.completed++;
+  else
+    conns.failed++;
+  if (tcp_close(pcb) != ERR_OK) {
+    tcp_abort(pcb);
+    err = ERR_ABRT;
+  } else {
+    err = ERR_OK;
+  }
+  conn_start();
+  return err;
+}
+
+static err_t serve_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+  if (!p)
+    return tcp_close(pcb);
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  tcp_write(pcb, payload, RESPONSE_SIZE, 0);
+  tcp_output(pcb);
+  return ERR_OK;
+}
+
+static err_t serve_accept(void *arg, struct tcp_pcb *pcb, err_t err) {
+  tcp_recv(pcb, serve_recv);
+  return ERR_OK;
+}
+
+static bool conns_done(void) {
+  return conns.completed + conns.failed >= conns.total;
+}
+
+static void bench_connect(unsigned total, unsigned parallel) {
+  struct tcp_pcb *server = listen_on(CONNECT_PORT, serve_accept);
+  uint64_t start = now_us;
+  bool ok;
+  memset(&conns, 0, sizeof(conns));
+  conns.total = total;
+  conns.parallel = parallel;
+  reset_stats();
+  conn_start();
+  ok = run(conns_done);
+  printf("connect: %u of %u connections, %u at a time, %.3f s, %.1f/s\n",
+         conns.completed, total, parallel, (now_us - start) / 1e6,
+         conns.completed * 1e6 / (now_us - start));
+  report(ok);
+  tcp_close(server);
+}
+
+/* Main */
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "usage: %s [options] [bulk|connect]\n"
+    "  -r kbit/s   link rate (%u)\n"
+    "  -l us       one way link latency (%u)\n"
+    "  -p loss     packets lost per 1000 (%u)\n"
+    "  -m bytes    heap limit, 0 for none (0)\n"
+    "  -b bytes    bulk transfer size (1048576)\n"
+    "  -c bytes    bulk write size (1024)\n"
+    "  -n count    connections to make (200)\n"
+    "  -j count    connections at a time (4)\n",
+    prog, wire.kbps, wire.latency_us, wire.loss);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  uint32_t size = 1 << 20, chunk = 1024;
+  unsigned total = 200, parallel = 4;
+  const char *which = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "r:l:p:m:b:c:n:j:")) != -1) {
+    switch (c) {
+      case 'r': wire.kbps = atoi(optarg); break;
+      case 'l': wire.latency_us = atoi(optarg); break;
+      case 'p': wire.loss = atoi(optarg); break;
+      case 'm': heap.limit = atoi(optarg); break;
+      case 'b': size = atoi(optarg); break;
+      case 'c': chunk = atoi(optarg); break;
+      case 'n': total = atoi(optarg); break;
+      case 'j': parallel = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    which = argv[optind];
+  if (!wire.kbps || !parallel || (which && strcmp(which, "bulk") && strcmp(which, "connect")))
+    usage(argv[0]);
+
+  memset(payload, 'x', sizeof(payload));
+  stack_init();
+  server_ip = bench_if.ip_addr;
+  printf("profile %s: TCP_MSS %u, TCP_WND %u, TCP_SND_BUF %u, TCP_SND_QUEUELEN %u\n",
+         BENCH_PROFILE, TCP_MSS, TCP_WND, TCP_SND_BUF, TCP_SND_QUEUELEN);
+  printf("link %u kbit/s, %u us latency, %u/1000 lost, heap limit %zu\n",
+         wire.kbps, wire.latency_us, wire.loss, heap.limit);
+  if (!which || !strcmp(which, "bulk"))
+    bench_bulk(size, chunk);
+  if (!which || !strcmp(which, "connect"))
+    bench_connect(total, parallel);
+  return 0;
+}
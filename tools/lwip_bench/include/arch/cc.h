@@ -0,0 +1,80 @@
+/*
+ * Host replacement for app/include/arch/cc.h, for building app/lwip on a
+ * 64-bit Linux host: pointers don't fit in 32 bits, and the SDK's os_*
+ * functions and section attributes are mapped onto libc and bench.c.
+ */
+#ifndef __ARCH_CC_H__
+#define __ARCH_CC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <endian.h>
+
+#define EFAULT 14
+
+typedef uint8_t    u8_t;
+typedef  int8_t    s8_t;
+typedef uint16_t   u16_t;
+typedef  int16_t   s16_t;
+typedef uint32_t   u32_t;
+typedef  int32_t   s32_t;
+typedef uintptr_t  mem_ptr_t;
+
+typedef uint8_t    uint8;
+typedef uint16_t   uint16;
+typedef uint32_t   uint32;
+typedef int32_t    sint32;
+
+#define S16_F "d"
+#define U16_F "d"
+#define X16_F "x"
+#define S32_F "d"
+#define U32_F "u"
+#define X32_F "x"
+
+#define LWIP_ERR_T s32_t
+
+#define PACK_STRUCT_FIELD(x) x
+#define PACK_STRUCT_STRUCT __attribute__((packed))
+#define PACK_STRUCT_BEGIN
+#define PACK_STRUCT_END
+
+#define LWIP_PLATFORM_DIAG(x) printf x
+#define LWIP_PLATFORM_ASSERT(x) bench_assert(x, __FILE__, __LINE__)
+void bench_assert(const char *msg, const char *file, int line);
+
+#define SYS_ARCH_DECL_PROTECT(x)
+#define SYS_ARCH_PROTECT(x)
+#define SYS_ARCH_UNPROTECT(x)
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define SHMEM_ATTR
+#define LOCAL static
+
+#define os_memset memset
+#define os_memcpy memcpy
+#define os_strlen strlen
+#define os_printf printf
+#define os_malloc(s)      pvPortMalloc(s, "", __LINE__, false)
+#define os_zalloc(s)      pvPortZalloc(s, "", __LINE__)
+#define os_realloc(p, s)  pvPortRealloc(p, s, "", __LINE__)
+#define os_free(p)        vPortFree(p, "", __LINE__)
+#define os_intr_lock()
+#define os_intr_unlock()
+unsigned long os_random(void);
+
+struct netif;
+struct netif *eagle_lwip_getif(uint8 index);
+void system_station_got_ip_set(void *ip, void *mask, void *gw);
+int r_rand(void);
+
+#define system_get_data_of_array_8(a, i) ((a)[i])
+#define system_get_string_from_flash(src, dst, n) strncpy(dst, src, n)
+#define system_pp_recycle_rx_pkt(eb)
+
+#endif /* __ARCH_CC_H__ */
@@ -0,0 +1,10 @@
+/* Host stub: lwIP's sys_now() reads the bench's virtual clock */
+#ifndef _EAGLE_SOC_H_
+#define _EAGLE_SOC_H_
+#include <stdint.h>
+uint32_t bench_now_us(void);
+#define NOW()           bench_now_us()
+#define TIMER_CLK_FREQ  1000000
+#define APB_CLK_FREQ    16000000        /* so timers.c counts in ms */
+extern uint8_t timer2_ms_flag;
+#endif
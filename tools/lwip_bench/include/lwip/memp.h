@@ -0,0 +1,19 @@
+/*
+ * Host wrapper for lwip/memp.h.  The firmware builds with MEMP_MEM_MALLOC,
+ * so pool objects come from the heap and memp_malloc() loses their type;
+ * here it is routed through bench.c so that each pool's use can be counted.
+ */
+#ifndef __BENCH_MEMP_H__
+#define __BENCH_MEMP_H__
+
+#include "../../../../app/include/lwip/memp.h"
+
+void *bench_memp_malloc(memp_t type);
+void bench_memp_free(memp_t type, void *mem);
+
+#undef memp_malloc
+#undef memp_free
+#define memp_malloc(type)     bench_memp_malloc(type)
+#define memp_free(type, mem)  bench_memp_free(type, mem)
+
+#endif
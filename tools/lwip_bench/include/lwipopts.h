@@ -0,0 +1,31 @@
+/*
+ * lwIP options for the host build: the firmware's own, with host values
+ * for those which the SDK reads from hardware registers.
+ *
+ * A profile is selected as for the firmware, with LWIP_PROFILE_* defines.
+ */
+#ifndef __LWIPOPTS_BENCH_H__
+#define __LWIPOPTS_BENCH_H__
+
+#include "../../../app/include/lwipopts.h"
+
+/* the values which the SDK keeps in registers, set by lwip_init() */
+#include <stdint.h>
+extern uint32_t bench_regs[5];
+#undef MEMP_NUM_TCP_PCB
+#define MEMP_NUM_TCP_PCB                bench_regs[0]
+#undef TCP_WND
+#define TCP_WND                         bench_regs[1]
+#undef TCP_MAXRTX
+#define TCP_MAXRTX                      bench_regs[2]
+#undef TCP_SYNMAXRTX
+#define TCP_SYNMAXRTX                   bench_regs[3]
+#undef DHCP_MAXRTX
+#define DHCP_MAXRTX                     bench_regs[4]
+
+#undef MEMCPY
+#define MEMCPY(dst,src,len)             memcpy(dst,src,len)
+#undef SMEMCPY
+#define SMEMCPY(dst,src,len)            memcpy(dst,src,len)
+
+#endif
@@ -60,6 +60,7 @@ PARTITION_TYPE  = {
 SYSTEM_PARAMETER = 6
 IROM0TEXT        = 102
 LFS              = 103
+OVERLAY          = 104
 SPIFFS           = 106
 
 MAX_PT_SIZE = 20*3
@@ -182,6 +183,12 @@ def load_PT(data, args):
             if Psize > 0:
                 map['LFS'] = {"addr" : Paddr, "size" : Psize}
 
+        elif Ptype == OVERLAY:
+            #  The LFS overlay region is aligned and placed like the LFS.
+            Psize = alignPT(Psize)
+            if Paddr == 0:
+                Paddr = lastEnd
+
         elif Ptype == SPIFFS:
             # The logic here is convolved.  Explicit start and length can be
             # set, but the SPIFFS region is aslo contrained by the end of the
@@ -0,0 +1,431 @@
+/*
+ * Host benchmark for the heap used by the firmware's TLS client connections.
+ *
+ * app/mbedtls is built for Linux with the firmware's options, and up to
+ * three clients set up as espconn_mbedtls.c sets them up connect to an
+ * mbedTLS server in the same process.  Records go through memory pipes,
+ * and the server's are handed to each client a TCP segment at a time, in
+ * turn, so that a record may be half read on each connection at once, as
+ * on the device.  Clients write and read in segment sized pieces, as
+ * espconn does.
+ *
+ * Every mbedTLS allocation is charged to the connection it was made for.
+ * For each connection the heap's high water mark is reported during the
+ * handshake and while exchanging messages of several sizes, and what it
+ * holds while idle in between.  The data echoed by the server is checked.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/certs.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+#ifndef BENCH_BUFFERS
+#define BENCH_BUFFERS "dynamic"
+#endif
+
+#define MAX_CONNS       3
+#define SEGMENT         1460    /* TCP_MSS, as espconn reads and writes */
+#define SERVER          MAX_CONNS
+#define NOBODY          (MAX_CONNS + 1)
+#define MAX_ROUNDS      10000
+
+static const size_t msg_sizes[] = { 100, 1400, 4000, 16000 };
+#define NUM_SIZES       (sizeof(msg_sizes) / sizeof(msg_sizes[0]))
+
+/* Heap, per owner: a client connection, the server or anything else */
+typedef struct {
+  size_t live, peak;
+} heap_t;
+
+static heap_t heap[NOBODY + 1];
+static size_t clients_live, clients_peak;
+static int owner = NOBODY;
+
+typedef union {
+  struct {
+    size_t len;
+    int owner;
+  } h;
+  max_align_t align;
+} alloc_hdr_t;
+
+void *mbedtls_calloc_wrap(size_t n, size_t size) {
+  if (size && n > (size_t) -1 / 2 / size)
+    return NULL;
+  alloc_hdr_t *a = calloc(1, sizeof(*a) + n * size);
+  if (!a)
+    return NULL;
+  a->h.len = n * size;
+  a->h.owner = owner;
+  heap_t *h = &heap[owner];
+  h->live += a->h.len;
+  if (h->live > h->peak)
+    h->peak = h->live;
+  if (owner < MAX_CONNS) {
+    clients_live += a->h.len;
+    if (clients_live > clients_peak)
+      clients_peak = clients_live;
+  }
+  return a + 1;
+}
+
+void mbedtls_free_wrap(void *p) {
+  if (!p)
+    return;
+  alloc_hdr_t *a = (alloc_hdr_t *) p - 1;
+  heap[a->h.owner].live -= a->h.len;
+  if (a->h.owner < MAX_CONNS)
+    clients_live -= a->h.len;
+  free(a);
+}
+
+static uint32_t seed = 1;
+
+static int r_rand(void) {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+int mbedtls_hardware_poll(void *data, unsigned char *output, size_t len, size_t *olen) {
+  for (size_t i = 0; i < len; i++)
+    output[i] = r_rand();
+  *olen = len;
+  return 0;
+}
+
+/* One direction of a connection.  Bytes written are readable once delivered. */
+typedef struct {
+  unsigned char *buf;
+  size_t size, written, delivered, read;
+} pipe_t;
+
+/* One end of a connection */
+typedef struct {
+  pipe_t *tx, *rx;
+} end_t;
+
+static int pipe_send(void *ctx, const unsigned char *buf, size_t len) {
+  pipe_t *p = ((end_t *) ctx)->tx;
+  if (p->written + len > p->size) {
+    p->size = (p->written + len) * 2;
+    p->buf = realloc(p->buf, p->size);
+    if (!p->buf)
+      abort();
+  }
+  memcpy(p->buf + p->written, buf, len);
+  p->written += len;
+  return len;
+}
+
+static int pipe_recv(void *ctx, unsigned char *buf, size_t len) {
+  pipe_t *p = ((end_t *) ctx)->rx;
+  size_t n = p->delivered - p->read;
+  if (!n)
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  if (n > len)
+    n = len;
+  memcpy(buf, p->buf + p->read, n);
+  p->read += n;
+  if (p->read == p->written)
+    p->read = p->delivered = p->written = 0;
+  return n;
+}
+
+static void deliver(pipe_t *p, size_t len) {
+  p->delivered += len;
+  if (p->delivered > p->written)
+    p->delivered = p->written;
+}
+
+typedef struct {
+  mbedtls_ssl_config conf;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_context srv;
+  pipe_t up, down;
+  end_t client, server;
+  unsigned char *sent, *echo, *rcvd;
+  size_t rcvd_len;
+} conn_t;
+
+static conn_t conns[MAX_CONNS];
+static int num_conns = MAX_CONNS;
+static unsigned char mfl_code = SSL_MAX_FRAGMENT_LENGTH_CODE;
+static int use_ec;
+static int one_by_one;
+
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context drbg;
+static mbedtls_ssl_config srv_conf;
+static mbedtls_x509_crt srv_chain;
+static mbedtls_pk_context srv_key;
+
+static void fail(const char *what, int i, int err) {
+  fprintf(stderr, "connection %d: %s failed, -0x%04x\n", i, what, -err);
+  exit(1);
+}
+
+static int is_fatal(int ret) {
+  return ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+/* The server, with a certificate chain of a realistic size */
+static void server_setup(void) {
+  const char *crt = use_ec ? mbedtls_test_srv_crt_ec : mbedtls_test_srv_crt_rsa;
+  size_t crt_len = use_ec ? mbedtls_test_srv_crt_ec_len : mbedtls_test_srv_crt_rsa_len;
+  const char *ca = use_ec ? mbedtls_test_ca_crt_ec : mbedtls_test_ca_crt_rsa;
+  size_t ca_len = use_ec ? mbedtls_test_ca_crt_ec_len : mbedtls_test_ca_crt_rsa_len;
+  const char *key = use_ec ? mbedtls_test_srv_key_ec : mbedtls_test_srv_key_rsa;
+  size_t key_len = use_ec ? mbedtls_test_srv_key_ec_len : mbedtls_test_srv_key_rsa_len;
+
+  owner = SERVER;
+  mbedtls_ssl_config_init(&srv_conf);
+  mbedtls_x509_crt_init(&srv_chain);
+  mbedtls_pk_init(&srv_key);
+  if (mbedtls_x509_crt_parse(&srv_chain, (const unsigned char *) crt, crt_len) ||
+      mbedtls_x509_crt_parse(&srv_chain, (const unsigned char *) ca, ca_len) ||
+      mbedtls_pk_parse_key(&srv_key, (const unsigned char *) key, key_len, NULL, 0))
+    fail("certificate", -1, 0);
+  mbedtls_ssl_config_defaults(&srv_conf, MBEDTLS_SSL_IS_SERVER,
+                              MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  mbedtls_ssl_conf_rng(&srv_conf, mbedtls_ctr_drbg_random, &drbg);
+  mbedtls_ssl_conf_own_cert(&srv_conf, &srv_chain, &srv_key);
+}
+
+/* A client, as espconn_ssl_client() and its handshake set one up */
+static void conn_setup(conn_t *c, int i) {
+  int ret;
+
+  owner = i;
+  mbedtls_ssl_init(&c->ssl);
+  mbedtls_ssl_config_init(&c->conf);
+  mbedtls_ssl_config_defaults(&c->conf, MBEDTLS_SSL_IS_CLIENT,
+                              MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  mbedtls_ssl_conf_authmode(&c->conf, MBEDTLS_SSL_VERIFY_NONE);
+  mbedtls_ssl_conf_rng(&c->conf, mbedtls_ctr_drbg_random, &drbg);
+  mbedtls_ssl_conf_max_frag_len(&c->conf, mfl_code);
+  if ((ret = mbedtls_ssl_setup(&c->ssl, &c->conf)) != 0)
+    fail("client setup", i, ret);
+  c->client.tx = c->server.rx = &c->up;
+  c->client.rx = c->server.tx = &c->down;
+  mbedtls_ssl_set_bio(&c->ssl, &c->client, pipe_send, pipe_recv, NULL);
+
+  owner = SERVER;
+  mbedtls_ssl_init(&c->srv);
+  if ((ret = mbedtls_ssl_setup(&c->srv, &srv_conf)) != 0)
+    fail("server setup", i, ret);
+  mbedtls_ssl_set_bio(&c->srv, &c->server, pipe_send, pipe_recv, NULL);
+}
+
+/* Per connection, the most of any connection, and of all together */
+typedef struct {
+  size_t peak, after, all;
+} result_t;
+
+static void phase_start(void) {
+  for (int i = 0; i < num_conns; i++)
+    heap[i].peak = heap[i].live;
+  clients_peak = clients_live;
+}
+
+static void phase_end(result_t *r) {
+  memset(r, 0, sizeof(*r));
+  for (int i = 0; i < num_conns; i++) {
+    if (heap[i].peak > r->peak)
+      r->peak = heap[i].peak;
+    if (heap[i].live > r->after)
+      r->after = heap[i].live;
+  }
+  r->all = clients_peak;
+}
+
+/* Handshakes on connections first to last - 1, all at once */
+static void handshakes(int first, int last) {
+  int done = 0, ret;
+
+  for (int round = 0; done < last - first; round++) {
+    if (round == MAX_ROUNDS)
+      fail("handshake", -1, 0);
+    done = 0;
+    for (int i = first; i < last; i++) {
+      conn_t *c = &conns[i];
+      if (c->ssl.state == MBEDTLS_SSL_HANDSHAKE_OVER && c->srv.state == MBEDTLS_SSL_HANDSHAKE_OVER) {
+        done++;
+        continue;
+      }
+      deliver(&c->down, SEGMENT);
+      owner = i;
+      if (c->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER && is_fatal(ret = mbedtls_ssl_handshake(&c->ssl)))
+        fail("client handshake", i, ret);
+      deliver(&c->up, c->up.written);
+      owner = SERVER;
+      if (c->srv.state != MBEDTLS_SSL_HANDSHAKE_OVER && is_fatal(ret = mbedtls_ssl_handshake(&c->srv)))
+        fail("server handshake", i, ret);
+    }
+  }
+}
+
+/*
+ * Each client sends len bytes, which the server echoes.  The echoes are
+ * then delivered to the clients a segment at a time, in turn.
+ */
+static void exchange(size_t len, result_t *r) {
+  int done = 0, ret;
+
+  phase_start();
+  for (int i = 0; i < num_conns; i++) {
+    conn_t *c = &conns[i];
+    for (size_t k = 0; k < len; k++)
+      c->sent[k] = r_rand();
+    owner = i;
+    for (size_t off = 0; off < len; off += ret) {
+      size_t n = len - off < SEGMENT ? len - off : SEGMENT;
+      if ((ret = mbedtls_ssl_write(&c->ssl, c->sent + off, n)) <= 0)
+        fail("client write", i, ret);
+    }
+    deliver(&c->up, c->up.written);
+    owner = SERVER;
+    for (size_t got = 0; got < len; got += ret)
+      if ((ret = mbedtls_ssl_read(&c->srv, c->echo + got, len - got)) <= 0)
+        fail("server read", i, ret);
+    for (size_t off = 0; off < len; off += ret)
+      if ((ret = mbedtls_ssl_write(&c->srv, c->echo + off, len - off)) <= 0)
+        fail("server write", i, ret);
+    c->rcvd_len = 0;
+  }
+  for (int round = 0; done < num_conns; round++) {
+    if (round == MAX_ROUNDS)
+      fail("exchange", -1, 0);
+    done = 0;
+    for (int i = 0; i < num_conns; i++) {
+      conn_t *c = &conns[i];
+      if (c->rcvd_len >= len) {
+        done++;
+        continue;
+      }
+      deliver(&c->down, SEGMENT);
+      owner = i;
+      while ((ret = mbedtls_ssl_read(&c->ssl, c->rcvd + c->rcvd_len, SEGMENT)) > 0)
+        c->rcvd_len += ret;
+      if (is_fatal(ret))
+        fail("client read", i, ret);
+    }
+  }
+  for (int i = 0; i < num_conns; i++)
+    if (conns[i].rcvd_len != len || memcmp(conns[i].sent, conns[i].rcvd, len))
+      fail("echo", i, 0);
+  phase_end(r);
+}
+
+static void conn_close(conn_t *c, int i) {
+  int ret;
+
+  owner = i;
+  if ((ret = mbedtls_ssl_close_notify(&c->ssl)) != 0)
+    fail("close", i, ret);
+  deliver(&c->up, c->up.written);
+  owner = SERVER;
+  if ((ret = mbedtls_ssl_read(&c->srv, c->echo, 1)) != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    fail("close notify", i, ret);
+  mbedtls_ssl_free(&c->srv);
+  owner = i;
+  mbedtls_ssl_free(&c->ssl);
+  mbedtls_ssl_config_free(&c->conf);
+  if (heap[i].live)
+    fprintf(stderr, "connection %d: %zu bytes left allocated\n", i, heap[i].live);
+}
+
+static void print_result(const char *what, const result_t *r) {
+  printf("%-22s %8zu %8zu %10zu\n", what, r->peak, r->after, r->all);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-n connections] [-f fragment length] [-e] [-s]\n"
+          "  -n  concurrent connections, 1 to %d, default %d\n"
+          "  -f  maximum fragment length to ask for: 512, 1024, 2048 or 4096,\n"
+          "      or 0 not to ask, default as SSL_MAX_FRAGMENT_LENGTH_CODE\n"
+          "  -e  the server has an ECDSA certificate rather than RSA\n"
+          "  -s  connect one after another rather than all at once\n",
+          name, MAX_CONNS, MAX_CONNS);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  result_t r;
+  char what[32];
+
+  while ((opt = getopt(argc, argv, "n:f:esh")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_conns = atoi(optarg);
+        if (num_conns < 1 || num_conns > MAX_CONNS)
+          usage(argv[0]);
+        break;
+      case 'f':
+        switch (atoi(optarg)) {
+          case 0:    mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_NONE; break;
+          case 512:  mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_512; break;
+          case 1024: mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_1024; break;
+          case 2048: mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_2048; break;
+          case 4096: mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_4096; break;
+          default:   usage(argv[0]);
+        }
+        break;
+      case 'e':
+        use_ec = 1;
+        break;
+      case 's':
+        one_by_one = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char *) "bench", 5))
+    fail("seed", -1, 0);
+  server_setup();
+  for (int i = 0; i < num_conns; i++) {
+    size_t max = msg_sizes[NUM_SIZES - 1];
+    conns[i].sent = malloc(max);
+    conns[i].echo = malloc(max);
+    conns[i].rcvd = malloc(max + SEGMENT);
+    conn_setup(&conns[i], i);
+  }
+
+  printf("%s buffers, SSL_BUFFER_SIZE %d, %d connection%s, %s server, fragment length ",
+         BENCH_BUFFERS, SSL_BUFFER_SIZE, num_conns, num_conns > 1 ? "s" : "", use_ec ? "ECDSA" : "RSA");
+  if (mfl_code == MBEDTLS_SSL_MAX_FRAG_LEN_NONE)
+    printf("not asked for\n");
+  else
+    printf("%d\n", 256 << mfl_code);
+  printf("%-22s %8s %8s %10s\n", one_by_one ? "connected one by one" : "connected at once",
+         "peak", "after", "all peak");
+
+  phase_start();
+  if (one_by_one)
+    for (int i = 0; i < num_conns; i++)
+      handshakes(i, i + 1);
+  else
+    handshakes(0, num_conns);
+  phase_end(&r);
+  print_result("handshake", &r);
+  for (size_t k = 0; k < NUM_SIZES; k++) {
+    exchange(msg_sizes[k], &r);
+    snprintf(what, sizeof(what), "%zu byte messages", msg_sizes[k]);
+    print_result(what, &r);
+  }
+  for (int i = 0; i < num_conns; i++)
+    conn_close(&conns[i], i);
+  return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * mbedTLS options for the host build: the firmware's own, with the test
+ * certificates for the server and without the sockets, which the firmware
+ * doesn't build either.
+ *
+ * BENCH_STATIC_BUFFERS builds with the record buffers at their full size
+ * for the life of a connection, as without SSL_BUFFER_DYNAMIC.
+ */
+#ifndef __BENCH_MBEDTLS_H__
+#define __BENCH_MBEDTLS_H__
+
+#include "user_config.h"
+#ifdef BENCH_STATIC_BUFFERS
+#undef SSL_BUFFER_DYNAMIC
+#endif
+
+#include "../../../app/include/user_mbedtls.h"
+
+#undef MBEDTLS_NET_C
+#define MBEDTLS_CERTS_C
+
+#endif
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+#
+# Convert a binary trace written by the trace module's trace.dump(filename)
+# into Chrome's trace event JSON, which can be loaded into chrome://tracing
+# or https://ui.perfetto.dev.
+#
+#   python3 tools/trace2chrome.py trace.bin > trace.json
+#
+# The dump holds the raw CCOUNT of each event, which wraps every 2^32 CPU
+# cycles (~27 s at 160 MHz).  It is unwrapped from one event to the next, so
+# gaps longer than that between consecutive events are lost.
+
+import argparse
+import json
+import struct
+import sys
+
+HEADER = struct.Struct('<4sHHIII')
+NAME = struct.Struct('<HB')
+EVENT = struct.Struct('<IHBxII')
+TRACE_USER = 0x100
+
+# ISR events are shown on their own row, everything else runs as a task
+ISR_EVENTS = {'gpio_isr'}
+
+
+def read_trace(data):
+    magic, version, nnames, mhz, recorded, nevents = HEADER.unpack_from(data)
+    if magic != b'NTRC' or version != 1:
+        raise ValueError('not a version 1 NodeMCU trace')
+    pos = HEADER.size
+    names = {}
+    for _ in range(nnames):
+        ident, length = NAME.unpack_from(data, pos)
+        pos += NAME.size
+        names[ident] = data[pos:pos + length].decode('utf-8', 'replace')
+        pos += length
+    events = [EVENT.unpack_from(data, pos + i * EVENT.size)
+              for i in range(nevents)]
+    return mhz, recorded, names, events
+
+
+def to_chrome(mhz, recorded, names, events):
+    out = []
+    cycles = 0
+    last = events[0][0] if events else 0
+    for ccount, ident, phase, a, b in events:
+        cycles += (ccount - last) & 0xFFFFFFFF
+        last = ccount
+        name = names.get(ident)
+        if name is None:
+            name = 'user%d' % (ident - TRACE_USER)
+        ev = {'name': name, 'ph': chr(phase), 'ts': cycles / mhz,
+              'pid': 1, 'tid': 2 if name in ISR_EVENTS else 1,
+              'args': {'a': '0x%08x' % a, 'b': b}}
+        if ev['ph'] == 'I':
+            ev['ph'] = 'i'
+            ev['s'] = 't'
+        out.append(ev)
+    meta = [{'name': 'thread_name', 'ph': 'M', 'pid': 1, 'tid': tid,
+             'args': {'name': label}}
+            for tid, label in ((1, 'tasks'), (2, 'interrupts'))]
+    return {'displayTimeUnit': 'ms', 'traceEvents': meta + out,
+            'otherData': {'cpu_mhz': mhz, 'recorded': recorded,
+                          'dropped': recorded - len(events)}}
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Convert a NodeMCU binary trace to Chrome trace JSON')
+    parser.add_argument('trace', help='file written by trace.dump(filename)')
+    parser.add_argument('-o', '--output', help='output file (default stdout)')
+    args = parser.parse_args()
+
+    with open(args.trace, 'rb') as f:
+        trace = to_chrome(*read_trace(f.read()))
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()